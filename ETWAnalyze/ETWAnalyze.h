@@ -0,0 +1,474 @@
+/*/////////////////////////////////////////////////////////////////////////////
+/// @summary Declares the types and functions shared between the commands
+/// implemented by the ETWAnalyze tool, which records, decodes and analyzes
+/// the events emitted by the custom providers defined in ETWProvider.man.
+/// @author Russell Klenk (contact@russellklenk.com)
+///////////////////////////////////////////////////////////////////////////80*/
+
+#ifndef ETW_ANALYZE_H
+#define ETW_ANALYZE_H
+
+/*////////////////
+//   Includes   //
+////////////////*/
+#include <errno.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <Windows.h>
+#include <evntrace.h>
+#include <evntcons.h>
+
+/*/////////////////
+//   Constants   //
+/////////////////*/
+/// @summary Helper macro to prevent warnings about unreferenced arguments.
+#define UNUSED_ARG(x)                \
+    do {                             \
+        (x);                         \
+    __pragma(warning(push));         \
+    __pragma(warning(disable:4127)); \
+    } while(0);                      \
+    __pragma(warning(pop))
+
+/// @summary The number of event timestamp units (100ns) per millisecond. Event
+/// timestamps are delivered by ProcessTrace() as FILETIME values.
+#define TICKS_PER_MS    10000.0
+
+/// @summary The provider GUIDs. These must match the values in ETWProvider.man.
+static GUID const ETW_MAIN_THREAD_GUID = { 0x042CD377, 0x8F6E, 0x4BF0, { 0x93, 0xDE, 0xB4, 0xBA, 0x32, 0x23, 0x47, 0x71 } };
+static GUID const ETW_TASK_THREAD_GUID = { 0x08F6A7B2, 0x48E7, 0x4AD4, { 0x9A, 0x22, 0x50, 0x80, 0x63, 0x74, 0xB0, 0x84 } };
+static GUID const ETW_USER_INPUT_GUID  = { 0x70E2503B, 0xC6F3, 0x4780, { 0xB3, 0x23, 0xBD, 0x8E, 0xD0, 0xC6, 0x1B, 0xF8 } };
+static GUID const ETW_SYNC_GUID        = { 0x5B0C1E4A, 0x3F27, 0x4D6B, { 0xA8, 0xE9, 0x71, 0xC2, 0xD4, 0x3F, 0x9A, 0x06 } };
+static GUID const ETW_FILE_IO_GUID     = { 0x3C9B57E1, 0xA6D2, 0x4F0E, { 0x9B, 0x84, 0xE2, 0x1D, 0x7A, 0x5C, 0x03, 0xF6 } };
+
+/// @summary Identifies the provider that emitted a decoded event.
+enum etw_source_e
+{
+    ETW_SOURCE_MAIN          = 0,
+    ETW_SOURCE_TASK          = 1,
+    ETW_SOURCE_INPUT         = 2,
+    ETW_SOURCE_SYNC          = 3,
+    ETW_SOURCE_FILEIO        = 4,
+    ETW_SOURCE_COUNT         = 5
+};
+
+/// @summary Identifies the type of a decoded event. Values are independent of
+/// the event IDs assigned in the manifest, which are reused between providers.
+enum etw_event_kind_e
+{
+    ETW_EVENT_UNKNOWN        = 0,
+    ETW_EVENT_ENTER_SCOPE    = 1,
+    ETW_EVENT_LEAVE_SCOPE    = 2,
+    ETW_EVENT_MARKER         = 3,
+    ETW_EVENT_THREAD_ID      = 4,
+    ETW_EVENT_MOUSE_DOWN     = 5,
+    ETW_EVENT_MOUSE_UP       = 6,
+    ETW_EVENT_MOUSE_MOVE     = 7,
+    ETW_EVENT_MOUSE_WHEEL    = 8,
+    ETW_EVENT_KEY_DOWN       = 9,
+    ETW_EVENT_WAIT_BEGIN     = 10,
+    ETW_EVENT_WAIT_END       = 11,
+    ETW_EVENT_FLOW           = 12,
+    ETW_EVENT_SAMPLE         = 13,
+    ETW_EVENT_EVENTS_LOST    = 14,
+    ETW_EVENT_TASK_RESUME    = 15,
+    ETW_EVENT_TASK_SUSPEND   = 16,
+    ETW_EVENT_TASK_COMPLETE  = 17,
+    ETW_EVENT_OVERHEAD       = 18,
+    ETW_EVENT_FILE_OPEN      = 19,
+    ETW_EVENT_FILE_READ      = 20,
+    ETW_EVENT_FILE_MAPPING   = 21,
+    ETW_EVENT_FILE_MAP_VIEW  = 22,
+    ETW_EVENT_FILE_UNMAP     = 23,
+    ETW_EVENT_FILE_PREFETCH  = 24,
+    ETW_EVENT_FILE_SUMMARY   = 25,
+    ETW_EVENT_MODULE         = 26,
+    ETW_EVENT_COUNTERS       = 27,
+    ETW_EVENT_RESIDENCY      = 28,
+    ETW_EVENT_SCOPE_SUMMARY  = 29,
+    ETW_EVENT_SCOPE_SAMPLED  = 30,
+    ETW_EVENT_SCOPE_TIME     = 31  /// Merged into the leave event that follows; never delivered.
+};
+
+/// @summary Identifies the phase reported by a flow event. These must match the
+/// values of etw_flow_phase_e in ETWClient.h.
+enum etw_flow_phase_e
+{
+    ETW_FLOW_ISSUE           = 0,
+    ETW_FLOW_START           = 1,
+    ETW_FLOW_FINISH          = 2,
+    ETW_FLOW_CANCEL          = 3,
+    ETW_FLOW_CONSUME         = 4
+};
+
+/*//////////////////
+//   Data Types   //
+//////////////////*/
+/// @summary A decoded event from one of the custom providers. String fields point into
+/// the event record and are valid only for the duration of the callback.
+struct etw_event_t
+{
+    int32_t      Kind;        /// One of etw_event_kind_e.
+    int32_t      Source;      /// One of etw_source_e.
+    int64_t      Timestamp;   /// The event timestamp, in 100ns units.
+    uint32_t     ProcessId;   /// The identifier of the process that emitted the event.
+    uint32_t     ThreadId;    /// The identifier of the thread that emitted the event, or the sampled thread for ETW_EVENT_SAMPLE.
+    uint32_t     Processor;   /// The zero-based index of the processor that logged the event.
+    uint32_t     Depth;       /// The scope nesting depth, for scope events, the number of scope names in a sample, or the number of open task scopes for task switch events.
+    float        Duration;    /// The scope duration or wait time in milliseconds, for ETW_EVENT_LEAVE_SCOPE and ETW_EVENT_WAIT_END, the task lifetime for ETW_EVENT_TASK_COMPLETE, the cost of a scope enter/leave pair for ETW_EVENT_OVERHEAD, the latency of a file I/O call, the summed latency for ETW_EVENT_FILE_SUMMARY or the summed duration for ETW_EVENT_SCOPE_SUMMARY, or the cost of taking the sample for ETW_EVENT_COUNTERS.
+    float        OnCpu;       /// The time the thread was running within the scope, the time the task was resumed, the cost within an empty scope for ETW_EVENT_OVERHEAD, the longest call for ETW_EVENT_FILE_SUMMARY, the longest scope for ETW_EVENT_SCOPE_SUMMARY, or the process CPU time for ETW_EVENT_COUNTERS, in milliseconds, or -1 if not measured.
+    uint64_t     Id;          /// The address or handle of the synchronization object for wait events, the flow ID for flow events, the instruction pointer for samples, the running total for ETW_EVENT_EVENTS_LOST, the task ID for task events, the file handle for file open, read and mapping events, the mapping handle for ETW_EVENT_FILE_MAP_VIEW, the address for unmap and prefetch events, the function address for function scopes, the base address for ETW_EVENT_MODULE, the bytes written for ETW_EVENT_COUNTERS, or the range address for ETW_EVENT_RESIDENCY.
+    uint64_t     Target;      /// The mapping handle created by ETW_EVENT_FILE_MAPPING, the view address returned for ETW_EVENT_FILE_MAP_VIEW, or the private bytes for ETW_EVENT_COUNTERS.
+    uint64_t     Offset;      /// The file offset for ETW_EVENT_FILE_READ and ETW_EVENT_FILE_MAP_VIEW, or ~0 if the read used the file pointer, the bytes read for ETW_EVENT_COUNTERS, or the resident bytes for ETW_EVENT_RESIDENCY.
+    uint64_t     Size;        /// The number of bytes read, mapped or prefetched by a file I/O event, the working set for ETW_EVENT_COUNTERS, or the range size for ETW_EVENT_RESIDENCY.
+    char const  *Text;        /// The scope description, marker text, thread name, key name, lock name, task name, file path, resolved function name, module path, range name or the ';'-separated scope stack of a sample.
+    int32_t      Value[4];    /// Additional integer fields (thread ID, button, flags, coordinates, wait result, flow phase, lost provider and count, task resumes and migrations, file access and error, read size requested, prefetch ranges, the summarized kind and count, the number of short calls elided from a function scope, the number of scopes in ETW_EVENT_SCOPE_SUMMARY, the number of scopes skipped and the sampling rate for ETW_EVENT_SCOPE_SAMPLED, the module size, the page faults and read and write operations for ETW_EVENT_COUNTERS, or the pages checked for ETW_EVENT_RESIDENCY.)
+};
+
+/// @summary The signature of the function invoked for each decoded event.
+/// @param ev The decoded event.
+/// @param context Opaque data supplied by the caller of etw_process_xxx.
+typedef void (*etw_event_fn)(etw_event_t const *ev, void *context);
+
+/// @summary Restricts the events delivered by etw_process_range.
+/// Unless Raw is set, the instrumentation overhead measured by the provider is subtracted
+/// from the duration of each scope, once for the scope itself and once for each scope
+/// nested inside it.
+struct etw_time_range_t
+{
+    double       FromMs;      /// The first time to deliver, in milliseconds since the trace started.
+    double       ToMs;        /// The last time to deliver, in milliseconds since the trace started, or -1 for the end of the trace.
+    uint32_t     ThreadId;    /// If non-zero, only events logged by this thread are delivered.
+    bool         Raw;         /// If true, scope durations are delivered as measured.
+};
+
+/// @summary Defines the configuration used to start a trace session.
+struct etw_session_config_t
+{
+    char const  *SessionName; /// The unique name of the session.
+    char const  *LogFile;     /// The path of the output .etl file, or NULL for a real-time session.
+    uint32_t     BufferSize;  /// The size of each buffer, in KB.
+    uint32_t     MinBuffers;  /// The number of buffers preallocated by the session.
+    uint32_t     MaxBuffers;  /// The maximum number of buffers the session may allocate.
+    uint32_t     PerCpuBuffers; /// If non-zero, MinBuffers and MaxBuffers are ignored and the session allocates this many buffers per logical processor.
+    uint32_t     FlushTimer;  /// The maximum number of seconds a buffer may hold events before being flushed.
+    uint32_t     MaxFileSize; /// If non-zero, the log file is split into chunks of at most this many MB. LogFile must contain a %d.
+    uint32_t     CircularSize; /// If non-zero, the log file is a ring of this many MB in which new events overwrite the oldest. Ignored if MaxFileSize is set.
+    uint32_t     LogFileMode; /// Additional EVENT_TRACE_xxx_MODE flags.
+    UCHAR        Level;       /// The maximum event level to enable.
+    ULONGLONG    Keywords;    /// The keyword mask enabled on each provider.
+    uint32_t     Providers;   /// A bitmask with bit (1 << etw_source_e) set for each provider to enable, or zero to enable all of them.
+};
+
+/// @summary State associated with a running trace session.
+struct etw_session_t
+{
+    TRACEHANDLE  Handle;      /// The session handle returned by StartTrace.
+    char         Name[256];   /// The session name.
+};
+
+/// @summary Statistics queried from a running or stopped trace session.
+struct etw_session_stats_t
+{
+    uint32_t     EventsLost;  /// The number of events that could not be written to a buffer.
+    uint32_t     BuffersLost; /// The number of buffers that could not be delivered to a real-time consumer or written to disk.
+    uint32_t     Buffers;     /// The number of buffers currently allocated to the session.
+    uint32_t     FreeBuffers; /// The number of buffers on the session free list.
+    uint32_t     Written;     /// The number of buffers written to the log file or delivered.
+};
+
+/// @summary Opaque state for a per-thread call tree built from scope events.
+struct etw_tree_t;
+
+/// @summary Opaque state used to resolve the addresses of instrumented functions to names.
+struct etw_symbols_t;
+
+/*///////////////////////
+//  Public Functions   //
+///////////////////////*/
+/// @summary Read and decode the custom events from one or more .etl files. Events from
+/// multiple files are delivered in timestamp order. This function blocks until all
+/// events have been delivered.
+/// @param paths The paths of the .etl files to read.
+/// @param count The number of paths. ProcessTrace() supports at most 64.
+/// @param callback The function to invoke for each decoded event.
+/// @param context Opaque data passed through to the callback.
+/// @return true if the files were processed successfully.
+bool etw_process_files(char const **paths, size_t count, etw_event_fn callback, void *context);
+
+/// @summary Read and decode the custom events within a time range from one or more
+/// .etl files. Any path ending in .etwidx is replaced with the chunks listed in that
+/// index which overlap the range, so only those chunks are opened and decoded.
+/// @param paths The paths of the .etl or .etwidx files to read.
+/// @param count The number of paths.
+/// @param range The time range and thread to deliver, or NULL to deliver all events.
+/// @param callback The function to invoke for each decoded event.
+/// @param context Opaque data passed through to the callback.
+/// @return true if the files were processed successfully.
+bool etw_process_range(char const **paths, size_t count, etw_time_range_t const *range, etw_event_fn callback, void *context);
+
+/// @summary Read and decode the custom events from several independently recorded traces,
+/// such as those of different processes or machines, and deliver them as one stream in
+/// timestamp order. Unlike etw_process_range, each path is decoded on its own thread into
+/// a small fixed-size buffer, so memory use is bounded by the number of paths, and each
+/// trace may come from a different session. Equal timestamps are delivered in path order.
+/// @param paths The paths of the .etl or .etwidx files to read, one per stream.
+/// @param count The number of paths, at most 64.
+/// @param range The time range and thread to deliver from each path, or NULL to deliver all events.
+/// @param callback The function to invoke for each decoded event, on the calling thread.
+/// @param context Opaque data passed through to the callback.
+/// @return true if all of the files were processed successfully.
+bool etw_merge_files(char const **paths, size_t count, etw_time_range_t const *range, etw_event_fn callback, void *context);
+
+/// @summary Parse one of the -from, -to, -thread and -raw options shared by the analysis commands.
+/// @param argc The number of command arguments.
+/// @param argv The command arguments.
+/// @param i The index of the current argument. On return, advanced past any option value.
+/// @param range The range to update.
+/// @return true if the argument was a range option and was consumed.
+bool etw_range_option(int argc, char **argv, int *i, etw_time_range_t *range);
+
+/// @summary Print the usage lines for the -from, -to, -thread and -raw options.
+/// @param fp The output stream.
+void etw_range_usage(FILE *fp);
+
+/// @summary Retrieve the session start time recorded in the header of an .etl file.
+/// @param path The path of the .etl file.
+/// @param start_time On return, stores the start time, in 100ns units.
+/// @return true if the file header could be read.
+bool etw_trace_start_time(char const *path, int64_t *start_time);
+
+/// @summary Expand a chunk file pattern such as "trace_%d.etl" into the paths of the
+/// chunk files that exist, numbered consecutively from 1. A path without a %d is
+/// returned unchanged.
+/// @param pattern The file pattern.
+/// @param paths On return, stores the expanded paths.
+/// @param max_paths The maximum number of paths to return.
+/// @return The number of paths stored.
+size_t etw_chunk_expand(char const *pattern, char (*paths)[MAX_PATH], size_t max_paths);
+
+/// @summary Build a chunk index for a set of .etl files, typically the chunks written
+/// by 'record -split'. The index records the time span and per-thread event counts of
+/// each chunk. The chunk files must remain in the same directory as the index.
+/// @param index_path The path of the .etwidx file to write.
+/// @param paths The paths of the chunk files.
+/// @param count The number of paths.
+/// @return true if the index was written.
+bool etw_index_build(char const *index_path, char const **paths, size_t count);
+
+/// @summary Select the chunks listed in an index that contain events within a range.
+/// @param index_path The path of the .etwidx file to read.
+/// @param range The time range and thread of interest, or NULL to select all chunks.
+/// @param paths On return, stores the paths of the selected chunks.
+/// @param max_paths The maximum number of paths to return.
+/// @param count On return, stores the number of selected chunks.
+/// @param base_time On return, stores the session start time the range is relative to.
+/// @return true if the index was read and at least one chunk was selected.
+bool etw_index_select(char const *index_path, etw_time_range_t const *range, char (*paths)[MAX_PATH], size_t max_paths, size_t *count, int64_t *base_time);
+
+/// @summary Decode the custom events delivered to a real-time session. This function
+/// blocks until the session is stopped.
+/// @param session_name The name of the real-time session to consume.
+/// @param callback The function to invoke for each decoded event.
+/// @param context Opaque data passed through to the callback.
+/// @return true if the session was consumed successfully.
+bool etw_process_realtime(char const *session_name, etw_event_fn callback, void *context);
+
+/// @summary Start a new trace session and enable the custom providers. Any existing
+/// session with the same name is stopped first; sessions with other names are left running,
+/// and ETW copies each event into every session whose keywords and level enable it.
+/// @param config The session configuration.
+/// @param session On return, stores the session state.
+/// @return true if the session was started.
+bool etw_session_start(etw_session_config_t const *config, etw_session_t *session);
+
+/// @summary Parse one of the -name, -keywords, -level and -providers options shared by the 
+/// commands that start a session.
+/// @param argc The number of command arguments.
+/// @param argv The command arguments.
+/// @param i The index of the current argument. On return, advanced past any option value.
+/// @param config The session configuration to update.
+/// @return true if the argument was a session option and was consumed.
+bool etw_session_option(int argc, char **argv, int *i, etw_session_config_t *config);
+
+/// @summary Print the usage lines for the -name, -keywords, -level and -providers options.
+/// @param fp The output stream.
+/// @param default_name The session name used when -name is not given.
+void etw_session_usage(FILE *fp, char const *default_name);
+
+/// @summary Query the buffer and loss statistics of a running session.
+/// @param session The session state returned by etw_session_start.
+/// @param stats On return, stores the session statistics.
+/// @return true if the statistics were retrieved.
+bool etw_session_query(etw_session_t *session, etw_session_stats_t *stats);
+
+/// @summary Stop a trace session, flushing any buffered events.
+/// @param session The session state returned by etw_session_start.
+/// @param stats On return, stores the final session statistics. May be NULL.
+/// @return true if the session was stopped.
+bool etw_session_stop(etw_session_t *session, etw_session_stats_t *stats);
+
+/// @summary Allocate an empty call tree.
+/// @return The call tree, or NULL if memory could not be allocated.
+etw_tree_t* etw_tree_create(void);
+
+/// @summary Free a call tree and all of its nodes.
+/// @param tree The call tree to free. May be NULL.
+void etw_tree_delete(etw_tree_t *tree);
+
+/// @summary Clear the accumulated times and counts in a call tree, keeping the
+/// tree structure and any scopes that are still open.
+/// @param tree The call tree.
+void etw_tree_reset(etw_tree_t *tree);
+
+/// @summary Update a call tree with a decoded event. EnterScope and LeaveScope events
+/// push and pop the per-thread scope stack; ThreadID events name the thread's root.
+/// Other events are ignored. Events for each thread must arrive in timestamp order.
+/// @param tree The call tree.
+/// @param ev The decoded event.
+void etw_tree_event(etw_tree_t *tree, etw_event_t const *ev);
+
+/// @summary Print a call tree in indented form with inclusive and exclusive times.
+/// @param tree The call tree.
+/// @param fp The output stream.
+/// @param min_percent Scopes below this percentage of their thread's time are omitted.
+void etw_tree_print(etw_tree_t const *tree, FILE *fp, double min_percent);
+
+/// @summary Write a call tree as folded stacks ("thread;outer;inner weight"), one line
+/// per scope path, weighted by exclusive time in microseconds.
+/// @param tree The call tree.
+/// @param fp The output stream.
+void etw_tree_folded(etw_tree_t const *tree, FILE *fp);
+
+/// @summary Allocate the state used to resolve function addresses. DbgHelp is loaded
+/// the first time a module or address is passed in.
+/// @return The symbol state, or NULL if memory could not be allocated.
+etw_symbols_t* etw_symbols_create(void);
+
+/// @summary Free the symbol state and all of the names it returned.
+/// @param symbols The symbol state returned by etw_symbols_create.
+void etw_symbols_delete(etw_symbols_t *symbols);
+
+/// @summary Load the symbols for a module described by a Module event. The PDB is found
+/// through the module file, so traces must be analyzed where the module is available.
+/// @param symbols The symbol state.
+/// @param pid The identifier of the traced process.
+/// @param base The address at which the module was loaded.
+/// @param size The size of the module image, in bytes.
+/// @param path The path of the module file.
+void etw_symbols_module(etw_symbols_t *symbols, uint32_t pid, uint64_t base, uint32_t size, char const *path);
+
+/// @summary Resolve the address of an instrumented function to a name of the form
+/// "module!function", falling back to "module+0xOFFSET" or the address in hex.
+/// @param symbols The symbol state.
+/// @param pid The identifier of the traced process.
+/// @param address The address of the function.
+/// @return The name, valid until the symbol state is deleted.
+char const* etw_symbols_name(etw_symbols_t *symbols, uint32_t pid, uint64_t address);
+
+/// @summary Implements the 'live' command.
+/// @param argc The number of command arguments.
+/// @param argv The command arguments, not including the command name.
+/// @return The process exit code.
+int cmd_live(int argc, char **argv);
+
+/// @summary Implements the 'record' command.
+/// @param argc The number of command arguments.
+/// @param argv The command arguments, not including the command name.
+/// @return The process exit code.
+int cmd_record(int argc, char **argv);
+
+/// @summary Implements the 'index' command.
+/// @param argc The number of command arguments.
+/// @param argv The command arguments, not including the command name.
+/// @return The process exit code.
+int cmd_index(int argc, char **argv);
+
+/// @summary Implements the 'locks' command.
+/// @param argc The number of command arguments.
+/// @param argv The command arguments, not including the command name.
+/// @return The process exit code.
+int cmd_locks(int argc, char **argv);
+
+/// @summary Implements the 'scopes' command.
+/// @param argc The number of command arguments.
+/// @param argv The command arguments, not including the command name.
+/// @return The process exit code.
+int cmd_scopes(int argc, char **argv);
+
+/// @summary Implements the 'tree' command.
+/// @param argc The number of command arguments.
+/// @param argv The command arguments, not including the command name.
+/// @return The process exit code.
+int cmd_tree(int argc, char **argv);
+
+/// @summary Implements the 'critpath' command.
+/// @param argc The number of command arguments.
+/// @param argv The command arguments, not including the command name.
+/// @return The process exit code.
+int cmd_critpath(int argc, char **argv);
+
+/// @summary Implements the 'diff' command.
+/// @param argc The number of command arguments.
+/// @param argv The command arguments, not including the command name.
+/// @return The process exit code.
+int cmd_diff(int argc, char **argv);
+
+/// @summary Implements the 'samples' command.
+/// @param argc The number of command arguments.
+/// @param argv The command arguments, not including the command name.
+/// @return The process exit code.
+int cmd_samples(int argc, char **argv);
+
+/// @summary Implements the 'tasks' command.
+/// @param argc The number of command arguments.
+/// @param argv The command arguments, not including the command name.
+/// @return The process exit code.
+int cmd_tasks(int argc, char **argv);
+
+/// @summary Implements the 'merge' command.
+/// @param argc The number of command arguments.
+/// @param argv The command arguments, not including the command name.
+/// @return The process exit code.
+int cmd_merge(int argc, char **argv);
+
+/// @summary Implements the 'input' command.
+/// @param argc The number of command arguments.
+/// @param argv The command arguments, not including the command name.
+/// @return The process exit code.
+int cmd_input(int argc, char **argv);
+
+/// @summary Implements the 'fileio' command.
+/// @param argc The number of command arguments.
+/// @param argv The command arguments, not including the command name.
+/// @return The process exit code.
+int cmd_fileio(int argc, char **argv);
+
+/// @summary Implements the 'launch' command.
+/// @param argc The number of command arguments.
+/// @param argv The command arguments, not including the command name.
+/// @return The process exit code.
+int cmd_launch(int argc, char **argv);
+
+/// @summary Implements the 'counters' command.
+/// @param argc The number of command arguments.
+/// @param argv The command arguments, not including the command name.
+/// @return The process exit code.
+int cmd_counters(int argc, char **argv);
+
+/// @summary Implements the 'top' command.
+/// @param argc The number of command arguments.
+/// @param argv The command arguments, not including the command name.
+/// @return The process exit code.
+int cmd_top(int argc, char **argv);
+
+/// @summary Implements the 'folded' command.
+/// @param argc The number of command arguments.
+/// @param argv The command arguments, not including the command name.
+/// @return The process exit code.
+int cmd_folded(int argc, char **argv);
+
+#endif /* !defined(ETW_ANALYZE_H) */
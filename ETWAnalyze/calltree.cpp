@@ -0,0 +1,520 @@
+/*/////////////////////////////////////////////////////////////////////////////
+/// @summary Implements a per-thread call tree that is built incrementally from
+/// the EnterScope and LeaveScope events, and tracks inclusive and exclusive
+/// time for each distinct scope path. Task scopes logged while a task context
+/// is resumed are attributed to the task, under a root for the task name.
+/// @author Russell Klenk (contact@russellklenk.com)
+///////////////////////////////////////////////////////////////////////////80*/
+
+/*////////////////
+//   Includes   //
+////////////////*/
+#include "ETWAnalyze.h"
+
+/*/////////////////
+//   Constants   //
+/////////////////*/
+/// @summary Define the maximum length of a scope or thread name, including the NULL.
+#define TREE_MAX_NAME        64
+
+/// @summary Define the maximum number of distinct threads tracked by a tree.
+#define TREE_MAX_THREADS     256
+
+/// @summary Define the maximum scope nesting depth tracked per thread. Deeper
+/// scopes are counted but not attributed.
+#define TREE_MAX_DEPTH       64
+
+/// @summary Define the maximum number of task contexts that may be live at once.
+#define TREE_MAX_TASKS       1024
+
+/// @summary Define the maximum number of distinct task names.
+#define TREE_MAX_TASK_ROOTS  256
+
+/// @summary The index used to indicate the absence of a node.
+#define TREE_INVALID_NODE    0xFFFFFFFFU
+
+/// @summary The index used to indicate that no task context is resumed on a thread.
+#define TREE_NO_TASK         0xFFFFFFFFU
+
+/*//////////////////
+//   Data Types   //
+//////////////////*/
+/// @summary A single node in the call tree, representing one distinct scope path.
+struct tree_node_t
+{
+    char         Name[TREE_MAX_NAME]; /// The scope description, or the thread name for a root node.
+    uint32_t     Parent;      /// The index of the parent node, or TREE_INVALID_NODE for a root.
+    uint32_t     FirstChild;  /// The index of the first child node, or TREE_INVALID_NODE.
+    uint32_t     NextSibling; /// The index of the next sibling node, or TREE_INVALID_NODE.
+    uint32_t     Source;      /// One of etw_source_e.
+    uint64_t     Count;       /// The number of completed scope instances.
+    int64_t      Inclusive;   /// The total time spent in the scope, in 100ns units.
+    int64_t      Children;    /// The total time spent in child scopes, in 100ns units.
+};
+
+/// @summary An open scope on a thread's scope stack.
+struct tree_frame_t
+{
+    uint32_t     Node;        /// The index of the node for the open scope.
+    int64_t      EnterTime;   /// The timestamp of the EnterScope event, in 100ns units.
+};
+
+/// @summary A stack of open scopes, belonging to a thread or a task context.
+struct tree_stack_t
+{
+    uint32_t     Root;        /// The index of the root node under which the scopes are attributed.
+    uint32_t     Depth;       /// The number of open scopes, which may exceed TREE_MAX_DEPTH.
+    tree_frame_t Frames[TREE_MAX_DEPTH]; /// The open scopes, outermost first.
+};
+
+/// @summary The scope stack and root node for a single thread.
+struct tree_thread_t
+{
+    uint32_t     ProcessId;   /// The identifier of the process that owns the thread.
+    uint32_t     ThreadId;    /// The operating system thread identifier.
+    uint32_t     Task;        /// The index of the task context resumed on the thread, or TREE_NO_TASK.
+    tree_stack_t Stack;       /// The scopes opened on the thread outside of any task context.
+};
+
+/// @summary The scope stack of a live task context, which moves between threads.
+struct tree_task_t
+{
+    uint64_t     TaskId;      /// The identifier of the task, or zero if the slot is free.
+    uint32_t     ProcessId;   /// The identifier of the process that owns the task.
+    uint32_t     Prev;        /// The task that was resumed on the thread before this one, or TREE_NO_TASK.
+    tree_stack_t Stack;       /// The scopes opened while the task was resumed.
+};
+
+/// @summary The call tree state. Nodes are stored in a single growable array
+/// and refer to each other by index, so the array may be reallocated freely.
+struct etw_tree_t
+{
+    tree_node_t  *Nodes;      /// The node storage.
+    uint32_t      NodeCount;  /// The number of nodes in use.
+    uint32_t      NodeCapacity; /// The number of nodes allocated.
+    uint32_t      ThreadCount;/// The number of entries in use in Threads.
+    uint32_t      Unmatched;  /// The number of LeaveScope events with no matching EnterScope.
+    uint32_t      Dropped;    /// The number of events dropped because a limit was reached.
+    uint32_t      TaskRootCount; /// The number of entries in use in TaskRoots.
+    uint32_t      TaskRoots[TREE_MAX_TASK_ROOTS]; /// The root node for each distinct task name.
+    tree_thread_t Threads[TREE_MAX_THREADS]; /// The per-thread state.
+    tree_task_t   Tasks[TREE_MAX_TASKS]; /// The live task contexts.
+};
+
+/*///////////////////////
+//   Local Functions   //
+///////////////////////*/
+/// @summary Copy a name into a fixed-size node name buffer, truncating if necessary.
+/// @param dst The destination buffer, TREE_MAX_NAME bytes.
+/// @param src The NULL-terminated source string.
+static void copy_name(char *dst, char const *src)
+{
+    strncpy(dst, src, TREE_MAX_NAME - 1);
+    dst[TREE_MAX_NAME-1] = '\0';
+}
+
+/// @summary Allocate a new node, growing the node array if necessary.
+/// @param tree The call tree.
+/// @param parent The index of the parent node, or TREE_INVALID_NODE.
+/// @param name The node name.
+/// @param source One of etw_source_e.
+/// @return The index of the new node, or TREE_INVALID_NODE if memory is exhausted.
+static uint32_t node_create(etw_tree_t *tree, uint32_t parent, char const *name, uint32_t source)
+{
+    if (tree->NodeCount == tree->NodeCapacity)
+    {
+        uint32_t     capacity = tree->NodeCapacity ? tree->NodeCapacity * 2 : 1024;
+        tree_node_t *nodes    = (tree_node_t*) realloc(tree->Nodes, capacity * sizeof(tree_node_t));
+        if (nodes == NULL)
+            return TREE_INVALID_NODE;
+        tree->Nodes        = nodes;
+        tree->NodeCapacity = capacity;
+    }
+
+    uint32_t     index = tree->NodeCount++;
+    tree_node_t *node  = &tree->Nodes[index];
+    memset(node, 0, sizeof(tree_node_t));
+    copy_name(node->Name, name);
+    node->Parent       = parent;
+    node->FirstChild   = TREE_INVALID_NODE;
+    node->NextSibling  = TREE_INVALID_NODE;
+    node->Source       = source;
+    if (parent != TREE_INVALID_NODE)
+    {   // link the new node at the head of the parent's child list.
+        node->NextSibling = tree->Nodes[parent].FirstChild;
+        tree->Nodes[parent].FirstChild = index;
+    }
+    return index;
+}
+
+/// @summary Find or create the child of a node with a given name.
+/// @param tree The call tree.
+/// @param parent The index of the parent node.
+/// @param name The scope description.
+/// @param source One of etw_source_e.
+/// @return The index of the child node, or TREE_INVALID_NODE if memory is exhausted.
+static uint32_t node_child(etw_tree_t *tree, uint32_t parent, char const *name, uint32_t source)
+{
+    for (uint32_t i = tree->Nodes[parent].FirstChild; i != TREE_INVALID_NODE; i = tree->Nodes[i].NextSibling)
+    {
+        tree_node_t const *node = &tree->Nodes[i];
+        if (node->Source == source && strncmp(node->Name, name, TREE_MAX_NAME - 1) == 0)
+            return i;
+    }
+    return node_create(tree, parent, name, source);
+}
+
+/// @summary Find or create the state for a thread.
+/// @param tree The call tree.
+/// @param process_id The identifier of the process that owns the thread.
+/// @param thread_id The operating system thread identifier.
+/// @return The thread state, or NULL if the thread table is full.
+static tree_thread_t* thread_find(etw_tree_t *tree, uint32_t process_id, uint32_t thread_id)
+{
+    for (uint32_t i = 0; i < tree->ThreadCount; ++i)
+    {
+        tree_thread_t *thread = &tree->Threads[i];
+        if (thread->ThreadId == thread_id && thread->ProcessId == process_id)
+            return thread;
+    }
+    if (tree->ThreadCount < TREE_MAX_THREADS)
+    {
+        tree_thread_t *thread = &tree->Threads[tree->ThreadCount];
+        char           name[TREE_MAX_NAME];
+        _snprintf(name, TREE_MAX_NAME, "Thread %u", thread_id);
+        name[TREE_MAX_NAME-1] = '\0';
+        if ((thread->Stack.Root = node_create(tree, TREE_INVALID_NODE, name, ETW_SOURCE_MAIN)) == TREE_INVALID_NODE)
+            return NULL;
+        thread->ProcessId   = process_id;
+        thread->ThreadId    = thread_id;
+        thread->Task        = TREE_NO_TASK;
+        thread->Stack.Depth = 0;
+        tree->ThreadCount++;
+        return thread;
+    }
+    return NULL;
+}
+
+/// @summary Find or create the root node shared by all tasks with a given name.
+/// @param tree The call tree.
+/// @param name The task name.
+/// @return The index of the root node, or TREE_INVALID_NODE if a limit was reached.
+static uint32_t task_root(etw_tree_t *tree, char const *name)
+{
+    char label[TREE_MAX_NAME];
+    _snprintf(label, TREE_MAX_NAME, "Task %s", name);
+    label[TREE_MAX_NAME-1] = '\0';
+    for (uint32_t i = 0; i < tree->TaskRootCount; ++i)
+    {
+        if (strcmp(tree->Nodes[tree->TaskRoots[i]].Name, label) == 0)
+            return tree->TaskRoots[i];
+    }
+    if (tree->TaskRootCount < TREE_MAX_TASK_ROOTS)
+    {
+        uint32_t root = node_create(tree, TREE_INVALID_NODE, label, ETW_SOURCE_TASK);
+        if (root != TREE_INVALID_NODE)
+            tree->TaskRoots[tree->TaskRootCount++] = root;
+        return root;
+    }
+    return TREE_INVALID_NODE;
+}
+
+/// @summary Find the state for a live task context, optionally creating it.
+/// @param tree The call tree.
+/// @param process_id The identifier of the process that owns the task.
+/// @param task_id The identifier of the task.
+/// @param name The task name, used when the task is created, or NULL to only find it.
+/// @return The index of the task in tree->Tasks, or TREE_NO_TASK.
+static uint32_t task_find(etw_tree_t *tree, uint32_t process_id, uint64_t task_id, char const *name)
+{
+    uint32_t slot = TREE_NO_TASK;
+    for (uint32_t i = 0; i < TREE_MAX_TASKS; ++i)
+    {
+        tree_task_t const *task = &tree->Tasks[i];
+        if (task->TaskId == task_id && task->ProcessId == process_id)
+            return i;
+        if (task->TaskId == 0 && slot == TREE_NO_TASK)
+            slot = i;
+    }
+    if (name != NULL && slot != TREE_NO_TASK)
+    {
+        tree_task_t *task = &tree->Tasks[slot];
+        if ((task->Stack.Root = task_root(tree, name)) == TREE_INVALID_NODE)
+            return TREE_NO_TASK;
+        task->TaskId      = task_id;
+        task->ProcessId   = process_id;
+        task->Prev        = TREE_NO_TASK;
+        task->Stack.Depth = 0;
+        return slot;
+    }
+    return TREE_NO_TASK;
+}
+
+/// @summary Update the task context resumed on a thread for a task event.
+/// @param tree The call tree.
+/// @param ev A TaskResume, TaskSuspend or TaskComplete event.
+static void task_event(etw_tree_t *tree, etw_event_t const *ev)
+{
+    tree_thread_t *thread = thread_find(tree, ev->ProcessId, ev->ThreadId);
+    uint32_t       index  = task_find(tree, ev->ProcessId, ev->Id, ev->Kind == ETW_EVENT_TASK_RESUME ? ev->Text : NULL);
+    if (thread == NULL || index == TREE_NO_TASK)
+    {   // the task was resumed before the trace started, or a limit was reached.
+        if (ev->Kind == ETW_EVENT_TASK_RESUME) tree->Dropped++;
+        return;
+    }
+    tree_task_t *task = &tree->Tasks[index];
+    if (ev->Kind == ETW_EVENT_TASK_RESUME)
+    {
+        task->Prev   = thread->Task;
+        thread->Task = index;
+    }
+    else if (ev->Kind == ETW_EVENT_TASK_SUSPEND && thread->Task == index)
+    {
+        thread->Task = task->Prev;
+        task->Prev   = TREE_NO_TASK;
+    }
+    else if (ev->Kind == ETW_EVENT_TASK_COMPLETE)
+    {   // scopes still open on the task are discarded with it.
+        task->TaskId = 0;
+    }
+}
+
+/// @summary Close the innermost open scope on a stack, attributing its time.
+/// @param tree The call tree.
+/// @param stack The thread or task scope stack.
+/// @param timestamp The timestamp of the LeaveScope event, in 100ns units.
+static void stack_pop(etw_tree_t *tree, tree_stack_t *stack, int64_t timestamp)
+{
+    tree_frame_t const &frame   = stack->Frames[--stack->Depth];
+    tree_node_t        *node    = &tree->Nodes[frame.Node];
+    int64_t const       elapsed = timestamp - frame.EnterTime;
+    node->Count++;
+    node->Inclusive += elapsed;
+    tree->Nodes[node->Parent].Children += elapsed;
+}
+
+/// @summary Compute the inclusive time of a root node, which is the sum of the
+/// inclusive time of its top-level scopes.
+/// @param tree The call tree.
+/// @param index The index of the root node.
+/// @return The inclusive time, in 100ns units.
+static int64_t root_time(etw_tree_t const *tree, uint32_t index)
+{
+    return tree->Nodes[index].Children;
+}
+
+/// @summary Print a node and its descendants in indented form.
+/// @param tree The call tree.
+/// @param fp The output stream.
+/// @param index The index of the node to print.
+/// @param depth The nesting depth of the node below the thread root.
+/// @param total The inclusive time of the thread root, in 100ns units.
+/// @param min_percent Nodes below this percentage of the thread's time are omitted.
+static void print_node(etw_tree_t const *tree, FILE *fp, uint32_t index, uint32_t depth, int64_t total, double min_percent)
+{
+    tree_node_t const *node    = &tree->Nodes[index];
+    double const       percent = total > 0 ? (100.0 * node->Inclusive) / total : 0.0;
+    if (percent < min_percent)
+        return;
+
+    fprintf(fp, "%12.3f %12.3f %10I64u %6.2f%%  %*s%s\n", node->Inclusive / TICKS_PER_MS,
+            (node->Inclusive - node->Children) / TICKS_PER_MS, node->Count, percent,
+            int(depth * 2), "", node->Name);
+    for (uint32_t i = node->FirstChild; i != TREE_INVALID_NODE; i = tree->Nodes[i].NextSibling)
+    {
+        print_node(tree, fp, i, depth + 1, total, min_percent);
+    }
+}
+
+/// @summary Write the folded stack for a node and its descendants.
+/// @param tree The call tree.
+/// @param fp The output stream.
+/// @param index The index of the node to write.
+/// @param path The buffer holding the semicolon-separated path of the parent node.
+/// @param length The number of characters in path.
+/// @param capacity The size of the path buffer, in bytes.
+static void fold_node(etw_tree_t const *tree, FILE *fp, uint32_t index, char *path, size_t length, size_t capacity)
+{
+    tree_node_t const *node = &tree->Nodes[index];
+    size_t             end  = length;
+
+    if (end > 0 && end + 1 < capacity)
+        path[end++] = ';';
+    for (char const *s = node->Name; *s && end + 1 < capacity; ++s)
+    {   // the folded format reserves ';' as the frame separator.
+        path[end++] = (*s == ';') ? ':' : *s;
+    }
+    path[end] = '\0';
+
+    // emit exclusive time in microseconds; flame graph tools expect integer weights.
+    int64_t exclusive = (node->Inclusive - node->Children) / 10;
+    if (node->Parent != TREE_INVALID_NODE && exclusive > 0)
+    {
+        fprintf(fp, "%s %I64d\n", path, exclusive);
+    }
+    for (uint32_t i = node->FirstChild; i != TREE_INVALID_NODE; i = tree->Nodes[i].NextSibling)
+    {
+        fold_node(tree, fp, i, path, end, capacity);
+    }
+    path[length] = '\0';
+}
+
+/*///////////////////////
+//  Public Functions   //
+///////////////////////*/
+etw_tree_t* etw_tree_create(void)
+{
+    return (etw_tree_t*) calloc(1, sizeof(etw_tree_t));
+}
+
+void etw_tree_delete(etw_tree_t *tree)
+{
+    if (tree != NULL)
+    {
+        free(tree->Nodes);
+        free(tree);
+    }
+}
+
+void etw_tree_reset(etw_tree_t *tree)
+{
+    for (uint32_t i = 0; i < tree->NodeCount; ++i)
+    {   // keep the structure and any open scopes; clear the accumulated times.
+        tree->Nodes[i].Count     = 0;
+        tree->Nodes[i].Inclusive = 0;
+        tree->Nodes[i].Children  = 0;
+    }
+    tree->Unmatched = 0;
+    tree->Dropped   = 0;
+}
+
+void etw_tree_event(etw_tree_t *tree, etw_event_t const *ev)
+{
+    tree_thread_t *thread = NULL;
+    tree_stack_t  *stack  = NULL;
+
+    if (ev->Kind == ETW_EVENT_THREAD_ID)
+    {   // the event names the thread identified in the payload.
+        if ((thread = thread_find(tree, ev->ProcessId, (uint32_t) ev->Value[0])) != NULL)
+            copy_name(tree->Nodes[thread->Stack.Root].Name, ev->Text);
+        return;
+    }
+    if (ev->Kind == ETW_EVENT_TASK_RESUME || ev->Kind == ETW_EVENT_TASK_SUSPEND || ev->Kind == ETW_EVENT_TASK_COMPLETE)
+    {
+        task_event(tree, ev);
+        return;
+    }
+    if (ev->Kind != ETW_EVENT_ENTER_SCOPE && ev->Kind != ETW_EVENT_LEAVE_SCOPE)
+    {
+        return;
+    }
+    if ((thread = thread_find(tree, ev->ProcessId, ev->ThreadId)) == NULL)
+    {
+        tree->Dropped++;
+        return;
+    }
+    if (ev->Source == ETW_SOURCE_TASK && thread->Task != TREE_NO_TASK)
+        stack = &tree->Tasks[thread->Task].Stack;
+    else
+        stack = &thread->Stack;
+
+    if (ev->Kind == ETW_EVENT_ENTER_SCOPE)
+    {
+        if (stack->Depth < TREE_MAX_DEPTH)
+        {
+            uint32_t parent = stack->Depth > 0 ? stack->Frames[stack->Depth-1].Node : stack->Root;
+            uint32_t node   = node_child(tree, parent, ev->Text, ev->Source);
+            if (node == TREE_INVALID_NODE)
+            {
+                tree->Dropped++;
+                return;
+            }
+            stack->Frames[stack->Depth].Node      = node;
+            stack->Frames[stack->Depth].EnterTime = ev->Timestamp;
+        }
+        else tree->Dropped++;
+        stack->Depth++;
+    }
+    else
+    {
+        if (stack->Depth == 0)
+        {   // the trace began while this scope was open.
+            tree->Unmatched++;
+            return;
+        }
+        if (stack->Depth > TREE_MAX_DEPTH)
+        {   // the matching EnterScope was not attributed.
+            stack->Depth--;
+            return;
+        }
+        // scopes may be left out of order if a thread mixes main and task scopes
+        // or an exception skipped a destructor. unwind to the matching scope.
+        uint32_t match = stack->Depth;
+        while (match > 0)
+        {
+            tree_node_t const *node = &tree->Nodes[stack->Frames[match-1].Node];
+            if (node->Source == (uint32_t) ev->Source && strncmp(node->Name, ev->Text, TREE_MAX_NAME - 1) == 0)
+                break;
+            match--;
+        }
+        if (match == 0)
+        {
+            tree->Unmatched++;
+            return;
+        }
+        while (stack->Depth >= match)
+        {
+            stack_pop(tree, stack, ev->Timestamp);
+        }
+    }
+}
+
+void etw_tree_print(etw_tree_t const *tree, FILE *fp, double min_percent)
+{
+    fprintf(fp, "%12s %12s %10s %7s  %s\n", "Incl (ms)", "Excl (ms)", "Count", "Incl", "Scope");
+    for (uint32_t i = 0; i < tree->ThreadCount; ++i)
+    {
+        tree_thread_t const *thread = &tree->Threads[i];
+        tree_node_t   const *root   = &tree->Nodes[thread->Stack.Root];
+        int64_t        const total  = root_time(tree, thread->Stack.Root);
+        if (root->FirstChild == TREE_INVALID_NODE)
+            continue;
+        fprintf(fp, "%12.3f %12s %10s %6.2f%%  %s (pid %u, tid %u)\n", total / TICKS_PER_MS, "", "", 100.0,
+                root->Name, thread->ProcessId, thread->ThreadId);
+        for (uint32_t c = root->FirstChild; c != TREE_INVALID_NODE; c = tree->Nodes[c].NextSibling)
+        {
+            print_node(tree, fp, c, 1, total, min_percent);
+        }
+    }
+    for (uint32_t i = 0; i < tree->TaskRootCount; ++i)
+    {   // task scopes are grouped by task name, whichever threads they ran on.
+        tree_node_t const *root  = &tree->Nodes[tree->TaskRoots[i]];
+        int64_t      const total = root_time(tree, tree->TaskRoots[i]);
+        if (root->FirstChild == TREE_INVALID_NODE)
+            continue;
+        fprintf(fp, "%12.3f %12s %10s %6.2f%%  %s\n", total / TICKS_PER_MS, "", "", 100.0, root->Name);
+        for (uint32_t c = root->FirstChild; c != TREE_INVALID_NODE; c = tree->Nodes[c].NextSibling)
+        {
+            print_node(tree, fp, c, 1, total, min_percent);
+        }
+    }
+    if (tree->Unmatched > 0 || tree->Dropped > 0)
+    {
+        fprintf(fp, "(%u unmatched LeaveScope events, %u events dropped)\n", tree->Unmatched, tree->Dropped);
+    }
+}
+
+void etw_tree_folded(etw_tree_t const *tree, FILE *fp)
+{
+    char path[TREE_MAX_DEPTH * TREE_MAX_NAME];
+    for (uint32_t i = 0; i < tree->ThreadCount; ++i)
+    {
+        path[0] = '\0';
+        fold_node(tree, fp, tree->Threads[i].Stack.Root, path, 0, sizeof(path));
+    }
+    for (uint32_t i = 0; i < tree->TaskRootCount; ++i)
+    {
+        path[0] = '\0';
+        fold_node(tree, fp, tree->TaskRoots[i], path, 0, sizeof(path));
+    }
+}
@@ -0,0 +1,387 @@
+/*/////////////////////////////////////////////////////////////////////////////
+/// @summary Implements the 'counters' command, which charts the process memory,
+/// I/O and CPU counters sampled by the provider's counter thread over time,
+/// along with the residency of any ranges registered with ETWCounterRegion.
+/// @author Russell Klenk (contact@russellklenk.com)
+///////////////////////////////////////////////////////////////////////////80*/
+
+/*////////////////
+//   Includes   //
+////////////////*/
+#include "ETWAnalyze.h"
+
+/*/////////////////
+//   Constants   //
+/////////////////*/
+/// @summary Define the maximum number of input files accepted on the command line.
+#define COUNTERS_MAX_INPUTS    64
+
+/// @summary Define the maximum number of processes tracked.
+#define COUNTERS_MAX_PROCESSES 64
+
+/// @summary Define the maximum number of regions tracked per process. This matches
+/// the number of regions the provider can sample.
+#define COUNTERS_MAX_REGIONS   16
+
+/// @summary Define the maximum length of a region name, including the NULL.
+#define COUNTERS_MAX_NAME      64
+
+/// @summary The default width of a row in the chart, in milliseconds.
+#define COUNTERS_DEFAULT_BIN   100.0
+
+/*//////////////////
+//   Data Types   //
+//////////////////*/
+/// @summary The counter deltas accumulated over one row of the chart.
+struct counters_bin_t
+{
+    uint32_t     Samples;     /// The number of samples that fell within the row.
+    uint64_t     WorkingSet;  /// The working set at the last sample, in bytes.
+    uint64_t     Private;     /// The private bytes at the last sample.
+    uint64_t     Faults;      /// The page faults since the previous row.
+    uint64_t     ReadBytes;   /// The bytes read since the previous row.
+    uint64_t     WriteBytes;  /// The bytes written since the previous row.
+    double       CpuMs;       /// The CPU time consumed since the previous row, in milliseconds.
+    uint64_t     Resident;    /// The summed resident bytes of the regions sampled within the row.
+    uint64_t     RegionSize;  /// The summed size of the regions sampled within the row.
+};
+
+/// @summary Residency statistics for a single registered region.
+struct counters_region_t
+{
+    char         Name[COUNTERS_MAX_NAME]; /// The region name.
+    uint64_t     Address;     /// The base address of the region.
+    uint64_t     Size;        /// The size of the region, in bytes.
+    uint32_t     Samples;     /// The number of residency events received.
+    double       SumPercent;  /// The summed resident percentage, for computing the mean.
+    double       MinPercent;  /// The lowest resident percentage observed.
+    double       MaxPercent;  /// The highest resident percentage observed.
+    double       LastPercent; /// The resident percentage at the last sample.
+};
+
+/// @summary The samples received from a single process.
+struct counters_process_t
+{
+    uint32_t          ProcessId;  /// The process identifier, or zero if the entry is unused.
+    int64_t           FirstTime;  /// The timestamp of the first counters event.
+    bool              HavePrev;   /// true if the Prev fields hold a sample.
+    uint32_t          PrevFaults; /// The page fault count at the previous sample.
+    uint64_t          PrevRead;   /// The bytes read at the previous sample.
+    uint64_t          PrevWrite;  /// The bytes written at the previous sample.
+    float             PrevCpu;    /// The CPU time at the previous sample, in milliseconds.
+    int64_t           PrevTime;   /// The timestamp of the previous sample.
+    double            SumGap;     /// The summed time between samples, in milliseconds.
+    uint32_t          Samples;    /// The number of counters events received.
+    double            SumCost;    /// The summed cost of taking the samples, in milliseconds.
+    double            MaxCost;    /// The highest cost of a single sample, in milliseconds.
+    uint64_t          PeakWorkingSet; /// The largest working set observed.
+    uint64_t          PeakPrivate;    /// The largest private bytes observed.
+    counters_bin_t   *Bins;       /// The rows of the chart, indexed by time since FirstTime.
+    uint32_t          BinCount;   /// The number of rows in use.
+    uint32_t          BinCapacity;/// The number of rows allocated.
+    counters_region_t Regions[COUNTERS_MAX_REGIONS]; /// The regions reported by the process.
+    uint32_t          RegionCount;/// The number of entries in Regions.
+};
+
+/// @summary The tables built while processing the input files.
+struct counters_state_t
+{
+    double             BinMs;     /// The width of a row in the chart, in milliseconds.
+    counters_process_t Processes[COUNTERS_MAX_PROCESSES]; /// The processes that reported counters.
+    uint32_t           ProcessCount; /// The number of entries in Processes.
+    uint32_t           Dropped;   /// The number of events dropped because a table was full.
+};
+
+/*///////////////////////
+//   Local Functions   //
+///////////////////////*/
+/// @summary Print usage information for the counters command.
+static void print_usage(void)
+{
+    fprintf(stdout, "USAGE: etwanalyze.exe counters [-interval MS] [-from MS] [-to MS] INFILE [INFILE...]\n");
+    fprintf(stdout, "  Chart the working set, private bytes, page faults, I/O throughput and CPU\n");
+    fprintf(stdout, "  use sampled by the counter thread, which runs while the Counters keyword is\n");
+    fprintf(stdout, "  enabled, and summarize the residency of ranges registered with ETWCounterRegion.\n");
+    fprintf(stdout, "  -interval: The width of each row of the chart, in milliseconds (default 100).\n");
+    etw_range_usage(stdout);
+    fprintf(stdout, "\n");
+}
+
+/// @summary Find or insert the entry for a process.
+/// @param state The counters command state.
+/// @param pid The process identifier.
+/// @param timestamp The timestamp of the event, used as the origin of a new entry.
+/// @return The process entry, or NULL if the table is full.
+static counters_process_t* find_process(counters_state_t *state, uint32_t pid, int64_t timestamp)
+{
+    for (uint32_t i = 0; i < state->ProcessCount; ++i)
+    {
+        if (state->Processes[i].ProcessId == pid)
+            return &state->Processes[i];
+    }
+    if (state->ProcessCount == COUNTERS_MAX_PROCESSES)
+        return NULL;
+
+    counters_process_t *proc = &state->Processes[state->ProcessCount++];
+    proc->ProcessId = pid;
+    proc->FirstTime = timestamp;
+    return proc;
+}
+
+/// @summary Retrieve the chart row containing a timestamp, growing the row list as needed.
+/// @param state The counters command state.
+/// @param proc The process entry.
+/// @param timestamp The event timestamp.
+/// @return The row, or NULL if the row list could not be grown.
+static counters_bin_t* find_bin(counters_state_t *state, counters_process_t *proc, int64_t timestamp)
+{
+    double   ms    = double(timestamp - proc->FirstTime) / TICKS_PER_MS;
+    uint32_t index = ms > 0.0 ? uint32_t(ms / state->BinMs) : 0;
+    if (index >= proc->BinCapacity)
+    {
+        uint32_t        cap  = proc->BinCapacity ? proc->BinCapacity : 256;
+        counters_bin_t *grow = NULL;
+        while (cap <= index) cap *= 2;
+        if ((grow = (counters_bin_t*) realloc(proc->Bins, cap * sizeof(counters_bin_t))) == NULL)
+            return NULL;
+        memset(grow + proc->BinCapacity, 0, (cap - proc->BinCapacity) * sizeof(counters_bin_t));
+        proc->Bins        = grow;
+        proc->BinCapacity = cap;
+    }
+    if (index >= proc->BinCount)
+        proc->BinCount = index + 1;
+    return &proc->Bins[index];
+}
+
+/// @summary Find or insert the entry for a registered region.
+/// @param proc The process entry.
+/// @param address The base address of the region.
+/// @param name The region name.
+/// @return The region entry, or NULL if the table is full.
+static counters_region_t* find_region(counters_process_t *proc, uint64_t address, char const *name)
+{
+    for (uint32_t i = 0; i < proc->RegionCount; ++i)
+    {
+        counters_region_t *region = &proc->Regions[i];
+        if (region->Address == address && strncmp(region->Name, name, COUNTERS_MAX_NAME - 1) == 0)
+            return region;
+    }
+    if (proc->RegionCount == COUNTERS_MAX_REGIONS)
+        return NULL;
+
+    counters_region_t *region = &proc->Regions[proc->RegionCount++];
+    strncpy(region->Name, name, COUNTERS_MAX_NAME - 1);
+    region->Name[COUNTERS_MAX_NAME-1] = '\0';
+    region->Address    = address;
+    region->MinPercent = 100.0;
+    return region;
+}
+
+/// @summary Add a counters sample to the chart. The counters are cumulative, so each
+/// row accumulates the difference from the previous sample.
+/// @param state The counters command state.
+/// @param ev The ETW_EVENT_COUNTERS event.
+static void record_counters(counters_state_t *state, etw_event_t const *ev)
+{
+    counters_process_t *proc = find_process(state, ev->ProcessId, ev->Timestamp);
+    counters_bin_t     *bin  = NULL;
+    if (proc == NULL || (bin = find_bin(state, proc, ev->Timestamp)) == NULL)
+    {
+        state->Dropped++;
+        return;
+    }
+    proc->Samples++;
+    proc->SumCost += ev->Duration;
+    if (ev->Duration > proc->MaxCost)        proc->MaxCost        = ev->Duration;
+    if (ev->Size     > proc->PeakWorkingSet) proc->PeakWorkingSet = ev->Size;
+    if (ev->Target   > proc->PeakPrivate)    proc->PeakPrivate    = ev->Target;
+    bin->Samples++;
+    bin->WorkingSet = ev->Size;
+    bin->Private    = ev->Target;
+    if (proc->HavePrev)
+    {   // counters only increase, so anything else means the process was restarted.
+        if (ev->Offset >= proc->PrevRead && ev->Id >= proc->PrevWrite && ev->OnCpu >= proc->PrevCpu)
+        {
+            bin->Faults     += uint32_t(ev->Value[0]) - proc->PrevFaults;
+            bin->ReadBytes  += ev->Offset - proc->PrevRead;
+            bin->WriteBytes += ev->Id     - proc->PrevWrite;
+            bin->CpuMs      += ev->OnCpu  - proc->PrevCpu;
+        }
+        proc->SumGap += double(ev->Timestamp - proc->PrevTime) / TICKS_PER_MS;
+    }
+    proc->HavePrev   = true;
+    proc->PrevFaults = uint32_t(ev->Value[0]);
+    proc->PrevRead   = ev->Offset;
+    proc->PrevWrite  = ev->Id;
+    proc->PrevCpu    = ev->OnCpu;
+    proc->PrevTime   = ev->Timestamp;
+}
+
+/// @summary Add a region residency sample to the region statistics and the chart.
+/// @param state The counters command state.
+/// @param ev The ETW_EVENT_RESIDENCY event.
+static void record_residency(counters_state_t *state, etw_event_t const *ev)
+{
+    counters_process_t *proc    = find_process(state, ev->ProcessId, ev->Timestamp);
+    counters_region_t  *region  = NULL;
+    counters_bin_t     *bin     = NULL;
+    double              percent = 0.0;
+    if (proc == NULL || (region = find_region(proc, ev->Id, ev->Text)) == NULL || (bin = find_bin(state, proc, ev->Timestamp)) == NULL)
+    {
+        state->Dropped++;
+        return;
+    }
+    if (ev->Size > 0)
+        percent = (100.0 * ev->Offset) / ev->Size;
+    region->Size         = ev->Size;
+    region->Samples++;
+    region->SumPercent  += percent;
+    region->LastPercent  = percent;
+    if (percent < region->MinPercent) region->MinPercent = percent;
+    if (percent > region->MaxPercent) region->MaxPercent = percent;
+    bin->Resident       += ev->Offset;
+    bin->RegionSize     += ev->Size;
+}
+
+/// @summary Receives each decoded event and accumulates counter samples.
+/// @param ev The decoded event.
+/// @param context Pointer to the counters_state_t.
+static void counters_event(etw_event_t const *ev, void *context)
+{
+    counters_state_t *state = (counters_state_t*) context;
+    switch (ev->Kind)
+    {
+    case ETW_EVENT_COUNTERS:
+        record_counters(state, ev);
+        break;
+    case ETW_EVENT_RESIDENCY:
+        record_residency(state, ev);
+        break;
+    default:
+        break;
+    }
+}
+
+/// @summary Print the chart and region summary for each process.
+/// @param state The counters command state.
+/// @param fp The output stream.
+static void print_counters(counters_state_t const *state, FILE *fp)
+{
+    double const MB    = 1024.0 * 1024.0;
+    double const per_s = 1000.0 / state->BinMs;
+
+    if (state->ProcessCount == 0)
+    {
+        fprintf(fp, "No counter samples found. Enable the Counters keyword (0x80) on the file I/O provider.\n");
+        return;
+    }
+    for (uint32_t p = 0; p < state->ProcessCount; ++p)
+    {
+        counters_process_t const *proc = &state->Processes[p];
+        uint64_t ws  = 0;
+        uint64_t pvt = 0;
+
+        fprintf(fp, "%sProcess %u: %u samples\n", p > 0 ? "\n" : "", proc->ProcessId, proc->Samples);
+        fprintf(fp, "%10s %10s %10s %10s %10s %10s %7s %9s\n", "Time (ms)", "WS (MB)", "Priv (MB)",
+                "Faults/s", "Read MB/s", "Write MB/s", "CPU %", "Resident%");
+        for (uint32_t i = 0; i < proc->BinCount; ++i)
+        {
+            counters_bin_t const *bin = &proc->Bins[i];
+            if (bin->Samples > 0)
+            {   // rows without a sample repeat the last known memory counters.
+                ws  = bin->WorkingSet;
+                pvt = bin->Private;
+            }
+            fprintf(fp, "%10.0f %10.2f %10.2f %10.0f %10.3f %10.3f %6.1f%%", i * state->BinMs, ws / MB, pvt / MB,
+                    bin->Faults * per_s, (bin->ReadBytes / MB) * per_s, (bin->WriteBytes / MB) * per_s,
+                    (100.0 * bin->CpuMs) / state->BinMs);
+            if (bin->RegionSize > 0)
+                fprintf(fp, " %8.1f%%\n", (100.0 * bin->Resident) / bin->RegionSize);
+            else
+                fprintf(fp, " %9s\n", "-");
+        }
+        fprintf(fp, "Peak working set %.2f MB, peak private bytes %.2f MB.\n", proc->PeakWorkingSet / MB, proc->PeakPrivate / MB);
+
+        if (proc->RegionCount > 0)
+        {
+            fprintf(fp, "\n%-32s %18s %12s %8s %8s %8s %8s\n", "Region", "Address", "Size (MB)",
+                    "Min %", "Mean %", "Max %", "Last %");
+        }
+        for (uint32_t i = 0; i < proc->RegionCount; ++i)
+        {
+            counters_region_t const *region = &proc->Regions[i];
+            fprintf(fp, "%-32s 0x%016I64X %12.3f %8.1f %8.1f %8.1f %8.1f\n", region->Name, region->Address,
+                    region->Size / MB, region->MinPercent, region->SumPercent / region->Samples,
+                    region->MaxPercent, region->LastPercent);
+        }
+
+        if (proc->Samples > 0)
+        {
+            double mean_cost = proc->SumCost / proc->Samples;
+            double mean_gap  = proc->Samples > 1 ? proc->SumGap / (proc->Samples - 1) : 0.0;
+            fprintf(fp, "Sampler cost: mean %.4f ms, max %.4f ms", mean_cost, proc->MaxCost);
+            if (mean_gap > 0.0)
+                fprintf(fp, ", %.3f%% of the %.1f ms interval", (100.0 * mean_cost) / mean_gap, mean_gap);
+            fprintf(fp, ".\n");
+        }
+    }
+    if (state->Dropped > 0)
+    {
+        fprintf(fp, "(%u events dropped; too many processes or regions)\n", state->Dropped);
+    }
+}
+
+/*///////////////////////
+//  Public Functions   //
+///////////////////////*/
+int cmd_counters(int argc, char **argv)
+{
+    char const       *inputs[COUNTERS_MAX_INPUTS];
+    size_t            ninput = 0;
+    double            binms  = COUNTERS_DEFAULT_BIN;
+    counters_state_t *state  = NULL;
+    etw_time_range_t  range  = { 0.0, -1.0, 0 };
+    bool              result = false;
+
+    for (int i = 0; i < argc; ++i)
+    {
+        if (etw_range_option(argc, argv, &i, &range))
+            continue;
+        else if (strcmp(argv[i], "-interval") == 0 && i + 1 < argc)
+            binms = atof(argv[++i]);
+        else if (argv[i][0] != '-' && ninput < COUNTERS_MAX_INPUTS)
+            inputs[ninput++] = argv[i];
+        else
+        {
+            print_usage();
+            return EXIT_FAILURE;
+        }
+    }
+    if (ninput == 0)
+    {
+        fprintf(stderr, "ERROR: Missing argument INFILE.\n\n");
+        print_usage();
+        return EXIT_FAILURE;
+    }
+    if (binms < 1.0)
+    {
+        fprintf(stderr, "ERROR: The interval must be at least 1 ms.\n");
+        return EXIT_FAILURE;
+    }
+    if ((state = (counters_state_t*) calloc(1, sizeof(counters_state_t))) == NULL)
+    {
+        fprintf(stderr, "ERROR: Unable to allocate counter tables.\n");
+        return EXIT_FAILURE;
+    }
+    state->BinMs = binms;
+    if ((result = etw_process_range(inputs, ninput, &range, counters_event, state)))
+    {
+        print_counters(state, stdout);
+    }
+    for (uint32_t i = 0; i < state->ProcessCount; ++i)
+    {
+        free(state->Processes[i].Bins);
+    }
+    free(state);
+    return result ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,525 @@
+/*/////////////////////////////////////////////////////////////////////////////
+/// @summary Implements the 'critpath' command, which follows the flow events
+/// linking work issued by one thread to its completion on another thread and
+/// reports how much of the consuming thread's time was spent waiting on, or
+/// duplicating, work that should have been done ahead of time.
+/// @author Russell Klenk (contact@russellklenk.com)
+///////////////////////////////////////////////////////////////////////////80*/
+
+/*////////////////
+//   Includes   //
+////////////////*/
+#include "ETWAnalyze.h"
+
+/*/////////////////
+//   Constants   //
+/////////////////*/
+/// @summary Define the maximum number of input files accepted on the command line.
+#define CRITPATH_MAX_INPUTS  64
+
+/// @summary Define the maximum number of distinct flows tracked.
+/// This value must be a power of two greater than zero.
+#define CRITPATH_MAX_FLOWS   16384
+
+/// @summary Define the maximum length of a tracked flow name, including the NULL.
+#define CRITPATH_MAX_NAME    32
+
+/// @summary Define the maximum number of threads that may consume flows.
+#define CRITPATH_MAX_THREADS 256
+
+/// @summary Define the maximum number of consumed flows awaiting the end of
+/// their dependent scope on a single thread.
+#define CRITPATH_MAX_PENDING 16
+
+/*//////////////////
+//   Data Types   //
+//////////////////*/
+/// @summary Classifies a consumed flow by the state of the producer at the time
+/// the consumer asked for the result.
+enum flow_class_e
+{
+    FLOW_CLASS_READY         = 0, /// The producer finished before the consumer needed the result.
+    FLOW_CLASS_LATE          = 1, /// The producer had started, but had not finished.
+    FLOW_CLASS_UNSTARTED     = 2, /// The producer had not started, or the work was never issued.
+    FLOW_CLASS_COUNT         = 3
+};
+
+/// @summary The timeline of a single flow, identified by process, name and flow ID.
+/// Timestamps are zero if the corresponding phase was not observed.
+struct flow_t
+{
+    char         Name[CRITPATH_MAX_NAME]; /// The flow name passed to ETWFlowMain or ETWFlowTask.
+    uint64_t     Id;          /// The flow identifier.
+    uint32_t     ProcessId;   /// The process that emitted the flow events.
+    uint32_t     Consumer;    /// The thread that consumed the result.
+    bool         Cancelled;   /// true if the producer abandoned the work.
+    int64_t      Issue;       /// The time at which the work was requested.
+    int64_t      Start;       /// The time at which the producer began the work.
+    int64_t      End;         /// The time at which the producer finished or abandoned the work.
+    int64_t      Consume;     /// The time at which the consumer needed the result.
+    int64_t      DepStart;    /// The time at which the consumer entered the scope that depends on the result.
+    int64_t      DepEnd;      /// The time at which the consumer left the dependent scope.
+    double       WaitedMs;    /// The time the consumer spent blocked between Consume and DepEnd, in milliseconds.
+};
+
+/// @summary Per-thread state used to find the scope that depends on each consumed flow.
+struct flow_thread_t
+{
+    uint32_t     ThreadId;    /// The operating system thread identifier.
+    uint32_t     Depth;       /// The number of open scopes on the thread.
+    uint32_t     PendingCount;/// The number of valid entries in Pending.
+    uint32_t     Pending[CRITPATH_MAX_PENDING]; /// Indices of consumed flows whose dependent scope has not closed.
+    uint32_t     Level[CRITPATH_MAX_PENDING];   /// The scope depth at which each dependent scope was entered.
+};
+
+/// @summary Aggregate timing for one measured quantity.
+struct flow_metric_t
+{
+    uint32_t     Count;       /// The number of samples.
+    double       TotalMs;     /// The sum of all samples, in milliseconds.
+    double       MaxMs;       /// The largest sample, in milliseconds.
+};
+
+/// @summary The state built while processing the input files.
+struct critpath_state_t
+{
+    flow_t        Flows[CRITPATH_MAX_FLOWS];     /// Open-addressed table of flow timelines.
+    uint32_t      FlowCount;  /// The number of used entries in Flows.
+    uint32_t      Overflow;   /// The number of flow events dropped because a table was full.
+    flow_thread_t Threads[CRITPATH_MAX_THREADS]; /// Consumer thread state.
+    uint32_t      ThreadCount;/// The number of used entries in Threads.
+};
+
+/*///////////////////////
+//   Local Functions   //
+///////////////////////*/
+/// @summary Print usage information for the critpath command.
+static void print_usage(void)
+{
+    fprintf(stdout, "USAGE: etwanalyze.exe critpath [-v] [-from MS] [-to MS] [-thread TID] INFILE [INFILE...]\n");
+    fprintf(stdout, "  Follow flow events from issue to consumption and report how much consumer\n");
+    fprintf(stdout, "  time was spent waiting on or duplicating work done by the producer thread.\n");
+    fprintf(stdout, "  The dependent scope of a flow is the first scope the consumer enters after\n");
+    fprintf(stdout, "  reporting ETW_FLOW_CONSUME.\n");
+    fprintf(stdout, "  -v: Print the timeline of each individual flow.\n");
+    etw_range_usage(stdout);
+    fprintf(stdout, "\n");
+}
+
+/// @summary Compute the FNV-1a hash of a flow name, flow ID and process ID.
+/// @param str The flow name.
+/// @param id The flow identifier.
+/// @param pid The process identifier.
+/// @return The 32-bit hash value.
+static uint32_t hash_flow(char const *str, uint64_t id, uint32_t pid)
+{
+    uint32_t h = 2166136261U;
+    while (*str)
+    {
+        h ^= (uint8_t) *str++;
+        h *= 16777619U;
+    }
+    for (int i = 0; i < 8; ++i, id >>= 8)
+    {
+        h ^= (uint8_t) id;
+        h *= 16777619U;
+    }
+    for (int i = 0; i < 4; ++i, pid >>= 8)
+    {
+        h ^= (uint8_t) pid;
+        h *= 16777619U;
+    }
+    return h;
+}
+
+/// @summary Find or insert the timeline for a flow.
+/// @param state The critpath command state.
+/// @param name The flow name.
+/// @param id The flow identifier.
+/// @param pid The process identifier.
+/// @return The flow, or NULL if the table is full.
+static flow_t* find_flow(critpath_state_t *state, char const *name, uint64_t id, uint32_t pid)
+{
+    uint32_t mask  = CRITPATH_MAX_FLOWS - 1;
+    uint32_t index = hash_flow(name, id, pid) & mask;
+    for (uint32_t i = 0; i < CRITPATH_MAX_FLOWS; ++i, index = (index + 1) & mask)
+    {
+        flow_t *flow = &state->Flows[index];
+        if (flow->Name[0] == '\0')
+        {
+            if (state->FlowCount == CRITPATH_MAX_FLOWS - 1)
+                return NULL;   // keep one slot free so lookups terminate.
+            strncpy(flow->Name, name[0] ? name : "(unnamed)", CRITPATH_MAX_NAME - 1);
+            flow->Name[CRITPATH_MAX_NAME-1] = '\0';
+            flow->Id        = id;
+            flow->ProcessId = pid;
+            state->FlowCount++;
+            return flow;
+        }
+        if (flow->Id == id && flow->ProcessId == pid && strncmp(flow->Name, name[0] ? name : "(unnamed)", CRITPATH_MAX_NAME - 1) == 0)
+        {
+            return flow;
+        }
+    }
+    return NULL;
+}
+
+/// @summary Find or insert the state for a thread.
+/// @param state The critpath command state.
+/// @param thread_id The operating system thread identifier.
+/// @param insert Specify true to create the entry if it does not exist.
+/// @return The thread state, or NULL.
+static flow_thread_t* find_thread(critpath_state_t *state, uint32_t thread_id, bool insert)
+{
+    for (uint32_t i = 0; i < state->ThreadCount; ++i)
+    {
+        if (state->Threads[i].ThreadId == thread_id)
+            return &state->Threads[i];
+    }
+    if (insert && state->ThreadCount < CRITPATH_MAX_THREADS)
+    {
+        flow_thread_t *thread = &state->Threads[state->ThreadCount++];
+        thread->ThreadId = thread_id;
+        return thread;
+    }
+    return NULL;
+}
+
+/// @summary Update a flow timeline from a flow event.
+/// @param state The critpath command state.
+/// @param ev The decoded ETW_EVENT_FLOW event.
+static void flow_phase(critpath_state_t *state, etw_event_t const *ev)
+{
+    flow_t *flow = find_flow(state, ev->Text, ev->Id, ev->ProcessId);
+    if (flow == NULL)
+    {
+        state->Overflow++;
+        return;
+    }
+    switch (ev->Value[0])
+    {
+    case ETW_FLOW_ISSUE:
+        flow->Issue = ev->Timestamp;
+        break;
+    case ETW_FLOW_START:
+        flow->Start = ev->Timestamp;
+        break;
+    case ETW_FLOW_FINISH:
+        flow->End   = ev->Timestamp;
+        break;
+    case ETW_FLOW_CANCEL:
+        flow->End   = ev->Timestamp;
+        flow->Cancelled = true;
+        break;
+    case ETW_FLOW_CONSUME:
+        {   // the next scope entered on this thread is the one that needs the result.
+            flow_thread_t *thread = find_thread(state, ev->ThreadId, true);
+            flow->Consume  = ev->Timestamp;
+            flow->Consumer = ev->ThreadId;
+            if (thread == NULL || thread->PendingCount == CRITPATH_MAX_PENDING)
+            {
+                state->Overflow++;
+                return;
+            }
+            thread->Pending[thread->PendingCount] = uint32_t(flow - state->Flows);
+            thread->Level  [thread->PendingCount] = UINT32_MAX;
+            thread->PendingCount++;
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+/// @summary Receives each decoded event and updates the flow timelines.
+/// @param ev The decoded event.
+/// @param context Pointer to the critpath_state_t.
+static void critpath_event(etw_event_t const *ev, void *context)
+{
+    critpath_state_t *state  = (critpath_state_t*) context;
+    flow_thread_t    *thread = NULL;
+    if (ev->Kind == ETW_EVENT_FLOW)
+    {
+        flow_phase(state, ev);
+        return;
+    }
+    if (ev->Kind != ETW_EVENT_ENTER_SCOPE && ev->Kind != ETW_EVENT_LEAVE_SCOPE && ev->Kind != ETW_EVENT_WAIT_END)
+    {
+        return;
+    }
+    if ((thread = find_thread(state, ev->ThreadId, false)) == NULL)
+    {   // only threads that have consumed a flow are interesting.
+        return;
+    }
+    if (ev->Kind == ETW_EVENT_ENTER_SCOPE)
+    {
+        for (uint32_t i = 0; i < thread->PendingCount; ++i)
+        {
+            if (thread->Level[i] == UINT32_MAX)
+            {
+                state->Flows[thread->Pending[i]].DepStart = ev->Timestamp;
+                thread->Level[i] = thread->Depth;
+            }
+        }
+        thread->Depth++;
+    }
+    else if (ev->Kind == ETW_EVENT_LEAVE_SCOPE)
+    {
+        if (thread->Depth > 0) thread->Depth--;
+        for (uint32_t i = 0; i < thread->PendingCount; /* empty */)
+        {
+            if (thread->Level[i] != UINT32_MAX && thread->Level[i] >= thread->Depth)
+            {   // the dependent scope closed; swap-remove the entry.
+                state->Flows[thread->Pending[i]].DepEnd = ev->Timestamp;
+                thread->PendingCount--;
+                thread->Pending[i] = thread->Pending[thread->PendingCount];
+                thread->Level  [i] = thread->Level  [thread->PendingCount];
+            }
+            else ++i;
+        }
+    }
+    else
+    {   // a blocking wait while the consumer is waiting on its input.
+        for (uint32_t i = 0; i < thread->PendingCount; ++i)
+        {
+            state->Flows[thread->Pending[i]].WaitedMs += ev->Duration;
+        }
+    }
+}
+
+/// @summary Compute the length of an interval, in milliseconds.
+/// @param beg The interval start time, or zero.
+/// @param end The interval end time, or zero.
+/// @return The interval length, or -1 if either endpoint is missing or the interval is negative.
+static double interval_ms(int64_t beg, int64_t end)
+{
+    if (beg == 0 || end == 0 || end < beg)
+        return -1.0;
+    return double(end - beg) / TICKS_PER_MS;
+}
+
+/// @summary Compute the length of the intersection of two intervals, in milliseconds.
+/// @return The overlap, or zero if the intervals do not intersect or are incomplete.
+static double overlap_ms(int64_t beg1, int64_t end1, int64_t beg2, int64_t end2)
+{
+    if (beg1 == 0 || end1 == 0 || beg2 == 0 || end2 == 0)
+        return 0.0;
+    int64_t beg = beg1 > beg2 ? beg1 : beg2;
+    int64_t end = end1 < end2 ? end1 : end2;
+    return end > beg ? double(end - beg) / TICKS_PER_MS : 0.0;
+}
+
+/// @summary Classify a consumed flow.
+/// @param flow The flow timeline.
+/// @return One of flow_class_e.
+static uint32_t classify(flow_t const *flow)
+{
+    if (flow->End != 0 && !flow->Cancelled && flow->End <= flow->Consume)
+        return FLOW_CLASS_READY;
+    if (flow->Start != 0 && flow->Start <= flow->Consume)
+        return FLOW_CLASS_LATE;
+    return FLOW_CLASS_UNSTARTED;
+}
+
+/// @summary Add a sample to a metric. Negative samples are ignored.
+static void add_sample(flow_metric_t *metric, double ms)
+{
+    if (ms < 0.0)
+        return;
+    metric->Count++;
+    metric->TotalMs += ms;
+    if (ms > metric->MaxMs) metric->MaxMs = ms;
+}
+
+/// @summary Print a single row of the summary table.
+static void print_metric(FILE *fp, char const *label, flow_metric_t const *metric)
+{
+    if (metric->Count == 0) fprintf(fp, "  %-36s %8u %12s %12s %12s\n", label, 0U, "-", "-", "-");
+    else fprintf(fp, "  %-36s %8u %12.3f %12.3f %12.3f\n", label, metric->Count, metric->TotalMs,
+                 metric->TotalMs / metric->Count, metric->MaxMs);
+}
+
+/// @summary Order flows by consume time, for use with qsort.
+static int compare_consume(void const *a, void const *b)
+{
+    flow_t const *fa = *(flow_t const**) a;
+    flow_t const *fb = *(flow_t const**) b;
+    if (fa->Consume < fb->Consume) return -1;
+    if (fa->Consume > fb->Consume) return +1;
+    return 0;
+}
+
+/// @summary Print the critical-path report.
+/// @param state The critpath command state.
+/// @param verbose Specify true to print the timeline of each flow.
+/// @param fp The output stream.
+static void print_report(critpath_state_t *state, bool verbose, FILE *fp)
+{
+    static char const *CLASS_NAME[FLOW_CLASS_COUNT] = { "ready", "late", "unstarted" };
+    flow_t      **order      = (flow_t**) malloc((state->FlowCount + 1) * sizeof(flow_t*));
+    uint32_t      count      = 0;
+    uint32_t      unconsumed = 0;
+    uint32_t      cancelled  = 0;
+    uint32_t      classes[FLOW_CLASS_COUNT] = { 0, 0, 0 };
+    flow_metric_t queue      = { 0, 0.0, 0.0 };
+    flow_metric_t work       = { 0, 0.0, 0.0 };
+    flow_metric_t wasted     = { 0, 0.0, 0.0 };
+    flow_metric_t slack      = { 0, 0.0, 0.0 };
+    flow_metric_t lateness   = { 0, 0.0, 0.0 };
+    flow_metric_t waited     = { 0, 0.0, 0.0 };
+    flow_metric_t duplicated = { 0, 0.0, 0.0 };
+    flow_metric_t dependent[FLOW_CLASS_COUNT];
+    memset(dependent, 0, sizeof(dependent));
+
+    if (order == NULL)
+    {
+        fprintf(stderr, "ERROR: Unable to allocate flow list.\n");
+        return;
+    }
+    for (uint32_t i = 0; i < CRITPATH_MAX_FLOWS; ++i)
+    {
+        flow_t *flow = &state->Flows[i];
+        if (flow->Name[0] == '\0')
+            continue;
+        // producer-side metrics are reported for every flow.
+        add_sample(&queue, interval_ms(flow->Issue, flow->Start));
+        if (flow->Cancelled)
+        {
+            add_sample(&wasted, interval_ms(flow->Start, flow->End));
+            cancelled++;
+        }
+        else add_sample(&work, interval_ms(flow->Start, flow->End));
+        if (flow->Consume == 0)
+        {
+            unconsumed++;
+            continue;
+        }
+        order[count++] = flow;
+    }
+    qsort(order, count, sizeof(flow_t*), compare_consume);
+
+    if (verbose)
+    {
+        fprintf(fp, "%-16s %10s %-9s %10s %10s %10s %10s %10s %10s\n", "Flow", "Id", "Class",
+                "Queue", "Work", "Slack", "Dependent", "Waited", "Duplicated");
+    }
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        flow_t const *flow  = order[i];
+        uint32_t      cls   = classify(flow);
+        double        dep   = interval_ms(flow->DepStart, flow->DepEnd);
+        double        dup   = overlap_ms(flow->Start, flow->End, flow->DepStart, flow->DepEnd);
+        double        sl    = -1.0;
+        classes[cls]++;
+        add_sample(&dependent[cls], dep);
+        if (cls == FLOW_CLASS_READY)
+        {   // how long the result sat waiting for the consumer.
+            sl = interval_ms(flow->End, flow->Consume);
+            add_sample(&slack, sl);
+        }
+        else if (!flow->Cancelled)
+        {   // how much earlier the producer would have had to finish.
+            add_sample(&lateness, interval_ms(flow->Consume, flow->End));
+        }
+        if (flow->WaitedMs > 0.0) add_sample(&waited, flow->WaitedMs);
+        if (dup > 0.0) add_sample(&duplicated, dup);
+        if (verbose)
+        {
+            double q = interval_ms(flow->Issue, flow->Start);
+            double w = interval_ms(flow->Start, flow->End);
+            fprintf(fp, "%-16s %10I64u %-9s ", flow->Name, flow->Id, CLASS_NAME[cls]);
+            if (q  >= 0.0) fprintf(fp, "%10.3f ", q ); else fprintf(fp, "%10s ", "-");
+            if (w  >= 0.0) fprintf(fp, "%10.3f ", w ); else fprintf(fp, "%10s ", "-");
+            if (sl >= 0.0) fprintf(fp, "%10.3f ", sl); else fprintf(fp, "%10s ", "-");
+            if (dep>= 0.0) fprintf(fp, "%10.3f ", dep);else fprintf(fp, "%10s ", "-");
+            fprintf(fp, "%10.3f %10.3f\n", flow->WaitedMs, dup);
+        }
+    }
+    if (verbose) fprintf(fp, "\n");
+
+    fprintf(fp, "Flows: %u consumed (%u ready, %u late, %u unstarted), %u cancelled, %u never consumed\n",
+            count, classes[FLOW_CLASS_READY], classes[FLOW_CLASS_LATE], classes[FLOW_CLASS_UNSTARTED],
+            cancelled, unconsumed);
+    fprintf(fp, "\n");
+    fprintf(fp, "  %-36s %8s %12s %12s %12s\n", "Producer", "Count", "Total (ms)", "Avg (ms)", "Max (ms)");
+    print_metric(fp, "Queue delay (issue to start)", &queue);
+    print_metric(fp, "Completed work", &work);
+    print_metric(fp, "Wasted work (cancelled)", &wasted);
+    print_metric(fp, "Slack (finish to consume)", &slack);
+    print_metric(fp, "Lateness (consume to finish)", &lateness);
+    fprintf(fp, "\n");
+    fprintf(fp, "  %-36s %8s %12s %12s %12s\n", "Consumer", "Count", "Total (ms)", "Avg (ms)", "Max (ms)");
+    print_metric(fp, "Dependent scope (ready)", &dependent[FLOW_CLASS_READY]);
+    print_metric(fp, "Dependent scope (late)", &dependent[FLOW_CLASS_LATE]);
+    print_metric(fp, "Dependent scope (unstarted)", &dependent[FLOW_CLASS_UNSTARTED]);
+    print_metric(fp, "Blocked waiting on producer", &waited);
+    print_metric(fp, "Duplicated producer work", &duplicated);
+
+    if (dependent[FLOW_CLASS_READY].Count > 0)
+    {   // attribute any dependent-scope time beyond the ready baseline to the producer.
+        double base  = dependent[FLOW_CLASS_READY].TotalMs / dependent[FLOW_CLASS_READY].Count;
+        double stall = 0.0;
+        for (uint32_t cls = FLOW_CLASS_LATE; cls < FLOW_CLASS_COUNT; ++cls)
+        {
+            double excess = dependent[cls].TotalMs - base * dependent[cls].Count;
+            if (excess > 0.0) stall += excess;
+        }
+        fprintf(fp, "\nEstimated critical-path stall: %.3f ms (dependent scope time above the %.3f ms ready baseline)\n",
+                stall, base);
+    }
+    if (state->Overflow > 0)
+    {
+        fprintf(fp, "(%u flow events dropped; too many flows or pending consumers)\n", state->Overflow);
+    }
+    free(order);
+}
+
+/*///////////////////////
+//  Public Functions   //
+///////////////////////*/
+int cmd_critpath(int argc, char **argv)
+{
+    char const       *inputs[CRITPATH_MAX_INPUTS];
+    size_t            ninput  = 0;
+    bool              verbose = false;
+    critpath_state_t *state   = NULL;
+    etw_time_range_t  range   = { 0.0, -1.0, 0 };
+
+    for (int i = 0; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "-v") == 0)
+            verbose = true;
+        else if (etw_range_option(argc, argv, &i, &range))
+            continue;
+        else if (argv[i][0] != '-' && ninput < CRITPATH_MAX_INPUTS)
+            inputs[ninput++] = argv[i];
+        else
+        {
+            print_usage();
+            return EXIT_FAILURE;
+        }
+    }
+    if (ninput == 0)
+    {
+        fprintf(stderr, "ERROR: Missing argument INFILE.\n\n");
+        print_usage();
+        return EXIT_FAILURE;
+    }
+    if ((state = (critpath_state_t*) calloc(1, sizeof(critpath_state_t))) == NULL)
+    {
+        fprintf(stderr, "ERROR: Unable to allocate flow table.\n");
+        return EXIT_FAILURE;
+    }
+    if (!etw_process_range(inputs, ninput, &range, critpath_event, state))
+    {
+        free(state);
+        return EXIT_FAILURE;
+    }
+    if (state->FlowCount == 0)
+    {
+        fprintf(stdout, "No flow events were recorded.\n");
+    }
+    else print_report(state, verbose, stdout);
+    free(state);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,608 @@
+/*/////////////////////////////////////////////////////////////////////////////
+/// @summary Implements the 'diff' command, which aligns the scopes and markers
+/// of a baseline trace and a candidate trace by name and reports the change in
+/// each latency distribution, with a bootstrap confidence interval for the
+/// change in median and a Mann-Whitney U test for significance.
+/// @author Russell Klenk (contact@russellklenk.com)
+///////////////////////////////////////////////////////////////////////////80*/
+
+/*////////////////
+//   Includes   //
+////////////////*/
+#include <ctype.h>
+#include <math.h>
+#include "ETWAnalyze.h"
+
+/*/////////////////
+//   Constants   //
+/////////////////*/
+/// @summary Define the maximum number of distinct scope and marker names tracked.
+/// This value must be a power of two greater than zero.
+#define DIFF_MAX_NAMES       2048
+
+/// @summary Define the maximum length of a tracked name, including the NULL.
+#define DIFF_MAX_NAME        64
+
+/// @summary Define the maximum number of threads tracked for marker intervals.
+#define DIFF_MAX_THREADS     256
+
+/// @summary Define the number of bootstrap resamples used for confidence intervals.
+#define DIFF_BOOTSTRAP_COUNT 1000
+
+/// @summary Define the maximum number of samples drawn per bootstrap resample.
+/// Larger sample sets are resampled at this size (an m-out-of-n bootstrap) to keep
+/// the cost bounded for long captures; see resample_median() for the rescaling.
+#define DIFF_BOOTSTRAP_LIMIT 4096
+
+/// @summary The exit code returned when at least one regression is flagged.
+#define DIFF_EXIT_REGRESSION 2
+
+/*//////////////////
+//   Data Types   //
+//////////////////*/
+/// @summary Identifies the two traces being compared.
+enum diff_side_e
+{
+    DIFF_BASE                = 0,
+    DIFF_NEW                 = 1,
+    DIFF_SIDE_COUNT          = 2
+};
+
+/// @summary A growable list of latency samples, in milliseconds.
+struct diff_samples_t
+{
+    float       *Values;      /// The sample values.
+    uint32_t     Count;       /// The number of valid samples.
+    uint32_t     Capacity;    /// The number of samples that fit in Values.
+};
+
+/// @summary The samples recorded for a single scope or marker name in both traces.
+struct diff_entry_t
+{
+    char           Name[DIFF_MAX_NAME]; /// The normalized scope or marker name.
+    bool           Marker;    /// true if the samples are intervals between markers.
+    diff_samples_t Samples[DIFF_SIDE_COUNT]; /// The samples from each trace.
+};
+
+/// @summary The most recent marker on a thread, used to measure marker intervals.
+struct diff_thread_t
+{
+    uint32_t     ThreadId;    /// The operating system thread identifier.
+    int64_t      LastTime;    /// The timestamp of the most recent marker.
+    char         LastName[DIFF_MAX_NAME]; /// The normalized name of the most recent marker.
+};
+
+/// @summary The state built while processing the input files.
+struct diff_state_t
+{
+    diff_entry_t  Entries[DIFF_MAX_NAMES]; /// Open-addressed table of entries.
+    uint32_t      EntryCount; /// The number of used entries.
+    uint32_t      Overflow;   /// The number of samples dropped because a table was full.
+    uint32_t      Side;       /// The trace currently being processed, one of diff_side_e.
+    diff_thread_t Threads[DIFF_MAX_THREADS]; /// Marker state for each thread.
+    uint32_t      ThreadCount;/// The number of used entries in Threads.
+};
+
+/// @summary The comparison computed for a single entry.
+struct diff_result_t
+{
+    diff_entry_t const *Entry;/// The entry being compared.
+    double       Median[DIFF_SIDE_COUNT]; /// The median of each side, in milliseconds.
+    double       P90[DIFF_SIDE_COUNT];    /// The 90th percentile of each side, in milliseconds.
+    double       DeltaPct;    /// The change in median, as a percentage of the baseline.
+    double       CiLow;       /// The lower bound of the confidence interval for the change in median, in milliseconds.
+    double       CiHigh;      /// The upper bound of the confidence interval for the change in median, in milliseconds.
+    double       PValue;      /// The two-sided p-value of the Mann-Whitney U test.
+    int          Verdict;     /// +1 for a regression, -1 for an improvement, 0 otherwise.
+};
+
+/// @summary A sample tagged with the side it came from, used for ranking.
+struct diff_ranked_t
+{
+    float        Value;       /// The sample value.
+    uint32_t     Side;        /// One of diff_side_e.
+};
+
+/*///////////////////////
+//   Local Functions   //
+///////////////////////*/
+/// @summary Print usage information for the diff command.
+static void print_usage(void)
+{
+    fprintf(stdout, "USAGE: etwanalyze.exe diff [-alpha P] [-threshold PCT] [-min N] [-markers] [-from MS] [-to MS] BASEFILE NEWFILE\n");
+    fprintf(stdout, "  Compare per-scope latency distributions between a baseline and a candidate trace.\n");
+    fprintf(stdout, "  Names are aligned after removing trailing hexadecimal or numeric arguments.\n");
+    fprintf(stdout, "  A change is flagged when the Mann-Whitney p-value is below -alpha, the median\n");
+    fprintf(stdout, "  moved by more than -threshold percent and the bootstrap interval excludes zero.\n");
+    fprintf(stdout, "  The exit code is %d if any regression is flagged, so the command can gate changes.\n", DIFF_EXIT_REGRESSION);
+    fprintf(stdout, "  -alpha:     The significance level (default 0.01).\n");
+    fprintf(stdout, "  -threshold: The minimum change in median to flag, in percent (default 5).\n");
+    fprintf(stdout, "  -min:       Skip names with fewer samples than this in either trace (default 8).\n");
+    fprintf(stdout, "  -markers:   Also compare the intervals between consecutive markers on a thread.\n");
+    fprintf(stdout, "  -from/-to:  Restrict both traces to a time range (see 'scopes').\n");
+    fprintf(stdout, "  BASEFILE and NEWFILE may be .etl files or .etwidx indexes.\n");
+    fprintf(stdout, "\n");
+}
+
+/// @summary Compute the FNV-1a hash of a NULL-terminated string.
+/// @param str The string to hash.
+/// @return The 32-bit hash value.
+static uint32_t hash_string(char const *str)
+{
+    uint32_t h = 2166136261U;
+    while (*str)
+    {
+        h ^= (uint8_t) *str++;
+        h *= 16777619U;
+    }
+    return h;
+}
+
+/// @summary Copy a scope or marker name, removing any trailing arguments that are
+/// hexadecimal or decimal numbers, such as the pointers formatted by MMIOPrefetch.
+/// @param dst The destination buffer, DIFF_MAX_NAME bytes.
+/// @param src The name to normalize.
+static void normalize_name(char *dst, char const *src)
+{
+    size_t len = 0;
+    strncpy(dst, src[0] ? src : "(unnamed)", DIFF_MAX_NAME - 1);
+    dst[DIFF_MAX_NAME-1] = '\0';
+    len = strlen(dst);
+    for ( ; ; )
+    {   // strip whitespace, then one token if it's entirely hex digits.
+        size_t beg = 0;
+        while (len > 0 && (dst[len-1] == ' ' || dst[len-1] == '\t')) dst[--len] = '\0';
+        beg = len;
+        while (beg > 0 && dst[beg-1] != ' ' && dst[beg-1] != '\t') --beg;
+        if (beg == 0 || beg == len) break;
+        size_t i = beg;
+        if (len - i > 2 && dst[i] == '0' && (dst[i+1] == 'x' || dst[i+1] == 'X')) i += 2;
+        while (i < len && isxdigit((unsigned char) dst[i])) ++i;
+        if (i != len) break;
+        dst[beg] = '\0';
+        len = beg;
+    }
+}
+
+/// @summary Find or insert the entry for a name.
+/// @param state The diff command state.
+/// @param name The normalized name.
+/// @param marker true if the entry records marker intervals.
+/// @return The entry, or NULL if the table is full.
+static diff_entry_t* find_entry(diff_state_t *state, char const *name, bool marker)
+{
+    uint32_t mask  = DIFF_MAX_NAMES - 1;
+    uint32_t index = (hash_string(name) + (marker ? 1 : 0)) & mask;
+    for (uint32_t i = 0; i < DIFF_MAX_NAMES; ++i, index = (index + 1) & mask)
+    {
+        diff_entry_t *entry = &state->Entries[index];
+        if (entry->Name[0] == '\0')
+        {
+            if (state->EntryCount == DIFF_MAX_NAMES - 1)
+                return NULL;   // keep one slot free so lookups terminate.
+            strncpy(entry->Name, name, DIFF_MAX_NAME - 1);
+            entry->Marker = marker;
+            state->EntryCount++;
+            return entry;
+        }
+        if (entry->Marker == marker && strcmp(entry->Name, name) == 0)
+        {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+/// @summary Append a sample to a sample list, growing it as necessary.
+/// @param list The sample list.
+/// @param value The sample value, in milliseconds.
+/// @return true if the sample was stored.
+static bool add_sample(diff_samples_t *list, float value)
+{
+    if (list->Count == list->Capacity)
+    {
+        uint32_t  cap  = list->Capacity ? list->Capacity * 2 : 256;
+        float    *grow = (float*) realloc(list->Values, cap * sizeof(float));
+        if (grow == NULL) return false;
+        list->Values   = grow;
+        list->Capacity = cap;
+    }
+    list->Values[list->Count++] = value;
+    return true;
+}
+
+/// @summary Record a sample for a name on the trace currently being processed.
+/// @param state The diff command state.
+/// @param name The normalized name.
+/// @param marker true if the sample is a marker interval.
+/// @param value The sample value, in milliseconds.
+static void record_sample(diff_state_t *state, char const *name, bool marker, float value)
+{
+    diff_entry_t *entry = find_entry(state, name, marker);
+    if (entry == NULL || !add_sample(&entry->Samples[state->Side], value))
+    {
+        state->Overflow++;
+    }
+}
+
+/// @summary Receives each decoded event and records scope durations and marker intervals.
+/// @param ev The decoded event.
+/// @param context Pointer to the diff_state_t.
+static void diff_event(etw_event_t const *ev, void *context)
+{
+    diff_state_t *state = (diff_state_t*) context;
+    char          name[DIFF_MAX_NAME];
+    if (ev->Kind == ETW_EVENT_LEAVE_SCOPE)
+    {
+        normalize_name(name, ev->Text);
+        record_sample(state, name, false, ev->Duration);
+    }
+    else if (ev->Kind == ETW_EVENT_MARKER)
+    {   // the interval is attributed to the marker that opened it.
+        diff_thread_t *thread = NULL;
+        for (uint32_t i = 0; i < state->ThreadCount; ++i)
+        {
+            if (state->Threads[i].ThreadId == ev->ThreadId)
+            {
+                thread = &state->Threads[i];
+                break;
+            }
+        }
+        if (thread == NULL && state->ThreadCount < DIFF_MAX_THREADS)
+        {
+            thread = &state->Threads[state->ThreadCount++];
+            thread->ThreadId = ev->ThreadId;
+        }
+        if (thread == NULL)
+        {
+            state->Overflow++;
+            return;
+        }
+        normalize_name(name, ev->Text);
+        if (thread->LastTime != 0)
+        {
+            record_sample(state, thread->LastName, true, float(double(ev->Timestamp - thread->LastTime) / TICKS_PER_MS));
+        }
+        thread->LastTime = ev->Timestamp;
+        strcpy(thread->LastName, name);
+    }
+}
+
+/// @summary Order floats ascending, for use with qsort.
+static int compare_float(void const *a, void const *b)
+{
+    float fa = *(float const*) a;
+    float fb = *(float const*) b;
+    return (fa > fb) - (fa < fb);
+}
+
+/// @summary Order doubles ascending, for use with qsort.
+static int compare_double(void const *a, void const *b)
+{
+    double da = *(double const*) a;
+    double db = *(double const*) b;
+    return (da > db) - (da < db);
+}
+
+/// @summary Order ranked samples by ascending value, for use with qsort.
+static int compare_ranked(void const *a, void const *b)
+{
+    float fa = ((diff_ranked_t const*) a)->Value;
+    float fb = ((diff_ranked_t const*) b)->Value;
+    return (fa > fb) - (fa < fb);
+}
+
+/// @summary Compute a percentile of a sorted sample list by linear interpolation.
+/// @param values The sorted samples.
+/// @param count The number of samples, which must be greater than zero.
+/// @param p The percentile, in [0, 1].
+/// @return The percentile value.
+static double percentile(float const *values, uint32_t count, double p)
+{
+    double   pos  = p * (count - 1);
+    uint32_t lo   = uint32_t(pos);
+    uint32_t hi   = lo + 1 < count ? lo + 1 : lo;
+    double   frac = pos - lo;
+    return values[lo] + (values[hi] - values[lo]) * frac;
+}
+
+/// @summary Generate the next value of a xorshift64 pseudo-random sequence.
+/// A fixed seed keeps the bootstrap intervals reproducible between runs.
+/// @param state The generator state, which must be non-zero.
+/// @return The next pseudo-random value.
+static uint64_t xorshift64(uint64_t &state)
+{
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+}
+
+/// @summary Partially sort an array so that the element at position k is the one
+/// that would be there if the array were sorted, and return it.
+/// @param values The array, which is reordered.
+/// @param count The number of elements.
+/// @param k The position of the element to select.
+/// @return The selected element.
+static float select_kth(float *values, uint32_t count, uint32_t k)
+{
+    uint32_t lo = 0, hi = count - 1;
+    while (lo < hi)
+    {
+        float    pivot = values[(lo + hi) / 2];
+        uint32_t i = lo, j = hi;
+        while (i <= j)
+        {
+            while (values[i] < pivot) ++i;
+            while (values[j] > pivot) --j;
+            if (i <= j)
+            {
+                float t = values[i]; values[i] = values[j]; values[j] = t;
+                ++i;
+                if (j == 0) break;
+                --j;
+            }
+        }
+        if (k <= j) hi = j;
+        else if (k >= i) lo = i;
+        else break;
+    }
+    return values[k];
+}
+
+/// @summary Draw a bootstrap resample of a sample list and return its median. When only
+/// m of the n samples are drawn, the median of the resample spreads sqrt(n/m) times wider
+/// around the observed median than that of a full resample would, so its deviation is 
+/// scaled by sqrt(m/n) to keep the interval at the width of the full bootstrap.
+/// @param src The sample list.
+/// @param median The median of the whole sample list.
+/// @param scratch Scratch storage for at least DIFF_BOOTSTRAP_LIMIT samples.
+/// @param rng The random number generator state.
+/// @return The median of the resample, rescaled to the full sample size.
+static double resample_median(diff_samples_t const *src, double median, float *scratch, uint64_t &rng)
+{
+    uint32_t n = src->Count < DIFF_BOOTSTRAP_LIMIT ? src->Count : DIFF_BOOTSTRAP_LIMIT;
+    for (uint32_t i = 0; i < n; ++i)
+    {
+        scratch[i] = src->Values[xorshift64(rng) % src->Count];
+    }
+    double const value = select_kth(scratch, n, n / 2);
+    if (n == src->Count)
+        return value;
+    return median + (value - median) * sqrt(double(n) / double(src->Count));
+}
+
+/// @summary Compute the two-sided p-value of the Mann-Whitney U test, using the
+/// normal approximation with a correction for ties.
+/// @param a The first sample list.
+/// @param b The second sample list.
+/// @param ranked Scratch storage for a->Count + b->Count samples.
+/// @return The p-value, or 1 if the test could not be computed.
+static double mann_whitney(diff_samples_t const *a, diff_samples_t const *b, diff_ranked_t *ranked)
+{
+    double   n1   = a->Count;
+    double   n2   = b->Count;
+    uint32_t n    = a->Count + b->Count;
+    double   rank = 0.0;   // the sum of the ranks of the samples from a.
+    double   ties = 0.0;   // the sum of (t^3 - t) over each group of tied values.
+    for (uint32_t i = 0; i < a->Count; ++i) { ranked[i].Value = a->Values[i]; ranked[i].Side = DIFF_BASE; }
+    for (uint32_t i = 0; i < b->Count; ++i) { ranked[a->Count + i].Value = b->Values[i]; ranked[a->Count + i].Side = DIFF_NEW; }
+    qsort(ranked, n, sizeof(diff_ranked_t), compare_ranked);
+    for (uint32_t i = 0; i < n; /* empty */)
+    {   // tied values share the average of the ranks they span.
+        uint32_t j = i + 1;
+        while (j < n && ranked[j].Value == ranked[i].Value) ++j;
+        double t   = double(j - i);
+        double avg = (double(i + 1) + double(j)) * 0.5;
+        for (uint32_t k = i; k < j; ++k)
+        {
+            if (ranked[k].Side == DIFF_BASE) rank += avg;
+        }
+        ties += t * t * t - t;
+        i = j;
+    }
+    double u     = rank - n1 * (n1 + 1.0) * 0.5;
+    double mean  = n1 * n2 * 0.5;
+    double var   = (n1 * n2 / 12.0) * ((n1 + n2 + 1.0) - ties / ((n1 + n2) * (n1 + n2 - 1.0)));
+    if (var <= 0.0)
+        return 1.0;
+    double z     = (fabs(u - mean) - 0.5) / sqrt(var);
+    if (z < 0.0) z = 0.0;
+    return erfc(z / sqrt(2.0));
+}
+
+/// @summary Compare the two sides of an entry.
+/// @param entry The entry to compare. The samples are sorted in place.
+/// @param alpha The significance level.
+/// @param threshold The minimum change in median to flag, in percent.
+/// @param scratch Scratch storage for DIFF_BOOTSTRAP_LIMIT floats.
+/// @param ranked Scratch storage for the combined sample count.
+/// @param result On return, stores the comparison.
+static void compare_entry(diff_entry_t *entry, double alpha, double threshold, float *scratch, diff_ranked_t *ranked, diff_result_t *result)
+{
+    diff_samples_t *base  = &entry->Samples[DIFF_BASE];
+    diff_samples_t *cand  = &entry->Samples[DIFF_NEW];
+    double         *delta = (double*) malloc(DIFF_BOOTSTRAP_COUNT * sizeof(double));
+    uint64_t        rng   = 0x9E3779B97F4A7C15ULL ^ hash_string(entry->Name);
+
+    memset(result, 0, sizeof(diff_result_t));
+    result->Entry  = entry;
+    result->PValue = mann_whitney(base, cand, ranked);
+    for (uint32_t side = 0; side < DIFF_SIDE_COUNT; ++side)
+    {
+        diff_samples_t *list = &entry->Samples[side];
+        qsort(list->Values, list->Count, sizeof(float), compare_float);
+        result->Median[side] = percentile(list->Values, list->Count, 0.5);
+        result->P90   [side] = percentile(list->Values, list->Count, 0.9);
+    }
+    if (result->Median[DIFF_BASE] > 0.0)
+    {
+        result->DeltaPct = 100.0 * (result->Median[DIFF_NEW] - result->Median[DIFF_BASE]) / result->Median[DIFF_BASE];
+    }
+    if (delta != NULL)
+    {   // percentile bootstrap of the difference in medians.
+        for (uint32_t i = 0; i < DIFF_BOOTSTRAP_COUNT; ++i)
+        {
+            delta[i] = resample_median(cand, result->Median[DIFF_NEW],  scratch, rng)
+                     - resample_median(base, result->Median[DIFF_BASE], scratch, rng);
+        }
+        qsort(delta, DIFF_BOOTSTRAP_COUNT, sizeof(double), compare_double);
+        result->CiLow  = delta[uint32_t(DIFF_BOOTSTRAP_COUNT * (alpha * 0.5))];
+        result->CiHigh = delta[uint32_t(DIFF_BOOTSTRAP_COUNT * (1.0 - alpha * 0.5)) - 1];
+        free(delta);
+    }
+    if (result->PValue < alpha && fabs(result->DeltaPct) > threshold)
+    {
+        if (result->DeltaPct > 0.0 && result->CiLow  > 0.0) result->Verdict = +1;
+        if (result->DeltaPct < 0.0 && result->CiHigh < 0.0) result->Verdict = -1;
+    }
+}
+
+/// @summary Order results with regressions first, then by descending change in median.
+static int compare_result(void const *a, void const *b)
+{
+    diff_result_t const *ra = (diff_result_t const*) a;
+    diff_result_t const *rb = (diff_result_t const*) b;
+    if (ra->Verdict  != rb->Verdict ) return rb->Verdict - ra->Verdict;
+    if (ra->DeltaPct >  rb->DeltaPct) return -1;
+    if (ra->DeltaPct <  rb->DeltaPct) return +1;
+    return 0;
+}
+
+/// @summary Free the sample lists owned by the diff state.
+/// @param state The diff command state.
+static void free_samples(diff_state_t *state)
+{
+    for (uint32_t i = 0; i < DIFF_MAX_NAMES; ++i)
+    {
+        free(state->Entries[i].Samples[DIFF_BASE].Values);
+        free(state->Entries[i].Samples[DIFF_NEW ].Values);
+    }
+}
+
+/*///////////////////////
+//  Public Functions   //
+///////////////////////*/
+int cmd_diff(int argc, char **argv)
+{
+    char const       *inputs[DIFF_SIDE_COUNT];
+    size_t            ninput    = 0;
+    double            alpha     = 0.01;
+    double            threshold = 5.0;
+    uint32_t          min_count = 8;
+    bool              markers   = false;
+    etw_time_range_t  range     = { 0.0, -1.0, 0 };
+    diff_state_t     *state     = NULL;
+    diff_result_t    *results   = NULL;
+    float            *scratch   = NULL;
+    diff_ranked_t    *ranked    = NULL;
+    uint32_t          maxcount  = 0;
+    uint32_t          count     = 0;
+    uint32_t          skipped   = 0;
+    uint32_t          regressed = 0;
+    uint32_t          improved  = 0;
+    int               result    = EXIT_FAILURE;
+
+    for (int i = 0; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "-alpha") == 0 && i + 1 < argc)
+            alpha = atof(argv[++i]);
+        else if (strcmp(argv[i], "-threshold") == 0 && i + 1 < argc)
+            threshold = atof(argv[++i]);
+        else if (strcmp(argv[i], "-min") == 0 && i + 1 < argc)
+            min_count = strtoul(argv[++i], NULL, 0);
+        else if (strcmp(argv[i], "-markers") == 0)
+            markers = true;
+        else if (etw_range_option(argc, argv, &i, &range))
+            continue;
+        else if (argv[i][0] != '-' && ninput < DIFF_SIDE_COUNT)
+            inputs[ninput++] = argv[i];
+        else
+        {
+            print_usage();
+            return EXIT_FAILURE;
+        }
+    }
+    if (ninput != DIFF_SIDE_COUNT)
+    {
+        fprintf(stderr, "ERROR: Missing argument BASEFILE or NEWFILE.\n\n");
+        print_usage();
+        return EXIT_FAILURE;
+    }
+    if (alpha <= 0.0 || alpha >= 1.0) alpha = 0.01;
+    if (min_count < 2) min_count = 2;
+    if ((state = (diff_state_t*) calloc(1, sizeof(diff_state_t))) == NULL)
+    {
+        fprintf(stderr, "ERROR: Unable to allocate sample table.\n");
+        return EXIT_FAILURE;
+    }
+    for (uint32_t side = 0; side < DIFF_SIDE_COUNT; ++side)
+    {   // process each trace separately; marker intervals never span the two.
+        state->Side        = side;
+        state->ThreadCount = 0;
+        if (!etw_process_range(&inputs[side], 1, &range, diff_event, state))
+            goto cleanup;
+    }
+
+    for (uint32_t i = 0; i < DIFF_MAX_NAMES; ++i)
+    {
+        diff_entry_t const *entry = &state->Entries[i];
+        uint32_t            n     = entry->Samples[DIFF_BASE].Count + entry->Samples[DIFF_NEW].Count;
+        if (entry->Name[0] != '\0' && n > maxcount) maxcount = n;
+    }
+    results = (diff_result_t*) malloc((state->EntryCount + 1) * sizeof(diff_result_t));
+    scratch = (float        *) malloc(DIFF_BOOTSTRAP_LIMIT * sizeof(float));
+    ranked  = (diff_ranked_t*) malloc((maxcount + 1) * sizeof(diff_ranked_t));
+    if (results == NULL || scratch == NULL || ranked == NULL)
+    {
+        fprintf(stderr, "ERROR: Unable to allocate comparison buffers.\n");
+        goto cleanup;
+    }
+    for (uint32_t i = 0; i < DIFF_MAX_NAMES; ++i)
+    {
+        diff_entry_t *entry = &state->Entries[i];
+        if (entry->Name[0] == '\0' || (entry->Marker && !markers))
+            continue;
+        if (entry->Samples[DIFF_BASE].Count < min_count || entry->Samples[DIFF_NEW].Count < min_count)
+        {
+            skipped++;
+            continue;
+        }
+        compare_entry(entry, alpha, threshold, scratch, ranked, &results[count]);
+        if (results[count].Verdict > 0) regressed++;
+        if (results[count].Verdict < 0) improved++;
+        count++;
+    }
+    qsort(results, count, sizeof(diff_result_t), compare_result);
+
+    fprintf(stdout, "Base: %s\nNew:  %s\n\n", inputs[DIFF_BASE], inputs[DIFF_NEW]);
+    fprintf(stdout, "%-3s %-32s %7s %7s %11s %11s %11s %11s %8s %23s %9s %s\n", "", "Name", "N(base)", "N(new)",
+            "Med(base)", "Med(new)", "P90(base)", "P90(new)", "Delta", "CI of delta (ms)", "p", "");
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        diff_result_t const *r = &results[i];
+        fprintf(stdout, "%-3s %-32s %7u %7u %11.4f %11.4f %11.4f %11.4f %+7.1f%% [%+10.4f, %+10.4f] %9.2e %s\n",
+                r->Entry->Marker ? "mrk" : "scp", r->Entry->Name,
+                r->Entry->Samples[DIFF_BASE].Count, r->Entry->Samples[DIFF_NEW].Count,
+                r->Median[DIFF_BASE], r->Median[DIFF_NEW], r->P90[DIFF_BASE], r->P90[DIFF_NEW],
+                r->DeltaPct, r->CiLow, r->CiHigh, r->PValue,
+                r->Verdict > 0 ? "REGRESSION" : (r->Verdict < 0 ? "improved" : ""));
+    }
+    fprintf(stdout, "\n%u compared, %u regressed, %u improved, %u skipped (fewer than %u samples).\n",
+            count, regressed, improved, skipped, min_count);
+    fprintf(stdout, "Confidence intervals are %.1f%% bootstrap intervals over %d resamples.\n",
+            100.0 * (1.0 - alpha), DIFF_BOOTSTRAP_COUNT);
+    if (state->Overflow > 0)
+    {
+        fprintf(stdout, "(%u samples dropped; too many distinct names)\n", state->Overflow);
+    }
+    result = regressed > 0 ? DIFF_EXIT_REGRESSION : EXIT_SUCCESS;
+
+cleanup:
+    free(ranked);
+    free(scratch);
+    free(results);
+    free_samples(state);
+    free(state);
+    return result;
+}
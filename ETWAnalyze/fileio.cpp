@@ -0,0 +1,464 @@
+/*/////////////////////////////////////////////////////////////////////////////
+/// @summary Implements the 'fileio' command, which summarizes the file I/O
+/// events emitted by the hooks installed with ETWHookFileIO. Operations are
+/// totalled by type, and reads and mapped views are attributed to the file
+/// they were performed on by following handles back to the open event.
+/// @author Russell Klenk (contact@russellklenk.com)
+///////////////////////////////////////////////////////////////////////////80*/
+
+/*////////////////
+//   Includes   //
+////////////////*/
+#include "ETWAnalyze.h"
+
+/*/////////////////
+//   Constants   //
+/////////////////*/
+/// @summary Define the maximum number of input files accepted on the command line.
+#define FILEIO_MAX_INPUTS    64
+
+/// @summary Define the maximum number of distinct file paths tracked.
+/// This value must be a power of two greater than zero.
+#define FILEIO_MAX_FILES     4096
+
+/// @summary Define the maximum number of live handles and view addresses tracked.
+/// This value must be a power of two greater than zero.
+#define FILEIO_MAX_HANDLES   16384
+
+/// @summary Define the maximum length of a tracked path, including the NULL.
+#define FILEIO_MAX_PATH      260
+
+/// @summary The number of file I/O operation types, ETW_EVENT_FILE_OPEN through ETW_EVENT_FILE_PREFETCH.
+#define FILEIO_OP_COUNT      6
+
+/// @summary The offset reported for reads that used the file pointer.
+#define FILEIO_OFFSET_UNKNOWN (~0ULL)
+
+/// @summary Identifies the namespace of a key in the handle table.
+#define FILEIO_KEY_HANDLE    1
+#define FILEIO_KEY_VIEW      2
+
+/*//////////////////
+//   Data Types   //
+//////////////////*/
+/// @summary Totals for all operations of a single type.
+struct fileio_op_t
+{
+    uint64_t     Count;       /// The number of operations, including summarized operations.
+    uint64_t     Errors;      /// The number of operations that reported an error.
+    uint64_t     Summarized;  /// The number of operations reported only in FileSummary events.
+    uint64_t     Bytes;       /// The number of bytes read, mapped or prefetched.
+    double       TotalMs;     /// The summed latency, in milliseconds.
+    double       MaxMs;       /// The longest latency, in milliseconds.
+};
+
+/// @summary Statistics for the operations performed on a single file path.
+struct fileio_file_t
+{
+    char         Path[FILEIO_MAX_PATH]; /// The file path.
+    uint32_t     Opens;       /// The number of times the file was opened.
+    double       OpenMs;      /// The summed latency of the opens, in milliseconds.
+    uint64_t     Reads;       /// The number of reads.
+    uint64_t     Sequential;  /// The number of reads at a known offset that began where the previous read ended.
+    uint64_t     ReadBytes;   /// The number of bytes read.
+    double       ReadMs;      /// The summed latency of the reads, in milliseconds.
+    double       ReadMaxMs;   /// The longest read, in milliseconds.
+    uint64_t     Views;       /// The number of views mapped.
+    uint64_t     ViewBytes;   /// The number of bytes mapped.
+    double       ViewMs;      /// The summed latency of mapping, unmapping and prefetching views, in milliseconds.
+};
+
+/// @summary Associates a handle or view address in a process with the file it refers to.
+struct fileio_handle_t
+{
+    uint32_t     ProcessId;   /// The process that owns the handle, or zero if the entry is unused.
+    uint32_t     Namespace;   /// One of FILEIO_KEY_HANDLE or FILEIO_KEY_VIEW.
+    uint64_t     Key;         /// The handle value or view address.
+    uint64_t     NextOffset;  /// The offset following the last read through the handle.
+    uint32_t     File;        /// The index of the file in fileio_state_t::Files.
+};
+
+/// @summary The tables built while processing the input files.
+struct fileio_state_t
+{
+    fileio_op_t     Ops[FILEIO_OP_COUNT];        /// Totals by operation, indexed by Kind - ETW_EVENT_FILE_OPEN.
+    fileio_file_t   Files[FILEIO_MAX_FILES];     /// Open-addressed table of file statistics.
+    uint32_t        FileCount;  /// The number of used entries in Files.
+    fileio_handle_t Handles[FILEIO_MAX_HANDLES]; /// Open-addressed table of handles and view addresses.
+    uint32_t        HandleCount; /// The number of used entries in Handles.
+    uint32_t        Overflow;   /// The number of operations not attributed because a table was full.
+};
+
+/*///////////////////////
+//   Local Functions   //
+///////////////////////*/
+/// @summary Print usage information for the fileio command.
+static void print_usage(void)
+{
+    fprintf(stdout, "USAGE: etwanalyze.exe fileio [-top N] [-from MS] [-to MS] [-thread TID] INFILE [INFILE...]\n");
+    fprintf(stdout, "  Summarize the file opens, reads and mapped views reported by the hooks\n");
+    fprintf(stdout, "  installed with ETWHookFileIO or 'etwanalyze launch', by operation and by file.\n");
+    fprintf(stdout, "  -top: List the N files with the most I/O time (default 20).\n");
+    etw_range_usage(stdout);
+    fprintf(stdout, "\n");
+}
+
+/// @summary Compute the FNV-1a hash of a NULL-terminated string.
+/// @param str The string to hash.
+/// @return The 32-bit hash value.
+static uint32_t hash_string(char const *str)
+{
+    uint32_t h = 2166136261U;
+    while (*str)
+    {
+        h ^= (uint8_t) *str++;
+        h *= 16777619U;
+    }
+    return h;
+}
+
+/// @summary Compute a hash for a handle table key.
+/// @param pid The process identifier.
+/// @param key The handle value or view address.
+/// @return The 32-bit hash value.
+static uint32_t hash_key(uint32_t pid, uint64_t key)
+{
+    uint64_t h = (key ^ (uint64_t(pid) << 32)) * 0x9E3779B97F4A7C15ULL;
+    return (uint32_t) (h >> 32);
+}
+
+/// @summary Find or insert the statistics entry for a file path.
+/// @param state The fileio command state.
+/// @param path The file path. An empty path is tracked as "(unknown)".
+/// @return The index of the entry, or FILEIO_MAX_FILES if the table is full.
+static uint32_t find_file(fileio_state_t *state, char const *path)
+{
+    uint32_t mask  = FILEIO_MAX_FILES - 1;
+    uint32_t index = 0;
+    if (path[0] == '\0')
+        path = "(unknown)";
+    index = hash_string(path) & mask;
+    for (uint32_t i = 0; i < FILEIO_MAX_FILES; ++i, index = (index + 1) & mask)
+    {
+        fileio_file_t *file = &state->Files[index];
+        if (file->Path[0] == '\0')
+        {
+            if (state->FileCount == FILEIO_MAX_FILES - 1)
+                return FILEIO_MAX_FILES; // keep one slot free so lookups terminate.
+            strncpy(file->Path, path, FILEIO_MAX_PATH - 1);
+            file->Path[FILEIO_MAX_PATH-1] = '\0';
+            state->FileCount++;
+            return index;
+        }
+        if (strncmp(file->Path, path, FILEIO_MAX_PATH - 1) == 0)
+        {
+            return index;
+        }
+    }
+    return FILEIO_MAX_FILES;
+}
+
+/// @summary Find the handle table entry for a handle or view address, optionally inserting it.
+/// @param state The fileio command state.
+/// @param pid The process that owns the handle.
+/// @param ns One of FILEIO_KEY_HANDLE or FILEIO_KEY_VIEW.
+/// @param key The handle value or view address.
+/// @param insert If true, an entry is created when none exists.
+/// @return The entry, or NULL if it does not exist or the table is full.
+static fileio_handle_t* find_handle(fileio_state_t *state, uint32_t pid, uint32_t ns, uint64_t key, bool insert)
+{
+    uint32_t mask  = FILEIO_MAX_HANDLES - 1;
+    uint32_t index = hash_key(pid, key + ns) & mask;
+    for (uint32_t i = 0; i < FILEIO_MAX_HANDLES; ++i, index = (index + 1) & mask)
+    {
+        fileio_handle_t *entry = &state->Handles[index];
+        if (entry->ProcessId == 0)
+        {
+            if (!insert || state->HandleCount == FILEIO_MAX_HANDLES - 1)
+                return NULL;
+            entry->ProcessId  = pid;
+            entry->Namespace  = ns;
+            entry->Key        = key;
+            entry->NextOffset = FILEIO_OFFSET_UNKNOWN;
+            entry->File       = FILEIO_MAX_FILES;
+            state->HandleCount++;
+            return entry;
+        }
+        if (entry->ProcessId == pid && entry->Namespace == ns && entry->Key == key)
+        {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+/// @summary Find the file a handle or view address refers to. Handles opened before the
+/// hooks were installed are attributed to "(unknown)".
+/// @param state The fileio command state.
+/// @param pid The process that owns the handle.
+/// @param ns One of FILEIO_KEY_HANDLE or FILEIO_KEY_VIEW.
+/// @param key The handle value or view address.
+/// @return The handle table entry, or NULL if the tables are full.
+static fileio_handle_t* attribute(fileio_state_t *state, uint32_t pid, uint32_t ns, uint64_t key)
+{
+    fileio_handle_t *entry = find_handle(state, pid, ns, key, true);
+    if (entry != NULL && entry->File == FILEIO_MAX_FILES)
+        entry->File = find_file(state, "");
+    if (entry == NULL || entry->File == FILEIO_MAX_FILES)
+    {
+        state->Overflow++;
+        return NULL;
+    }
+    return entry;
+}
+
+/// @summary Bind a handle or view address to a file, replacing any previous binding since
+/// handle values and addresses are reused once closed or unmapped.
+/// @param state The fileio command state.
+/// @param pid The process that owns the handle.
+/// @param ns One of FILEIO_KEY_HANDLE or FILEIO_KEY_VIEW.
+/// @param key The handle value or view address.
+/// @param file The index of the file.
+static void bind_handle(fileio_state_t *state, uint32_t pid, uint32_t ns, uint64_t key, uint32_t file)
+{
+    fileio_handle_t *entry = find_handle(state, pid, ns, key, true);
+    if (entry == NULL || file == FILEIO_MAX_FILES)
+    {
+        state->Overflow++;
+        return;
+    }
+    entry->File       = file;
+    entry->NextOffset = FILEIO_OFFSET_UNKNOWN;
+}
+
+/// @summary Add an operation to the totals for its type.
+/// @param op The totals for the operation type.
+/// @param bytes The number of bytes transferred.
+/// @param ms The latency of the operation, in milliseconds.
+/// @param error The error code reported by the operation.
+static void count_op(fileio_op_t *op, uint64_t bytes, double ms, int32_t error)
+{
+    op->Count++;
+    op->Bytes   += bytes;
+    op->TotalMs += ms;
+    if (ms > op->MaxMs) op->MaxMs = ms;
+    if (error != 0) op->Errors++;
+}
+
+/// @summary Receives each decoded event and accumulates file I/O statistics.
+/// @param ev The decoded event.
+/// @param context Pointer to the fileio_state_t.
+static void fileio_event(etw_event_t const *ev, void *context)
+{
+    fileio_state_t  *state = (fileio_state_t*) context;
+    fileio_handle_t *entry = NULL;
+    fileio_file_t   *file  = NULL;
+    uint32_t         index = FILEIO_MAX_FILES;
+
+    switch (ev->Kind)
+    {
+    case ETW_EVENT_FILE_OPEN:
+        count_op(&state->Ops[0], 0, ev->Duration, ev->Value[1]);
+        if ((index = find_file(state, ev->Text)) == FILEIO_MAX_FILES)
+        {
+            state->Overflow++;
+            break;
+        }
+        file = &state->Files[index];
+        file->Opens++;
+        file->OpenMs += ev->Duration;
+        if (ev->Value[1] == 0)
+            bind_handle(state, ev->ProcessId, FILEIO_KEY_HANDLE, ev->Id, index);
+        break;
+
+    case ETW_EVENT_FILE_READ:
+        count_op(&state->Ops[1], ev->Size, ev->Duration, ev->Value[1]);
+        if ((entry = attribute(state, ev->ProcessId, FILEIO_KEY_HANDLE, ev->Id)) == NULL)
+            break;
+        file = &state->Files[entry->File];
+        file->Reads++;
+        file->ReadBytes += ev->Size;
+        file->ReadMs    += ev->Duration;
+        if (ev->Duration > file->ReadMaxMs) file->ReadMaxMs = ev->Duration;
+        if (ev->Offset != FILEIO_OFFSET_UNKNOWN)
+        {
+            if (ev->Offset == entry->NextOffset)
+                file->Sequential++;
+            entry->NextOffset = ev->Offset + ev->Size;
+        }
+        break;
+
+    case ETW_EVENT_FILE_MAPPING:
+        count_op(&state->Ops[2], 0, ev->Duration, ev->Target == 0);
+        if (ev->Target == 0)
+            break;
+        if (ev->Id == FILEIO_OFFSET_UNKNOWN || ev->Id == 0xFFFFFFFFULL)
+        {   // INVALID_HANDLE_VALUE; a section backed by the paging file.
+            index = find_file(state, "(pagefile)");
+        }
+        else if ((entry = attribute(state, ev->ProcessId, FILEIO_KEY_HANDLE, ev->Id)) != NULL)
+        {
+            index = entry->File;
+        }
+        if (index == FILEIO_MAX_FILES)
+            break;
+        state->Files[index].ViewMs += ev->Duration;
+        bind_handle(state, ev->ProcessId, FILEIO_KEY_HANDLE, ev->Target, index);
+        break;
+
+    case ETW_EVENT_FILE_MAP_VIEW:
+        count_op(&state->Ops[3], ev->Size, ev->Duration, ev->Target == 0);
+        if (ev->Target == 0 || (entry = attribute(state, ev->ProcessId, FILEIO_KEY_HANDLE, ev->Id)) == NULL)
+            break;
+        file = &state->Files[entry->File];
+        file->Views++;
+        file->ViewBytes += ev->Size;
+        file->ViewMs    += ev->Duration;
+        bind_handle(state, ev->ProcessId, FILEIO_KEY_VIEW, ev->Target, entry->File);
+        break;
+
+    case ETW_EVENT_FILE_UNMAP:
+    case ETW_EVENT_FILE_PREFETCH:
+        count_op(&state->Ops[ev->Kind - ETW_EVENT_FILE_OPEN], ev->Size, ev->Duration, 0);
+        if ((entry = find_handle(state, ev->ProcessId, FILEIO_KEY_VIEW, ev->Id, false)) != NULL && entry->File != FILEIO_MAX_FILES)
+            state->Files[entry->File].ViewMs += ev->Duration;
+        break;
+
+    case ETW_EVENT_FILE_SUMMARY:
+        if (ev->Value[0] >= ETW_EVENT_FILE_OPEN && ev->Value[0] < ETW_EVENT_FILE_OPEN + FILEIO_OP_COUNT)
+        {   // summarized operations can't be attributed to a file.
+            fileio_op_t *op = &state->Ops[ev->Value[0] - ETW_EVENT_FILE_OPEN];
+            op->Count      += (uint32_t) ev->Value[1];
+            op->Summarized += (uint32_t) ev->Value[1];
+            op->Bytes      += ev->Size;
+            op->TotalMs    += ev->Duration;
+            if (ev->OnCpu > op->MaxMs) op->MaxMs = ev->OnCpu;
+        }
+        break;
+
+    default:
+        break;
+    }
+}
+
+/// @summary Compute the total time spent in I/O calls on a file.
+/// @param file The file statistics.
+/// @return The total time, in milliseconds.
+static double file_time(fileio_file_t const *file)
+{
+    return file->OpenMs + file->ReadMs + file->ViewMs;
+}
+
+/// @summary Order files by descending total I/O time, for use with qsort.
+static int compare_time(void const *a, void const *b)
+{
+    double ta = file_time(*(fileio_file_t const**) a);
+    double tb = file_time(*(fileio_file_t const**) b);
+    if (ta > tb) return -1;
+    if (ta < tb) return +1;
+    return 0;
+}
+
+/// @summary Print the totals by operation, followed by the files with the most I/O time.
+/// @param state The fileio command state.
+/// @param top The maximum number of files to list.
+/// @param fp The output stream.
+static void print_fileio(fileio_state_t *state, uint32_t top, FILE *fp)
+{
+    static char const *OP_NAME[FILEIO_OP_COUNT] = { "Open", "Read", "Mapping", "MapView", "Unmap", "Prefetch" };
+    fileio_file_t    **order = (fileio_file_t**) malloc((state->FileCount + 1) * sizeof(fileio_file_t*));
+    uint32_t           count = 0;
+    if (order == NULL)
+    {
+        fprintf(stderr, "ERROR: Unable to allocate file list.\n");
+        return;
+    }
+
+    fprintf(fp, "%-10s %10s %8s %10s %12s %12s %10s %10s\n", "Operation", "Count", "Errors", "Summarized",
+            "Bytes (MB)", "Total (ms)", "Avg (ms)", "Max (ms)");
+    for (uint32_t i = 0; i < FILEIO_OP_COUNT; ++i)
+    {
+        fileio_op_t const *op = &state->Ops[i];
+        if (op->Count == 0)
+            continue;
+        fprintf(fp, "%-10s %10I64u %8I64u %10I64u %12.3f %12.3f %10.4f %10.3f\n", OP_NAME[i], op->Count, op->Errors,
+                op->Summarized, op->Bytes / (1024.0 * 1024.0), op->TotalMs, op->TotalMs / op->Count, op->MaxMs);
+    }
+
+    for (uint32_t i = 0; i < FILEIO_MAX_FILES; ++i)
+    {
+        if (state->Files[i].Path[0] != '\0')
+            order[count++] = &state->Files[i];
+    }
+    qsort(order, count, sizeof(fileio_file_t*), compare_time);
+    if (count > top)
+        count = top;
+
+    if (count > 0)
+    {
+        fprintf(fp, "\n%-48s %6s %8s %10s %10s %8s %5s %6s %10s %10s\n", "File", "Opens", "Reads", "Read (MB)",
+                "Read (ms)", "Max (ms)", "Seq%", "Views", "Map (MB)", "Map (ms)");
+    }
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        fileio_file_t const *file = order[i];
+        size_t const         len  = strlen(file->Path);
+        // show the end of long paths, which identifies the file.
+        fprintf(fp, "%-48s %6u %8I64u %10.3f %10.3f %8.3f %4.0f%% %6I64u %10.3f %10.3f\n",
+                len > 48 ? file->Path + len - 48 : file->Path, file->Opens, file->Reads,
+                file->ReadBytes / (1024.0 * 1024.0), file->ReadMs, file->ReadMaxMs,
+                file->Reads > 0 ? (100.0 * file->Sequential) / file->Reads : 0.0,
+                file->Views, file->ViewBytes / (1024.0 * 1024.0), file->ViewMs);
+    }
+    if (state->Overflow > 0)
+    {
+        fprintf(fp, "(%u operations not attributed to a file; too many files or handles)\n", state->Overflow);
+    }
+    free(order);
+}
+
+/*///////////////////////
+//  Public Functions   //
+///////////////////////*/
+int cmd_fileio(int argc, char **argv)
+{
+    char const      *inputs[FILEIO_MAX_INPUTS];
+    size_t           ninput = 0;
+    uint32_t         top    = 20;
+    fileio_state_t  *state  = NULL;
+    etw_time_range_t range  = { 0.0, -1.0, 0 };
+
+    for (int i = 0; i < argc; ++i)
+    {
+        if (etw_range_option(argc, argv, &i, &range))
+            continue;
+        else if (strcmp(argv[i], "-top") == 0 && i + 1 < argc)
+            top = strtoul(argv[++i], NULL, 0);
+        else if (argv[i][0] != '-' && ninput < FILEIO_MAX_INPUTS)
+            inputs[ninput++] = argv[i];
+        else
+        {
+            print_usage();
+            return EXIT_FAILURE;
+        }
+    }
+    if (ninput == 0)
+    {
+        fprintf(stderr, "ERROR: Missing argument INFILE.\n\n");
+        print_usage();
+        return EXIT_FAILURE;
+    }
+    if ((state = (fileio_state_t*) calloc(1, sizeof(fileio_state_t))) == NULL)
+    {
+        fprintf(stderr, "ERROR: Unable to allocate file I/O tables.\n");
+        return EXIT_FAILURE;
+    }
+    if (!etw_process_range(inputs, ninput, &range, fileio_event, state))
+    {
+        free(state);
+        return EXIT_FAILURE;
+    }
+    print_fileio(state, top, stdout);
+    free(state);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,498 @@
+/*/////////////////////////////////////////////////////////////////////////////
+/// @summary Implements the chunk index written alongside split trace files,
+/// and the 'index' command. The index records the time span and per-thread
+/// event counts of each chunk, so readers can open only the chunks that
+/// contain a requested time range instead of decoding the entire capture.
+/// @author Russell Klenk (contact@russellklenk.com)
+///////////////////////////////////////////////////////////////////////////80*/
+
+/*////////////////
+//   Includes   //
+////////////////*/
+#include "ETWAnalyze.h"
+
+/*/////////////////
+//   Constants   //
+/////////////////*/
+/// @summary The value stored in the first four bytes of an index file ('ETWI').
+#define INDEX_MAGIC          0x49575445U
+
+/// @summary The version of the index file format.
+#define INDEX_VERSION        1U
+
+/// @summary Define the maximum number of chunks accepted by the index command.
+#define INDEX_MAX_CHUNKS     4096
+
+/// @summary Define the maximum number of distinct threads recorded per chunk.
+#define INDEX_MAX_THREADS    256
+
+/*//////////////////
+//   Data Types   //
+//////////////////*/
+/// @summary The fixed-size header at the start of an index file. The header is
+/// followed by ChunkCount index_chunk_t records and ThreadCount index_thread_t records.
+struct index_header_t
+{
+    uint32_t     Magic;       /// INDEX_MAGIC.
+    uint32_t     Version;     /// INDEX_VERSION.
+    uint32_t     ChunkCount;  /// The number of chunk records.
+    uint32_t     ThreadCount; /// The total number of thread records.
+    int64_t      BaseTime;    /// The earliest session start time of any chunk, in 100ns units.
+};
+
+/// @summary Describes a single chunk file.
+struct index_chunk_t
+{
+    char         Name[MAX_PATH]; /// The file name of the chunk, relative to the directory containing the index.
+    int64_t      FirstTime;   /// The timestamp of the first custom event in the chunk.
+    int64_t      LastTime;    /// The timestamp of the last custom event in the chunk.
+    uint64_t     FileSize;    /// The size of the chunk file, in bytes.
+    uint32_t     EventCount;  /// The number of custom events in the chunk.
+    uint32_t     FirstThread; /// The index of the first thread record for the chunk.
+    uint32_t     ThreadCount; /// The number of thread records for the chunk.
+    uint32_t     Reserved;    /// Padding; always zero.
+};
+
+/// @summary Describes the events logged by a single thread within a chunk.
+struct index_thread_t
+{
+    uint32_t     ThreadId;    /// The operating system thread identifier.
+    uint32_t     EventCount;  /// The number of custom events logged by the thread.
+    int64_t      FirstTime;   /// The timestamp of the thread's first event in the chunk.
+    int64_t      LastTime;    /// The timestamp of the thread's last event in the chunk.
+};
+
+/// @summary The state accumulated while scanning a single chunk.
+struct index_scan_t
+{
+    index_chunk_t  Chunk;     /// The chunk record being built.
+    index_thread_t Threads[INDEX_MAX_THREADS]; /// The threads seen in the chunk.
+    uint32_t       ThreadCount; /// The number of used entries in Threads.
+    uint32_t       Overflow;  /// The number of events from threads that did not fit in Threads.
+};
+
+/// @summary An index file loaded into memory.
+struct index_file_t
+{
+    index_header_t  Header;   /// The file header.
+    index_chunk_t  *Chunks;   /// The chunk records.
+    index_thread_t *Threads;  /// The thread records.
+};
+
+/*///////////////////////
+//   Local Functions   //
+///////////////////////*/
+/// @summary Print usage information for the index command.
+static void print_usage(void)
+{
+    fprintf(stdout, "USAGE: etwanalyze.exe index [-o OUTFILE] INFILE [INFILE...]\n");
+    fprintf(stdout, "       etwanalyze.exe index -list INDEX\n");
+    fprintf(stdout, "  Build a chunk index for a capture split with 'record -split'. The index\n");
+    fprintf(stdout, "  may be passed to any analysis command in place of the .etl files, and\n");
+    fprintf(stdout, "  with -from/-to only the chunks overlapping that range are decoded.\n");
+    fprintf(stdout, "  INFILE may contain a %%d, which is replaced with 1, 2, 3... until no file exists.\n");
+    fprintf(stdout, "  -o:    The path of the index (default: the first INFILE with the extension .etwidx).\n");
+    fprintf(stdout, "  -list: Print the chunks recorded in an existing index.\n");
+    fprintf(stdout, "\n");
+}
+
+/// @summary Retrieve the size of a file.
+/// @param path The path of the file.
+/// @return The file size in bytes, or zero if the file cannot be queried.
+static uint64_t file_size(char const *path)
+{
+    WIN32_FILE_ATTRIBUTE_DATA attr;
+    if (GetFileAttributesExA(path, GetFileExInfoStandard, &attr))
+    {
+        return (uint64_t(attr.nFileSizeHigh) << 32) | uint64_t(attr.nFileSizeLow);
+    }
+    return 0;
+}
+
+/// @summary Find the file name component of a path.
+/// @param path The path.
+/// @return A pointer to the first character after the last path separator.
+static char const* path_file_name(char const *path)
+{
+    char const *name = path;
+    for (char const *p = path; *p; ++p)
+    {
+        if (*p == '\\' || *p == '/' || *p == ':')
+            name = p + 1;
+    }
+    return name;
+}
+
+/// @summary Receives each decoded event from a chunk and updates its time span and thread list.
+/// @param ev The decoded event.
+/// @param context Pointer to the index_scan_t.
+static void index_event(etw_event_t const *ev, void *context)
+{
+    index_scan_t   *scan   = (index_scan_t*) context;
+    index_thread_t *thread = NULL;
+    if (scan->Chunk.EventCount == 0 || ev->Timestamp < scan->Chunk.FirstTime) scan->Chunk.FirstTime = ev->Timestamp;
+    if (scan->Chunk.EventCount == 0 || ev->Timestamp > scan->Chunk.LastTime ) scan->Chunk.LastTime  = ev->Timestamp;
+    scan->Chunk.EventCount++;
+    for (uint32_t i = 0; i < scan->ThreadCount; ++i)
+    {
+        if (scan->Threads[i].ThreadId == ev->ThreadId)
+        {
+            thread = &scan->Threads[i];
+            break;
+        }
+    }
+    if (thread == NULL)
+    {
+        if (scan->ThreadCount == INDEX_MAX_THREADS)
+        {
+            scan->Overflow++;
+            return;
+        }
+        thread = &scan->Threads[scan->ThreadCount++];
+        thread->ThreadId  = ev->ThreadId;
+        thread->FirstTime = ev->Timestamp;
+        thread->LastTime  = ev->Timestamp;
+    }
+    if (ev->Timestamp < thread->FirstTime) thread->FirstTime = ev->Timestamp;
+    if (ev->Timestamp > thread->LastTime ) thread->LastTime  = ev->Timestamp;
+    thread->EventCount++;
+}
+
+/// @summary Load an index file into memory.
+/// @param path The path of the index file.
+/// @param index On return, stores the loaded index. Free with index_free.
+/// @return true if the index was loaded.
+static bool index_load(char const *path, index_file_t *index)
+{
+    FILE *fp = fopen(path, "rb");
+    memset(index, 0, sizeof(index_file_t));
+    if (fp == NULL)
+    {
+        fprintf(stderr, "ERROR: Unable to open index file \'%s\': %s\n", path, strerror(errno));
+        return false;
+    }
+    if (fread(&index->Header, sizeof(index_header_t), 1, fp) != 1 ||
+        index->Header.Magic != INDEX_MAGIC || index->Header.Version != INDEX_VERSION)
+    {
+        fprintf(stderr, "ERROR: \'%s\' is not a trace index.\n", path);
+        fclose(fp);
+        return false;
+    }
+    index->Chunks  = (index_chunk_t *) malloc((index->Header.ChunkCount  + 1) * sizeof(index_chunk_t));
+    index->Threads = (index_thread_t*) malloc((index->Header.ThreadCount + 1) * sizeof(index_thread_t));
+    if (index->Chunks == NULL || index->Threads == NULL)
+    {
+        fprintf(stderr, "ERROR: Unable to allocate memory for index \'%s\'.\n", path);
+        goto error_cleanup;
+    }
+    if (fread(index->Chunks , sizeof(index_chunk_t) , index->Header.ChunkCount , fp) != index->Header.ChunkCount ||
+        fread(index->Threads, sizeof(index_thread_t), index->Header.ThreadCount, fp) != index->Header.ThreadCount)
+    {
+        fprintf(stderr, "ERROR: The index file \'%s\' is truncated.\n", path);
+        goto error_cleanup;
+    }
+    fclose(fp);
+    return true;
+
+error_cleanup:
+    free(index->Threads);
+    free(index->Chunks);
+    memset(index, 0, sizeof(index_file_t));
+    fclose(fp);
+    return false;
+}
+
+/// @summary Free the memory allocated by index_load.
+/// @param index The loaded index.
+static void index_free(index_file_t *index)
+{
+    free(index->Threads);
+    free(index->Chunks);
+    memset(index, 0, sizeof(index_file_t));
+}
+
+/// @summary Determine whether a chunk contains events within a time range.
+/// @param index The loaded index.
+/// @param chunk The chunk record.
+/// @param start The first time of interest, in 100ns units.
+/// @param end The last time of interest, in 100ns units.
+/// @param thread_id If non-zero, only events from this thread are of interest.
+/// @return true if the chunk should be decoded.
+static bool chunk_overlaps(index_file_t const *index, index_chunk_t const *chunk, int64_t start, int64_t end, uint32_t thread_id)
+{
+    if (thread_id == 0)
+    {
+        return chunk->EventCount > 0 && chunk->FirstTime <= end && chunk->LastTime >= start;
+    }
+    for (uint32_t i = 0; i < chunk->ThreadCount; ++i)
+    {
+        index_thread_t const *thread = &index->Threads[chunk->FirstThread + i];
+        if (thread->ThreadId == thread_id)
+            return thread->FirstTime <= end && thread->LastTime >= start;
+    }
+    return false;
+}
+
+/// @summary Print the chunks recorded in an index.
+/// @param index The loaded index.
+/// @param fp The output stream.
+static void print_index(index_file_t const *index, FILE *fp)
+{
+    uint64_t events = 0;
+    uint64_t bytes  = 0;
+    fprintf(fp, "%-40s %10s %8s %12s %12s %14s\n", "Chunk", "Events", "Threads", "From (ms)", "To (ms)", "Size (bytes)");
+    for (uint32_t i = 0; i < index->Header.ChunkCount; ++i)
+    {
+        index_chunk_t const *chunk = &index->Chunks[i];
+        if (chunk->EventCount > 0)
+        {
+            fprintf(fp, "%-40s %10u %8u %12.3f %12.3f %14I64u\n", chunk->Name, chunk->EventCount, chunk->ThreadCount,
+                    double(chunk->FirstTime - index->Header.BaseTime) / TICKS_PER_MS,
+                    double(chunk->LastTime  - index->Header.BaseTime) / TICKS_PER_MS, chunk->FileSize);
+        }
+        else fprintf(fp, "%-40s %10u %8u %12s %12s %14I64u\n", chunk->Name, 0U, 0U, "-", "-", chunk->FileSize);
+        events += chunk->EventCount;
+        bytes  += chunk->FileSize;
+    }
+    fprintf(fp, "%u chunks, %I64u events, %I64u bytes.\n", index->Header.ChunkCount, events, bytes);
+}
+
+/*///////////////////////
+//  Public Functions   //
+///////////////////////*/
+size_t etw_chunk_expand(char const *pattern, char (*paths)[MAX_PATH], size_t max_paths)
+{
+    size_t count = 0;
+    if (strstr(pattern, "%d") == NULL)
+    {   // not a pattern; pass the path through unchanged.
+        if (max_paths == 0) return 0;
+        strncpy(paths[0], pattern, MAX_PATH - 1);
+        paths[0][MAX_PATH-1] = '\0';
+        return 1;
+    }
+    for (int n = 1; count < max_paths; ++n)
+    {   // the logger numbers files starting from 1.
+        _snprintf(paths[count], MAX_PATH, pattern, n);
+        paths[count][MAX_PATH-1] = '\0';
+        if (GetFileAttributesA(paths[count]) == INVALID_FILE_ATTRIBUTES)
+            break;
+        count++;
+    }
+    return count;
+}
+
+bool etw_index_build(char const *index_path, char const **paths, size_t count)
+{
+    index_header_t  header;
+    index_chunk_t  *chunks  = (index_chunk_t *) calloc(count + 1, sizeof(index_chunk_t));
+    index_thread_t *threads = NULL;
+    index_scan_t   *scan    = (index_scan_t  *) calloc(1, sizeof(index_scan_t));
+    uint32_t        nthread = 0;
+    FILE           *fp      = NULL;
+
+    memset(&header, 0, sizeof(header));
+    header.Magic    = INDEX_MAGIC;
+    header.Version  = INDEX_VERSION;
+    header.BaseTime = INT64_MAX;
+    if (chunks == NULL || scan == NULL)
+    {
+        fprintf(stderr, "ERROR: Unable to allocate memory for the index.\n");
+        goto error_cleanup;
+    }
+    for (size_t i = 0; i < count; ++i)
+    {   // scan each chunk separately so that its time span is known.
+        int64_t         start = 0;
+        index_thread_t *grow  = NULL;
+        memset(scan, 0, sizeof(index_scan_t));
+        if (!etw_trace_start_time(paths[i], &start) || !etw_process_files(&paths[i], 1, index_event, scan))
+        {
+            goto error_cleanup;
+        }
+        if (start < header.BaseTime) header.BaseTime = start;
+        if (scan->Overflow > 0)
+        {
+            fprintf(stderr, "WARNING: %u events in \'%s\' are from threads beyond the first %d; -thread may miss them.\n",
+                    scan->Overflow, paths[i], INDEX_MAX_THREADS);
+        }
+        if ((grow = (index_thread_t*) realloc(threads, (nthread + scan->ThreadCount + 1) * sizeof(index_thread_t))) == NULL)
+        {
+            fprintf(stderr, "ERROR: Unable to allocate memory for the index.\n");
+            goto error_cleanup;
+        }
+        threads = grow;
+        memcpy(&threads[nthread], scan->Threads, scan->ThreadCount * sizeof(index_thread_t));
+        strncpy(scan->Chunk.Name, path_file_name(paths[i]), MAX_PATH - 1);
+        scan->Chunk.FileSize    = file_size(paths[i]);
+        scan->Chunk.FirstThread = nthread;
+        scan->Chunk.ThreadCount = scan->ThreadCount;
+        chunks[i] = scan->Chunk;
+        nthread  += scan->ThreadCount;
+    }
+    header.ChunkCount  = uint32_t(count);
+    header.ThreadCount = nthread;
+
+    if ((fp = fopen(index_path, "wb")) == NULL)
+    {
+        fprintf(stderr, "ERROR: Unable to open index file \'%s\': %s\n", index_path, strerror(errno));
+        goto error_cleanup;
+    }
+    if (fwrite(&header, sizeof(header), 1, fp) != 1 ||
+        fwrite(chunks , sizeof(index_chunk_t) , count  , fp) != count ||
+        fwrite(threads, sizeof(index_thread_t), nthread, fp) != nthread)
+    {
+        fprintf(stderr, "ERROR: Unable to write index file \'%s\': %s\n", index_path, strerror(errno));
+        goto error_cleanup;
+    }
+    fclose(fp);
+    free(threads);
+    free(scan);
+    free(chunks);
+    return true;
+
+error_cleanup:
+    if (fp != NULL) fclose(fp);
+    free(threads);
+    free(scan);
+    free(chunks);
+    return false;
+}
+
+bool etw_index_select(char const *index_path, etw_time_range_t const *range, char (*paths)[MAX_PATH], size_t max_paths, size_t *count, int64_t *base_time)
+{
+    index_file_t index;
+    char         dir[MAX_PATH];
+    size_t       dirlen = size_t(path_file_name(index_path) - index_path);
+    int64_t      start  = 0;
+    int64_t      end    = INT64_MAX;
+    uint32_t     tid    = 0;
+
+    *count = 0;
+    if (!index_load(index_path, &index))
+    {
+        return false;
+    }
+    if (range != NULL)
+    {
+        start = index.Header.BaseTime + int64_t(range->FromMs * TICKS_PER_MS);
+        end   = range->ToMs >= 0.0 ? index.Header.BaseTime + int64_t(range->ToMs * TICKS_PER_MS) : INT64_MAX;
+        tid   = range->ThreadId;
+    }
+    if (dirlen >= MAX_PATH) dirlen = MAX_PATH - 1;
+    memcpy(dir, index_path, dirlen);
+    dir[dirlen] = '\0';
+
+    for (uint32_t i = 0; i < index.Header.ChunkCount; ++i)
+    {
+        index_chunk_t const *chunk = &index.Chunks[i];
+        if (range != NULL && !chunk_overlaps(&index, chunk, start, end, tid))
+            continue;
+        if (*count == max_paths)
+        {
+            fprintf(stderr, "ERROR: More than %u chunks of \'%s\' overlap the requested range.\n", uint32_t(max_paths), index_path);
+            index_free(&index);
+            return false;
+        }
+        _snprintf(paths[*count], MAX_PATH, "%s%s", dir, chunk->Name);
+        paths[*count][MAX_PATH-1] = '\0';
+        (*count)++;
+    }
+    if (*count == 0)
+    {
+        fprintf(stderr, "ERROR: No chunks of \'%s\' overlap the requested range.\n", index_path);
+        index_free(&index);
+        return false;
+    }
+    *base_time = index.Header.BaseTime;
+    index_free(&index);
+    return true;
+}
+
+int cmd_index(int argc, char **argv)
+{
+    char        (*chunks)[MAX_PATH] = NULL;
+    char const   **inputs  = NULL;
+    char const    *outfile = NULL;
+    char const    *list    = NULL;
+    char const    *first   = NULL;
+    char           defpath[MAX_PATH];
+    size_t         nchunk  = 0;
+    int            result  = EXIT_FAILURE;
+
+    if ((chunks = (char(*)[MAX_PATH]) malloc(INDEX_MAX_CHUNKS * MAX_PATH)) == NULL ||
+        (inputs = (char const**)      malloc(INDEX_MAX_CHUNKS * sizeof(char const*))) == NULL)
+    {
+        fprintf(stderr, "ERROR: Unable to allocate chunk list.\n");
+        free(chunks);
+        return EXIT_FAILURE;
+    }
+    for (int i = 0; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+            outfile = argv[++i];
+        else if (strcmp(argv[i], "-list") == 0 && i + 1 < argc)
+            list = argv[++i];
+        else if (argv[i][0] != '-')
+        {
+            if (first == NULL) first = argv[i];
+            nchunk += etw_chunk_expand(argv[i], &chunks[nchunk], INDEX_MAX_CHUNKS - nchunk);
+        }
+        else
+        {
+            print_usage();
+            goto cleanup;
+        }
+    }
+    if (list != NULL)
+    {
+        index_file_t index;
+        if (index_load(list, &index))
+        {
+            print_index(&index, stdout);
+            index_free(&index);
+            result = EXIT_SUCCESS;
+        }
+        goto cleanup;
+    }
+    if (nchunk == 0)
+    {
+        fprintf(stderr, "ERROR: Missing argument INFILE, or no chunk files were found.\n\n");
+        print_usage();
+        goto cleanup;
+    }
+    if (outfile == NULL)
+    {   // replace the extension of the first input and drop any %d.
+        char *ext = NULL;
+        char *num = NULL;
+        strncpy(defpath, first, MAX_PATH - 1);
+        defpath[MAX_PATH-1] = '\0';
+        if ((num = strstr(defpath, "%d")) != NULL)
+        {
+            char *tail = num + 2;
+            if (num > defpath && (num[-1] == '_' || num[-1] == '-' || num[-1] == '.')) num--;
+            memmove(num, tail, strlen(tail) + 1);
+        }
+        if ((ext = strrchr(defpath, '.')) != NULL && ext > path_file_name(defpath)) *ext = '\0';
+        strncat(defpath, ".etwidx", MAX_PATH - strlen(defpath) - 1);
+        outfile = defpath;
+    }
+    for (size_t i = 0; i < nchunk; ++i)
+    {
+        inputs[i] = chunks[i];
+    }
+    if (etw_index_build(outfile, inputs, nchunk))
+    {
+        index_file_t index;
+        fprintf(stdout, "STATUS: Wrote index \'%s\'.\n", outfile);
+        if (index_load(outfile, &index))
+        {
+            print_index(&index, stdout);
+            index_free(&index);
+        }
+        result = EXIT_SUCCESS;
+    }
+
+cleanup:
+    free(inputs);
+    free(chunks);
+    return result;
+}
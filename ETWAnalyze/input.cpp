@@ -0,0 +1,443 @@
+/*/////////////////////////////////////////////////////////////////////////////
+/// @summary Implements the 'input' command, which matches each event logged by
+/// the USER_INPUT provider to the main-thread work that responded to it, and
+/// reports the distribution of input-to-completion latency for each type of
+/// input. This is the latency a user perceives between acting and seeing the
+/// result, including any work the handler hands off to other threads.
+/// @author Russell Klenk (contact@russellklenk.com)
+///////////////////////////////////////////////////////////////////////////80*/
+
+/*////////////////
+//   Includes   //
+////////////////*/
+#include "ETWAnalyze.h"
+
+/*/////////////////
+//   Constants   //
+/////////////////*/
+/// @summary Define the maximum number of input files accepted on the command line.
+#define INPUT_MAX_INPUTS     64
+
+/// @summary Define the maximum number of threads that may log input events.
+#define INPUT_MAX_THREADS    256
+
+/// @summary Define the maximum number of responses that may have an open scope on a
+/// single thread at the same time.
+#define INPUT_MAX_ACTIVE     16
+
+/// @summary Define the maximum number of flows issued by responses that may be awaiting
+/// ETW_FLOW_FINISH at the same time.
+#define INPUT_MAX_FLOWS      256
+
+/// @summary Define the value used to indicate that a thread has no pending response.
+#define INPUT_NO_RESPONSE    UINT32_MAX
+
+/// @summary Define the number of input types reported, one per etw_event_kind_e value
+/// from ETW_EVENT_MOUSE_DOWN through ETW_EVENT_KEY_DOWN.
+#define INPUT_TYPE_COUNT     5
+
+/*//////////////////
+//   Data Types   //
+//////////////////*/
+/// @summary A single input event.
+struct input_t
+{
+    int64_t      Timestamp;   /// The time at which the input was logged.
+    uint32_t     Type;        /// The input type, as an index from ETW_EVENT_MOUSE_DOWN.
+    uint32_t     Response;    /// The index of the response the input belongs to.
+};
+
+/// @summary The work done in response to one or more inputs logged on the same thread
+/// before that work began. A response completes when the scope it was bound to has
+/// closed and every flow issued on its behalf has finished.
+struct input_response_t
+{
+    uint32_t     Outstanding; /// The number of open scopes and unfinished flows.
+    bool         Bound;       /// true once a scope or flow has been attributed to the response.
+    bool         Cancelled;   /// true if a flow issued on behalf of the response was cancelled.
+    int64_t      End;         /// The time at which the last scope or flow completed.
+};
+
+/// @summary Per-thread state used to attribute scopes and flows to responses.
+struct input_thread_t
+{
+    uint32_t     ThreadId;    /// The operating system thread identifier.
+    uint32_t     Depth;       /// The number of open scopes on the thread.
+    uint32_t     Pending;     /// The response awaiting its first scope, or INPUT_NO_RESPONSE.
+    uint32_t     ActiveCount; /// The number of valid entries in Active.
+    uint32_t     Active[INPUT_MAX_ACTIVE]; /// Responses whose scope is open on the thread.
+    uint32_t     Level [INPUT_MAX_ACTIVE]; /// The scope depth at which each response's scope was entered.
+};
+
+/// @summary A flow issued on behalf of a response, awaiting ETW_FLOW_FINISH or ETW_FLOW_CANCEL.
+struct input_flow_t
+{
+    uint64_t     Id;          /// The flow identifier.
+    uint32_t     ProcessId;   /// The process that issued the flow.
+    uint32_t     Response;    /// The response waiting on the flow.
+};
+
+/// @summary The state built while processing the input files.
+struct input_state_t
+{
+    input_t          *Inputs;      /// The input events, in timestamp order.
+    uint32_t          InputCount;  /// The number of valid entries in Inputs.
+    uint32_t          InputCapacity; /// The number of entries allocated for Inputs.
+    input_response_t *Responses;   /// The responses, indexed by input_t::Response.
+    uint32_t          ResponseCount; /// The number of valid entries in Responses.
+    uint32_t          ResponseCapacity; /// The number of entries allocated for Responses.
+    input_thread_t    Threads[INPUT_MAX_THREADS]; /// State for each thread that logged input.
+    uint32_t          ThreadCount; /// The number of used entries in Threads.
+    input_flow_t      Flows[INPUT_MAX_FLOWS]; /// Flows issued on behalf of responses.
+    uint32_t          FlowCount;   /// The number of valid entries in Flows.
+    uint32_t          Overflow;    /// The number of scopes or flows not attributed because a table was full.
+    bool              OutOfMemory; /// true if an allocation failed while processing events.
+};
+
+/*///////////////////////
+//   Local Functions   //
+///////////////////////*/
+/// @summary Print usage information for the input command.
+static void print_usage(void)
+{
+    fprintf(stdout, "USAGE: etwanalyze.exe input [-budget MS] [-from MS] [-to MS] [-thread TID] INFILE [INFILE...]\n");
+    fprintf(stdout, "  Report the latency from each input event to the completion of the work\n");
+    fprintf(stdout, "  that responded to it, per input type. The response to an input is the next\n");
+    fprintf(stdout, "  main-thread scope entered on the thread that logged it, extended by any flow\n");
+    fprintf(stdout, "  issued on that thread, within that scope or before it, until the flow reports\n");
+    fprintf(stdout, "  ETW_FLOW_FINISH. Issue a flow right after logging an input to correlate it\n");
+    fprintf(stdout, "  explicitly with work completed elsewhere.\n");
+    fprintf(stdout, "  -budget: The latency above which a response is counted as slow (default 100).\n");
+    etw_range_usage(stdout);
+    fprintf(stdout, "\n");
+}
+
+/// @summary Find or insert the state for a thread.
+/// @param state The input command state.
+/// @param thread_id The operating system thread identifier.
+/// @param insert Specify true to create the entry if it does not exist.
+/// @return The thread state, or NULL.
+static input_thread_t* find_thread(input_state_t *state, uint32_t thread_id, bool insert)
+{
+    for (uint32_t i = 0; i < state->ThreadCount; ++i)
+    {
+        if (state->Threads[i].ThreadId == thread_id)
+            return &state->Threads[i];
+    }
+    if (insert && state->ThreadCount < INPUT_MAX_THREADS)
+    {
+        input_thread_t *thread = &state->Threads[state->ThreadCount++];
+        thread->ThreadId = thread_id;
+        thread->Pending  = INPUT_NO_RESPONSE;
+        return thread;
+    }
+    return NULL;
+}
+
+/// @summary Append an entry to a growable array, doubling its capacity as necessary.
+/// @param items The array. On return, may point to a new allocation.
+/// @param count The number of valid entries. Incremented on success.
+/// @param capacity The number of entries allocated. Updated if the array grows.
+/// @param size The size of a single entry, in bytes.
+/// @return The new entry, zero-initialized, or NULL if the array could not grow.
+static void* append_item(void **items, uint32_t *count, uint32_t *capacity, size_t size)
+{
+    if (*count == *capacity)
+    {
+        uint32_t newcap = *capacity ? *capacity * 2 : 1024;
+        void    *newbuf = realloc(*items, newcap * size);
+        if (newbuf == NULL)
+            return NULL;
+        *items    = newbuf;
+        *capacity = newcap;
+    }
+    uint8_t *item = (uint8_t*) *items + (*count)++ * size;
+    memset(item, 0, size);
+    return item;
+}
+
+/// @summary Record an input event, attaching it to the response pending on its thread.
+/// @param state The input command state.
+/// @param ev The decoded input event.
+static void record_input(input_state_t *state, etw_event_t const *ev)
+{
+    input_thread_t *thread = find_thread(state, ev->ThreadId, true);
+    input_t        *input  = NULL;
+    if (thread == NULL)
+    {
+        state->Overflow++;
+        return;
+    }
+    if (thread->Pending == INPUT_NO_RESPONSE)
+    {   // inputs logged before the next scope is entered share one response.
+        if (append_item((void**) &state->Responses, &state->ResponseCount, &state->ResponseCapacity, sizeof(input_response_t)) == NULL)
+        {
+            state->OutOfMemory = true;
+            return;
+        }
+        thread->Pending = state->ResponseCount - 1;
+    }
+    if ((input = (input_t*) append_item((void**) &state->Inputs, &state->InputCount, &state->InputCapacity, sizeof(input_t))) == NULL)
+    {
+        state->OutOfMemory = true;
+        return;
+    }
+    input->Timestamp = ev->Timestamp;
+    input->Type      = uint32_t(ev->Kind - ETW_EVENT_MOUSE_DOWN);
+    input->Response  = thread->Pending;
+}
+
+/// @summary Mark one scope or flow of a response as complete.
+/// @param state The input command state.
+/// @param index The index of the response.
+/// @param timestamp The time at which the scope or flow completed.
+static void complete_part(input_state_t *state, uint32_t index, int64_t timestamp)
+{
+    input_response_t *response = &state->Responses[index];
+    if (response->Outstanding > 0) response->Outstanding--;
+    if (timestamp > response->End) response->End = timestamp;
+}
+
+/// @summary Attribute a flow event to a response.
+/// @param state The input command state.
+/// @param ev The decoded ETW_EVENT_FLOW event.
+static void flow_phase(input_state_t *state, etw_event_t const *ev)
+{
+    if (ev->Value[0] == ETW_FLOW_ISSUE)
+    {   // bind the flow to the response pending on, or running on, the issuing thread.
+        input_thread_t *thread = find_thread(state, ev->ThreadId, false);
+        uint32_t        index  = INPUT_NO_RESPONSE;
+        if (thread == NULL)
+            return;
+        if (thread->Pending != INPUT_NO_RESPONSE)
+            index = thread->Pending;
+        else if (thread->ActiveCount > 0)
+            index = thread->Active[thread->ActiveCount-1];
+        else
+            return;
+        if (state->FlowCount == INPUT_MAX_FLOWS)
+        {
+            state->Overflow++;
+            return;
+        }
+        input_flow_t *flow = &state->Flows[state->FlowCount++];
+        flow->Id        = ev->Id;
+        flow->ProcessId = ev->ProcessId;
+        flow->Response  = index;
+        state->Responses[index].Outstanding++;
+        state->Responses[index].Bound = true;
+    }
+    else if (ev->Value[0] == ETW_FLOW_FINISH || ev->Value[0] == ETW_FLOW_CANCEL)
+    {
+        for (uint32_t i = 0; i < state->FlowCount; ++i)
+        {
+            input_flow_t *flow = &state->Flows[i];
+            if (flow->Id == ev->Id && flow->ProcessId == ev->ProcessId)
+            {   // the flow completed; swap-remove the entry.
+                if (ev->Value[0] == ETW_FLOW_CANCEL)
+                    state->Responses[flow->Response].Cancelled = true;
+                complete_part(state, flow->Response, ev->Timestamp);
+                *flow = state->Flows[--state->FlowCount];
+                return;
+            }
+        }
+    }
+}
+
+/// @summary Receives each decoded event and attributes scopes and flows to responses.
+/// @param ev The decoded event.
+/// @param context Pointer to the input_state_t.
+static void input_event(etw_event_t const *ev, void *context)
+{
+    input_state_t  *state  = (input_state_t*) context;
+    input_thread_t *thread = NULL;
+    if (ev->Source == ETW_SOURCE_INPUT)
+    {
+        if (ev->Kind >= ETW_EVENT_MOUSE_DOWN && ev->Kind <= ETW_EVENT_KEY_DOWN)
+            record_input(state, ev);
+        return;
+    }
+    if (ev->Kind == ETW_EVENT_FLOW)
+    {
+        flow_phase(state, ev);
+        return;
+    }
+    if (ev->Source != ETW_SOURCE_MAIN || (ev->Kind != ETW_EVENT_ENTER_SCOPE && ev->Kind != ETW_EVENT_LEAVE_SCOPE))
+    {
+        return;
+    }
+    if ((thread = find_thread(state, ev->ThreadId, false)) == NULL)
+    {   // only threads that have logged input are interesting.
+        return;
+    }
+    if (ev->Kind == ETW_EVENT_ENTER_SCOPE)
+    {
+        if (thread->Pending != INPUT_NO_RESPONSE)
+        {   // the first scope entered after the input is the one that handles it.
+            if (thread->ActiveCount < INPUT_MAX_ACTIVE)
+            {
+                state->Responses[thread->Pending].Outstanding++;
+                state->Responses[thread->Pending].Bound = true;
+                thread->Active[thread->ActiveCount] = thread->Pending;
+                thread->Level [thread->ActiveCount] = thread->Depth;
+                thread->ActiveCount++;
+            }
+            else state->Overflow++;
+            thread->Pending = INPUT_NO_RESPONSE;
+        }
+        thread->Depth++;
+    }
+    else
+    {
+        if (thread->Depth > 0) thread->Depth--;
+        while (thread->ActiveCount > 0 && thread->Level[thread->ActiveCount-1] >= thread->Depth)
+        {
+            thread->ActiveCount--;
+            complete_part(state, thread->Active[thread->ActiveCount], ev->Timestamp);
+        }
+    }
+}
+
+/// @summary Order floats ascending, for use with qsort.
+static int compare_float(void const *a, void const *b)
+{
+    float fa = *(float const*) a;
+    float fb = *(float const*) b;
+    return (fa > fb) - (fa < fb);
+}
+
+/// @summary Compute a percentile of a sorted sample list by linear interpolation.
+/// @param values The sorted samples.
+/// @param count The number of samples, which must be greater than zero.
+/// @param p The percentile, in [0, 1].
+/// @return The percentile value.
+static double percentile(float const *values, uint32_t count, double p)
+{
+    double   pos  = p * (count - 1);
+    uint32_t lo   = uint32_t(pos);
+    uint32_t hi   = lo + 1 < count ? lo + 1 : lo;
+    double   frac = pos - lo;
+    return values[lo] + (values[hi] - values[lo]) * frac;
+}
+
+/// @summary Print the latency distribution for each input type.
+/// @param state The input command state.
+/// @param budget_ms The latency above which a response is counted as slow.
+/// @param fp The output stream.
+/// @return true if the report was printed.
+static bool print_latency(input_state_t *state, double budget_ms, FILE *fp)
+{
+    static char const *TYPE_NAME[INPUT_TYPE_COUNT] = { "MouseDown", "MouseUp", "MouseMove", "MouseWheel", "KeyDown" };
+    float   *values = (float*) malloc((state->InputCount + 1) * sizeof(float));
+    if (values == NULL)
+    {
+        fprintf(stderr, "ERROR: Unable to allocate latency list.\n");
+        return false;
+    }
+    fprintf(fp, "%-12s %8s %9s %10s %10s %10s %10s %10s %7s\n", "Input", "Count", "Unmatched", "Mean (ms)",
+            "P50 (ms)", "P90 (ms)", "P99 (ms)", "Max (ms)", "Slow%");
+    for (uint32_t type = 0; type < INPUT_TYPE_COUNT; ++type)
+    {
+        uint32_t count     = 0;
+        uint32_t unmatched = 0;
+        uint32_t slow      = 0;
+        double   total     = 0.0;
+        for (uint32_t i = 0; i < state->InputCount; ++i)
+        {
+            input_t          const *input    = &state->Inputs[i];
+            input_response_t const *response = &state->Responses[input->Response];
+            if (input->Type != type)
+                continue;
+            if (!response->Bound || response->Outstanding > 0 || response->Cancelled || response->End < input->Timestamp)
+            {   // never handled, still running at the end of the trace, or abandoned.
+                unmatched++;
+                continue;
+            }
+            float ms = float(double(response->End - input->Timestamp) / TICKS_PER_MS);
+            values[count++] = ms;
+            total += ms;
+            if (ms > budget_ms) slow++;
+        }
+        if (count == 0 && unmatched == 0)
+            continue;
+        if (count == 0)
+        {
+            fprintf(fp, "%-12s %8u %9u %10s %10s %10s %10s %10s %7s\n", TYPE_NAME[type], 0U, unmatched, "-", "-", "-", "-", "-", "-");
+            continue;
+        }
+        qsort(values, count, sizeof(float), compare_float);
+        fprintf(fp, "%-12s %8u %9u %10.3f %10.3f %10.3f %10.3f %10.3f %6.1f%%\n", TYPE_NAME[type], count, unmatched,
+                total / count, percentile(values, count, 0.50), percentile(values, count, 0.90),
+                percentile(values, count, 0.99), values[count-1], (100.0 * slow) / count);
+    }
+    if (state->Overflow > 0)
+    {
+        fprintf(fp, "(%u scopes or flows not attributed; too many threads or open responses)\n", state->Overflow);
+    }
+    free(values);
+    return true;
+}
+
+/*///////////////////////
+//  Public Functions   //
+///////////////////////*/
+int cmd_input(int argc, char **argv)
+{
+    char const      *inputs[INPUT_MAX_INPUTS];
+    size_t           ninput  = 0;
+    double           budget  = 100.0;
+    input_state_t   *state   = NULL;
+    etw_time_range_t range   = { 0.0, -1.0, 0 };
+    int              result  = EXIT_FAILURE;
+
+    for (int i = 0; i < argc; ++i)
+    {
+        if (etw_range_option(argc, argv, &i, &range))
+            continue;
+        else if (strcmp(argv[i], "-budget") == 0 && i + 1 < argc)
+            budget = atof(argv[++i]);
+        else if (argv[i][0] != '-' && ninput < INPUT_MAX_INPUTS)
+            inputs[ninput++] = argv[i];
+        else
+        {
+            print_usage();
+            return EXIT_FAILURE;
+        }
+    }
+    if (ninput == 0)
+    {
+        fprintf(stderr, "ERROR: Missing argument INFILE.\n\n");
+        print_usage();
+        return EXIT_FAILURE;
+    }
+    if ((state = (input_state_t*) calloc(1, sizeof(input_state_t))) == NULL)
+    {
+        fprintf(stderr, "ERROR: Unable to allocate input state.\n");
+        return EXIT_FAILURE;
+    }
+    if (!etw_process_range(inputs, ninput, &range, input_event, state))
+    {
+        goto error_cleanup;
+    }
+    if (state->OutOfMemory)
+    {
+        fprintf(stderr, "ERROR: Ran out of memory recording input events.\n");
+        goto error_cleanup;
+    }
+    if (state->InputCount == 0)
+    {
+        fprintf(stdout, "No input events found. Log input with ETWMouseDown, ETWMouseUp and ETWKeyDown.\n");
+        result = EXIT_SUCCESS;
+        goto error_cleanup;
+    }
+    if (print_latency(state, budget, stdout))
+    {
+        result = EXIT_SUCCESS;
+    }
+
+error_cleanup:
+    free(state->Responses);
+    free(state->Inputs);
+    free(state);
+    return result;
+}
@@ -0,0 +1,301 @@
+/*/////////////////////////////////////////////////////////////////////////////
+/// @summary Implements the 'launch' command, which starts a program with the
+/// provider DLL injected and its file I/O hooks installed, so that the opens,
+/// reads and mapped views of an uninstrumented program are reported to the
+/// ETW.FILE_IO provider. The program is created suspended, the DLL is loaded
+/// into it on a remote thread, ETWInjectMain is run on a second remote thread,
+/// and the program is then resumed.
+/// @author Russell Klenk (contact@russellklenk.com)
+///////////////////////////////////////////////////////////////////////////80*/
+
+/*////////////////
+//   Includes   //
+////////////////*/
+#include "ETWAnalyze.h"
+#include <TlHelp32.h>
+
+/*/////////////////
+//   Constants   //
+/////////////////*/
+/// @summary Define the maximum length of the command line of the launched program.
+#define LAUNCH_MAX_COMMAND   32768
+
+/// @summary Define the time allowed for each remote thread to complete, in milliseconds.
+#define LAUNCH_REMOTE_TIMEOUT 30000
+
+/*///////////////////////
+//   Local Functions   //
+///////////////////////*/
+/// @summary Print usage information for the launch command.
+static void print_usage(void)
+{
+    fprintf(stdout, "USAGE: etwanalyze.exe launch [-dll PATH] [-nowait] PROGRAM [ARGS...]\n");
+    fprintf(stdout, "  Start PROGRAM with ETWProvider.dll injected and its file I/O hooks installed,\n");
+    fprintf(stdout, "  so that CreateFile, ReadFile, CreateFileMapping, MapViewOfFile, UnmapViewOfFile\n");
+    fprintf(stdout, "  and PrefetchVirtualMemory calls are logged by the ETW.FILE_IO provider. Start a\n");
+    fprintf(stdout, "  session with 'etwanalyze record' first, and analyze it with 'etwanalyze fileio'.\n");
+    fprintf(stdout, "  PROGRAM must have the same architecture as etwanalyze.exe. Modules the program\n");
+    fprintf(stdout, "  loads after it starts, and functions it resolves with GetProcAddress, are not hooked.\n");
+    fprintf(stdout, "  -dll   : The path of ETWProvider.dll (default: next to etwanalyze.exe).\n");
+    fprintf(stdout, "  -nowait: Return once the program is running, rather than when it exits.\n");
+    fprintf(stdout, "\n");
+}
+
+/// @summary Append an argument to a command line, quoting it according to the rules used
+/// by CommandLineToArgvW and the C runtime.
+/// @param cmd The command line buffer.
+/// @param len On input, the current length of the command line. On output, the new length.
+/// @param max The size of the command line buffer, in characters.
+/// @param arg The argument to append.
+/// @return true if the argument fit in the buffer.
+static bool append_argument(char *cmd, size_t *len, size_t max, char const *arg)
+{
+    size_t n = *len;
+    if (n > 0 && n + 1 < max)
+        cmd[n++] = ' ';
+    if (n + 1 >= max)
+        return false;
+    cmd[n++] = '"';
+    for (char const *p = arg; ; ++p)
+    {   // backslashes are literal unless they precede a quote.
+        size_t slashes = 0;
+        while (*p == '\\')
+        {
+            slashes++;
+            p++;
+        }
+        size_t const count = (*p == '\0') ? slashes * 2 : (*p == '"' ? slashes * 2 + 1 : slashes);
+        if (n + count + 2 >= max)
+            return false;
+        for (size_t i = 0; i < count; ++i)
+            cmd[n++] = '\\';
+        if (*p == '\0')
+            break;
+        cmd[n++] = *p;
+    }
+    cmd[n++] = '"';
+    cmd[n]   = '\0';
+    *len     = n;
+    return true;
+}
+
+/// @summary Run a function in another process on a new thread, and wait for it to return.
+/// @param process The target process, opened with PROCESS_CREATE_THREAD access.
+/// @param start The address of the function in the target process.
+/// @param argp The argument passed to the function.
+/// @param exit_code On return, the value returned by the function.
+/// @return true if the thread ran to completion.
+static bool run_remote(HANDLE process, void *start, void *argp, DWORD *exit_code)
+{
+    HANDLE thread = CreateRemoteThread(process, NULL, 0, (LPTHREAD_START_ROUTINE) start, argp, 0, NULL);
+    if (thread == NULL)
+    {
+        fprintf(stderr, "ERROR: Unable to create remote thread: 0x%08X.\n", GetLastError());
+        return false;
+    }
+    if (WaitForSingleObject(thread, LAUNCH_REMOTE_TIMEOUT) != WAIT_OBJECT_0)
+    {
+        fprintf(stderr, "ERROR: Remote thread did not complete.\n");
+        CloseHandle(thread);
+        return false;
+    }
+    GetExitCodeThread(thread, exit_code);
+    CloseHandle(thread);
+    return true;
+}
+
+/// @summary Find the base address of a module loaded in another process.
+/// @param process_id The identifier of the target process.
+/// @param dll_path The path of the module.
+/// @return The base address of the module in the target process, or NULL.
+static BYTE* find_remote_module(DWORD process_id, char const *dll_path)
+{
+    MODULEENTRY32W entry;
+    WCHAR          name[MAX_PATH];
+    char const    *base_name = dll_path;
+    BYTE          *result    = NULL;
+    HANDLE         snapshot  = INVALID_HANDLE_VALUE;
+
+    for (char const *p = dll_path; *p; ++p)
+    {
+        if (*p == '\\' || *p == '/')
+            base_name = p + 1;
+    }
+    if (MultiByteToWideChar(CP_ACP, 0, base_name, -1, name, MAX_PATH) == 0)
+        return NULL;
+    if ((snapshot = CreateToolhelp32Snapshot(TH32CS_SNAPMODULE, process_id)) == INVALID_HANDLE_VALUE)
+    {
+        fprintf(stderr, "ERROR: Unable to enumerate modules: 0x%08X.\n", GetLastError());
+        return NULL;
+    }
+    entry.dwSize = sizeof(entry);
+    for (BOOL ok = Module32FirstW(snapshot, &entry); ok; ok = Module32NextW(snapshot, &entry))
+    {
+        if (_wcsicmp(entry.szModule, name) == 0)
+        {
+            result = entry.modBaseAddr;
+            break;
+        }
+    }
+    CloseHandle(snapshot);
+    return result;
+}
+
+/*///////////////////////
+//  Public Functions   //
+///////////////////////*/
+int cmd_launch(int argc, char **argv)
+{
+    STARTUPINFOA        si;
+    PROCESS_INFORMATION pi;
+    char                dll_path[MAX_PATH];
+    char const         *dll_arg  = NULL;
+    char               *command  = NULL;
+    size_t              cmdlen   = 0;
+    bool                wait     = true;
+    bool                resumed  = false;
+    int                 first    = -1;
+    HMODULE             local    = NULL;
+    BYTE               *remote   = NULL;
+    void               *path_mem = NULL;
+    void               *load_fn  = NULL;
+    size_t              inject   = 0;
+    DWORD               exitcode = 0;
+    int                 result   = EXIT_FAILURE;
+
+    ZeroMemory(&pi, sizeof(pi));
+    for (int i = 0; i < argc && first < 0; ++i)
+    {
+        if (strcmp(argv[i], "-dll") == 0 && i + 1 < argc)
+            dll_arg = argv[++i];
+        else if (strcmp(argv[i], "-nowait") == 0)
+            wait = false;
+        else if (argv[i][0] != '-')
+            first = i;
+        else
+        {
+            print_usage();
+            return EXIT_FAILURE;
+        }
+    }
+    if (first < 0)
+    {
+        fprintf(stderr, "ERROR: Missing argument PROGRAM.\n\n");
+        print_usage();
+        return EXIT_FAILURE;
+    }
+    if (dll_arg != NULL)
+    {
+        if (GetFullPathNameA(dll_arg, MAX_PATH, dll_path, NULL) == 0)
+        {
+            fprintf(stderr, "ERROR: Invalid DLL path \'%s\'.\n", dll_arg);
+            return EXIT_FAILURE;
+        }
+    }
+    else
+    {   // default to the provider DLL installed alongside the analyzer.
+        DWORD len = GetModuleFileNameA(NULL, dll_path, MAX_PATH);
+        while (len > 0 && dll_path[len-1] != '\\' && dll_path[len-1] != '/')
+            len--;
+        if (len == 0 || len + sizeof("ETWProvider.dll") > MAX_PATH)
+        {
+            fprintf(stderr, "ERROR: Unable to locate ETWProvider.dll; use -dll.\n");
+            return EXIT_FAILURE;
+        }
+        strcpy(dll_path + len, "ETWProvider.dll");
+    }
+
+    // resolve the offset of ETWInjectMain within the DLL by loading it locally.
+    if ((local = LoadLibraryA(dll_path)) == NULL)
+    {
+        fprintf(stderr, "ERROR: Unable to load \'%s\': 0x%08X.\n", dll_path, GetLastError());
+        return EXIT_FAILURE;
+    }
+    if ((load_fn = (void*) GetProcAddress(local, "ETWInjectMain")) == NULL)
+    {
+        fprintf(stderr, "ERROR: \'%s\' does not export ETWInjectMain.\n", dll_path);
+        goto error_cleanup;
+    }
+    inject  = (BYTE*) load_fn - (BYTE*) local;
+    // kernel32.dll is mapped at the same address in every process of the same architecture.
+    load_fn = (void*) GetProcAddress(GetModuleHandleA("kernel32.dll"), "LoadLibraryA");
+
+    if ((command = (char*) malloc(LAUNCH_MAX_COMMAND)) == NULL)
+    {
+        fprintf(stderr, "ERROR: Unable to allocate command line.\n");
+        goto error_cleanup;
+    }
+    command[0] = '\0';
+    for (int i = first; i < argc; ++i)
+    {
+        if (!append_argument(command, &cmdlen, LAUNCH_MAX_COMMAND, argv[i]))
+        {
+            fprintf(stderr, "ERROR: Command line is too long.\n");
+            goto error_cleanup;
+        }
+    }
+
+    ZeroMemory(&si, sizeof(si));
+    si.cb = sizeof(si);
+    if (!CreateProcessA(NULL, command, NULL, NULL, FALSE, CREATE_SUSPENDED, NULL, NULL, &si, &pi))
+    {
+        fprintf(stderr, "ERROR: Unable to start \'%s\': 0x%08X.\n", argv[first], GetLastError());
+        goto error_cleanup;
+    }
+
+    // load the DLL into the target. the remote thread also initializes the process,
+    // so the program's static imports are bound before the hooks are installed.
+    if ((path_mem = VirtualAllocEx(pi.hProcess, NULL, MAX_PATH, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE)) == NULL)
+    {
+        fprintf(stderr, "ERROR: Unable to allocate memory in the target process: 0x%08X.\n", GetLastError());
+        goto error_cleanup;
+    }
+    if (!WriteProcessMemory(pi.hProcess, path_mem, dll_path, strlen(dll_path) + 1, NULL))
+    {
+        fprintf(stderr, "ERROR: Unable to write to the target process: 0x%08X.\n", GetLastError());
+        goto error_cleanup;
+    }
+    if (!run_remote(pi.hProcess, load_fn, path_mem, &exitcode) || exitcode == 0)
+    {
+        fprintf(stderr, "ERROR: Unable to load \'%s\' into the target process.\n", dll_path);
+        goto error_cleanup;
+    }
+    if ((remote = find_remote_module(pi.dwProcessId, dll_path)) == NULL)
+    {
+        fprintf(stderr, "ERROR: Unable to find \'%s\' in the target process.\n", dll_path);
+        goto error_cleanup;
+    }
+    if (!run_remote(pi.hProcess, remote + inject, NULL, &exitcode))
+    {
+        goto error_cleanup;
+    }
+    fprintf(stdout, "Started process %u with %u file I/O imports hooked.\n", pi.dwProcessId, exitcode);
+    if (exitcode == 0)
+    {
+        fprintf(stdout, "WARNING: No imports were hooked; the program may resolve them dynamically.\n");
+    }
+    ResumeThread(pi.hThread);
+    resumed = true;
+    result  = EXIT_SUCCESS;
+    if (wait)
+    {   // forward the program's exit code.
+        WaitForSingleObject(pi.hProcess, INFINITE);
+        GetExitCodeProcess(pi.hProcess, &exitcode);
+        result = (int) exitcode;
+    }
+
+error_cleanup:
+    if (pi.hProcess != NULL && !resumed)
+    {   // don't leave a suspended process behind.
+        TerminateProcess(pi.hProcess, EXIT_FAILURE);
+    }
+    else if (path_mem != NULL && !wait)
+    {
+        VirtualFreeEx(pi.hProcess, path_mem, 0, MEM_RELEASE);
+    }
+    if (pi.hThread  != NULL) CloseHandle(pi.hThread);
+    if (pi.hProcess != NULL) CloseHandle(pi.hProcess);
+    if (local != NULL) FreeLibrary(local);
+    free(command);
+    return result;
+}
@@ -0,0 +1,316 @@
+/*/////////////////////////////////////////////////////////////////////////////
+/// @summary Implements the 'live' command, which starts a real-time session
+/// and periodically prints scope timings and event loss while the instrumented
+/// process is running.
+/// @author Russell Klenk (contact@russellklenk.com)
+///////////////////////////////////////////////////////////////////////////80*/
+
+/*////////////////
+//   Includes   //
+////////////////*/
+#include "ETWAnalyze.h"
+
+/*/////////////////
+//   Constants   //
+/////////////////*/
+/// @summary The name of the real-time session started by the live command.
+#define LIVE_SESSION_NAME    "ETWAnalyze-Live"
+
+/// @summary Define the maximum number of distinct scope names tracked per interval.
+/// This value must be a power of two greater than zero.
+#define LIVE_MAX_SCOPES      256
+
+/// @summary Define the maximum length of a tracked scope name, including the NULL.
+#define LIVE_MAX_NAME        64
+
+/*//////////////////
+//   Data Types   //
+//////////////////*/
+/// @summary Timing statistics for a single scope name over the current interval.
+struct live_scope_t
+{
+    char         Name[LIVE_MAX_NAME]; /// The scope description.
+    uint32_t     Source;      /// One of etw_source_e.
+    uint32_t     Count;       /// The number of scope instances that completed.
+    double       TotalMs;     /// The sum of all scope durations, in milliseconds.
+    float        MaxMs;       /// The longest scope duration, in milliseconds.
+    uint32_t     CpuCount;    /// The number of instances for which on-CPU time was measured.
+    double       OnCpuMs;     /// The sum of the measured on-CPU times, in milliseconds.
+};
+
+/// @summary State shared between the consumer thread and the reporting thread.
+struct live_state_t
+{
+    CRITICAL_SECTION Lock;    /// Protects all fields below.
+    live_scope_t Scopes[LIVE_MAX_SCOPES]; /// Open-addressed table of scope statistics.
+    uint32_t     ScopeCount;  /// The number of used entries in Scopes.
+    uint32_t     Overflow;    /// The number of scopes dropped because the table was full.
+    uint64_t     Events;      /// The number of events received this interval.
+    uint64_t     Dropped;     /// The number of events the providers reported dropping this interval.
+    bool         Verbose;     /// If true, print each scope as it completes.
+    etw_tree_t  *Tree;        /// The call tree updated as events arrive, or NULL.
+    char const  *Session;     /// The name of the real-time session consumed.
+};
+
+/*///////////////
+//   Globals   //
+///////////////*/
+/// @summary Manual-reset event signaled when the user presses Ctrl+C.
+static HANDLE LIVE_EXIT_SIGNAL = NULL;
+
+/*///////////////////////
+//   Local Functions   //
+///////////////////////*/
+/// @summary Print usage information for the live command.
+static void print_usage(void)
+{
+    fprintf(stdout, "USAGE: etwanalyze.exe live [-name NAME] [-keywords MASK] [-level N] [-providers LIST] [-interval MS] [-tree] [-v]\n");
+    fprintf(stdout, "  Stream events from the custom providers and print scope timings.\n");
+    etw_session_usage(stdout, LIVE_SESSION_NAME);
+    fprintf(stdout, "  -interval:   The reporting interval, in milliseconds (default 1000).\n");
+    fprintf(stdout, "  -tree:       Print the call tree for each interval instead of flat timings.\n");
+    fprintf(stdout, "  -v:          Print every scope as it completes.\n");
+    fprintf(stdout, "\n");
+}
+
+/// @summary Console control handler; requests a clean shutdown on Ctrl+C or Ctrl+Break.
+static BOOL WINAPI console_handler(DWORD ctrl_type)
+{
+    UNUSED_ARG(ctrl_type);
+    SetEvent(LIVE_EXIT_SIGNAL);
+    return TRUE;
+}
+
+/// @summary Compute the FNV-1a hash of a NULL-terminated string.
+/// @param str The string to hash.
+/// @return The 32-bit hash value.
+static uint32_t hash_string(char const *str)
+{
+    uint32_t h = 2166136261U;
+    while (*str)
+    {
+        h ^= (uint8_t) *str++;
+        h *= 16777619U;
+    }
+    return h;
+}
+
+/// @summary Find or insert the statistics entry for a scope name.
+/// The caller must hold state->Lock.
+/// @param state The live command state.
+/// @param name The scope description.
+/// @param source One of etw_source_e.
+/// @return The entry, or NULL if the table is full.
+static live_scope_t* find_scope(live_state_t *state, char const *name, uint32_t source)
+{
+    uint32_t mask  = LIVE_MAX_SCOPES - 1;
+    uint32_t index = (hash_string(name) + source) & mask;
+    for (uint32_t i = 0; i < LIVE_MAX_SCOPES; ++i, index = (index + 1) & mask)
+    {
+        live_scope_t *scope = &state->Scopes[index];
+        if (scope->Name[0] == '\0')
+        {
+            if (state->ScopeCount == LIVE_MAX_SCOPES - 1)
+                return NULL;   // keep one slot free so lookups terminate.
+            strncpy(scope->Name, name, LIVE_MAX_NAME - 1);
+            scope->Name[LIVE_MAX_NAME-1] = '\0';
+            scope->Source = source;
+            state->ScopeCount++;
+            return scope;
+        }
+        if (scope->Source == source && strncmp(scope->Name, name, LIVE_MAX_NAME - 1) == 0)
+        {
+            return scope;
+        }
+    }
+    return NULL;
+}
+
+/// @summary Receives each decoded event on the consumer thread.
+/// @param ev The decoded event.
+/// @param context Pointer to the live_state_t.
+static void live_event(etw_event_t const *ev, void *context)
+{
+    live_state_t *state = (live_state_t*) context;
+    EnterCriticalSection(&state->Lock);
+    state->Events++;
+    if (state->Tree != NULL)
+    {
+        etw_tree_event(state->Tree, ev);
+    }
+    if (ev->Kind == ETW_EVENT_EVENTS_LOST)
+    {
+        state->Dropped += (uint32_t) ev->Value[1];
+    }
+    else if (ev->Kind == ETW_EVENT_LEAVE_SCOPE)
+    {
+        live_scope_t *scope = find_scope(state, ev->Text, ev->Source);
+        if (scope != NULL)
+        {
+            scope->Count++;
+            scope->TotalMs += ev->Duration;
+            if (ev->Duration > scope->MaxMs) scope->MaxMs = ev->Duration;
+            if (ev->OnCpu >= 0.0f)
+            {
+                scope->CpuCount++;
+                scope->OnCpuMs += ev->OnCpu;
+            }
+        }
+        else state->Overflow++;
+        if (state->Verbose)
+        {
+            fprintf(stdout, "[%5u] %*s%s %.3f ms\n", ev->ThreadId, int(ev->Depth * 2), "", ev->Text, ev->Duration);
+        }
+    }
+    else if (ev->Kind == ETW_EVENT_MARKER && state->Verbose)
+    {
+        fprintf(stdout, "[%5u] -- %s\n", ev->ThreadId, ev->Text);
+    }
+    LeaveCriticalSection(&state->Lock);
+}
+
+/// @summary Entry point of the consumer thread. Returns when the session is stopped.
+/// @param arg Pointer to the live_state_t.
+/// @return Zero if the session was consumed successfully.
+static DWORD WINAPI consumer_thread(void *arg)
+{
+    live_state_t *state = (live_state_t*) arg;
+    return etw_process_realtime(state->Session, live_event, arg) ? 0 : 1;
+}
+
+/// @summary Print the statistics gathered over the last interval, and reset them.
+/// @param state The live command state.
+/// @param stats The session statistics queried at the end of the interval.
+/// @param prev The session statistics queried at the end of the previous interval.
+static void report_interval(live_state_t *state, etw_session_stats_t const &stats, etw_session_stats_t const &prev)
+{
+    static char const *SOURCE_NAME[ETW_SOURCE_COUNT] = { "MAIN", "TASK", "INPUT", "SYNC", "FILEIO" };
+    EnterCriticalSection(&state->Lock);
+    fprintf(stdout, "---- %I64u events, %u events lost, %u buffers lost, %I64u dropped by providers, %u/%u buffers free\n",
+            state->Events, stats.EventsLost - prev.EventsLost, stats.BuffersLost - prev.BuffersLost,
+            state->Dropped, stats.FreeBuffers, stats.Buffers);
+    for (uint32_t i = 0; i < LIVE_MAX_SCOPES && state->Tree == NULL; ++i)
+    {
+        live_scope_t const *scope = &state->Scopes[i];
+        if (scope->Name[0] != '\0' && scope->Count > 0)
+        {
+            fprintf(stdout, "%-5s %-40s %8u calls %10.3f ms avg %10.3f ms max", SOURCE_NAME[scope->Source],
+                    scope->Name, scope->Count, scope->TotalMs / scope->Count, scope->MaxMs);
+            if (scope->CpuCount > 0)
+                fprintf(stdout, " %10.3f ms on-cpu\n", scope->OnCpuMs / scope->CpuCount);
+            else
+                fprintf(stdout, "\n");
+        }
+    }
+    if (state->Overflow > 0)
+    {
+        fprintf(stdout, "(%u scopes not shown; too many distinct names)\n", state->Overflow);
+    }
+    if (state->Tree != NULL)
+    {   // scopes still open at the end of the interval are attributed to the next.
+        etw_tree_print(state->Tree, stdout, 0.0);
+        etw_tree_reset(state->Tree);
+    }
+    memset(state->Scopes, 0, sizeof(state->Scopes));
+    state->ScopeCount = 0;
+    state->Overflow   = 0;
+    state->Events     = 0;
+    state->Dropped    = 0;
+    LeaveCriticalSection(&state->Lock);
+}
+
+/*///////////////////////
+//  Public Functions   //
+///////////////////////*/
+int cmd_live(int argc, char **argv)
+{
+    etw_session_config_t config;
+    etw_session_t        session;
+    etw_session_stats_t  stats    = { 0 };
+    etw_session_stats_t  prev     = { 0 };
+    live_state_t        *state    = NULL;
+    HANDLE               consumer = NULL;
+    DWORD                interval = 1000;
+    bool                 verbose  = false;
+    bool                 calltree = false;
+
+    // small buffers flushed every second keep latency low. when the consumer
+    // falls behind, ETW drops whole buffers rather than stalling the writers.
+    memset(&config, 0, sizeof(config));
+    config.SessionName = LIVE_SESSION_NAME;
+    config.LogFile     = NULL;
+    config.BufferSize  = 64;
+    config.PerCpuBuffers = 4;
+    config.FlushTimer  = 1;
+    config.Level       = TRACE_LEVEL_VERBOSE;
+    config.Keywords    = ~0ULL;
+
+    for (int i = 0; i < argc; ++i)
+    {
+        if (etw_session_option(argc, argv, &i, &config))
+            continue;
+        else if (strcmp(argv[i], "-interval") == 0 && i + 1 < argc)
+            interval = strtoul(argv[++i], NULL, 0);
+        else if (strcmp(argv[i], "-tree") == 0)
+            calltree = true;
+        else if (strcmp(argv[i], "-v") == 0)
+            verbose  = true;
+        else
+        {
+            print_usage();
+            return EXIT_FAILURE;
+        }
+    }
+
+    if ((state = (live_state_t*) calloc(1, sizeof(live_state_t))) == NULL)
+    {
+        fprintf(stderr, "ERROR: Unable to allocate live view state.\n");
+        return EXIT_FAILURE;
+    }
+    if (calltree && (state->Tree = etw_tree_create()) == NULL)
+    {
+        fprintf(stderr, "ERROR: Unable to allocate call tree.\n");
+        free(state);
+        return EXIT_FAILURE;
+    }
+    InitializeCriticalSection(&state->Lock);
+    state->Verbose     = verbose;
+    state->Session     = config.SessionName;
+
+    LIVE_EXIT_SIGNAL = CreateEvent(NULL, TRUE, FALSE, NULL);
+    SetConsoleCtrlHandler(console_handler, TRUE);
+    if (!etw_session_start(&config, &session))
+    {
+        goto cleanup;
+    }
+    if ((consumer = CreateThread(NULL, 0, consumer_thread, state, 0, NULL)) == NULL)
+    {
+        fprintf(stderr, "ERROR: Unable to create consumer thread: 0x%08X.\n", GetLastError());
+        etw_session_stop(&session, NULL);
+        goto cleanup;
+    }
+
+    fprintf(stdout, "STATUS: Streaming from session \'%s\'. Press Ctrl+C to stop.\n", session.Name);
+    while (WaitForSingleObject(LIVE_EXIT_SIGNAL, interval) == WAIT_TIMEOUT)
+    {
+        if (etw_session_query(&session, &stats))
+        {
+            report_interval(state, stats, prev);
+            prev = stats;
+        }
+    }
+
+    // stopping the session causes ProcessTrace to return on the consumer thread.
+    etw_session_stop(&session, &stats);
+    WaitForSingleObject(consumer, INFINITE);
+    CloseHandle(consumer);
+    fprintf(stdout, "STATUS: Session stopped. %u events lost, %u buffers lost.\n", stats.EventsLost, stats.BuffersLost);
+
+cleanup:
+    SetConsoleCtrlHandler(console_handler, FALSE);
+    CloseHandle(LIVE_EXIT_SIGNAL);
+    DeleteCriticalSection(&state->Lock);
+    etw_tree_delete(state->Tree);
+    free(state);
+    return (consumer != NULL) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
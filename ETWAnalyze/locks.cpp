@@ -0,0 +1,280 @@
+/*/////////////////////////////////////////////////////////////////////////////
+/// @summary Implements the 'locks' command, which summarizes the contended
+/// waits recorded by the SYNC provider in one or more .etl files and prints
+/// a wait-time histogram for each lock.
+/// @author Russell Klenk (contact@russellklenk.com)
+///////////////////////////////////////////////////////////////////////////80*/
+
+/*////////////////
+//   Includes   //
+////////////////*/
+#include "ETWAnalyze.h"
+
+/*/////////////////
+//   Constants   //
+/////////////////*/
+/// @summary Define the maximum number of input files accepted on the command line.
+#define LOCKS_MAX_INPUTS     64
+
+/// @summary Define the maximum number of distinct locks tracked.
+/// This value must be a power of two greater than zero.
+#define LOCKS_MAX_LOCKS      1024
+
+/// @summary Define the maximum length of a tracked lock name, including the NULL.
+#define LOCKS_MAX_NAME       64
+
+/// @summary Define the number of histogram buckets. Bucket i counts waits of
+/// [2^i, 2^(i+1)) microseconds; the first and last buckets are open-ended.
+#define LOCKS_BUCKET_COUNT   24
+
+/// @summary Define the width of the widest histogram bar, in characters.
+#define LOCKS_BAR_WIDTH      40
+
+/*//////////////////
+//   Data Types   //
+//////////////////*/
+/// @summary Wait statistics for a single named synchronization object.
+struct lock_stats_t
+{
+    char         Name[LOCKS_MAX_NAME]; /// The lock name passed to ETWWaitBegin.
+    uint64_t     Object;      /// The address or handle of the synchronization object.
+    uint32_t     Count;       /// The number of contended waits.
+    uint32_t     Timeouts;    /// The number of waits that returned WAIT_TIMEOUT.
+    double       TotalMs;     /// The sum of all wait times, in milliseconds.
+    double       MaxMs;       /// The longest wait time, in milliseconds.
+    uint32_t     Histogram[LOCKS_BUCKET_COUNT]; /// The number of waits in each log2 bucket.
+};
+
+/// @summary The table of lock statistics built while processing the input files.
+struct locks_state_t
+{
+    lock_stats_t Locks[LOCKS_MAX_LOCKS]; /// Open-addressed table of lock statistics.
+    uint32_t     LockCount;   /// The number of used entries in Locks.
+    uint32_t     Overflow;    /// The number of waits dropped because the table was full.
+};
+
+/*///////////////////////
+//   Local Functions   //
+///////////////////////*/
+/// @summary Print usage information for the locks command.
+static void print_usage(void)
+{
+    fprintf(stdout, "USAGE: etwanalyze.exe locks [-nohist] [-from MS] [-to MS] [-thread TID] INFILE [INFILE...]\n");
+    fprintf(stdout, "  Summarize contended lock acquisitions and blocking waits.\n");
+    fprintf(stdout, "  -nohist: Do not print the wait-time histogram for each lock.\n");
+    etw_range_usage(stdout);
+    fprintf(stdout, "\n");
+}
+
+/// @summary Compute the FNV-1a hash of a NULL-terminated string and an object identifier.
+/// @param str The string to hash.
+/// @param object The object identifier to hash.
+/// @return The 32-bit hash value.
+static uint32_t hash_lock(char const *str, uint64_t object)
+{
+    uint32_t h = 2166136261U;
+    while (*str)
+    {
+        h ^= (uint8_t) *str++;
+        h *= 16777619U;
+    }
+    for (int i = 0; i < 8; ++i, object >>= 8)
+    {
+        h ^= (uint8_t) object;
+        h *= 16777619U;
+    }
+    return h;
+}
+
+/// @summary Find or insert the statistics entry for a lock.
+/// @param state The locks command state.
+/// @param name The lock name.
+/// @param object The address or handle of the synchronization object.
+/// @return The entry, or NULL if the table is full.
+static lock_stats_t* find_lock(locks_state_t *state, char const *name, uint64_t object)
+{
+    uint32_t mask  = LOCKS_MAX_LOCKS - 1;
+    uint32_t index = hash_lock(name, object) & mask;
+    for (uint32_t i = 0; i < LOCKS_MAX_LOCKS; ++i, index = (index + 1) & mask)
+    {
+        lock_stats_t *lock = &state->Locks[index];
+        if (lock->Name[0] == '\0')
+        {
+            if (state->LockCount == LOCKS_MAX_LOCKS - 1)
+                return NULL;   // keep one slot free so lookups terminate.
+            strncpy(lock->Name, name[0] ? name : "(unnamed)", LOCKS_MAX_NAME - 1);
+            lock->Name[LOCKS_MAX_NAME-1] = '\0';
+            lock->Object = object;
+            state->LockCount++;
+            return lock;
+        }
+        if (lock->Object == object && strncmp(lock->Name, name[0] ? name : "(unnamed)", LOCKS_MAX_NAME - 1) == 0)
+        {
+            return lock;
+        }
+    }
+    return NULL;
+}
+
+/// @summary Compute the histogram bucket for a wait time.
+/// @param ms The wait time, in milliseconds.
+/// @return The bucket index, in [0, LOCKS_BUCKET_COUNT).
+static uint32_t wait_bucket(float ms)
+{
+    uint64_t us     = (uint64_t) (ms * 1000.0f);
+    uint32_t bucket = 0;
+    while (us > 1 && bucket < LOCKS_BUCKET_COUNT - 1)
+    {
+        us >>= 1;
+        bucket++;
+    }
+    return bucket;
+}
+
+/// @summary Receives each decoded event and accumulates wait statistics.
+/// @param ev The decoded event.
+/// @param context Pointer to the locks_state_t.
+static void locks_event(etw_event_t const *ev, void *context)
+{
+    locks_state_t *state = (locks_state_t*) context;
+    lock_stats_t  *lock  = NULL;
+    if (ev->Kind != ETW_EVENT_WAIT_END)
+    {
+        return;
+    }
+    if ((lock = find_lock(state, ev->Text, ev->Id)) == NULL)
+    {
+        state->Overflow++;
+        return;
+    }
+    lock->Count++;
+    lock->TotalMs += ev->Duration;
+    if (ev->Duration > lock->MaxMs) lock->MaxMs = ev->Duration;
+    if (ev->Value[0] == WAIT_TIMEOUT) lock->Timeouts++;
+    lock->Histogram[wait_bucket(ev->Duration)]++;
+}
+
+/// @summary Order lock statistics by descending total wait time, for use with qsort.
+static int compare_total(void const *a, void const *b)
+{
+    lock_stats_t const *la = *(lock_stats_t const**) a;
+    lock_stats_t const *lb = *(lock_stats_t const**) b;
+    if (la->TotalMs > lb->TotalMs) return -1;
+    if (la->TotalMs < lb->TotalMs) return +1;
+    return 0;
+}
+
+/// @summary Format a duration given in microseconds as a short human-readable string.
+/// @param buf The destination buffer.
+/// @param size The size of the destination buffer, in bytes.
+/// @param us The duration, in microseconds.
+static void format_us(char *buf, size_t size, uint64_t us)
+{
+    if (us >= 1000000) _snprintf(buf, size, "%I64us" , us / 1000000);
+    else if (us >= 1000) _snprintf(buf, size, "%I64ums", us / 1000);
+    else _snprintf(buf, size, "%I64uus", us);
+    buf[size-1] = '\0';
+}
+
+/// @summary Print the wait-time histogram for a lock.
+/// @param lock The lock statistics.
+/// @param fp The output stream.
+static void print_histogram(lock_stats_t const *lock, FILE *fp)
+{
+    uint32_t first = LOCKS_BUCKET_COUNT, last = 0, peak = 0;
+    for (uint32_t i = 0; i < LOCKS_BUCKET_COUNT; ++i)
+    {
+        if (lock->Histogram[i] == 0) continue;
+        if (first == LOCKS_BUCKET_COUNT) first = i;
+        if (lock->Histogram[i] > peak) peak = lock->Histogram[i];
+        last = i;
+    }
+    for (uint32_t i = first; i <= last && peak > 0; ++i)
+    {
+        char     lo[16], hi[16];
+        uint32_t width = (uint32_t) ((uint64_t(lock->Histogram[i]) * LOCKS_BAR_WIDTH + peak - 1) / peak);
+        format_us(lo, sizeof(lo), i == 0 ? 0 : (1ULL << i));
+        format_us(hi, sizeof(hi), 1ULL << (i + 1));
+        if (i == LOCKS_BUCKET_COUNT - 1) strcpy(hi, "inf");
+        fprintf(fp, "    [%6s, %6s) %8u |%.*s\n", lo, hi, lock->Histogram[i], int(width),
+                "########################################");
+    }
+}
+
+/*///////////////////////
+//  Public Functions   //
+///////////////////////*/
+int cmd_locks(int argc, char **argv)
+{
+    char const    *inputs[LOCKS_MAX_INPUTS];
+    size_t         ninput = 0;
+    bool           hist   = true;
+    locks_state_t *state  = NULL;
+    lock_stats_t **order  = NULL;
+    uint32_t       count  = 0;
+    etw_time_range_t range = { 0.0, -1.0, 0 };
+
+    for (int i = 0; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "-nohist") == 0)
+            hist = false;
+        else if (etw_range_option(argc, argv, &i, &range))
+            continue;
+        else if (argv[i][0] != '-' && ninput < LOCKS_MAX_INPUTS)
+            inputs[ninput++] = argv[i];
+        else
+        {
+            print_usage();
+            return EXIT_FAILURE;
+        }
+    }
+    if (ninput == 0)
+    {
+        fprintf(stderr, "ERROR: Missing argument INFILE.\n\n");
+        print_usage();
+        return EXIT_FAILURE;
+    }
+    if ((state = (locks_state_t*) calloc(1, sizeof(locks_state_t))) == NULL)
+    {
+        fprintf(stderr, "ERROR: Unable to allocate lock table.\n");
+        return EXIT_FAILURE;
+    }
+    if (!etw_process_range(inputs, ninput, &range, locks_event, state))
+    {
+        free(state);
+        return EXIT_FAILURE;
+    }
+    if ((order = (lock_stats_t**) malloc((state->LockCount + 1) * sizeof(lock_stats_t*))) == NULL)
+    {
+        fprintf(stderr, "ERROR: Unable to allocate lock list.\n");
+        free(state);
+        return EXIT_FAILURE;
+    }
+    for (uint32_t i = 0; i < LOCKS_MAX_LOCKS; ++i)
+    {
+        if (state->Locks[i].Name[0] != '\0')
+            order[count++] = &state->Locks[i];
+    }
+    qsort(order, count, sizeof(lock_stats_t*), compare_total);
+
+    fprintf(stdout, "%-32s %18s %8s %8s %12s %12s %12s\n", "Lock", "Object", "Waits", "Timeouts",
+            "Total (ms)", "Avg (ms)", "Max (ms)");
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        lock_stats_t const *lock = order[i];
+        fprintf(stdout, "%-32s 0x%016I64X %8u %8u %12.3f %12.3f %12.3f\n", lock->Name, lock->Object,
+                lock->Count, lock->Timeouts, lock->TotalMs, lock->TotalMs / lock->Count, lock->MaxMs);
+        if (hist) print_histogram(lock, stdout);
+    }
+    if (count == 0)
+    {
+        fprintf(stdout, "No contended waits were recorded.\n");
+    }
+    if (state->Overflow > 0)
+    {
+        fprintf(stdout, "(%u waits not shown; too many distinct locks)\n", state->Overflow);
+    }
+    free(order);
+    free(state);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,84 @@
+/*/////////////////////////////////////////////////////////////////////////////
+/// @summary Defines the application entry point.
+/// @author Russell Klenk (contact@russellklenk.com)
+///////////////////////////////////////////////////////////////////////////80*/
+
+/*////////////////
+//   Includes   //
+////////////////*/
+#include "ETWAnalyze.h"
+
+/*//////////////////
+//   Data Types   //
+//////////////////*/
+/// @summary Associates a command name with the function that implements it.
+struct command_t
+{
+    char const  *Name;        /// The command name, as typed on the command line.
+    char const  *Summary;     /// A one-line description of the command.
+    int        (*Main)(int, char**); /// The command entry point.
+};
+
+/*///////////////
+//   Globals   //
+///////////////*/
+/// @summary The table of commands supported by the tool.
+static command_t const COMMANDS[] =
+{
+    { "live"  , "Stream events from a real-time session and print scope timings.", cmd_live   },
+    { "top"   , "Show the hottest scopes in a running process without a trace session.", cmd_top },
+    { "record", "Record events to a compressed .etl file until Ctrl+C is pressed.", cmd_record },
+    { "index" , "Build a chunk index for random access into a split recording.", cmd_index  },
+    { "locks" , "Summarize contended lock acquisitions with wait-time histograms.", cmd_locks  },
+    { "critpath", "Report time the main thread spent waiting on or redoing task work.", cmd_critpath },
+    { "scopes", "Summarize scope durations, split into on-CPU and off-CPU time.", cmd_scopes },
+    { "tree"  , "Print the per-thread call tree with inclusive and exclusive times.", cmd_tree   },
+    { "folded", "Write folded stacks for generating a flame graph.", cmd_folded },
+    { "samples", "Attribute periodic samples to the scopes open when they were taken.", cmd_samples },
+    { "tasks" , "Summarize task latency, split into running and suspended time.", cmd_tasks  },
+    { "input" , "Report input-to-response latency for each type of user input.", cmd_input  },
+    { "fileio", "Summarize hooked file opens, reads and mapped views by operation and file.", cmd_fileio },
+    { "launch", "Start a program with the file I/O hooks injected.", cmd_launch },
+    { "counters", "Chart sampled memory, I/O and CPU counters and region residency.", cmd_counters },
+    { "merge" , "Merge the events of several traces into a single timeline.", cmd_merge  },
+    { "diff"  , "Compare scope latencies between two traces and flag regressions.", cmd_diff   }
+};
+static size_t const    COMMAND_COUNT = sizeof(COMMANDS) / sizeof(COMMANDS[0]);
+
+/*///////////////////////
+//   Local Functions   //
+///////////////////////*/
+/// @summary Print usage information, and then exit.
+static void print_usage(void)
+{
+    fprintf(stdout, "etwanalyze.exe: Record and analyze events from the custom ETW providers.\n");
+    fprintf(stdout, "USAGE: etwanalyze.exe COMMAND [ARGS...]\n");
+    for (size_t i = 0; i < COMMAND_COUNT; ++i)
+    {
+        fprintf(stdout, "  %-10s %s\n", COMMANDS[i].Name, COMMANDS[i].Summary);
+    }
+    fprintf(stdout, "\n");
+    exit(EXIT_FAILURE);
+}
+
+/*///////////////////////
+//  Public Functions   //
+///////////////////////*/
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+    {   // the command name is missing.
+        fprintf(stderr, "ERROR: Missing argument COMMAND.\n\n");
+        print_usage();
+    }
+    for (size_t i = 0; i < COMMAND_COUNT; ++i)
+    {
+        if (_stricmp(argv[1], COMMANDS[i].Name) == 0)
+        {   // pass the arguments following the command name.
+            return COMMANDS[i].Main(argc - 2, argv + 2);
+        }
+    }
+    fprintf(stderr, "ERROR: Unknown command \'%s\'.\n\n", argv[1]);
+    print_usage();
+    return EXIT_FAILURE;
+}
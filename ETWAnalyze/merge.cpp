@@ -0,0 +1,410 @@
+/*/////////////////////////////////////////////////////////////////////////////
+/// @summary Implements a streaming k-way merge of the events decoded from
+/// several independently recorded traces, and the 'merge' command, which
+/// writes the merged events as a single timeline. Each input is decoded by
+/// its own thread into a small ring of fixed-size blocks, and the calling
+/// thread repeatedly takes the earliest event at the head of any stream, so
+/// memory use depends only on the number of inputs, not on their size.
+/// @author Russell Klenk (contact@russellklenk.com)
+///////////////////////////////////////////////////////////////////////////80*/
+
+/*////////////////
+//   Includes   //
+////////////////*/
+#include "ETWAnalyze.h"
+
+/*/////////////////
+//   Constants   //
+/////////////////*/
+/// @summary Define the maximum number of streams that may be merged at once. Each
+/// stream is decoded by a separate thread.
+#define MERGE_MAX_STREAMS    64
+
+/// @summary Define the number of blocks in the ring of each stream. The decoding thread
+/// fills blocks while the merging thread drains them.
+#define MERGE_BLOCK_COUNT    4
+
+/// @summary Define the maximum number of events stored in a single block.
+#define MERGE_BLOCK_EVENTS   512
+
+/// @summary Define the number of bytes of string storage in a single block. A block is
+/// handed to the merging thread early if the next event's text does not fit.
+#define MERGE_BLOCK_TEXT     (32 * 1024)
+
+/*//////////////////
+//   Data Types   //
+//////////////////*/
+/// @summary A batch of decoded events, with the strings they refer to copied alongside.
+struct merge_block_t
+{
+    etw_event_t  Events[MERGE_BLOCK_EVENTS]; /// The decoded events, in timestamp order.
+    uint32_t     Count;       /// The number of events in the block.
+    uint32_t     TextUsed;    /// The number of bytes of Text in use.
+    bool         Last;        /// true if this is the final block of the stream.
+    char         Text[MERGE_BLOCK_TEXT]; /// Storage for the event strings.
+};
+
+/// @summary The state of a single input stream. The decoding thread is the only writer
+/// of Produce and the blocks it has acquired; the merging thread is the only reader.
+struct merge_stream_t
+{
+    char const  *Path;        /// The .etl or .etwidx file decoded into this stream.
+    etw_time_range_t const *Range; /// The range passed to etw_process_range, or NULL.
+    HANDLE       Thread;      /// The decoding thread.
+    HANDLE       Full;        /// Semaphore counting the blocks ready to be merged.
+    HANDLE       Empty;       /// Semaphore counting the blocks free to be filled.
+    merge_block_t *Blocks;    /// The ring of MERGE_BLOCK_COUNT blocks.
+    uint32_t     Produce;     /// The index of the block being filled by the decoding thread.
+    uint32_t     Consume;     /// The index of the block being read by the merging thread.
+    uint32_t     Cursor;      /// The index of the head event within the block being read.
+    bool         Reading;     /// true if the merging thread holds the block at Consume.
+    bool         Result;      /// The value returned by etw_process_range.
+    uint64_t     Events;      /// The number of events delivered from the stream.
+};
+
+/// @summary The state of a merge, shared by the functions that maintain the heap.
+struct merge_state_t
+{
+    merge_stream_t *Streams;  /// The input streams.
+    uint32_t     Heap[MERGE_MAX_STREAMS]; /// Indices of the streams with a head event, as a binary min-heap.
+    uint32_t     HeapCount;   /// The number of streams in the heap.
+};
+
+/// @summary State for the 'merge' command.
+struct merge_output_t
+{
+    FILE        *Output;      /// The stream the timeline is written to.
+    int64_t      BaseTime;    /// The timestamp of the first event written.
+    int64_t      LastTime;    /// The timestamp of the most recent event written.
+    uint64_t     Count;       /// The number of events written.
+    uint64_t     Reordered;   /// The number of events earlier than the event written before them.
+};
+
+/*///////////////////////
+//   Local Functions   //
+///////////////////////*/
+/// @summary Print usage information for the merge command.
+static void print_usage(void)
+{
+    fprintf(stdout, "USAGE: etwanalyze.exe merge [-o OUTFILE] [-from MS] [-to MS] [-thread TID] INFILE [INFILE...]\n");
+    fprintf(stdout, "  Merge the events from several traces, such as recordings of different\n");
+    fprintf(stdout, "  processes or machines, into one timeline ordered by timestamp. Each INFILE\n");
+    fprintf(stdout, "  is decoded on its own thread and at most %d may be given.\n", MERGE_MAX_STREAMS);
+    fprintf(stdout, "  -o:      The path of the text file to write (default stdout).\n");
+    etw_range_usage(stdout);
+    fprintf(stdout, "  The range is applied to each INFILE relative to its own start time.\n");
+    fprintf(stdout, "  INFILE may be an .etwidx written by 'record -split' or 'index'.\n");
+    fprintf(stdout, "\n");
+}
+
+/// @summary Hand the block being filled to the merging thread, and wait for a free block.
+/// @param stream The stream being decoded.
+/// @param last true if the stream has no more events.
+static void block_publish(merge_stream_t *stream, bool last)
+{
+    stream->Blocks[stream->Produce].Last = last;
+    ReleaseSemaphore(stream->Full, 1, NULL);
+    if (!last)
+    {
+        stream->Produce = (stream->Produce + 1) % MERGE_BLOCK_COUNT;
+        WaitForSingleObject(stream->Empty, INFINITE);
+        stream->Blocks[stream->Produce].Count    = 0;
+        stream->Blocks[stream->Produce].TextUsed = 0;
+        stream->Blocks[stream->Produce].Last     = false;
+    }
+}
+
+/// @summary Receives each decoded event on the decoding thread of a stream, and copies
+/// it, along with its text, into the block being filled. A trace is not quite in timestamp
+/// order: the enter events of held scopes and of function calls are backdated to when the 
+/// scope or call began. Each event is therefore inserted in timestamp order among the events
+/// of the block being filled, which absorbs a backdated event unless the events it should 
+/// precede have already been handed to the merging thread.
+/// @param ev The decoded event.
+/// @param context Pointer to the merge_stream_t.
+static void stream_event(etw_event_t const *ev, void *context)
+{
+    merge_stream_t *stream = (merge_stream_t*) context;
+    merge_block_t  *block  = &stream->Blocks[stream->Produce];
+    size_t          length = strlen(ev->Text) + 1;
+
+    if (length > MERGE_BLOCK_TEXT)
+    {   // only sample stacks can be long; keep the outermost scopes.
+        length = MERGE_BLOCK_TEXT;
+    }
+    if (block->Count == MERGE_BLOCK_EVENTS || block->TextUsed + length > MERGE_BLOCK_TEXT)
+    {
+        block_publish(stream, false);
+        block = &stream->Blocks[stream->Produce];
+    }
+    char        *text = &block->Text[block->TextUsed];
+    uint32_t     pos  = block->Count;
+    while (pos > 0 && block->Events[pos-1].Timestamp > ev->Timestamp)
+        --pos;
+    memmove(&block->Events[pos+1], &block->Events[pos], (block->Count - pos) * sizeof(etw_event_t));
+    etw_event_t *copy = &block->Events[pos];
+    block->Count++;
+    memcpy(text, ev->Text, length - 1);
+    text[length-1]    = '\0';
+    block->TextUsed  += (uint32_t) length;
+    *copy             = *ev;
+    copy->Text        = text;
+}
+
+/// @summary The entry point of the decoding thread of a stream.
+/// @param argp Pointer to the merge_stream_t.
+/// @return Zero if the stream was decoded successfully.
+static DWORD WINAPI stream_main(LPVOID argp)
+{
+    merge_stream_t *stream = (merge_stream_t*) argp;
+    WaitForSingleObject(stream->Empty, INFINITE);
+    stream->Result = etw_process_range(&stream->Path, 1, stream->Range, stream_event, stream);
+    block_publish(stream, true);
+    return stream->Result ? 0 : 1;
+}
+
+/// @summary Retrieve the event at the head of a stream, waiting for the decoding thread
+/// to fill the next block if the current one has been consumed.
+/// @param stream The stream.
+/// @return The head event, or NULL if the stream has no more events.
+static etw_event_t const* stream_head(merge_stream_t *stream)
+{
+    for ( ; ; )
+    {
+        if (!stream->Reading)
+        {
+            WaitForSingleObject(stream->Full, INFINITE);
+            stream->Reading = true;
+            stream->Cursor  = 0;
+        }
+        merge_block_t const *block = &stream->Blocks[stream->Consume];
+        if (stream->Cursor < block->Count)
+            return &block->Events[stream->Cursor];
+        if (block->Last)
+            return NULL;
+        // the block has been consumed; return it to the decoding thread.
+        stream->Reading = false;
+        stream->Consume = (stream->Consume + 1) % MERGE_BLOCK_COUNT;
+        ReleaseSemaphore(stream->Empty, 1, NULL);
+    }
+}
+
+/// @summary Determine whether the head of one stream must be delivered before another.
+/// Ties are broken by stream index, so that equal timestamps merge deterministically;
+/// events within a stream are delivered in the order of the blocks they were placed in.
+/// @param state The merge state.
+/// @param a The index of the first stream.
+/// @param b The index of the second stream.
+/// @return true if the head of stream a orders before the head of stream b.
+static bool heap_less(merge_state_t *state, uint32_t a, uint32_t b)
+{
+    merge_stream_t const *sa = &state->Streams[a];
+    merge_stream_t const *sb = &state->Streams[b];
+    int64_t const ta = sa->Blocks[sa->Consume].Events[sa->Cursor].Timestamp;
+    int64_t const tb = sb->Blocks[sb->Consume].Events[sb->Cursor].Timestamp;
+    return ta < tb || (ta == tb && a < b);
+}
+
+/// @summary Restore the heap property below a position whose stream head has changed.
+/// @param state The merge state.
+/// @param pos The position in the heap.
+static void heap_sift_down(merge_state_t *state, uint32_t pos)
+{
+    for ( ; ; )
+    {
+        uint32_t least = pos;
+        uint32_t left  = pos * 2 + 1;
+        uint32_t right = pos * 2 + 2;
+        if (left  < state->HeapCount && heap_less(state, state->Heap[left ], state->Heap[least])) least = left;
+        if (right < state->HeapCount && heap_less(state, state->Heap[right], state->Heap[least])) least = right;
+        if (least == pos)
+            return;
+        uint32_t swap      = state->Heap[pos];
+        state->Heap[pos]   = state->Heap[least];
+        state->Heap[least] = swap;
+        pos = least;
+    }
+}
+
+/// @summary Receives each merged event and writes it to the timeline.
+/// @param ev The decoded event.
+/// @param context Pointer to the merge_output_t.
+static void output_event(etw_event_t const *ev, void *context)
+{
+    static char const *SOURCE_NAME[ETW_SOURCE_COUNT] = { "MAIN", "TASK", "INPUT", "SYNC", "FILEIO" };
+    static char const *KIND_NAME[] =
+    {
+        "Unknown", "EnterScope", "LeaveScope", "Marker", "ThreadID", "MouseDown", "MouseUp",
+        "MouseMove", "MouseWheel", "KeyDown", "WaitBegin", "WaitEnd", "Flow", "Sample",
+        "EventsLost", "TaskResume", "TaskSuspend", "TaskComplete", "Overhead", "FileOpen", "FileRead",
+        "FileMapping", "FileMapView", "FileUnmap", "FilePrefetch", "FileSummary",
+        "Module", "Counters", "Residency", "ScopeSummary", "ScopeSampled"
+    };
+    static size_t const KIND_COUNT = sizeof(KIND_NAME) / sizeof(KIND_NAME[0]);
+
+    merge_output_t *out = (merge_output_t*) context;
+    if (out->Count == 0)
+    {
+        out->BaseTime = ev->Timestamp;
+        fprintf(out->Output, "%14s %8s %8s %4s %-5s %-12s %5s %12s %s\n", "Time (ms)", "PID", "TID", "CPU",
+                "Src", "Event", "Depth", "Dur (ms)", "Text");
+    }
+    else if (ev->Timestamp < out->LastTime)
+    {
+        out->Reordered++;
+    }
+    fprintf(out->Output, "%14.4f %8u %8u %4u %-5s %-12s %5u %12.4f %s\n", (ev->Timestamp - out->BaseTime) / TICKS_PER_MS,
+            ev->ProcessId, ev->ThreadId, ev->Processor, SOURCE_NAME[ev->Source],
+            (size_t) ev->Kind < KIND_COUNT ? KIND_NAME[ev->Kind] : "?", ev->Depth, ev->Duration, ev->Text);
+    out->LastTime = ev->Timestamp;
+    out->Count++;
+}
+
+/*///////////////////////
+//  Public Functions   //
+///////////////////////*/
+bool etw_merge_files(char const **paths, size_t count, etw_time_range_t const *range, etw_event_fn callback, void *context)
+{
+    merge_state_t   state;
+    merge_stream_t *streams = NULL;
+    bool            result  = true;
+    size_t          nstart  = 0;
+
+    if (count == 0 || count > MERGE_MAX_STREAMS)
+    {
+        fprintf(stderr, "ERROR: Between 1 and %d traces may be merged at once.\n", MERGE_MAX_STREAMS);
+        return false;
+    }
+    if ((streams = (merge_stream_t*) calloc(count, sizeof(merge_stream_t))) == NULL)
+    {
+        fprintf(stderr, "ERROR: Unable to allocate merge streams.\n");
+        return false;
+    }
+    for (nstart = 0; nstart < count; ++nstart)
+    {
+        merge_stream_t *stream = &streams[nstart];
+        stream->Path   = paths[nstart];
+        stream->Range  = range;
+        stream->Blocks = (merge_block_t*) malloc(MERGE_BLOCK_COUNT * sizeof(merge_block_t));
+        stream->Full   = CreateSemaphore(NULL, 0, MERGE_BLOCK_COUNT, NULL);
+        stream->Empty  = CreateSemaphore(NULL, MERGE_BLOCK_COUNT, MERGE_BLOCK_COUNT, NULL);
+        if (stream->Blocks == NULL || stream->Full == NULL || stream->Empty == NULL)
+        {
+            fprintf(stderr, "ERROR: Unable to allocate merge buffers for \'%s\'.\n", paths[nstart]);
+            goto error_cleanup;
+        }
+        stream->Blocks[0].Count    = 0;
+        stream->Blocks[0].TextUsed = 0;
+        stream->Blocks[0].Last     = false;
+        if ((stream->Thread = CreateThread(NULL, 0, stream_main, stream, 0, NULL)) == NULL)
+        {
+            fprintf(stderr, "ERROR: Unable to start decoding thread for \'%s\': 0x%08X.\n", paths[nstart], GetLastError());
+            goto error_cleanup;
+        }
+    }
+
+    // prime the heap with the first event of each stream.
+    state.Streams   = streams;
+    state.HeapCount = 0;
+    for (uint32_t i = 0; i < (uint32_t) count; ++i)
+    {
+        if (stream_head(&streams[i]) != NULL)
+            state.Heap[state.HeapCount++] = i;
+    }
+    for (uint32_t i = state.HeapCount / 2; i > 0; --i)
+    {
+        heap_sift_down(&state, i - 1);
+    }
+    while (state.HeapCount > 0)
+    {   // deliver the earliest head, then advance that stream.
+        merge_stream_t *stream = &streams[state.Heap[0]];
+        callback(&stream->Blocks[stream->Consume].Events[stream->Cursor], context);
+        stream->Cursor++;
+        stream->Events++;
+        if (stream_head(stream) == NULL)
+            state.Heap[0] = state.Heap[--state.HeapCount];
+        heap_sift_down(&state, 0);
+    }
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        WaitForSingleObject(streams[i].Thread, INFINITE);
+        CloseHandle(streams[i].Thread);
+        CloseHandle(streams[i].Empty);
+        CloseHandle(streams[i].Full);
+        free(streams[i].Blocks);
+        if (!streams[i].Result) result = false;
+    }
+    free(streams);
+    return result;
+
+error_cleanup:
+    for (size_t i = 0; i <= nstart && i < count; ++i)
+    {   // let any running decoding threads finish, discarding their events.
+        merge_stream_t *stream = &streams[i];
+        if (stream->Thread != NULL)
+        {
+            while (stream_head(stream) != NULL)
+                stream->Cursor++;
+            WaitForSingleObject(stream->Thread, INFINITE);
+            CloseHandle(stream->Thread);
+        }
+        if (stream->Empty != NULL) CloseHandle(stream->Empty);
+        if (stream->Full  != NULL) CloseHandle(stream->Full);
+        free(stream->Blocks);
+    }
+    free(streams);
+    return false;
+}
+
+int cmd_merge(int argc, char **argv)
+{
+    char const      *inputs[MERGE_MAX_STREAMS];
+    char const      *outfile = NULL;
+    size_t           ninput  = 0;
+    merge_output_t   out;
+    etw_time_range_t range   = { 0.0, -1.0, 0 };
+
+    memset(&out, 0, sizeof(out));
+    for (int i = 0; i < argc; ++i)
+    {
+        if (etw_range_option(argc, argv, &i, &range))
+            continue;
+        else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+            outfile = argv[++i];
+        else if (argv[i][0] != '-' && ninput < MERGE_MAX_STREAMS)
+            inputs[ninput++] = argv[i];
+        else
+        {
+            print_usage();
+            return EXIT_FAILURE;
+        }
+    }
+    if (ninput == 0)
+    {
+        fprintf(stderr, "ERROR: Missing argument INFILE.\n\n");
+        print_usage();
+        return EXIT_FAILURE;
+    }
+    if (outfile != NULL && (out.Output = fopen(outfile, "w")) == NULL)
+    {
+        fprintf(stderr, "ERROR: Unable to open output file \'%s\' (errno = %d).\n", outfile, errno);
+        return EXIT_FAILURE;
+    }
+    if (out.Output == NULL)
+    {
+        out.Output = stdout;
+    }
+    bool result = etw_merge_files(inputs, ninput, &range, output_event, &out);
+    if (out.Output != stdout)
+    {
+        fclose(out.Output);
+        fprintf(stdout, "STATUS: Wrote %I64u events from %u traces to \'%s\'.\n", out.Count, uint32_t(ninput), outfile);
+    }
+    if (out.Reordered > 0)
+    {   // backdated enter events are reordered within a block of their stream; these were
+        // backdated past a block already merged, or reflect clock skew within a stream.
+        fprintf(stderr, "WARNING: %I64u events were earlier than the event before them.\n", out.Reordered);
+    }
+    return result ? EXIT_SUCCESS : EXIT_FAILURE;
+}
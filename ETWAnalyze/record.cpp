@@ -0,0 +1,247 @@
+/*/////////////////////////////////////////////////////////////////////////////
+/// @summary Implements the 'record' command, which captures events from the
+/// custom providers to an .etl file until the user presses Ctrl+C.
+/// @author Russell Klenk (contact@russellklenk.com)
+///////////////////////////////////////////////////////////////////////////80*/
+
+/*////////////////
+//   Includes   //
+////////////////*/
+#include "ETWAnalyze.h"
+
+/*/////////////////
+//   Constants   //
+/////////////////*/
+/// @summary Defined in evntrace.h, which requires the Windows 8 SDK. The logger
+/// compresses each buffer as it is flushed to disk, on the logger thread, so
+/// the threads writing events pay nothing extra. OpenTrace() decompresses
+/// transparently when the file is read back.
+#ifndef EVENT_TRACE_COMPRESSED_MODE
+#define EVENT_TRACE_COMPRESSED_MODE 0x04000000
+#endif
+
+/// @summary The default name of the session started by the record command.
+#define RECORD_SESSION_NAME  "ETWAnalyze-Record"
+
+/// @summary Define the maximum number of chunks indexed after a split recording.
+#define RECORD_MAX_CHUNKS    4096
+
+/*///////////////
+//   Globals   //
+///////////////*/
+/// @summary Manual-reset event signaled when the user presses Ctrl+C.
+static HANDLE RECORD_EXIT_SIGNAL = NULL;
+
+/*///////////////////////
+//   Local Functions   //
+///////////////////////*/
+/// @summary Print usage information for the record command.
+static void print_usage(void)
+{
+    fprintf(stdout, "USAGE: etwanalyze.exe record -o OUTFILE [-name NAME] [-keywords MASK] [-level N] [-providers LIST] [-buffers N | -percpu N] [-buffersize KB] [-split MB | -circular MB] [-nocompress]\n");
+    fprintf(stdout, "  Record events from the custom providers until Ctrl+C is pressed.\n");
+    fprintf(stdout, "  -o:          The path of the .etl file to write.\n");
+    etw_session_usage(stdout, RECORD_SESSION_NAME);
+    fprintf(stdout, "  -buffers:    The number of buffers (default 64).\n");
+    fprintf(stdout, "  -percpu:     The number of buffers per logical processor, instead of -buffers.\n");
+    fprintf(stdout, "  -buffersize: The size of each buffer, in KB (default 1024).\n");
+    fprintf(stdout, "  -split:      Start a new chunk file every MB megabytes and write an index of the\n");
+    fprintf(stdout, "               chunks when recording stops. OUTFILE may contain a %%d for the chunk\n");
+    fprintf(stdout, "               number; otherwise _%%d is inserted before the extension.\n");
+    fprintf(stdout, "  -circular:   Keep only the most recent MB megabytes of events; when the file is\n");
+    fprintf(stdout, "               full, new buffers overwrite the oldest. Events are never dropped for\n");
+    fprintf(stdout, "               lack of disk space, but the start of the recording is lost.\n");
+    fprintf(stdout, "  -nocompress: Write uncompressed buffers (required before Windows 8).\n");
+    fprintf(stdout, "  For example, to keep a flight recorder of scopes, markers and flows running\n");
+    fprintf(stdout, "  and take a short verbose capture beside it, run:\n");
+    fprintf(stdout, "    etwanalyze.exe record -name Flight -o flight.etl -circular 64 -keywords 0x3\n");
+    fprintf(stdout, "    etwanalyze.exe record -o debug.etl\n");
+    fprintf(stdout, "  Each event is written once by the process, and ETW copies it only into the\n");
+    fprintf(stdout, "  sessions whose keywords and level enable it, so the flight recorder receives\n");
+    fprintf(stdout, "  no samples, function calls, CPU times or HighFrequency events. The process\n");
+    fprintf(stdout, "  still pays for what the verbose capture enables while it runs.\n");
+    fprintf(stdout, "\n");
+}
+
+/// @summary Console control handler; requests a clean shutdown on Ctrl+C or Ctrl+Break.
+static BOOL WINAPI console_handler(DWORD ctrl_type)
+{
+    UNUSED_ARG(ctrl_type);
+    SetEvent(RECORD_EXIT_SIGNAL);
+    return TRUE;
+}
+
+/// @summary Retrieve the size of a file.
+/// @param path The path of the file.
+/// @return The file size in bytes, or zero if the file cannot be queried.
+static uint64_t file_size(char const *path)
+{
+    WIN32_FILE_ATTRIBUTE_DATA attr;
+    if (GetFileAttributesExA(path, GetFileExInfoStandard, &attr))
+    {
+        return (uint64_t(attr.nFileSizeHigh) << 32) | uint64_t(attr.nFileSizeLow);
+    }
+    return 0;
+}
+
+/// @summary Build the chunk file pattern and index path for a split recording.
+/// @param outfile The output path supplied on the command line.
+/// @param pattern On return, stores the chunk file pattern, which contains a %d.
+/// @param index On return, stores the path of the chunk index.
+static void split_paths(char const *outfile, char (&pattern)[MAX_PATH], char (&index)[MAX_PATH])
+{
+    char const *num = strstr(outfile, "%d");
+    char const *ext = strrchr(outfile, '.');
+    if (num != NULL)
+    {   // the caller chose where the chunk number goes.
+        char const *cut = num;
+        if (cut > outfile && (cut[-1] == '_' || cut[-1] == '-' || cut[-1] == '.')) cut--;
+        _snprintf(pattern, MAX_PATH, "%s", outfile);
+        _snprintf(index  , MAX_PATH, "%.*s%s", int(cut - outfile), outfile, num + 2);
+    }
+    else if (ext != NULL && strpbrk(ext, "\\/") == NULL)
+    {   // insert the chunk number before the extension.
+        _snprintf(pattern, MAX_PATH, "%.*s_%%d%s", int(ext - outfile), outfile, ext);
+        _snprintf(index  , MAX_PATH, "%s", outfile);
+    }
+    else
+    {
+        _snprintf(pattern, MAX_PATH, "%s_%%d.etl", outfile);
+        _snprintf(index  , MAX_PATH, "%s", outfile);
+    }
+    pattern[MAX_PATH-1] = '\0';
+    index  [MAX_PATH-1] = '\0';
+    if ((ext = strrchr(index, '.')) != NULL && strpbrk(ext, "\\/") == NULL)
+    {
+        index[ext - index] = '\0';
+    }
+    strncat(index, ".etwidx", MAX_PATH - strlen(index) - 1);
+}
+
+/// @summary Write the chunk index for a split recording.
+/// @param pattern The chunk file pattern.
+/// @param index The path of the index file to write.
+/// @return The total size of the chunk files, in bytes.
+static uint64_t write_index(char const *pattern, char const *index)
+{
+    char        (*chunks)[MAX_PATH] = (char(*)[MAX_PATH]) malloc(RECORD_MAX_CHUNKS * MAX_PATH);
+    char const   **paths  = (char const**) malloc(RECORD_MAX_CHUNKS * sizeof(char const*));
+    size_t         count  = 0;
+    uint64_t       total  = 0;
+    if (chunks == NULL || paths == NULL)
+    {
+        fprintf(stderr, "ERROR: Unable to allocate chunk list; run 'etwanalyze index %s'.\n", pattern);
+        free(paths);
+        free(chunks);
+        return 0;
+    }
+    count = etw_chunk_expand(pattern, chunks, RECORD_MAX_CHUNKS);
+    for (size_t i = 0; i < count; ++i)
+    {
+        paths[i] = chunks[i];
+        total   += file_size(chunks[i]);
+    }
+    if (count > 0 && etw_index_build(index, paths, count))
+    {
+        fprintf(stdout, "STATUS: Wrote %u chunks and index '%s'.\n", uint32_t(count), index);
+    }
+    free(paths);
+    free(chunks);
+    return total;
+}
+
+/*///////////////////////
+//  Public Functions   //
+///////////////////////*/
+int cmd_record(int argc, char **argv)
+{
+    etw_session_config_t config;
+    etw_session_t        session;
+    etw_session_stats_t  stats    = { 0 };
+    char const          *outfile  = NULL;
+    bool                 compress = true;
+    char                 pattern[MAX_PATH];
+    char                 index[MAX_PATH];
+    uint64_t             written  = 0;
+
+    // the defaults match the EventCollector in ETWProviderCustom.wprp.
+    memset(&config, 0, sizeof(config));
+    config.SessionName = RECORD_SESSION_NAME;
+    config.BufferSize  = 1024;
+    config.MinBuffers  = 64;
+    config.MaxBuffers  = 64;
+    config.FlushTimer  = 0;
+    config.Level       = TRACE_LEVEL_VERBOSE;
+    config.Keywords    = ~0ULL;
+
+    for (int i = 0; i < argc; ++i)
+    {
+        if (etw_session_option(argc, argv, &i, &config))
+            continue;
+        else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+            outfile = argv[++i];
+        else if (strcmp(argv[i], "-buffers") == 0 && i + 1 < argc)
+            config.MinBuffers = config.MaxBuffers = strtoul(argv[++i], NULL, 0);
+        else if (strcmp(argv[i], "-percpu") == 0 && i + 1 < argc)
+            config.PerCpuBuffers = strtoul(argv[++i], NULL, 0);
+        else if (strcmp(argv[i], "-buffersize") == 0 && i + 1 < argc)
+            config.BufferSize = strtoul(argv[++i], NULL, 0);
+        else if (strcmp(argv[i], "-split") == 0 && i + 1 < argc)
+            config.MaxFileSize = strtoul(argv[++i], NULL, 0);
+        else if (strcmp(argv[i], "-circular") == 0 && i + 1 < argc)
+            config.CircularSize = strtoul(argv[++i], NULL, 0);
+        else if (strcmp(argv[i], "-nocompress") == 0)
+            compress = false;
+        else
+        {
+            print_usage();
+            return EXIT_FAILURE;
+        }
+    }
+    if (outfile == NULL)
+    {
+        fprintf(stderr, "ERROR: Missing argument -o OUTFILE.\n\n");
+        print_usage();
+        return EXIT_FAILURE;
+    }
+    if (config.MaxFileSize != 0 && config.CircularSize != 0)
+    {
+        fprintf(stderr, "ERROR: -split and -circular cannot be used together.\n\n");
+        print_usage();
+        return EXIT_FAILURE;
+    }
+    config.LogFile     = outfile;
+    config.LogFileMode = compress ? EVENT_TRACE_COMPRESSED_MODE : 0;
+    if (config.MaxFileSize != 0)
+    {   // the logger names each chunk by substituting its number for the %d.
+        split_paths(outfile, pattern, index);
+        config.LogFile = pattern;
+    }
+
+    RECORD_EXIT_SIGNAL = CreateEvent(NULL, TRUE, FALSE, NULL);
+    SetConsoleCtrlHandler(console_handler, TRUE);
+    if (!etw_session_start(&config, &session))
+    {
+        SetConsoleCtrlHandler(console_handler, FALSE);
+        CloseHandle(RECORD_EXIT_SIGNAL);
+        return EXIT_FAILURE;
+    }
+
+    fprintf(stdout, "STATUS: Recording session \'%s\' to \'%s\'%s. Press Ctrl+C to stop.\n", session.Name, config.LogFile, compress ? " (compressed)" : "");
+    WaitForSingleObject(RECORD_EXIT_SIGNAL, INFINITE);
+    etw_session_stop(&session, &stats);
+    if (config.MaxFileSize != 0)
+        written = write_index(pattern, index);
+    else
+        written = file_size(outfile);
+    fprintf(stdout, "STATUS: Wrote %u buffers (%I64u bytes on disk). %u events lost, %u buffers lost.\n",
+            stats.Written, written, stats.EventsLost, stats.BuffersLost);
+    if (config.CircularSize != 0 && uint64_t(stats.Written) * config.BufferSize > uint64_t(config.CircularSize) * 1024)
+    {   // the file wrapped, so the oldest events were overwritten rather than lost.
+        fprintf(stdout, "STATUS: The circular log file wrapped; only the most recent events were kept.\n");
+    }
+
+    SetConsoleCtrlHandler(console_handler, FALSE);
+    CloseHandle(RECORD_EXIT_SIGNAL);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,536 @@
+/*/////////////////////////////////////////////////////////////////////////////
+/// @summary Implements the 'samples' command, which attributes the periodic
+/// samples recorded when the Sampling keyword is enabled to the scopes that
+/// were open on the sampled thread, giving a statistical breakdown of where
+/// time goes inside long scopes without adding instrumentation.
+/// @author Russell Klenk (contact@russellklenk.com)
+///////////////////////////////////////////////////////////////////////////80*/
+
+/*////////////////
+//   Includes   //
+////////////////*/
+#include "ETWAnalyze.h"
+
+/*/////////////////
+//   Constants   //
+/////////////////*/
+/// @summary Define the maximum number of input files accepted on the command line.
+#define SAMPLES_MAX_INPUTS   64
+
+/// @summary Define the maximum number of distinct threads tracked.
+#define SAMPLES_MAX_THREADS  256
+
+/// @summary Define the maximum number of distinct (thread, stack, address) entries tracked.
+/// This value must be a power of two greater than zero.
+#define SAMPLES_MAX_STACKS   16384
+
+/// @summary Define the maximum number of distinct scope names tracked.
+/// This value must be a power of two greater than zero.
+#define SAMPLES_MAX_SCOPES   4096
+
+/// @summary Define the maximum number of distinct (scope, address) pairs tracked.
+/// This value must be a power of two greater than zero.
+#define SAMPLES_MAX_ADDRS    16384
+
+/// @summary Define the maximum length of a stored scope stack, including the NULL.
+#define SAMPLES_MAX_STACK    256
+
+/// @summary Define the maximum length of a tracked scope or thread name, including the NULL.
+#define SAMPLES_MAX_NAME     64
+
+/// @summary Define the maximum number of scope names in a single sample.
+#define SAMPLES_MAX_DEPTH    64
+
+/// @summary Define the number of addresses printed below each scope with -ip.
+#define SAMPLES_TOP_ADDRS    5
+
+/// @summary The name reported for samples taken while no scope was open.
+#define SAMPLES_NO_SCOPE     "(no scope)"
+
+/*//////////////////
+//   Data Types   //
+//////////////////*/
+/// @summary Identifies a thread that was sampled, and the name it reported.
+struct sample_thread_t
+{
+    uint32_t     ProcessId;   /// The identifier of the process that owns the thread.
+    uint32_t     ThreadId;    /// The identifier of the thread.
+    char         Name[SAMPLES_MAX_NAME]; /// The thread name from ThreadID_Event, or empty.
+};
+
+/// @summary The number of samples that share a thread, scope stack and (optionally) address.
+struct sample_stack_t
+{
+    char         Stack[SAMPLES_MAX_STACK]; /// The ';'-separated scope names, outermost first.
+    uint64_t     Address;     /// The sampled instruction pointer rounded down to the granule, if -ip was specified.
+    uint32_t     Thread;      /// The index of the thread in samples_state_t::Threads, plus one.
+    uint32_t     Count;       /// The number of samples.
+};
+
+/// @summary The number of samples attributed to a single scope name.
+struct sample_scope_t
+{
+    char         Name[SAMPLES_MAX_NAME]; /// The scope name.
+    uint32_t     Self;        /// The number of samples taken while this was the innermost open scope.
+    uint32_t     Inclusive;   /// The number of samples taken while this scope was open at any depth.
+};
+
+/// @summary The number of samples at a single address within the innermost scope.
+struct sample_addr_t
+{
+    uint64_t     Address;     /// The sampled instruction pointer rounded down to the granule.
+    uint32_t     Scope;       /// The index of the scope in samples_state_t::Scopes, plus one.
+    uint32_t     Count;       /// The number of samples.
+};
+
+/// @summary The tables built while processing the input files.
+struct samples_state_t
+{
+    sample_thread_t Threads[SAMPLES_MAX_THREADS]; /// The sampled and named threads.
+    sample_stack_t  Stacks [SAMPLES_MAX_STACKS];  /// Open-addressed table of stacks.
+    sample_scope_t  Scopes [SAMPLES_MAX_SCOPES];  /// Open-addressed table of scope names.
+    sample_addr_t   Addrs  [SAMPLES_MAX_ADDRS];   /// Open-addressed table of addresses.
+    uint32_t        ThreadCount; /// The number of used entries in Threads.
+    uint32_t        StackCount;  /// The number of used entries in Stacks.
+    uint32_t        ScopeCount;  /// The number of used entries in Scopes.
+    uint32_t        AddrCount;   /// The number of used entries in Addrs.
+    uint32_t        Total;       /// The total number of samples.
+    uint32_t        Unscoped;    /// The number of samples taken while no scope was open.
+    uint32_t        Overflow;    /// The number of samples not fully recorded because a table was full.
+    uint64_t        Granule;     /// Addresses are rounded down to a multiple of this many bytes.
+    bool            ByAddress;   /// If true, stacks and scopes are broken down by address.
+};
+
+/*///////////////////////
+//   Local Functions   //
+///////////////////////*/
+/// @summary Print usage information for the samples command.
+static void print_usage(void)
+{
+    fprintf(stdout, "USAGE: etwanalyze.exe samples [-top N] [-ip] [-granule BYTES] [-folded OUTFILE] [-from MS] [-to MS] [-thread TID] INFILE [INFILE...]\n");
+    fprintf(stdout, "  Attribute periodic samples to the scopes open on the sampled thread.\n");
+    fprintf(stdout, "  Samples are recorded when the Sampling keyword (0x20) was enabled.\n");
+    fprintf(stdout, "  -top:     The number of scopes to print (default 30).\n");
+    fprintf(stdout, "  -ip:      Break each scope down by sampled instruction address.\n");
+    fprintf(stdout, "  -granule: Round addresses down to a multiple of BYTES (default 1).\n");
+    fprintf(stdout, "  -folded:  Also write folded stacks for generating a flame graph.\n");
+    etw_range_usage(stdout);
+    fprintf(stdout, "\n");
+}
+
+/// @summary Compute the FNV-1a hash of a NULL-terminated string, continuing from a previous hash.
+/// @param h The initial hash value; 2166136261U to start a new hash.
+/// @param str The string to hash.
+/// @return The 32-bit hash value.
+static uint32_t hash_string(uint32_t h, char const *str)
+{
+    while (*str)
+    {
+        h ^= (uint8_t) *str++;
+        h *= 16777619U;
+    }
+    return h;
+}
+
+/// @summary Continue an FNV-1a hash with a 64-bit value.
+/// @param h The hash value to continue.
+/// @param value The value to hash.
+/// @return The 32-bit hash value.
+static uint32_t hash_uint64(uint32_t h, uint64_t value)
+{
+    for (int i = 0; i < 8; ++i, value >>= 8)
+    {
+        h ^= (uint8_t) value;
+        h *= 16777619U;
+    }
+    return h;
+}
+
+/// @summary Find or insert a thread entry.
+/// @param state The samples command state.
+/// @param process_id The identifier of the process that owns the thread.
+/// @param thread_id The identifier of the thread.
+/// @return The index of the thread, plus one, or zero if the table is full.
+static uint32_t find_thread(samples_state_t *state, uint32_t process_id, uint32_t thread_id)
+{
+    for (uint32_t i = 0; i < state->ThreadCount; ++i)
+    {
+        if (state->Threads[i].ProcessId == process_id && state->Threads[i].ThreadId == thread_id)
+            return i + 1;
+    }
+    if (state->ThreadCount == SAMPLES_MAX_THREADS)
+    {
+        return 0;
+    }
+    state->Threads[state->ThreadCount].ProcessId = process_id;
+    state->Threads[state->ThreadCount].ThreadId  = thread_id;
+    state->Threads[state->ThreadCount].Name[0]   = '\0';
+    return ++state->ThreadCount;
+}
+
+/// @summary Find or insert the entry for a (thread, stack, address) combination.
+/// @param state The samples command state.
+/// @param thread The index of the thread, plus one.
+/// @param stack The scope stack string.
+/// @param address The rounded address, or zero if addresses are not tracked.
+/// @return The entry, or NULL if the table is full.
+static sample_stack_t* find_stack(samples_state_t *state, uint32_t thread, char const *stack, uint64_t address)
+{
+    uint32_t mask  = SAMPLES_MAX_STACKS - 1;
+    uint32_t index = hash_uint64(hash_uint64(hash_string(2166136261U, stack), thread), address) & mask;
+    for (uint32_t i = 0; i < SAMPLES_MAX_STACKS; ++i, index = (index + 1) & mask)
+    {
+        sample_stack_t *entry = &state->Stacks[index];
+        if (entry->Thread == 0)
+        {
+            if (state->StackCount == SAMPLES_MAX_STACKS - 1)
+                return NULL;   // keep one slot free so lookups terminate.
+            strncpy(entry->Stack, stack, SAMPLES_MAX_STACK - 1);
+            entry->Stack[SAMPLES_MAX_STACK-1] = '\0';
+            entry->Thread  = thread;
+            entry->Address = address;
+            state->StackCount++;
+            return entry;
+        }
+        if (entry->Thread == thread && entry->Address == address && strncmp(entry->Stack, stack, SAMPLES_MAX_STACK - 1) == 0)
+        {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+/// @summary Find or insert the entry for a scope name.
+/// @param state The samples command state.
+/// @param name The scope name.
+/// @return The index of the scope, plus one, or zero if the table is full.
+static uint32_t find_scope(samples_state_t *state, char const *name)
+{
+    uint32_t mask  = SAMPLES_MAX_SCOPES - 1;
+    uint32_t index = hash_string(2166136261U, name) & mask;
+    for (uint32_t i = 0; i < SAMPLES_MAX_SCOPES; ++i, index = (index + 1) & mask)
+    {
+        sample_scope_t *scope = &state->Scopes[index];
+        if (scope->Name[0] == '\0')
+        {
+            if (state->ScopeCount == SAMPLES_MAX_SCOPES - 1)
+                return 0;
+            strncpy(scope->Name, name, SAMPLES_MAX_NAME - 1);
+            scope->Name[SAMPLES_MAX_NAME-1] = '\0';
+            state->ScopeCount++;
+            return index + 1;
+        }
+        if (strncmp(scope->Name, name, SAMPLES_MAX_NAME - 1) == 0)
+        {
+            return index + 1;
+        }
+    }
+    return 0;
+}
+
+/// @summary Find or insert the entry for an address within a scope.
+/// @param state The samples command state.
+/// @param scope The index of the innermost scope, plus one.
+/// @param address The rounded address.
+/// @return The entry, or NULL if the table is full.
+static sample_addr_t* find_addr(samples_state_t *state, uint32_t scope, uint64_t address)
+{
+    uint32_t mask  = SAMPLES_MAX_ADDRS - 1;
+    uint32_t index = hash_uint64(hash_uint64(2166136261U, scope), address) & mask;
+    for (uint32_t i = 0; i < SAMPLES_MAX_ADDRS; ++i, index = (index + 1) & mask)
+    {
+        sample_addr_t *entry = &state->Addrs[index];
+        if (entry->Scope == 0)
+        {
+            if (state->AddrCount == SAMPLES_MAX_ADDRS - 1)
+                return NULL;
+            entry->Scope   = scope;
+            entry->Address = address;
+            state->AddrCount++;
+            return entry;
+        }
+        if (entry->Scope == scope && entry->Address == address)
+        {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+/// @summary Split a sample stack string into its scope names.
+/// @param stack The ';'-separated stack string.
+/// @param names On return, stores the scope names, outermost first.
+/// @param max_names The maximum number of names to return.
+/// @return The number of names stored.
+static uint32_t split_stack(char const *stack, char (*names)[SAMPLES_MAX_NAME], uint32_t max_names)
+{
+    uint32_t count = 0;
+    while (*stack != '\0' && count < max_names)
+    {
+        size_t n = 0;
+        while (*stack != '\0' && *stack != ';')
+        {
+            if (n < SAMPLES_MAX_NAME - 1)
+                names[count][n++] = *stack;
+            stack++;
+        }
+        names[count++][n] = '\0';
+        if (*stack == ';') stack++;
+    }
+    return count;
+}
+
+/// @summary Receives each decoded event and attributes samples to scopes.
+/// @param ev The decoded event.
+/// @param context Pointer to the samples_state_t.
+static void samples_event(etw_event_t const *ev, void *context)
+{
+    samples_state_t *state = (samples_state_t*) context;
+    char             names[SAMPLES_MAX_DEPTH][SAMPLES_MAX_NAME];
+    uint32_t         scopes[SAMPLES_MAX_DEPTH];
+    uint32_t         thread = 0;
+    uint32_t         count  = 0;
+    uint64_t         addr   = 0;
+    bool             full   = false;
+
+    if (ev->Kind == ETW_EVENT_THREAD_ID)
+    {   // the event names the thread identified in the payload.
+        if ((thread = find_thread(state, ev->ProcessId, (uint32_t) ev->Value[0])) != 0)
+        {
+            strncpy(state->Threads[thread-1].Name, ev->Text, SAMPLES_MAX_NAME - 1);
+            state->Threads[thread-1].Name[SAMPLES_MAX_NAME-1] = '\0';
+        }
+        return;
+    }
+    if (ev->Kind != ETW_EVENT_SAMPLE)
+    {
+        return;
+    }
+
+    state->Total++;
+    addr   = state->ByAddress ? ev->Id - (ev->Id % state->Granule) : 0;
+    count  = split_stack(ev->Text, names, SAMPLES_MAX_DEPTH);
+    if (count == 0)
+    {   // attribute samples outside of any scope to a pseudo-scope.
+        strcpy(names[0], SAMPLES_NO_SCOPE);
+        state->Unscoped++;
+        count = 1;
+    }
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        if ((scopes[i] = find_scope(state, names[i])) == 0)
+        {
+            full = true;
+            continue;
+        }
+        bool recursive = false;
+        for (uint32_t j = 0; j < i && !recursive; ++j)
+        {   // count recursive scopes once per sample.
+            recursive = scopes[j] == scopes[i];
+        }
+        if (!recursive) state->Scopes[scopes[i]-1].Inclusive++;
+    }
+    if (scopes[count-1] != 0)
+    {
+        sample_addr_t *entry = NULL;
+        state->Scopes[scopes[count-1]-1].Self++;
+        if (state->ByAddress)
+        {
+            if ((entry = find_addr(state, scopes[count-1], addr)) != NULL) entry->Count++;
+            else full = true;
+        }
+    }
+    if ((thread = find_thread(state, ev->ProcessId, ev->ThreadId)) != 0)
+    {
+        sample_stack_t *entry = find_stack(state, thread, ev->Text, addr);
+        if (entry != NULL) entry->Count++;
+        else full = true;
+    }
+    else full = true;
+    if (full) state->Overflow++;
+}
+
+/// @summary Order scopes by descending self samples, then inclusive samples, for use with qsort.
+static int compare_scope(void const *a, void const *b)
+{
+    sample_scope_t const *sa = *(sample_scope_t const**) a;
+    sample_scope_t const *sb = *(sample_scope_t const**) b;
+    if (sa->Self != sb->Self) return sa->Self > sb->Self ? -1 : +1;
+    if (sa->Inclusive != sb->Inclusive) return sa->Inclusive > sb->Inclusive ? -1 : +1;
+    return strcmp(sa->Name, sb->Name);
+}
+
+/// @summary Order addresses by descending sample count, for use with qsort.
+static int compare_addr(void const *a, void const *b)
+{
+    sample_addr_t const *aa = *(sample_addr_t const**) a;
+    sample_addr_t const *ab = *(sample_addr_t const**) b;
+    if (aa->Count != ab->Count) return aa->Count > ab->Count ? -1 : +1;
+    return aa->Address < ab->Address ? -1 : (aa->Address > ab->Address ? +1 : 0);
+}
+
+/// @summary Print the addresses sampled most often while a scope was innermost.
+/// @param state The samples command state.
+/// @param scope The index of the scope, plus one.
+/// @param order Scratch storage for SAMPLES_MAX_ADDRS pointers.
+/// @param fp The output stream.
+static void print_addrs(samples_state_t const *state, uint32_t scope, sample_addr_t const **order, FILE *fp)
+{
+    sample_scope_t const *entry = &state->Scopes[scope-1];
+    uint32_t              count = 0;
+    for (uint32_t i = 0; i < SAMPLES_MAX_ADDRS; ++i)
+    {
+        if (state->Addrs[i].Scope == scope)
+            order[count++] = &state->Addrs[i];
+    }
+    qsort(order, count, sizeof(sample_addr_t const*), compare_addr);
+    for (uint32_t i = 0; i < count && i < SAMPLES_TOP_ADDRS; ++i)
+    {
+        fprintf(fp, "      0x%016I64X %10u %6.2f%%\n", order[i]->Address, order[i]->Count,
+                (100.0 * order[i]->Count) / entry->Self);
+    }
+    if (count > SAMPLES_TOP_ADDRS)
+    {
+        fprintf(fp, "      (%u more addresses)\n", count - SAMPLES_TOP_ADDRS);
+    }
+}
+
+/// @summary Write the sampled stacks in the folded format, prefixed with the thread name.
+/// @param state The samples command state.
+/// @param fp The output stream.
+static void write_folded(samples_state_t const *state, FILE *fp)
+{
+    for (uint32_t i = 0; i < SAMPLES_MAX_STACKS; ++i)
+    {
+        sample_stack_t  const *entry  = &state->Stacks[i];
+        sample_thread_t const *thread = NULL;
+        if (entry->Thread == 0)
+            continue;
+
+        thread = &state->Threads[entry->Thread-1];
+        if (thread->Name[0] != '\0') fprintf(fp, "%s", thread->Name);
+        else fprintf(fp, "Thread %u", thread->ThreadId);
+        if (entry->Stack[0] != '\0') fprintf(fp, ";%s", entry->Stack);
+        if (state->ByAddress) fprintf(fp, ";0x%I64X", entry->Address);
+        fprintf(fp, " %u\n", entry->Count);
+    }
+}
+
+/*///////////////////////
+//  Public Functions   //
+///////////////////////*/
+int cmd_samples(int argc, char **argv)
+{
+    char const       *inputs[SAMPLES_MAX_INPUTS];
+    size_t            ninput  = 0;
+    char const       *folded  = NULL;
+    uint32_t          top     = 30;
+    uint32_t          count   = 0;
+    samples_state_t  *state   = NULL;
+    sample_scope_t  **order   = NULL;
+    sample_addr_t const **addrs = NULL;
+    FILE             *fp      = NULL;
+    int               result  = EXIT_FAILURE;
+    etw_time_range_t  range   = { 0.0, -1.0, 0 };
+
+    if ((state = (samples_state_t*) calloc(1, sizeof(samples_state_t))) == NULL)
+    {
+        fprintf(stderr, "ERROR: Unable to allocate sample tables.\n");
+        return EXIT_FAILURE;
+    }
+    state->Granule = 1;
+    for (int i = 0; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "-top") == 0 && i + 1 < argc)
+            top = (uint32_t) atoi(argv[++i]);
+        else if (strcmp(argv[i], "-ip") == 0)
+            state->ByAddress = true;
+        else if (strcmp(argv[i], "-granule") == 0 && i + 1 < argc)
+            state->Granule = _strtoui64(argv[++i], NULL, 0);
+        else if (strcmp(argv[i], "-folded") == 0 && i + 1 < argc)
+            folded = argv[++i];
+        else if (etw_range_option(argc, argv, &i, &range))
+            continue;
+        else if (argv[i][0] != '-' && ninput < SAMPLES_MAX_INPUTS)
+            inputs[ninput++] = argv[i];
+        else
+        {
+            print_usage();
+            goto error_cleanup;
+        }
+    }
+    if (ninput == 0)
+    {
+        fprintf(stderr, "ERROR: Missing argument INFILE.\n\n");
+        print_usage();
+        goto error_cleanup;
+    }
+    if (state->Granule == 0)
+    {
+        state->Granule = 1;
+    }
+    if (!etw_process_range(inputs, ninput, &range, samples_event, state))
+    {
+        goto error_cleanup;
+    }
+    if (state->Total == 0)
+    {
+        fprintf(stdout, "No samples were recorded. Enable the Sampling keyword (0x20) when recording.\n");
+        result = EXIT_SUCCESS;
+        goto error_cleanup;
+    }
+
+    order = (sample_scope_t**) malloc((state->ScopeCount + 1) * sizeof(sample_scope_t*));
+    addrs = (sample_addr_t const**) malloc(SAMPLES_MAX_ADDRS * sizeof(sample_addr_t const*));
+    if (order == NULL || addrs == NULL)
+    {
+        fprintf(stderr, "ERROR: Unable to allocate scope list.\n");
+        goto error_cleanup;
+    }
+    for (uint32_t i = 0; i < SAMPLES_MAX_SCOPES; ++i)
+    {
+        if (state->Scopes[i].Name[0] != '\0')
+            order[count++] = &state->Scopes[i];
+    }
+    qsort(order, count, sizeof(sample_scope_t*), compare_scope);
+
+    fprintf(stdout, "Samples: %u on %u thread(s), %u (%.2f%%) outside of any scope.\n\n", state->Total,
+            state->ThreadCount, state->Unscoped, (100.0 * state->Unscoped) / state->Total);
+    fprintf(stdout, "%-40s %10s %8s %10s %8s\n", "Scope", "Self", "Self%", "Inclusive", "Incl%");
+    for (uint32_t i = 0; i < count && i < top; ++i)
+    {
+        sample_scope_t const *scope = order[i];
+        fprintf(stdout, "%-40s %10u %7.2f%% %10u %7.2f%%\n", scope->Name, scope->Self,
+                (100.0 * scope->Self) / state->Total, scope->Inclusive, (100.0 * scope->Inclusive) / state->Total);
+        if (state->ByAddress && scope->Self > 0)
+        {
+            print_addrs(state, uint32_t(scope - state->Scopes) + 1, addrs, stdout);
+        }
+    }
+    if (count > top)
+    {
+        fprintf(stdout, "(%u more scopes not shown)\n", count - top);
+    }
+    if (state->Overflow > 0)
+    {
+        fprintf(stdout, "(%u samples not fully attributed; too many distinct stacks or scopes)\n", state->Overflow);
+    }
+
+    if (folded != NULL)
+    {
+        if ((fp = fopen(folded, "w")) == NULL)
+        {
+            fprintf(stderr, "ERROR: Unable to open output file \'%s\': %s\n", folded, strerror(errno));
+            goto error_cleanup;
+        }
+        write_folded(state, fp);
+        fclose(fp);
+    }
+    result = EXIT_SUCCESS;
+
+error_cleanup:
+    if (addrs != NULL) free((void*) addrs);
+    if (order != NULL) free(order);
+    free(state);
+    return result;
+}
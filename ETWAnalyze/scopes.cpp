@@ -0,0 +1,272 @@
+/*/////////////////////////////////////////////////////////////////////////////
+/// @summary Implements the 'scopes' command, which summarizes the timed scopes
+/// recorded in one or more .etl files, splitting the wall time of each scope
+/// into the time spent running on a processor and the time spent blocked.
+/// @author Russell Klenk (contact@russellklenk.com)
+///////////////////////////////////////////////////////////////////////////80*/
+
+/*////////////////
+//   Includes   //
+////////////////*/
+#include "ETWAnalyze.h"
+
+/*/////////////////
+//   Constants   //
+/////////////////*/
+/// @summary Define the maximum number of input files accepted on the command line.
+#define SCOPES_MAX_INPUTS    64
+
+/// @summary Define the maximum number of distinct scope names tracked.
+/// This value must be a power of two greater than zero.
+#define SCOPES_MAX_SCOPES    4096
+
+/// @summary Define the maximum length of a tracked scope name, including the NULL.
+#define SCOPES_MAX_NAME      64
+
+/*//////////////////
+//   Data Types   //
+//////////////////*/
+/// @summary Timing statistics for all instances of a single scope name.
+struct scope_stats_t
+{
+    char         Name[SCOPES_MAX_NAME]; /// The scope description.
+    uint32_t     Source;      /// One of etw_source_e.
+    uint32_t     Count;       /// The number of scope instances that completed, including elided instances.
+    uint32_t     Elided;      /// The number of instances too short to report, known only from ScopeSummary events.
+    uint32_t     Skipped;     /// The number of instances not sampled, known only from ScopeSampled events.
+    uint32_t     CpuCount;    /// The number of instances for which on-CPU time was measured.
+    double       TotalMs;     /// The sum of all scope durations, in milliseconds.
+    double       MaxMs;       /// The longest scope duration, in milliseconds.
+    double       OnCpuMs;     /// The sum of the measured on-CPU times, in milliseconds.
+    double       OffCpuMs;    /// The sum of the measured off-CPU times, in milliseconds.
+};
+
+/// @summary The table of scope statistics built while processing the input files.
+struct scopes_state_t
+{
+    scope_stats_t Scopes[SCOPES_MAX_SCOPES]; /// Open-addressed table of scope statistics.
+    uint32_t      ScopeCount; /// The number of used entries in Scopes.
+    uint32_t      Overflow;   /// The number of scopes dropped because the table was full.
+};
+
+/*///////////////////////
+//   Local Functions   //
+///////////////////////*/
+/// @summary Print usage information for the scopes command.
+static void print_usage(void)
+{
+    fprintf(stdout, "USAGE: etwanalyze.exe scopes [-from MS] [-to MS] [-thread TID] INFILE [INFILE...]\n");
+    fprintf(stdout, "  Summarize scope durations, split into on-CPU and off-CPU time.\n");
+    fprintf(stdout, "  On-CPU time is available when the ThreadTime keyword (0x8) was enabled.\n");
+    fprintf(stdout, "  Scopes elided for being shorter than their ETWScopeThreshold are included\n");
+    fprintf(stdout, "  in the count and total, and also shown in the Elided column.\n");
+    fprintf(stdout, "  For scopes sampled with ETWScopeSampling, the count includes the instances\n");
+    fprintf(stdout, "  not sampled, shown in the Skipped column, and the total and on/off-CPU\n");
+    fprintf(stdout, "  times are scaled up by the same ratio; the max is that of the sampled ones.\n");
+    etw_range_usage(stdout);
+    fprintf(stdout, "\n");
+}
+
+/// @summary Compute the FNV-1a hash of a NULL-terminated string.
+/// @param str The string to hash.
+/// @return The 32-bit hash value.
+static uint32_t hash_string(char const *str)
+{
+    uint32_t h = 2166136261U;
+    while (*str)
+    {
+        h ^= (uint8_t) *str++;
+        h *= 16777619U;
+    }
+    return h;
+}
+
+/// @summary Find or insert the statistics entry for a scope name.
+/// @param state The scopes command state.
+/// @param name The scope description.
+/// @param source One of etw_source_e.
+/// @return The entry, or NULL if the table is full.
+static scope_stats_t* find_scope(scopes_state_t *state, char const *name, uint32_t source)
+{
+    uint32_t mask  = SCOPES_MAX_SCOPES - 1;
+    uint32_t index = (hash_string(name) + source) & mask;
+    for (uint32_t i = 0; i < SCOPES_MAX_SCOPES; ++i, index = (index + 1) & mask)
+    {
+        scope_stats_t *scope = &state->Scopes[index];
+        if (scope->Name[0] == '\0')
+        {
+            if (state->ScopeCount == SCOPES_MAX_SCOPES - 1)
+                return NULL;   // keep one slot free so lookups terminate.
+            strncpy(scope->Name, name, SCOPES_MAX_NAME - 1);
+            scope->Name[SCOPES_MAX_NAME-1] = '\0';
+            scope->Source = source;
+            state->ScopeCount++;
+            return scope;
+        }
+        if (scope->Source == source && strncmp(scope->Name, name, SCOPES_MAX_NAME - 1) == 0)
+        {
+            return scope;
+        }
+    }
+    return NULL;
+}
+
+/// @summary Receives each decoded event and accumulates scope statistics.
+/// @param ev The decoded event.
+/// @param context Pointer to the scopes_state_t.
+static void scopes_event(etw_event_t const *ev, void *context)
+{
+    scopes_state_t *state = (scopes_state_t*) context;
+    scope_stats_t  *scope = NULL;
+    if (ev->Kind != ETW_EVENT_LEAVE_SCOPE && ev->Kind != ETW_EVENT_SCOPE_SUMMARY && ev->Kind != ETW_EVENT_SCOPE_SAMPLED)
+    {
+        return;
+    }
+    if ((scope = find_scope(state, ev->Text, ev->Source)) == NULL)
+    {
+        state->Overflow++;
+        return;
+    }
+    if (ev->Kind == ETW_EVENT_SCOPE_SUMMARY)
+    {   // elided scopes have no on-CPU time.
+        scope->Count   += (uint32_t) ev->Value[0];
+        scope->Elided  += (uint32_t) ev->Value[0];
+        scope->TotalMs += ev->Duration;
+        if (ev->OnCpu > scope->MaxMs) scope->MaxMs = ev->OnCpu;
+        return;
+    }
+    if (ev->Kind == ETW_EVENT_SCOPE_SAMPLED)
+    {   // counted only; the times are scaled once all events have been seen.
+        scope->Skipped += (uint32_t) ev->Value[0];
+        return;
+    }
+    scope->Count++;
+    scope->TotalMs += ev->Duration;
+    if (ev->Duration > scope->MaxMs) scope->MaxMs = ev->Duration;
+    if (ev->OnCpu >= 0.0f)
+    {   // clamp, since the wall and cycle clocks are sampled at slightly different times.
+        float oncpu = ev->OnCpu < ev->Duration ? ev->OnCpu : ev->Duration;
+        scope->CpuCount++;
+        scope->OnCpuMs  += oncpu;
+        scope->OffCpuMs += ev->Duration - oncpu;
+    }
+}
+
+/// @summary Scale the statistics of sampled scope names to estimates for all instances. Each
+/// instance was sampled independently with the same probability, so the sampled instances 
+/// are a uniform random subset of the exact total Count + Skipped, and scaling their sums by
+/// that total over the number sampled gives unbiased estimates of the sums over all instances.
+/// @param state The scopes command state.
+static void scale_sampled(scopes_state_t *state)
+{
+    for (uint32_t i = 0; i < SCOPES_MAX_SCOPES; ++i)
+    {
+        scope_stats_t *scope = &state->Scopes[i];
+        if (scope->Name[0] == '\0' || scope->Skipped == 0)
+            continue;
+        if (scope->Count > 0)
+        {
+            double scale     = double(scope->Count + scope->Skipped) / double(scope->Count);
+            scope->TotalMs  *= scale;
+            scope->OnCpuMs  *= scale;
+            scope->OffCpuMs *= scale;
+        }
+        scope->Count += scope->Skipped;
+    }
+}
+
+/// @summary Order scope statistics by descending total duration, for use with qsort.
+static int compare_total(void const *a, void const *b)
+{
+    scope_stats_t const *sa = *(scope_stats_t const**) a;
+    scope_stats_t const *sb = *(scope_stats_t const**) b;
+    if (sa->TotalMs > sb->TotalMs) return -1;
+    if (sa->TotalMs < sb->TotalMs) return +1;
+    return 0;
+}
+
+/// @summary Print the scope statistics, ordered by descending total duration.
+/// @param state The scopes command state.
+/// @param fp The output stream.
+static void print_scopes(scopes_state_t *state, FILE *fp)
+{
+    static char const *SOURCE_NAME[ETW_SOURCE_COUNT] = { "MAIN", "TASK", "INPUT", "SYNC", "FILEIO" };
+    scope_stats_t     **order = (scope_stats_t**) malloc((state->ScopeCount + 1) * sizeof(scope_stats_t*));
+    uint32_t            count = 0;
+    if (order == NULL)
+    {
+        fprintf(stderr, "ERROR: Unable to allocate scope list.\n");
+        return;
+    }
+    for (uint32_t i = 0; i < SCOPES_MAX_SCOPES; ++i)
+    {
+        if (state->Scopes[i].Name[0] != '\0')
+            order[count++] = &state->Scopes[i];
+    }
+    qsort(order, count, sizeof(scope_stats_t*), compare_total);
+
+    fprintf(fp, "%-5s %-40s %8s %8s %8s %12s %12s %12s %12s %6s\n", "Src", "Scope", "Count", "Elided", "Skipped",
+            "Total (ms)", "Avg (ms)", "OnCpu (ms)", "OffCpu (ms)", "Off%");
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        scope_stats_t const *scope = order[i];
+        fprintf(fp, "%-5s %-40s %8u %8u %8u %12.3f %12.3f ", SOURCE_NAME[scope->Source], scope->Name,
+                scope->Count, scope->Elided, scope->Skipped, scope->TotalMs, scope->TotalMs / scope->Count);
+        if (scope->CpuCount > 0)
+        {   // report per-instance averages over the instances that were measured.
+            double measured = scope->OnCpuMs + scope->OffCpuMs;
+            fprintf(fp, "%12.3f %12.3f %5.1f%%\n", scope->OnCpuMs / scope->CpuCount, scope->OffCpuMs / scope->CpuCount,
+                    measured > 0.0 ? (100.0 * scope->OffCpuMs) / measured : 0.0);
+        }
+        else fprintf(fp, "%12s %12s %6s\n", "-", "-", "-");
+    }
+    if (state->Overflow > 0)
+    {
+        fprintf(fp, "(%u scopes not shown; too many distinct names)\n", state->Overflow);
+    }
+    free(order);
+}
+
+/*///////////////////////
+//  Public Functions   //
+///////////////////////*/
+int cmd_scopes(int argc, char **argv)
+{
+    char const     *inputs[SCOPES_MAX_INPUTS];
+    size_t          ninput = 0;
+    scopes_state_t *state  = NULL;
+    etw_time_range_t range = { 0.0, -1.0, 0 };
+
+    for (int i = 0; i < argc; ++i)
+    {
+        if (etw_range_option(argc, argv, &i, &range))
+            continue;
+        else if (argv[i][0] != '-' && ninput < SCOPES_MAX_INPUTS)
+            inputs[ninput++] = argv[i];
+        else
+        {
+            print_usage();
+            return EXIT_FAILURE;
+        }
+    }
+    if (ninput == 0)
+    {
+        fprintf(stderr, "ERROR: Missing argument INFILE.\n\n");
+        print_usage();
+        return EXIT_FAILURE;
+    }
+    if ((state = (scopes_state_t*) calloc(1, sizeof(scopes_state_t))) == NULL)
+    {
+        fprintf(stderr, "ERROR: Unable to allocate scope table.\n");
+        return EXIT_FAILURE;
+    }
+    if (!etw_process_range(inputs, ninput, &range, scopes_event, state))
+    {
+        free(state);
+        return EXIT_FAILURE;
+    }
+    scale_sampled(state);
+    print_scopes(state, stdout);
+    free(state);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,268 @@
+/*/////////////////////////////////////////////////////////////////////////////
+/// @summary Implements starting, querying and stopping the trace sessions
+/// that collect events from the custom providers.
+/// @author Russell Klenk (contact@russellklenk.com)
+///////////////////////////////////////////////////////////////////////////80*/
+
+/*////////////////
+//   Includes   //
+////////////////*/
+#include "ETWAnalyze.h"
+
+/*/////////////////
+//   Constants   //
+/////////////////*/
+/// @summary Define the maximum length of the session name and log file path
+/// stored after the EVENT_TRACE_PROPERTIES structure, in bytes.
+#define MAX_SESSION_NAME     256
+#define MAX_LOGFILE_PATH     1024
+
+/// @summary Define the total size of the EVENT_TRACE_PROPERTIES allocation.
+#define PROPERTIES_SIZE      (sizeof(EVENT_TRACE_PROPERTIES) + MAX_SESSION_NAME + MAX_LOGFILE_PATH)
+
+/*///////////////////////
+//   Local Functions   //
+///////////////////////*/
+/// @summary Allocate and zero-initialize an EVENT_TRACE_PROPERTIES structure with
+/// space for the session name and log file path.
+/// @return The properties structure. Free with free().
+static EVENT_TRACE_PROPERTIES* properties_alloc(void)
+{
+    EVENT_TRACE_PROPERTIES *props = (EVENT_TRACE_PROPERTIES*) calloc(1, PROPERTIES_SIZE);
+    if (props != NULL)
+    {
+        props->Wnode.BufferSize    = (ULONG) PROPERTIES_SIZE;
+        props->LoggerNameOffset    = (ULONG) sizeof(EVENT_TRACE_PROPERTIES);
+        props->LogFileNameOffset   = (ULONG) sizeof(EVENT_TRACE_PROPERTIES) + MAX_SESSION_NAME;
+    }
+    return props;
+}
+
+/// @summary Copy the statistics out of a properties structure returned by ControlTrace().
+/// @param props The properties structure.
+/// @param stats The statistics to populate.
+static void properties_stats(EVENT_TRACE_PROPERTIES const *props, etw_session_stats_t *stats)
+{
+    stats->EventsLost  = props->EventsLost;
+    stats->BuffersLost = props->RealTimeBuffersLost + props->LogBuffersLost;
+    stats->Buffers     = props->NumberOfBuffers;
+    stats->FreeBuffers = props->FreeBuffers;
+    stats->Written     = props->BuffersWritten;
+}
+
+/// @summary Stop a session by name. Used to clean up sessions left running by
+/// an earlier instance that did not exit cleanly.
+/// @param name The name of the session.
+static void stop_by_name(char const *name)
+{
+    EVENT_TRACE_PROPERTIES *props = properties_alloc();
+    if (props != NULL)
+    {
+        ControlTraceA(0, name, props, EVENT_TRACE_CONTROL_STOP);
+        free(props);
+    }
+}
+
+/// @summary Parse a comma-separated list of provider names, as accepted by -providers.
+/// @param list The list, for example "main,fileio".
+/// @param mask On return, stores the bitmask for etw_session_config_t::Providers.
+/// @return true if every name in the list was recognized.
+static bool parse_providers(char const *list, uint32_t *mask)
+{
+    static char const *NAMES[ETW_SOURCE_COUNT] = { "main", "task", "input", "sync", "fileio" };
+    uint32_t           bits = 0;
+    while (*list != '\0')
+    {
+        char const *end = strchr(list, ',');
+        size_t      len = end != NULL ? size_t(end - list) : strlen(list);
+        uint32_t    bit = 0;
+        for (uint32_t i = 0; i < ETW_SOURCE_COUNT && bit == 0; ++i)
+        {
+            if (strlen(NAMES[i]) == len && _strnicmp(NAMES[i], list, len) == 0)
+                bit = 1U << i;
+        }
+        if (bit == 0)
+        {
+            fprintf(stderr, "ERROR: Unknown provider \'%.*s\'.\n", int(len), list);
+            return false;
+        }
+        bits |= bit;
+        list += len;
+        if (*list == ',') list++;
+    }
+    *mask = bits;
+    return (bits != 0);
+}
+
+/// @summary Retrieve the number of logical processors in all processor groups.
+/// @return The number of logical processors, which is always at least one.
+static uint32_t processor_count(void)
+{
+    DWORD count = GetActiveProcessorCount(ALL_PROCESSOR_GROUPS);
+    return count > 0 ? uint32_t(count) : 1;
+}
+
+/*///////////////////////
+//  Public Functions   //
+///////////////////////*/
+bool etw_session_start(etw_session_config_t const *config, etw_session_t *session)
+{
+    EVENT_TRACE_PROPERTIES *props  = NULL;
+    GUID const *providers[ETW_SOURCE_COUNT] =
+    {
+        &ETW_MAIN_THREAD_GUID,
+        &ETW_TASK_THREAD_GUID,
+        &ETW_USER_INPUT_GUID,
+        &ETW_SYNC_GUID,
+        &ETW_FILE_IO_GUID
+    };
+    ULONG result = ERROR_SUCCESS;
+
+    session->Handle  = 0;
+    strncpy(session->Name, config->SessionName, sizeof(session->Name) - 1);
+    session->Name[sizeof(session->Name)-1] = '\0';
+
+    if ((props = properties_alloc()) == NULL)
+    {
+        fprintf(stderr, "ERROR: Unable to allocate session properties.\n");
+        return false;
+    }
+    props->Wnode.Flags         = WNODE_FLAG_TRACED_GUID;
+    props->Wnode.ClientContext = 1; // QueryPerformanceCounter timestamps
+    props->BufferSize          = config->BufferSize;
+    props->MinimumBuffers      = config->MinBuffers;
+    props->MaximumBuffers      = config->MaxBuffers;
+    if (config->PerCpuBuffers != 0)
+    {   // the logger keeps a separate set of buffers for each processor and a
+        // writer reserves space in the buffer of the processor it's running on
+        // with a single interlocked add. sizing by processor count keeps memory
+        // proportional to the core count, however many threads are emitting.
+        props->MinimumBuffers  = config->PerCpuBuffers * processor_count();
+        props->MaximumBuffers  = props->MinimumBuffers * 2;
+    }
+    props->FlushTimer          = config->FlushTimer;
+    props->LogFileMode         = config->LogFileMode;
+    if (config->LogFile != NULL)
+    {   // log to a file. the path must be copied into the trailing storage.
+        // when splitting, the logger substitutes an increasing counter for
+        // the %d in the path each time the current file reaches MaxFileSize.
+        if (config->MaxFileSize != 0)
+        {
+            props->LogFileMode    |= EVENT_TRACE_FILE_MODE_NEWFILE;
+            props->MaximumFileSize = config->MaxFileSize;
+        }
+        else if (config->CircularSize != 0)
+        {   // when the file is full, the logger overwrites the oldest buffers.
+            props->LogFileMode    |= EVENT_TRACE_FILE_MODE_CIRCULAR;
+            props->MaximumFileSize = config->CircularSize;
+        }
+        else props->LogFileMode   |= EVENT_TRACE_FILE_MODE_SEQUENTIAL;
+        strncpy((char*) props + props->LogFileNameOffset, config->LogFile, MAX_LOGFILE_PATH - 1);
+    }
+    else
+    {   // deliver events to a real-time consumer. if the consumer falls behind,
+        // ETW discards whole buffers and counts them in RealTimeBuffersLost;
+        // the threads writing events are never blocked.
+        props->LogFileMode    |= EVENT_TRACE_REAL_TIME_MODE;
+        props->LogFileNameOffset = 0;
+    }
+
+    if ((result = StartTraceA(&session->Handle, session->Name, props)) == ERROR_ALREADY_EXISTS)
+    {   // a previous instance didn't clean up, or is still running; stop it and try again.
+        fprintf(stdout, "STATUS: Stopping the existing session \'%s\'.\n", session->Name);
+        stop_by_name(session->Name);
+        result = StartTraceA(&session->Handle, session->Name, props);
+    }
+    free(props);
+    if (result != ERROR_SUCCESS)
+    {
+        if (result == ERROR_ACCESS_DENIED)
+            fprintf(stderr, "ERROR: Starting a trace session requires administrator privileges.\n");
+        else
+            fprintf(stderr, "ERROR: Unable to start trace session \'%s\': 0x%08X.\n", session->Name, result);
+        session->Handle = 0;
+        return false;
+    }
+
+    for (size_t i = 0; i < ETW_SOURCE_COUNT; ++i)
+    {   // the masks apply to this session only; other sessions keep their own.
+        if (config->Providers != 0 && (config->Providers & (1U << i)) == 0)
+            continue;
+        result = EnableTraceEx2(session->Handle, providers[i], EVENT_CONTROL_CODE_ENABLE_PROVIDER, config->Level, config->Keywords, 0, 0, NULL);
+        if (result != ERROR_SUCCESS)
+        {
+            fprintf(stderr, "ERROR: Unable to enable provider %u on session \'%s\': 0x%08X.\n", unsigned(i), session->Name, result);
+            etw_session_stop(session, NULL);
+            return false;
+        }
+    }
+    return true;
+}
+
+bool etw_session_option(int argc, char **argv, int *i, etw_session_config_t *config)
+{
+    if (*i + 1 >= argc)
+        return false;
+    if (strcmp(argv[*i], "-name") == 0)
+        config->SessionName = argv[++(*i)];
+    else if (strcmp(argv[*i], "-keywords") == 0)
+        config->Keywords    = _strtoui64(argv[++(*i)], NULL, 0);
+    else if (strcmp(argv[*i], "-level") == 0)
+        config->Level       = (UCHAR) strtoul(argv[++(*i)], NULL, 0);
+    else if (strcmp(argv[*i], "-providers") == 0)
+        return parse_providers(argv[++(*i)], &config->Providers);
+    else
+        return false;
+    return true;
+}
+
+void etw_session_usage(FILE *fp, char const *default_name)
+{
+    fprintf(fp, "  -name:       The name of the trace session (default %s). Sessions with\n", default_name);
+    fprintf(fp, "               different names run side by side, each with its own buffers,\n");
+    fprintf(fp, "               keywords and level; a session with the same name is stopped.\n");
+    fprintf(fp, "  -keywords:   The keyword mask to enable (default 0xFFFFFFFFFFFFFFFF): 0x1 markers,\n");
+    fprintf(fp, "               0x2 scopes, flows, tasks, clicks, keys and file opens, 0x4 mouse\n");
+    fprintf(fp, "               moves and file reads and views, 0x8 scope CPU times, 0x10 waits,\n");
+    fprintf(fp, "               0x20 samples, 0x40 function calls, 0x80 counters, 0x100 overhead\n");
+    fprintf(fp, "               calibration probes. Thread names, lost events and overhead\n");
+    fprintf(fp, "               reports go to every session.\n");
+    fprintf(fp, "  -level:      The maximum level to enable, from 1 (critical) to 5 (verbose, the default).\n");
+    fprintf(fp, "  -providers:  A comma-separated list of the providers to enable, from main, task,\n");
+    fprintf(fp, "               input, sync and fileio (default all).\n");
+}
+
+bool etw_session_query(etw_session_t *session, etw_session_stats_t *stats)
+{
+    EVENT_TRACE_PROPERTIES *props = properties_alloc();
+    ULONG                   result;
+    if (props == NULL)
+    {
+        return false;
+    }
+    if ((result = ControlTraceA(session->Handle, NULL, props, EVENT_TRACE_CONTROL_QUERY)) == ERROR_SUCCESS)
+    {
+        properties_stats(props, stats);
+    }
+    free(props);
+    return (result == ERROR_SUCCESS);
+}
+
+bool etw_session_stop(etw_session_t *session, etw_session_stats_t *stats)
+{
+    EVENT_TRACE_PROPERTIES *props = properties_alloc();
+    ULONG                   result;
+    if (props == NULL || session->Handle == 0)
+    {
+        free(props);
+        return false;
+    }
+    if ((result = ControlTraceA(session->Handle, NULL, props, EVENT_TRACE_CONTROL_STOP)) == ERROR_SUCCESS)
+    {
+        if (stats != NULL) properties_stats(props, stats);
+    }
+    else fprintf(stderr, "ERROR: Unable to stop trace session \'%s\': 0x%08X.\n", session->Name, result);
+    session->Handle = 0;
+    free(props);
+    return (result == ERROR_SUCCESS);
+}
@@ -0,0 +1,277 @@
+/*/////////////////////////////////////////////////////////////////////////////
+/// @summary Resolves the addresses reported by the FunctionEnter and FunctionLeave
+/// events to function names, using DbgHelp and the PDBs of the modules described
+/// by the Module events in the same trace.
+/// @author Russell Klenk (contact@russellklenk.com)
+///////////////////////////////////////////////////////////////////////////80*/
+
+/*////////////////
+//   Includes   //
+////////////////*/
+#include "ETWAnalyze.h"
+#include <DbgHelp.h>
+
+/*/////////////////
+//   Constants   //
+/////////////////*/
+/// @summary Define the maximum number of processes and modules per process for which
+/// symbols are loaded. Addresses in other modules are reported as hex.
+#define SYMBOLS_MAX_PROCESSES    64
+#define SYMBOLS_MAX_MODULES      64
+
+/// @summary Define the number of slots in the table of resolved names. Must be a power
+/// of two. Once the table is three-quarters full, further names are resolved on each use.
+#define SYMBOLS_CACHE_SIZE       16384
+
+/// @summary Define the maximum length of a resolved name, including the module name.
+#define SYMBOLS_NAME_SIZE        512
+
+/*//////////////////
+//   Data Types   //
+//////////////////*/
+/// @summary Typedefs for the DbgHelp functions resolved at runtime, so that the analyzer
+/// runs without dbghelp.dll when no trace contains function events.
+typedef DWORD   (WINAPI *SymSetOptionsFn)(DWORD);
+typedef BOOL    (WINAPI *SymInitializeFn)(HANDLE, PCSTR, BOOL);
+typedef BOOL    (WINAPI *SymCleanupFn)(HANDLE);
+typedef DWORD64 (WINAPI *SymLoadModuleExFn)(HANDLE, HANDLE, PCSTR, PCSTR, DWORD64, DWORD, PMODLOAD_DATA, DWORD);
+typedef BOOL    (WINAPI *SymFromAddrFn)(HANDLE, DWORD64, PDWORD64, PSYMBOL_INFO);
+
+/// @summary A module described by a Module event.
+struct etw_symbol_module_t
+{
+    uint64_t     Base;        /// The address at which the module was loaded.
+    uint32_t     Size;        /// The size of the module image, in bytes.
+    char const  *Name;        /// The file name of the module, pointing into Path.
+    char         Path[MAX_PATH]; /// The path of the module file in the traced process.
+};
+
+/// @summary The modules loaded by one traced process, and the DbgHelp session holding
+/// their symbols. DbgHelp identifies a session by an arbitrary handle value, so each
+/// process is given a unique fake handle.
+struct etw_symbol_process_t
+{
+    uint32_t     ProcessId;   /// The identifier of the traced process.
+    HANDLE       Handle;      /// The value identifying the DbgHelp session.
+    bool         Initialized; /// true if SymInitialize succeeded for Handle.
+    uint32_t     ModuleCount; /// The number of valid entries in Modules.
+    etw_symbol_module_t Modules[SYMBOLS_MAX_MODULES];
+};
+
+/// @summary A resolved name in the cache. Name is NULL for an empty slot.
+struct etw_symbol_entry_t
+{
+    uint32_t     ProcessId;   /// The identifier of the traced process.
+    uint64_t     Address;     /// The address of the function.
+    char        *Name;        /// The resolved name, allocated with malloc.
+};
+
+/// @summary The symbol state for one pass over a set of traces.
+struct etw_symbols_t
+{
+    HMODULE           DbgHelp;  /// The handle of dbghelp.dll, or NULL.
+    bool              Resolved; /// true once loading dbghelp.dll has been attempted.
+    SymSetOptionsFn   SymSetOptions_Func;
+    SymInitializeFn   SymInitialize_Func;
+    SymCleanupFn      SymCleanup_Func;
+    SymLoadModuleExFn SymLoadModuleEx_Func;
+    SymFromAddrFn     SymFromAddr_Func;
+    uint32_t          ProcessCount; /// The number of valid entries in Processes.
+    uint32_t          CacheCount;   /// The number of occupied slots in Cache.
+    etw_symbol_process_t Processes[SYMBOLS_MAX_PROCESSES];
+    etw_symbol_entry_t   Cache[SYMBOLS_CACHE_SIZE];
+    char              Scratch[SYMBOLS_NAME_SIZE]; /// Holds a name that could not be cached.
+};
+
+/*///////////////////////
+//   Local Functions   //
+///////////////////////*/
+/// @summary Load dbghelp.dll and resolve the functions used here, the first time a symbol
+/// is needed. DbgHelp is searched for next to the analyzer first, since the copy in the
+/// system directory may be too old to read current PDBs.
+/// @param symbols The symbol state.
+/// @return true if all of the functions are available.
+static bool symbols_load_dbghelp(etw_symbols_t *symbols)
+{
+    if (symbols->Resolved)
+        return symbols->SymFromAddr_Func != NULL;
+
+    symbols->Resolved = true;
+    if ((symbols->DbgHelp = LoadLibraryA("dbghelp.dll")) == NULL)
+    {
+        fprintf(stderr, "WARNING: Unable to load dbghelp.dll; function addresses will not be resolved.\n");
+        return false;
+    }
+    symbols->SymSetOptions_Func   = (SymSetOptionsFn  ) GetProcAddress(symbols->DbgHelp, "SymSetOptions");
+    symbols->SymInitialize_Func   = (SymInitializeFn  ) GetProcAddress(symbols->DbgHelp, "SymInitialize");
+    symbols->SymCleanup_Func      = (SymCleanupFn     ) GetProcAddress(symbols->DbgHelp, "SymCleanup");
+    symbols->SymLoadModuleEx_Func = (SymLoadModuleExFn) GetProcAddress(symbols->DbgHelp, "SymLoadModuleEx");
+    symbols->SymFromAddr_Func     = (SymFromAddrFn    ) GetProcAddress(symbols->DbgHelp, "SymFromAddr");
+    if (symbols->SymSetOptions_Func   == NULL || symbols->SymInitialize_Func == NULL ||
+        symbols->SymCleanup_Func      == NULL || symbols->SymLoadModuleEx_Func == NULL)
+    {
+        fprintf(stderr, "WARNING: dbghelp.dll is missing required functions; function addresses will not be resolved.\n");
+        symbols->SymFromAddr_Func = NULL;
+        return false;
+    }
+    symbols->SymSetOptions_Func(SYMOPT_UNDNAME | SYMOPT_DEFERRED_LOADS | SYMOPT_FAIL_CRITICAL_ERRORS);
+    return symbols->SymFromAddr_Func != NULL;
+}
+
+/// @summary Find the state for a traced process, adding it if necessary.
+/// @param symbols The symbol state.
+/// @param pid The identifier of the traced process.
+/// @return The process state, or NULL if too many processes have been seen.
+static etw_symbol_process_t* symbols_process(etw_symbols_t *symbols, uint32_t pid)
+{
+    etw_symbol_process_t *process = NULL;
+    for (uint32_t i = 0; i < symbols->ProcessCount; ++i)
+    {
+        if (symbols->Processes[i].ProcessId == pid)
+            return &symbols->Processes[i];
+    }
+    if (symbols->ProcessCount == SYMBOLS_MAX_PROCESSES)
+        return NULL;
+
+    process = &symbols->Processes[symbols->ProcessCount];
+    process->ProcessId   = pid;
+    process->Handle      = (HANDLE)(uintptr_t)(0x10000 + symbols->ProcessCount);
+    process->Initialized = false;
+    process->ModuleCount = 0;
+    if (symbols_load_dbghelp(symbols))
+    {   // no process is attached, so modules are only loaded when described by an event.
+        process->Initialized = symbols->SymInitialize_Func(process->Handle, NULL, FALSE) ? true : false;
+    }
+    symbols->ProcessCount++;
+    return process;
+}
+
+/// @summary Find the module containing an address in a traced process.
+/// @param process The process state.
+/// @param address The address.
+/// @return The module, or NULL if no Module event described it.
+static etw_symbol_module_t const* symbols_find_module(etw_symbol_process_t const *process, uint64_t address)
+{
+    for (uint32_t i = 0; i < process->ModuleCount; ++i)
+    {
+        etw_symbol_module_t const *module = &process->Modules[i];
+        if (address - module->Base < module->Size)
+            return module;
+    }
+    return NULL;
+}
+
+/// @summary Format the name of a function as "module!symbol", or "module+0xOFFSET" if
+/// the module has no symbols, or the address in hex if the module is not known.
+/// @param symbols The symbol state.
+/// @param pid The identifier of the traced process.
+/// @param address The address of the function.
+/// @param buf The output buffer, of SYMBOLS_NAME_SIZE bytes.
+static void symbols_format(etw_symbols_t *symbols, uint32_t pid, uint64_t address, char *buf)
+{
+    etw_symbol_process_t      *process = symbols_process(symbols, pid);
+    etw_symbol_module_t const *module  = process != NULL ? symbols_find_module(process, address) : NULL;
+    uint64_t                   storage[(sizeof(SYMBOL_INFO) + SYMBOLS_NAME_SIZE + 7) / 8];
+    SYMBOL_INFO               *info    = (SYMBOL_INFO*) storage;
+    DWORD64                    disp    = 0;
+
+    if (module == NULL)
+    {
+        _snprintf_s(buf, SYMBOLS_NAME_SIZE, _TRUNCATE, "0x%016llX", (unsigned long long) address);
+        return;
+    }
+    memset(info, 0, sizeof(SYMBOL_INFO));
+    info->SizeOfStruct = sizeof(SYMBOL_INFO);
+    info->MaxNameLen   = SYMBOLS_NAME_SIZE - 1;
+    if (process->Initialized && symbols->SymFromAddr_Func(process->Handle, address, &disp, info))
+    {
+        if (disp == 0) _snprintf_s(buf, SYMBOLS_NAME_SIZE, _TRUNCATE, "%s!%s", module->Name, info->Name);
+        else _snprintf_s(buf, SYMBOLS_NAME_SIZE, _TRUNCATE, "%s!%s+0x%llX", module->Name, info->Name, (unsigned long long) disp);
+        return;
+    }
+    _snprintf_s(buf, SYMBOLS_NAME_SIZE, _TRUNCATE, "%s+0x%llX", module->Name, (unsigned long long)(address - module->Base));
+}
+
+/*///////////////////////
+//  Public Functions   //
+///////////////////////*/
+etw_symbols_t* etw_symbols_create(void)
+{
+    return (etw_symbols_t*) calloc(1, sizeof(etw_symbols_t));
+}
+
+void etw_symbols_delete(etw_symbols_t *symbols)
+{
+    if (symbols == NULL)
+        return;
+    for (uint32_t i = 0; i < SYMBOLS_CACHE_SIZE; ++i)
+    {
+        free(symbols->Cache[i].Name);
+    }
+    for (uint32_t i = 0; i < symbols->ProcessCount; ++i)
+    {
+        if (symbols->Processes[i].Initialized)
+            symbols->SymCleanup_Func(symbols->Processes[i].Handle);
+    }
+    if (symbols->DbgHelp != NULL)
+    {
+        FreeLibrary(symbols->DbgHelp);
+    }
+    free(symbols);
+}
+
+void etw_symbols_module(etw_symbols_t *symbols, uint32_t pid, uint64_t base, uint32_t size, char const *path)
+{
+    etw_symbol_process_t *process = symbols_process(symbols, pid);
+    etw_symbol_module_t  *module  = NULL;
+    if (process == NULL)
+        return;
+    for (uint32_t i = 0; i < process->ModuleCount; ++i)
+    {   // each session that enables the provider sees the module described again.
+        if (process->Modules[i].Base == base)
+            return;
+    }
+    if (process->ModuleCount == SYMBOLS_MAX_MODULES)
+        return;
+
+    module = &process->Modules[process->ModuleCount++];
+    module->Base = base;
+    module->Size = size;
+    strncpy_s(module->Path, MAX_PATH, path, _TRUNCATE);
+    module->Name = module->Path;
+    for (char const *s = module->Path; *s != '\0'; ++s)
+    {
+        if (*s == '\\' || *s == '/') module->Name = s + 1;
+    }
+    if (process->Initialized)
+    {   // the PDB is located through the image, so the module file must still exist.
+        symbols->SymLoadModuleEx_Func(process->Handle, NULL, module->Path, NULL, base, size, NULL, 0);
+    }
+}
+
+char const* etw_symbols_name(etw_symbols_t *symbols, uint32_t pid, uint64_t address)
+{
+    uint32_t const mask  = SYMBOLS_CACHE_SIZE - 1;
+    uint32_t       index = uint32_t((address ^ (address >> 32) ^ pid) * 2654435761U) & mask;
+    for (uint32_t i = 0; i < SYMBOLS_CACHE_SIZE; ++i, index = (index + 1) & mask)
+    {
+        etw_symbol_entry_t *entry = &symbols->Cache[index];
+        if (entry->Name == NULL)
+            break;
+        if (entry->Address == address && entry->ProcessId == pid)
+            return entry->Name;
+    }
+    symbols_format(symbols, pid, address, symbols->Scratch);
+    if (symbols->CacheCount < (SYMBOLS_CACHE_SIZE / 4) * 3 && symbols->Cache[index].Name == NULL)
+    {
+        etw_symbol_entry_t *entry = &symbols->Cache[index];
+        if ((entry->Name = _strdup(symbols->Scratch)) != NULL)
+        {
+            entry->ProcessId = pid;
+            entry->Address   = address;
+            symbols->CacheCount++;
+            return entry->Name;
+        }
+    }
+    return symbols->Scratch;
+}
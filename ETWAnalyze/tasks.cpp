@@ -0,0 +1,280 @@
+/*/////////////////////////////////////////////////////////////////////////////
+/// @summary Implements the 'tasks' command, which summarizes the latency of the
+/// task contexts recorded in one or more .etl files. The latency of each task,
+/// from creation to completion, is split into the time it was resumed on some
+/// thread and the time it spent suspended, waiting to be resumed.
+/// @author Russell Klenk (contact@russellklenk.com)
+///////////////////////////////////////////////////////////////////////////80*/
+
+/*////////////////
+//   Includes   //
+////////////////*/
+#include "ETWAnalyze.h"
+
+/*/////////////////
+//   Constants   //
+/////////////////*/
+/// @summary Define the maximum number of input files accepted on the command line.
+#define TASKS_MAX_INPUTS     64
+
+/// @summary Define the maximum number of distinct task names tracked.
+/// This value must be a power of two greater than zero.
+#define TASKS_MAX_NAMES      1024
+
+/// @summary Define the maximum length of a tracked task name, including the NULL.
+#define TASKS_MAX_NAME       64
+
+/// @summary Define the maximum number of slowest task instances that may be listed.
+#define TASKS_MAX_SLOWEST    64
+
+/*//////////////////
+//   Data Types   //
+//////////////////*/
+/// @summary Latency statistics for all completed tasks with a single name.
+struct task_stats_t
+{
+    char         Name[TASKS_MAX_NAME]; /// The task name.
+    uint32_t     Count;       /// The number of tasks that completed.
+    double       TotalMs;     /// The sum of the task lifetimes, in milliseconds.
+    double       MaxMs;       /// The longest task lifetime, in milliseconds.
+    double       RunningMs;   /// The sum of the time the tasks were resumed, in milliseconds.
+    uint64_t     Resumes;     /// The total number of times the tasks were resumed.
+    uint64_t     Migrations;  /// The total number of times the tasks moved to a different thread.
+};
+
+/// @summary A single completed task, kept in the list of slowest tasks.
+struct task_instance_t
+{
+    char         Name[TASKS_MAX_NAME]; /// The task name.
+    uint64_t     TaskId;      /// The identifier of the task.
+    uint32_t     ProcessId;   /// The identifier of the process that owns the task.
+    uint32_t     ThreadId;    /// The thread on which the task completed.
+    float        LifetimeMs;  /// The time from creation to completion, in milliseconds.
+    float        RunningMs;   /// The time the task was resumed, in milliseconds.
+    uint32_t     Resumes;     /// The number of times the task was resumed.
+};
+
+/// @summary The table of task statistics built while processing the input files.
+struct tasks_state_t
+{
+    task_stats_t    Names[TASKS_MAX_NAMES]; /// Open-addressed table of task statistics.
+    uint32_t        NameCount;  /// The number of used entries in Names.
+    uint32_t        Overflow;   /// The number of tasks dropped because the table was full.
+    task_instance_t Slowest[TASKS_MAX_SLOWEST]; /// The slowest tasks, in descending order of lifetime.
+    uint32_t        SlowestCount; /// The number of entries in use in Slowest.
+    uint32_t        SlowestMax; /// The number of slowest tasks to list.
+};
+
+/*///////////////////////
+//   Local Functions   //
+///////////////////////*/
+/// @summary Print usage information for the tasks command.
+static void print_usage(void)
+{
+    fprintf(stdout, "USAGE: etwanalyze.exe tasks [-slowest N] [-from MS] [-to MS] [-thread TID] INFILE [INFILE...]\n");
+    fprintf(stdout, "  Summarize the latency of task contexts created with ETWTaskCreate, split\n");
+    fprintf(stdout, "  into the time each task was running and the time it was suspended.\n");
+    fprintf(stdout, "  -slowest: Also list the N slowest tasks (default 10, at most %d).\n", TASKS_MAX_SLOWEST);
+    etw_range_usage(stdout);
+    fprintf(stdout, "\n");
+}
+
+/// @summary Compute the FNV-1a hash of a NULL-terminated string.
+/// @param str The string to hash.
+/// @return The 32-bit hash value.
+static uint32_t hash_string(char const *str)
+{
+    uint32_t h = 2166136261U;
+    while (*str)
+    {
+        h ^= (uint8_t) *str++;
+        h *= 16777619U;
+    }
+    return h;
+}
+
+/// @summary Find or insert the statistics entry for a task name.
+/// @param state The tasks command state.
+/// @param name The task name.
+/// @return The entry, or NULL if the table is full.
+static task_stats_t* find_task(tasks_state_t *state, char const *name)
+{
+    uint32_t mask  = TASKS_MAX_NAMES - 1;
+    uint32_t index = hash_string(name) & mask;
+    for (uint32_t i = 0; i < TASKS_MAX_NAMES; ++i, index = (index + 1) & mask)
+    {
+        task_stats_t *task = &state->Names[index];
+        if (task->Name[0] == '\0')
+        {
+            if (state->NameCount == TASKS_MAX_NAMES - 1)
+                return NULL;   // keep one slot free so lookups terminate.
+            strncpy(task->Name, name[0] != '\0' ? name : "(unnamed)", TASKS_MAX_NAME - 1);
+            task->Name[TASKS_MAX_NAME-1] = '\0';
+            state->NameCount++;
+            return task;
+        }
+        if (strncmp(task->Name, name[0] != '\0' ? name : "(unnamed)", TASKS_MAX_NAME - 1) == 0)
+        {
+            return task;
+        }
+    }
+    return NULL;
+}
+
+/// @summary Insert a completed task into the list of slowest tasks, if it qualifies.
+/// @param state The tasks command state.
+/// @param ev The TaskComplete event.
+static void track_slowest(tasks_state_t *state, etw_event_t const *ev)
+{
+    uint32_t pos = state->SlowestCount;
+    while (pos > 0 && state->Slowest[pos-1].LifetimeMs < ev->Duration)
+    {
+        pos--;
+    }
+    if (pos >= state->SlowestMax)
+        return;
+    if (state->SlowestCount < state->SlowestMax)
+        state->SlowestCount++;
+    memmove(&state->Slowest[pos+1], &state->Slowest[pos], (state->SlowestCount - pos - 1) * sizeof(task_instance_t));
+
+    task_instance_t *task = &state->Slowest[pos];
+    strncpy(task->Name, ev->Text, TASKS_MAX_NAME - 1);
+    task->Name[TASKS_MAX_NAME-1] = '\0';
+    task->TaskId     = ev->Id;
+    task->ProcessId  = ev->ProcessId;
+    task->ThreadId   = ev->ThreadId;
+    task->LifetimeMs = ev->Duration;
+    task->RunningMs  = ev->OnCpu;
+    task->Resumes    = (uint32_t) ev->Value[0];
+}
+
+/// @summary Receives each decoded event and accumulates task statistics.
+/// @param ev The decoded event.
+/// @param context Pointer to the tasks_state_t.
+static void tasks_event(etw_event_t const *ev, void *context)
+{
+    tasks_state_t *state = (tasks_state_t*) context;
+    task_stats_t  *task  = NULL;
+    if (ev->Kind != ETW_EVENT_TASK_COMPLETE)
+    {
+        return;
+    }
+    if ((task = find_task(state, ev->Text)) == NULL)
+    {
+        state->Overflow++;
+        return;
+    }
+    task->Count++;
+    task->TotalMs    += ev->Duration;
+    task->RunningMs  += ev->OnCpu < ev->Duration ? ev->OnCpu : ev->Duration;
+    task->Resumes    += (uint32_t) ev->Value[0];
+    task->Migrations += (uint32_t) ev->Value[1];
+    if (ev->Duration > task->MaxMs) task->MaxMs = ev->Duration;
+    track_slowest(state, ev);
+}
+
+/// @summary Order task statistics by descending total lifetime, for use with qsort.
+static int compare_total(void const *a, void const *b)
+{
+    task_stats_t const *ta = *(task_stats_t const**) a;
+    task_stats_t const *tb = *(task_stats_t const**) b;
+    if (ta->TotalMs > tb->TotalMs) return -1;
+    if (ta->TotalMs < tb->TotalMs) return +1;
+    return 0;
+}
+
+/// @summary Print the task statistics, ordered by descending total lifetime, followed by
+/// the slowest individual tasks.
+/// @param state The tasks command state.
+/// @param fp The output stream.
+static void print_tasks(tasks_state_t *state, FILE *fp)
+{
+    task_stats_t **order = (task_stats_t**) malloc((state->NameCount + 1) * sizeof(task_stats_t*));
+    uint32_t       count = 0;
+    if (order == NULL)
+    {
+        fprintf(stderr, "ERROR: Unable to allocate task list.\n");
+        return;
+    }
+    for (uint32_t i = 0; i < TASKS_MAX_NAMES; ++i)
+    {
+        if (state->Names[i].Name[0] != '\0')
+            order[count++] = &state->Names[i];
+    }
+    qsort(order, count, sizeof(task_stats_t*), compare_total);
+
+    fprintf(fp, "%-32s %8s %12s %12s %12s %12s %6s %8s %8s\n", "Task", "Count", "Total (ms)", "Avg (ms)",
+            "Max (ms)", "Running (ms)", "Wait%", "Resumes", "Moves");
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        task_stats_t const *task = order[i];
+        double const        wait = task->TotalMs - task->RunningMs;
+        fprintf(fp, "%-32s %8u %12.3f %12.3f %12.3f %12.3f %5.1f%% %8.1f %8.1f\n", task->Name, task->Count,
+                task->TotalMs, task->TotalMs / task->Count, task->MaxMs, task->RunningMs / task->Count,
+                task->TotalMs > 0.0 ? (100.0 * wait) / task->TotalMs : 0.0,
+                double(task->Resumes) / task->Count, double(task->Migrations) / task->Count);
+    }
+    if (state->Overflow > 0)
+    {
+        fprintf(fp, "(%u tasks not shown; too many distinct names)\n", state->Overflow);
+    }
+    if (state->SlowestCount > 0)
+    {
+        fprintf(fp, "\n%-32s %10s %8s %8s %12s %12s %8s\n", "Slowest", "Task ID", "PID", "TID",
+                "Life (ms)", "Running (ms)", "Resumes");
+        for (uint32_t i = 0; i < state->SlowestCount; ++i)
+        {
+            task_instance_t const *task = &state->Slowest[i];
+            fprintf(fp, "%-32s %10I64u %8u %8u %12.3f %12.3f %8u\n", task->Name, task->TaskId, task->ProcessId,
+                    task->ThreadId, task->LifetimeMs, task->RunningMs, task->Resumes);
+        }
+    }
+    free(order);
+}
+
+/*///////////////////////
+//  Public Functions   //
+///////////////////////*/
+int cmd_tasks(int argc, char **argv)
+{
+    char const      *inputs[TASKS_MAX_INPUTS];
+    size_t           ninput  = 0;
+    uint32_t         slowest = 10;
+    tasks_state_t   *state   = NULL;
+    etw_time_range_t range   = { 0.0, -1.0, 0 };
+
+    for (int i = 0; i < argc; ++i)
+    {
+        if (etw_range_option(argc, argv, &i, &range))
+            continue;
+        else if (strcmp(argv[i], "-slowest") == 0 && i + 1 < argc)
+            slowest = strtoul(argv[++i], NULL, 0);
+        else if (argv[i][0] != '-' && ninput < TASKS_MAX_INPUTS)
+            inputs[ninput++] = argv[i];
+        else
+        {
+            print_usage();
+            return EXIT_FAILURE;
+        }
+    }
+    if (ninput == 0)
+    {
+        fprintf(stderr, "ERROR: Missing argument INFILE.\n\n");
+        print_usage();
+        return EXIT_FAILURE;
+    }
+    if ((state = (tasks_state_t*) calloc(1, sizeof(tasks_state_t))) == NULL)
+    {
+        fprintf(stderr, "ERROR: Unable to allocate task table.\n");
+        return EXIT_FAILURE;
+    }
+    state->SlowestMax = slowest < TASKS_MAX_SLOWEST ? slowest : TASKS_MAX_SLOWEST;
+    if (!etw_process_range(inputs, ninput, &range, tasks_event, state))
+    {
+        free(state);
+        return EXIT_FAILURE;
+    }
+    print_tasks(state, stdout);
+    free(state);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,400 @@
+/*/////////////////////////////////////////////////////////////////////////////
+/// @summary Implements the 'top' command, which attaches to the shared-memory
+/// statistics segment published by the provider DLL in an instrumented process
+/// and periodically prints the hottest scopes over a sliding window. No trace
+/// session is started, and the segment is mapped read-only.
+/// @author Russell Klenk (contact@russellklenk.com)
+///////////////////////////////////////////////////////////////////////////80*/
+
+/*////////////////
+//   Includes   //
+////////////////*/
+#include "ETWAnalyze.h"
+#include <TlHelp32.h>
+#include "ETWProvider/ETWStats.h"
+
+/*/////////////////
+//   Constants   //
+/////////////////*/
+/// @summary Identifies the column used to order the scopes.
+enum top_sort_e
+{
+    TOP_SORT_TOTAL           = 0,  /// Total time spent in the scope over the window.
+    TOP_SORT_COUNT           = 1,  /// Number of instances completed over the window.
+    TOP_SORT_MEAN            = 2,  /// Mean duration over the window.
+    TOP_SORT_P99             = 3   /// 99th percentile duration over the window.
+};
+
+/*//////////////////
+//   Data Types   //
+//////////////////*/
+/// @summary The statistics of one scope aggregated over the sliding window.
+struct top_row_t
+{
+    char         Name[ETW_STATS_MAX_NAME]; /// The scope name.
+    int32_t      Source;      /// Zero for the main thread provider, one for the task thread provider.
+    uint32_t     Count;       /// The number of instances completed over the window.
+    double       Rate;        /// The number of instances completed per second.
+    double       TotalMs;     /// The sum of the durations, in milliseconds.
+    double       MeanMs;      /// The mean duration, in milliseconds.
+    double       P99Ms;       /// The estimated 99th percentile duration, in milliseconds.
+    int64_t      Lifetime;    /// The number of instances completed since the segment was created.
+};
+
+/*///////////////
+//   Globals   //
+///////////////*/
+/// @summary Manual-reset event signaled when the user presses Ctrl+C.
+static HANDLE TOP_EXIT_SIGNAL = NULL;
+
+/// @summary The column used by compare_rows.
+static int    TOP_SORT_KEY    = TOP_SORT_TOTAL;
+
+/*///////////////////////
+//   Local Functions   //
+///////////////////////*/
+/// @summary Print usage information for the top command.
+static void print_usage(void)
+{
+    fprintf(stdout, "USAGE: etwanalyze.exe top -list\n");
+    fprintf(stdout, "       etwanalyze.exe top -p PID [-interval MS] [-n N] [-sort total|count|mean|p99] [-once]\n");
+    fprintf(stdout, "  Show the hottest scopes in a running process, without starting a trace session.\n");
+    fprintf(stdout, "  The process must enable statistics with ETWSetLiveStats(TRUE).\n");
+    fprintf(stdout, "  -list:     List the processes that publish scope statistics.\n");
+    fprintf(stdout, "  -p:        The identifier of the process to attach to.\n");
+    fprintf(stdout, "  -interval: The refresh interval, in milliseconds (default 1000).\n");
+    fprintf(stdout, "  -n:        The number of scopes to show (default 25).\n");
+    fprintf(stdout, "  -sort:     The column to order scopes by (default total).\n");
+    fprintf(stdout, "  -once:     Print the statistics once and exit.\n");
+    fprintf(stdout, "\n");
+}
+
+/// @summary Handle Ctrl+C by signaling the main loop to exit.
+/// @param ctrl_type The type of control signal received.
+/// @return TRUE to indicate the signal was handled.
+static BOOL WINAPI console_handler(DWORD ctrl_type)
+{
+    UNUSED_ARG(ctrl_type);
+    SetEvent(TOP_EXIT_SIGNAL);
+    return TRUE;
+}
+
+/// @summary Open and map the statistics segment of a process, read-only.
+/// @param process_id The identifier of the process.
+/// @param mapping On return, stores the file mapping handle.
+/// @return The segment header, or NULL if the process does not publish statistics.
+static etw_stats_header_t const* stats_open(DWORD process_id, HANDLE *mapping)
+{
+    etw_stats_header_t const *header = NULL;
+    char                      name[64];
+
+    _snprintf(name, sizeof(name), ETW_STATS_MAPPING_FORMATA, process_id);
+    name[sizeof(name)-1] = '\0';
+    if ((*mapping = OpenFileMappingA(FILE_MAP_READ, FALSE, name)) == NULL)
+    {
+        return NULL;
+    }
+    if ((header = (etw_stats_header_t const*) MapViewOfFile(*mapping, FILE_MAP_READ, 0, 0, 0)) == NULL)
+    {
+        CloseHandle(*mapping);
+        *mapping = NULL;
+        return NULL;
+    }
+    if (header->Magic != ETW_STATS_MAGIC || header->Version != ETW_STATS_VERSION ||
+        header->WindowCount != ETW_STATS_WINDOW_COUNT || header->BucketCount != ETW_STATS_BUCKET_COUNT)
+    {   // not initialized yet, or published by an incompatible provider.
+        UnmapViewOfFile(header);
+        CloseHandle(*mapping);
+        *mapping = NULL;
+        return NULL;
+    }
+    return header;
+}
+
+/// @summary Print the processes that publish a statistics segment.
+/// @return The number of processes found.
+static uint32_t list_processes(void)
+{
+    PROCESSENTRY32 entry;
+    HANDLE         snapshot = CreateToolhelp32Snapshot(TH32CS_SNAPPROCESS, 0);
+    uint32_t       count    = 0;
+
+    if (snapshot == INVALID_HANDLE_VALUE)
+    {
+        fprintf(stderr, "ERROR: Unable to enumerate processes: 0x%08X.\n", GetLastError());
+        return 0;
+    }
+    entry.dwSize = sizeof(entry);
+    fprintf(stdout, "%8s %8s %s\n", "PID", "Scopes", "Process");
+    for (BOOL ok = Process32First(snapshot, &entry); ok; ok = Process32Next(snapshot, &entry))
+    {
+        HANDLE                    mapping = NULL;
+        etw_stats_header_t const *header  = stats_open(entry.th32ProcessID, &mapping);
+        if (header != NULL)
+        {
+            fprintf(stdout, "%8u %8d %s\n", header->ProcessId, header->ScopeCount, header->ProcessName);
+            UnmapViewOfFile(header);
+            CloseHandle(mapping);
+            count++;
+        }
+    }
+    CloseHandle(snapshot);
+    if (count == 0)
+    {
+        fprintf(stdout, "No instrumented processes are running.\n");
+    }
+    return count;
+}
+
+/// @summary Estimate a percentile from a log2 histogram, interpolating within the bucket.
+/// @param histogram The bucket counts.
+/// @param count The sum of the bucket counts.
+/// @param fraction The percentile, in [0, 1].
+/// @return The estimated duration, in milliseconds.
+static double histogram_percentile(uint32_t const *histogram, uint32_t count, double fraction)
+{
+    double   target = fraction * count;
+    uint32_t seen   = 0;
+    for (uint32_t i = 0; i < ETW_STATS_BUCKET_COUNT; ++i)
+    {
+        if (histogram[i] > 0 && seen + histogram[i] >= target)
+        {
+            double lo = (i == 0) ? 0.0 : double(1ULL << i);
+            double hi = double(1ULL << (i + 1));
+            return (lo + (hi - lo) * ((target - seen) / histogram[i])) / 1000.0;
+        }
+        seen += histogram[i];
+    }
+    return double(1ULL << ETW_STATS_BUCKET_COUNT) / 1000.0;
+}
+
+/// @summary Aggregate the windows of a scope that fall within the sliding window. The
+/// oldest window in the ring is skipped, since a writer may be recycling it.
+/// @param header The segment header.
+/// @param scope The scope slot.
+/// @param epoch The current window number.
+/// @param span_sec The length of the sliding window, in seconds.
+/// @param row On return, stores the aggregated statistics.
+/// @return true if any instance completed within the sliding window.
+static bool aggregate_scope(etw_stats_header_t const *header, etw_stats_scope_t const *scope, LONG epoch, double span_sec, top_row_t *row)
+{
+    uint32_t histogram[ETW_STATS_BUCKET_COUNT];
+    int64_t  total_us = 0;
+    uint32_t count    = 0;
+
+    memset(histogram, 0, sizeof(histogram));
+    for (uint32_t i = 0; i < header->WindowCount; ++i)
+    {
+        etw_stats_window_t const *window = &scope->Windows[i];
+        LONG const                when   = window->Epoch;
+        if (when <= 0 || when > epoch || when <= epoch - LONG(header->WindowCount - 1))
+            continue;
+        count    += (uint32_t) window->Count;
+        total_us += window->TotalUs;
+        for (uint32_t j = 0; j < ETW_STATS_BUCKET_COUNT; ++j)
+        {
+            histogram[j] += (uint32_t) window->Histogram[j];
+        }
+    }
+    if (count == 0)
+    {
+        return false;
+    }
+    memcpy(row->Name, scope->Name, ETW_STATS_MAX_NAME);
+    row->Name[ETW_STATS_MAX_NAME-1] = '\0';
+    row->Source   = scope->Source;
+    row->Count    = count;
+    row->Rate     = span_sec > 0.0 ? count / span_sec : 0.0;
+    row->TotalMs  = total_us / 1000.0;
+    row->MeanMs   = row->TotalMs / count;
+    row->P99Ms    = histogram_percentile(histogram, count, 0.99);
+    row->Lifetime = scope->TotalCount;
+    return true;
+}
+
+/// @summary Order rows by the column selected with -sort, descending, for use with qsort.
+static int compare_rows(void const *a, void const *b)
+{
+    top_row_t const *ra = (top_row_t const*) a;
+    top_row_t const *rb = (top_row_t const*) b;
+    double           va = 0.0, vb = 0.0;
+    switch (TOP_SORT_KEY)
+    {
+    case TOP_SORT_COUNT: va = ra->Count  ; vb = rb->Count  ; break;
+    case TOP_SORT_MEAN : va = ra->MeanMs ; vb = rb->MeanMs ; break;
+    case TOP_SORT_P99  : va = ra->P99Ms  ; vb = rb->P99Ms  ; break;
+    default            : va = ra->TotalMs; vb = rb->TotalMs; break;
+    }
+    if (va > vb) return -1;
+    if (va < vb) return +1;
+    return strcmp(ra->Name, rb->Name);
+}
+
+/// @summary Move the cursor to the top of the console and clear it, so that each refresh
+/// replaces the previous one. Does nothing if the output is redirected.
+static void clear_console(void)
+{
+    HANDLE                     out  = GetStdHandle(STD_OUTPUT_HANDLE);
+    CONSOLE_SCREEN_BUFFER_INFO info;
+    COORD                      home = { 0, 0 };
+    DWORD                      written = 0;
+    if (GetConsoleScreenBufferInfo(out, &info))
+    {
+        DWORD cells = DWORD(info.dwSize.X) * DWORD(info.dwSize.Y);
+        FillConsoleOutputCharacterA(out, ' ', cells, home, &written);
+        FillConsoleOutputAttribute (out, info.wAttributes, cells, home, &written);
+        SetConsoleCursorPosition   (out, home);
+    }
+}
+
+/// @summary Print the hottest scopes over the sliding window.
+/// @param header The segment header.
+/// @param rows Scratch storage for header->ScopeCapacity rows.
+/// @param max_rows The maximum number of rows to print.
+static void report(etw_stats_header_t const *header, top_row_t *rows, uint32_t max_rows)
+{
+    static char const        *SOURCE_NAME[2] = { "MAIN", "TASK" };
+    etw_stats_scope_t const  *scopes = (etw_stats_scope_t const*) (header + 1);
+    LARGE_INTEGER             now;
+    LONGLONG                  window_ticks = (header->QpcFrequency * header->WindowMs) / 1000;
+    LONG                      epoch  = 0;
+    LONG                      complete = 0;
+    double                    span   = 0.0;
+    uint32_t                  count  = 0;
+
+    QueryPerformanceCounter(&now);
+    epoch = etw_stats_epoch(header, now.QuadPart);
+    // the sliding window covers the complete windows aggregated by aggregate_scope,
+    // plus the part of the current window that has elapsed.
+    complete = epoch - 1;
+    if (complete > LONG(header->WindowCount) - 2)
+        complete = LONG(header->WindowCount) - 2;
+    span  = double((now.QuadPart - header->StartQpc) % window_ticks) / header->QpcFrequency;
+    span += complete * (header->WindowMs / 1000.0);
+
+    for (uint32_t i = 0; i < header->ScopeCapacity; ++i)
+    {
+        if (scopes[i].Ready && aggregate_scope(header, &scopes[i], epoch, span, &rows[count]))
+            count++;
+    }
+    qsort(rows, count, sizeof(top_row_t), compare_rows);
+
+    fprintf(stdout, "%s (PID %u): %d scopes, last %.1f seconds", header->ProcessName, header->ProcessId, header->ScopeCount, span);
+    if (header->Overflow > 0) fprintf(stdout, ", %d instances not tracked", header->Overflow);
+    fprintf(stdout, "\n\n%-4s %-40s %10s %10s %12s %10s %10s %12s\n", "Src", "Scope", "Count", "Rate/s", "Total (ms)",
+            "Mean (ms)", "P99 (ms)", "Lifetime");
+    for (uint32_t i = 0; i < count && i < max_rows; ++i)
+    {
+        top_row_t const *row = &rows[i];
+        fprintf(stdout, "%-4s %-40s %10u %10.1f %12.3f %10.3f %10.3f %12I64d\n", SOURCE_NAME[row->Source & 1], row->Name,
+                row->Count, row->Rate, row->TotalMs, row->MeanMs, row->P99Ms, row->Lifetime);
+    }
+    if (count == 0)
+    {
+        fprintf(stdout, "No scopes completed in the last %.1f seconds.\n", span);
+    }
+    else if (count > max_rows)
+    {
+        fprintf(stdout, "(%u more scopes not shown)\n", count - max_rows);
+    }
+}
+
+/*///////////////////////
+//  Public Functions   //
+///////////////////////*/
+int cmd_top(int argc, char **argv)
+{
+    etw_stats_header_t const *header   = NULL;
+    HANDLE                    mapping  = NULL;
+    HANDLE                    process  = NULL;
+    HANDLE                    waits[2];
+    top_row_t                *rows     = NULL;
+    DWORD                     pid      = 0;
+    DWORD                     interval = 1000;
+    uint32_t                  max_rows = 25;
+    bool                      list     = false;
+    bool                      once     = false;
+
+    for (int i = 0; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "-list") == 0)
+            list = true;
+        else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc)
+            pid = strtoul(argv[++i], NULL, 0);
+        else if (strcmp(argv[i], "-interval") == 0 && i + 1 < argc)
+            interval = strtoul(argv[++i], NULL, 0);
+        else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+            max_rows = (uint32_t) atoi(argv[++i]);
+        else if (strcmp(argv[i], "-once") == 0)
+            once = true;
+        else if (strcmp(argv[i], "-sort") == 0 && i + 1 < argc)
+        {
+            char const *key = argv[++i];
+            if      (_stricmp(key, "total") == 0) TOP_SORT_KEY = TOP_SORT_TOTAL;
+            else if (_stricmp(key, "count") == 0) TOP_SORT_KEY = TOP_SORT_COUNT;
+            else if (_stricmp(key, "mean" ) == 0) TOP_SORT_KEY = TOP_SORT_MEAN;
+            else if (_stricmp(key, "p99"  ) == 0) TOP_SORT_KEY = TOP_SORT_P99;
+            else
+            {
+                print_usage();
+                return EXIT_FAILURE;
+            }
+        }
+        else
+        {
+            print_usage();
+            return EXIT_FAILURE;
+        }
+    }
+    if (list)
+    {
+        list_processes();
+        return EXIT_SUCCESS;
+    }
+    if (pid == 0)
+    {
+        fprintf(stderr, "ERROR: Missing argument -p PID.\n\n");
+        print_usage();
+        return EXIT_FAILURE;
+    }
+    if ((header = stats_open(pid, &mapping)) == NULL)
+    {
+        fprintf(stderr, "ERROR: Process %u does not publish scope statistics; see ETWSetLiveStats().\n", pid);
+        return EXIT_FAILURE;
+    }
+    if ((rows = (top_row_t*) malloc(header->ScopeCapacity * sizeof(top_row_t))) == NULL)
+    {
+        fprintf(stderr, "ERROR: Unable to allocate scope list.\n");
+        UnmapViewOfFile(header);
+        CloseHandle(mapping);
+        return EXIT_FAILURE;
+    }
+    if (once)
+    {
+        report(header, rows, max_rows);
+    }
+    else
+    {   // the view stays valid after the process exits, so also watch the process.
+        TOP_EXIT_SIGNAL = CreateEvent(NULL, TRUE, FALSE, NULL);
+        process  = OpenProcess(SYNCHRONIZE, FALSE, pid);
+        waits[0] = TOP_EXIT_SIGNAL;
+        waits[1] = process;
+        SetConsoleCtrlHandler(console_handler, TRUE);
+        do
+        {
+            clear_console();
+            report(header, rows, max_rows);
+        } while (WaitForMultipleObjects(process != NULL ? 2 : 1, waits, FALSE, interval) == WAIT_TIMEOUT);
+        if (process != NULL && WaitForSingleObject(process, 0) == WAIT_OBJECT_0)
+        {
+            fprintf(stdout, "STATUS: Process %u has exited.\n", pid);
+        }
+        SetConsoleCtrlHandler(console_handler, FALSE);
+        if (process != NULL) CloseHandle(process);
+        CloseHandle(TOP_EXIT_SIGNAL);
+    }
+    free(rows);
+    UnmapViewOfFile(header);
+    CloseHandle(mapping);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,974 @@
+/*/////////////////////////////////////////////////////////////////////////////
+/// @summary Implements reading and decoding of the custom events from .etl
+/// files and real-time sessions.
+/// @author Russell Klenk (contact@russellklenk.com)
+///////////////////////////////////////////////////////////////////////////80*/
+
+/*////////////////
+//   Includes   //
+////////////////*/
+#include "ETWAnalyze.h"
+
+/*/////////////////
+//   Constants   //
+/////////////////*/
+/// @summary Define the maximum number of trace handles ProcessTrace() accepts.
+#define MAX_TRACE_HANDLES    64
+
+/// @summary The file extension identifying a chunk index written by etw_index_build.
+#define INDEX_EXTENSION      ".etwidx"
+
+/// @summary The event IDs assigned in ETWProvider.man.
+#define EVENT_ID_ENTER_SCOPE   100
+#define EVENT_ID_LEAVE_SCOPE   101
+#define EVENT_ID_THREAD_ID     102
+#define EVENT_ID_MARKER        103
+#define EVENT_ID_LEAVE_TIME    104
+#define EVENT_ID_FLOW          105
+#define EVENT_ID_SAMPLE        106
+#define EVENT_ID_EVENTS_LOST   107
+#define EVENT_ID_TASK_RESUME   108
+#define EVENT_ID_TASK_SUSPEND  109
+#define EVENT_ID_TASK_COMPLETE 110
+#define EVENT_ID_OVERHEAD      112
+#define EVENT_ID_FUNCTION_ENTER 113
+#define EVENT_ID_FUNCTION_LEAVE 114
+#define EVENT_ID_MODULE        115
+#define EVENT_ID_ENTER_LATE    116
+#define EVENT_ID_SCOPE_SUMMARY 117
+#define EVENT_ID_SCOPE_SAMPLED 118
+#define EVENT_ID_SCOPE_TIME    119
+#define EVENT_ID_WAIT_BEGIN    200
+#define EVENT_ID_WAIT_END      201
+#define EVENT_ID_MOUSE_DOWN    400
+#define EVENT_ID_MOUSE_UP      401
+#define EVENT_ID_MOUSE_MOVE    402
+#define EVENT_ID_MOUSE_WHEEL   403
+#define EVENT_ID_KEY_DOWN      404
+#define EVENT_ID_FILE_OPEN     500
+#define EVENT_ID_FILE_READ     501
+#define EVENT_ID_FILE_MAPPING  502
+#define EVENT_ID_FILE_MAP_VIEW 503
+#define EVENT_ID_FILE_UNMAP    504
+#define EVENT_ID_FILE_PREFETCH 505
+#define EVENT_ID_FILE_SUMMARY  506
+#define EVENT_ID_COUNTERS      507
+#define EVENT_ID_RESIDENCY     508
+
+/// @summary Define the number of thread scope stacks tracked to compensate for overhead.
+/// This value must be a power of two greater than zero.
+#define OVERHEAD_MAX_THREADS   1024
+
+/// @summary Define the maximum scope depth at which nested scopes are counted.
+#define OVERHEAD_MAX_DEPTH     64
+
+/// @summary Define the maximum number of processes whose overhead measurement is kept.
+#define OVERHEAD_MAX_PROCESSES 64
+
+/// @summary Define the number of thread scope stacks tracked to attach on-CPU times to leave
+/// events. This value must be a power of two greater than zero.
+#define SCOPE_TIME_MAX_THREADS 1024
+
+/*//////////////////
+//   Data Types   //
+//////////////////*/
+/// @summary The number of scopes nested within each open scope of one thread and source.
+struct etw_overhead_stack_t
+{
+    uint32_t     Key;         /// The thread ID shifted left by one, or'd with the source, plus one; zero if unused.
+    uint32_t     Nested[OVERHEAD_MAX_DEPTH]; /// The number of scopes completed within the open scope at each depth.
+};
+
+/// @summary The state used to subtract instrumentation overhead from scope durations.
+struct etw_overhead_t
+{
+    uint32_t     ProcessId[OVERHEAD_MAX_PROCESSES]; /// The processes that reported their overhead.
+    float        PairMs   [OVERHEAD_MAX_PROCESSES]; /// The cost of a nested scope enter/leave pair, in milliseconds.
+    float        BiasMs   [OVERHEAD_MAX_PROCESSES]; /// The cost included in the duration of an empty scope, in milliseconds.
+    uint32_t     ProcessCount; /// The number of valid entries in ProcessId.
+    etw_overhead_stack_t Stacks[OVERHEAD_MAX_THREADS]; /// Open-addressed table of scope stacks.
+};
+
+/// @summary The on-CPU time reported by a ScopeTime event, held for the leave event that the
+/// provider writes next on the same thread and provider.
+struct etw_scope_time_t
+{
+    uint32_t     Key;         /// The thread ID shifted left by one, or'd with the source, plus one; zero if unused.
+    uint32_t     Depth;       /// The depth after the scope closed, which the leave event also carries.
+    float        OnCpu;       /// The time the thread was running within the scope, in milliseconds, or -1 if none is held.
+};
+
+/// @summary The user context attached to each opened trace, used to route
+/// decoded events to the caller-supplied callback.
+struct etw_dispatch_t
+{
+    etw_event_fn Callback;    /// The function to invoke for each decoded event.
+    void        *Context;     /// Opaque data passed through to the callback.
+    int64_t      StartTime;   /// Events before this timestamp are discarded.
+    int64_t      EndTime;     /// Events after this timestamp are discarded.
+    uint32_t     ThreadId;    /// If non-zero, events from other threads are discarded.
+    uint64_t     Lost[ETW_SOURCE_COUNT]; /// The number of events the providers reported dropping, by etw_source_e.
+    uint64_t     SessionLost; /// The number of events the sessions reported losing, from the log file headers.
+    uint64_t     BuffersLost; /// The number of buffers the sessions reported losing, from the log file headers.
+    bool         Raw;         /// If true, scope durations are not compensated for overhead.
+    etw_overhead_t *Overhead; /// Allocated on the first scope event, unless Raw is set.
+    etw_symbols_t  *Symbols;  /// Allocated on the first module or function event.
+    etw_scope_time_t *ScopeTimes; /// Allocated on the first ScopeTime event, with SCOPE_TIME_MAX_THREADS entries.
+};
+
+/// @summary A cursor used to read fields from the user data of an event record.
+struct etw_payload_t
+{
+    uint8_t const *Cursor;    /// The next byte to read.
+    uint8_t const *End;       /// One past the last byte of user data.
+};
+
+/*///////////////////////
+//   Local Functions   //
+///////////////////////*/
+/// @summary Read a NULL-terminated win:AnsiString field.
+/// @param p The payload cursor.
+/// @return The string, or an empty string if the payload is truncated.
+static char const* payload_string(etw_payload_t &p)
+{
+    uint8_t const *s = p.Cursor;
+    while (p.Cursor < p.End)
+    {
+        if (*p.Cursor++ == 0)
+            return (char const*) s;
+    }
+    return "";
+}
+
+/// @summary Read a win:UInt32 or win:Int32 field.
+/// @param p The payload cursor.
+/// @return The field value, or zero if the payload is truncated.
+static uint32_t payload_uint32(etw_payload_t &p)
+{
+    uint32_t value = 0;
+    if (p.End - p.Cursor >= (ptrdiff_t) sizeof(uint32_t))
+    {
+        memcpy(&value, p.Cursor, sizeof(uint32_t));
+        p.Cursor += sizeof(uint32_t);
+    }
+    else p.Cursor = p.End;
+    return value;
+}
+
+/// @summary Read a win:UInt64 field.
+/// @param p The payload cursor.
+/// @return The field value, or zero if the payload is truncated.
+static uint64_t payload_uint64(etw_payload_t &p)
+{
+    uint64_t value = 0;
+    if (p.End - p.Cursor >= (ptrdiff_t) sizeof(uint64_t))
+    {
+        memcpy(&value, p.Cursor, sizeof(uint64_t));
+        p.Cursor += sizeof(uint64_t);
+    }
+    else p.Cursor = p.End;
+    return value;
+}
+
+/// @summary Read a win:Float field.
+/// @param p The payload cursor.
+/// @return The field value, or zero if the payload is truncated.
+static float payload_float(etw_payload_t &p)
+{
+    float value = 0.0f;
+    if (p.End - p.Cursor >= (ptrdiff_t) sizeof(float))
+    {
+        memcpy(&value, p.Cursor, sizeof(float));
+        p.Cursor += sizeof(float);
+    }
+    else p.Cursor = p.End;
+    return value;
+}
+
+/// @summary Decode the scope, marker and thread events shared by the MAIN_THREAD
+/// and TASK_THREAD providers.
+/// @param id The event ID from the event descriptor.
+/// @param p The payload cursor.
+/// @param ev The event to populate.
+/// @return true if the event was recognized.
+static bool decode_thread_event(USHORT id, etw_payload_t &p, etw_event_t *ev)
+{
+    switch (id)
+    {
+    case EVENT_ID_ENTER_SCOPE:
+        ev->Kind     = ETW_EVENT_ENTER_SCOPE;
+        ev->Text     = payload_string(p);
+        ev->Depth    = payload_uint32(p);
+        return true;
+
+    case EVENT_ID_LEAVE_SCOPE:
+        ev->Kind     = ETW_EVENT_LEAVE_SCOPE;
+        ev->Text     = payload_string(p);
+        ev->Duration = payload_float (p);
+        ev->Depth    = payload_uint32(p);
+        return true;
+
+    case EVENT_ID_LEAVE_TIME:                       // written in place of the leave by older providers
+        ev->Kind     = ETW_EVENT_LEAVE_SCOPE;
+        ev->Text     = payload_string(p);
+        ev->Duration = payload_float (p);
+        ev->OnCpu    = payload_float (p);
+        payload_float(p);             // off-CPU time, derived from the above
+        ev->Depth    = payload_uint32(p);
+        return true;
+
+    case EVENT_ID_SCOPE_TIME:
+        ev->Kind     = ETW_EVENT_SCOPE_TIME;
+        ev->Text     = payload_string(p);
+        ev->OnCpu    = payload_float (p);
+        payload_float(p);             // off-CPU time, derived from the leave duration
+        ev->Depth    = payload_uint32(p);
+        return true;
+
+    case EVENT_ID_THREAD_ID:
+        ev->Kind     = ETW_EVENT_THREAD_ID;
+        ev->Text     = payload_string(p);
+        ev->Value[0] = (int32_t) payload_uint32(p);
+        return true;
+
+    case EVENT_ID_MARKER:
+        ev->Kind     = ETW_EVENT_MARKER;
+        ev->Text     = payload_string(p);
+        return true;
+
+    case EVENT_ID_FLOW:
+        ev->Kind     = ETW_EVENT_FLOW;
+        ev->Text     = payload_string(p);
+        ev->Id       = payload_uint64(p);
+        ev->Value[0] = (int32_t) payload_uint32(p); // phase
+        return true;
+
+    case EVENT_ID_SAMPLE:
+        ev->Kind     = ETW_EVENT_SAMPLE;
+        ev->Value[0] = (int32_t) ev->ThreadId;      // the sampler thread
+        ev->ThreadId = payload_uint32(p);           // the sampled thread
+        ev->Id       = payload_uint64(p);           // instruction pointer
+        ev->Depth    = payload_uint32(p);
+        ev->Text     = payload_string(p);
+        return true;
+
+    case EVENT_ID_EVENTS_LOST:
+        ev->Kind     = ETW_EVENT_EVENTS_LOST;
+        ev->Value[0] = (int32_t) payload_uint32(p); // etw_provider_e
+        ev->ThreadId = payload_uint32(p);           // the thread that dropped the events
+        ev->Value[1] = (int32_t) payload_uint32(p); // dropped since the last report
+        ev->Id       = payload_uint64(p);           // dropped since the thread started
+        return true;
+
+    case EVENT_ID_TASK_RESUME:
+    case EVENT_ID_TASK_SUSPEND:
+        ev->Kind     = id == EVENT_ID_TASK_RESUME ? ETW_EVENT_TASK_RESUME : ETW_EVENT_TASK_SUSPEND;
+        ev->Id       = payload_uint64(p);           // task ID
+        ev->Text     = payload_string(p);
+        ev->Depth    = payload_uint32(p);
+        return true;
+
+    case EVENT_ID_TASK_COMPLETE:
+        ev->Kind     = ETW_EVENT_TASK_COMPLETE;
+        ev->Id       = payload_uint64(p);           // task ID
+        ev->Text     = payload_string(p);
+        ev->Duration = payload_float (p);           // lifetime
+        ev->OnCpu    = payload_float (p);           // time resumed
+        ev->Value[0] = (int32_t) payload_uint32(p); // resumes
+        ev->Value[1] = (int32_t) payload_uint32(p); // migrations
+        return true;
+
+    case EVENT_ID_OVERHEAD:
+        ev->Kind     = ETW_EVENT_OVERHEAD;
+        ev->Duration = payload_float (p) / 1000000.0f; // enter/leave pair
+        ev->OnCpu    = payload_float (p) / 1000000.0f; // within an empty scope
+        ev->Value[0] = (int32_t) payload_uint32(p); // iterations
+        return true;
+
+    case EVENT_ID_FUNCTION_ENTER:
+        ev->Kind     = ETW_EVENT_ENTER_SCOPE;
+        ev->Id       = payload_uint64(p);           // function address
+        ev->Depth    = payload_uint32(p);
+        ev->Timestamp -= int64_t(payload_float(p) * TICKS_PER_MS); // written when the call became reportable
+        return true;
+
+    case EVENT_ID_FUNCTION_LEAVE:
+        ev->Kind     = ETW_EVENT_LEAVE_SCOPE;
+        ev->Id       = payload_uint64(p);           // function address
+        ev->Duration = payload_float (p);
+        ev->Depth    = payload_uint32(p);
+        ev->Value[0] = (int32_t) payload_uint32(p); // short calls elided
+        return true;
+
+    case EVENT_ID_ENTER_LATE:
+        ev->Kind     = ETW_EVENT_ENTER_SCOPE;
+        ev->Text     = payload_string(p);
+        ev->Depth    = payload_uint32(p);
+        ev->Timestamp -= int64_t(payload_float(p) * TICKS_PER_MS); // written when the scope became reportable
+        return true;
+
+    case EVENT_ID_SCOPE_SUMMARY:
+        ev->Kind     = ETW_EVENT_SCOPE_SUMMARY;
+        ev->Text     = payload_string(p);
+        ev->Value[0] = (int32_t) payload_uint32(p); // scopes elided
+        ev->Duration = payload_float (p);           // summed duration
+        ev->OnCpu    = payload_float (p);           // longest
+        return true;
+
+    case EVENT_ID_SCOPE_SAMPLED:
+        ev->Kind     = ETW_EVENT_SCOPE_SAMPLED;
+        ev->Text     = payload_string(p);
+        ev->Value[0] = (int32_t) payload_uint32(p); // scopes not sampled
+        ev->Value[1] = (int32_t) payload_uint32(p); // sampled one in N
+        return true;
+
+    case EVENT_ID_MODULE:
+        ev->Kind     = ETW_EVENT_MODULE;
+        ev->Id       = payload_uint64(p);           // base address
+        ev->Value[0] = (int32_t) payload_uint32(p); // image size
+        ev->Text     = payload_string(p);
+        return true;
+
+    default:
+        return false;
+    }
+}
+
+/// @summary Decode the events emitted by the USER_INPUT provider.
+/// @param id The event ID from the event descriptor.
+/// @param p The payload cursor.
+/// @param ev The event to populate.
+/// @return true if the event was recognized.
+static bool decode_input_event(USHORT id, etw_payload_t &p, etw_event_t *ev)
+{
+    switch (id)
+    {
+    case EVENT_ID_MOUSE_DOWN:
+    case EVENT_ID_MOUSE_UP:
+        ev->Kind     = id == EVENT_ID_MOUSE_DOWN ? ETW_EVENT_MOUSE_DOWN : ETW_EVENT_MOUSE_UP;
+        ev->Value[0] = (int32_t) payload_uint32(p); // button
+        ev->Value[1] = (int32_t) payload_uint32(p); // flags
+        ev->Value[2] = (int32_t) payload_uint32(p); // x
+        ev->Value[3] = (int32_t) payload_uint32(p); // y
+        return true;
+
+    case EVENT_ID_MOUSE_MOVE:
+        ev->Kind     = ETW_EVENT_MOUSE_MOVE;
+        ev->Value[1] = (int32_t) payload_uint32(p); // flags
+        ev->Value[2] = (int32_t) payload_uint32(p); // x
+        ev->Value[3] = (int32_t) payload_uint32(p); // y
+        return true;
+
+    case EVENT_ID_MOUSE_WHEEL:
+        ev->Kind     = ETW_EVENT_MOUSE_WHEEL;
+        ev->Value[1] = (int32_t) payload_uint32(p); // flags
+        ev->Value[0] = (int32_t) payload_uint32(p); // delta_z
+        ev->Value[2] = (int32_t) payload_uint32(p); // x
+        ev->Value[3] = (int32_t) payload_uint32(p); // y
+        return true;
+
+    case EVENT_ID_KEY_DOWN:
+        ev->Kind     = ETW_EVENT_KEY_DOWN;
+        ev->Value[0] = (int32_t) payload_uint32(p); // virtual key code
+        ev->Text     = payload_string(p);           // key name
+        ev->Value[1] = (int32_t) payload_uint32(p); // repeat count
+        ev->Value[2] = (int32_t) payload_uint32(p); // flags
+        return true;
+
+    default:
+        return false;
+    }
+}
+
+/// @summary Decode the events emitted by the SYNC provider.
+/// @param id The event ID from the event descriptor.
+/// @param p The payload cursor.
+/// @param ev The event to populate.
+/// @return true if the event was recognized.
+static bool decode_sync_event(USHORT id, etw_payload_t &p, etw_event_t *ev)
+{
+    switch (id)
+    {
+    case EVENT_ID_WAIT_BEGIN:
+        ev->Kind     = ETW_EVENT_WAIT_BEGIN;
+        ev->Text     = payload_string(p);
+        ev->Id       = payload_uint64(p);
+        return true;
+
+    case EVENT_ID_WAIT_END:
+        ev->Kind     = ETW_EVENT_WAIT_END;
+        ev->Text     = payload_string(p);
+        ev->Id       = payload_uint64(p);
+        ev->Duration = payload_float (p);
+        ev->Value[0] = (int32_t) payload_uint32(p); // wait result
+        return true;
+
+    default:
+        return false;
+    }
+}
+
+/// @summary Decode the events emitted by the FILE_IO provider.
+/// @param id The event ID from the event descriptor.
+/// @param p The payload cursor.
+/// @param ev The event to populate.
+/// @return true if the event was recognized.
+static bool decode_fileio_event(USHORT id, etw_payload_t &p, etw_event_t *ev)
+{
+    switch (id)
+    {
+    case EVENT_ID_FILE_OPEN:
+        ev->Kind     = ETW_EVENT_FILE_OPEN;
+        ev->Text     = payload_string(p);           // path
+        ev->Id       = payload_uint64(p);           // file handle
+        ev->Value[0] = (int32_t) payload_uint32(p); // access
+        ev->Value[1] = (int32_t) payload_uint32(p); // error
+        ev->Duration = payload_float (p);
+        return true;
+
+    case EVENT_ID_FILE_READ:
+        ev->Kind     = ETW_EVENT_FILE_READ;
+        ev->Id       = payload_uint64(p);           // file handle
+        ev->Offset   = payload_uint64(p);
+        ev->Value[0] = (int32_t) payload_uint32(p); // requested
+        ev->Size     = payload_uint32(p);           // transferred
+        ev->Value[1] = (int32_t) payload_uint32(p); // error
+        ev->Duration = payload_float (p);
+        return true;
+
+    case EVENT_ID_FILE_MAPPING:
+        ev->Kind     = ETW_EVENT_FILE_MAPPING;
+        ev->Id       = payload_uint64(p);           // file handle
+        ev->Target   = payload_uint64(p);           // mapping handle
+        ev->Size     = payload_uint64(p);
+        ev->Duration = payload_float (p);
+        return true;
+
+    case EVENT_ID_FILE_MAP_VIEW:
+        ev->Kind     = ETW_EVENT_FILE_MAP_VIEW;
+        ev->Id       = payload_uint64(p);           // mapping handle
+        ev->Target   = payload_uint64(p);           // view address
+        ev->Offset   = payload_uint64(p);
+        ev->Size     = payload_uint64(p);
+        ev->Duration = payload_float (p);
+        return true;
+
+    case EVENT_ID_FILE_UNMAP:
+        ev->Kind     = ETW_EVENT_FILE_UNMAP;
+        ev->Id       = payload_uint64(p);           // view address
+        ev->Duration = payload_float (p);
+        return true;
+
+    case EVENT_ID_FILE_PREFETCH:
+        ev->Kind     = ETW_EVENT_FILE_PREFETCH;
+        ev->Id       = payload_uint64(p);           // first address
+        ev->Size     = payload_uint64(p);
+        ev->Value[0] = (int32_t) payload_uint32(p); // ranges
+        ev->Duration = payload_float (p);
+        return true;
+
+    case EVENT_ID_FILE_SUMMARY:
+        ev->Kind     = ETW_EVENT_FILE_SUMMARY;      // the operation is an offset from FileOpen_Event.
+        ev->Value[0] = ETW_EVENT_FILE_OPEN + (int32_t) payload_uint32(p);
+        ev->Value[1] = (int32_t) payload_uint32(p); // count
+        ev->Size     = payload_uint64(p);
+        ev->Duration = payload_float (p);           // total
+        ev->OnCpu    = payload_float (p);           // longest
+        return true;
+
+    case EVENT_ID_COUNTERS:
+        ev->Kind     = ETW_EVENT_COUNTERS;
+        ev->Size     = payload_uint64(p);           // working set
+        ev->Target   = payload_uint64(p);           // private bytes
+        ev->Value[0] = (int32_t) payload_uint32(p); // page faults
+        ev->Offset   = payload_uint64(p);           // bytes read
+        ev->Id       = payload_uint64(p);           // bytes written
+        ev->Value[1] = (int32_t) payload_uint64(p); // read operations
+        ev->Value[2] = (int32_t) payload_uint64(p); // write operations
+        ev->OnCpu    = payload_float (p);           // process CPU time
+        ev->Duration = payload_float (p);           // cost of the sample
+        return true;
+
+    case EVENT_ID_RESIDENCY:
+        ev->Kind     = ETW_EVENT_RESIDENCY;
+        ev->Text     = payload_string(p);           // region name
+        ev->Id       = payload_uint64(p);           // address
+        ev->Size     = payload_uint64(p);
+        ev->Offset   = payload_uint64(p);           // resident bytes
+        ev->Value[0] = (int32_t) payload_uint32(p); // pages checked
+        return true;
+
+    default:
+        return false;
+    }
+}
+
+/// @summary Compute the key identifying the scope stack of a thread and source.
+/// @param ev A scope event from the MAIN_THREAD or TASK_THREAD provider.
+/// @return The thread ID shifted left by one, or'd with the source, plus one.
+static inline uint32_t scope_stack_key(etw_event_t const *ev)
+{
+    return ((ev->ThreadId << 1) | uint32_t(ev->Source == ETW_SOURCE_TASK)) + 1;
+}
+
+/// @summary Find or insert the scope stack for a thread and source.
+/// @param overhead The overhead compensation state.
+/// @param ev The scope event.
+/// @return The stack, or NULL if the table is full.
+static etw_overhead_stack_t* overhead_stack(etw_overhead_t *overhead, etw_event_t const *ev)
+{
+    uint32_t const key   = scope_stack_key(ev);
+    uint32_t const mask  = OVERHEAD_MAX_THREADS - 1;
+    uint32_t       index = (key * 2654435761U) & mask;
+    for (uint32_t i = 0; i < OVERHEAD_MAX_THREADS; ++i, index = (index + 1) & mask)
+    {
+        etw_overhead_stack_t *stack = &overhead->Stacks[index];
+        if (stack->Key == key)
+            return stack;
+        if (stack->Key == 0)
+        {
+            stack->Key = key;
+            return stack;
+        }
+    }
+    return NULL;
+}
+
+/// @summary Subtract the instrumentation overhead from the duration of a scope. The provider
+/// reports the cost of a scope enter/leave pair and the part of that cost that falls within
+/// the scope's own timestamps. A scope's measured duration includes the latter once, plus 
+/// a whole pair for every scope nested inside it, which are counted here by depth. Scopes 
+/// logged by a process before it reported its overhead are delivered as measured.
+/// @param dispatch The dispatch state.
+/// @param ev The decoded event, updated in place.
+static void compensate_overhead(etw_dispatch_t *dispatch, etw_event_t *ev)
+{
+    etw_overhead_t       *overhead = dispatch->Overhead;
+    etw_overhead_stack_t *stack    = NULL;
+    if (dispatch->Raw || (ev->Source != ETW_SOURCE_MAIN && ev->Source != ETW_SOURCE_TASK))
+        return;
+    if (ev->Kind != ETW_EVENT_ENTER_SCOPE && ev->Kind != ETW_EVENT_LEAVE_SCOPE && ev->Kind != ETW_EVENT_OVERHEAD)
+        return;
+    if (overhead == NULL)
+    {   // only allocated for traces with scopes.
+        if ((overhead = (etw_overhead_t*) calloc(1, sizeof(etw_overhead_t))) == NULL)
+        {
+            dispatch->Raw = true;
+            return;
+        }
+        dispatch->Overhead = overhead;
+    }
+    if (ev->Kind == ETW_EVENT_OVERHEAD)
+    {   // keep the most recent measurement for each process.
+        uint32_t i = 0;
+        while (i < overhead->ProcessCount && overhead->ProcessId[i] != ev->ProcessId)
+            ++i;
+        if (i == OVERHEAD_MAX_PROCESSES)
+            return;
+        if (i == overhead->ProcessCount)
+            overhead->ProcessCount++;
+        overhead->ProcessId[i] = ev->ProcessId;
+        overhead->PairMs   [i] = ev->Duration;
+        overhead->BiasMs   [i] = ev->OnCpu;
+        return;
+    }
+    if ((stack = overhead_stack(overhead, ev)) == NULL)
+        return;
+    if (ev->Kind == ETW_EVENT_ENTER_SCOPE)
+    {   // the enter event carries the depth of the new scope, starting from one.
+        if (ev->Depth < OVERHEAD_MAX_DEPTH)
+            stack->Nested[ev->Depth] = 0;
+        return;
+    }
+    // the leave event carries the depth after the scope closed.
+    uint32_t const depth  = ev->Depth + 1;
+    uint32_t       nested = 0;
+    if (depth < OVERHEAD_MAX_DEPTH)
+    {
+        nested = stack->Nested[depth];
+        stack->Nested[depth] = 0;
+    }
+    if (ev->Depth > 0 && ev->Depth < OVERHEAD_MAX_DEPTH)
+    {
+        stack->Nested[ev->Depth] += nested + 1;
+    }
+    for (uint32_t i = 0; i < overhead->ProcessCount; ++i)
+    {
+        if (overhead->ProcessId[i] == ev->ProcessId)
+        {
+            float cost = overhead->BiasMs[i] + overhead->PairMs[i] * nested;
+            ev->Duration = ev->Duration > cost ? ev->Duration - cost : 0.0f;
+            if (ev->OnCpu >= 0.0f)
+                ev->OnCpu = ev->OnCpu > cost ? ev->OnCpu - cost : 0.0f;
+            return;
+        }
+    }
+}
+
+/// @summary Find the on-CPU time slot for the thread and source of a scope event.
+/// @param dispatch The dispatch state.
+/// @param ev The scope event.
+/// @param insert true to allocate the table and insert a slot if none exists.
+/// @return The slot, or NULL if none exists or the table is full.
+static etw_scope_time_t* scope_time_slot(etw_dispatch_t *dispatch, etw_event_t const *ev, bool insert)
+{
+    uint32_t const key   = scope_stack_key(ev);
+    uint32_t const mask  = SCOPE_TIME_MAX_THREADS - 1;
+    uint32_t       index = (key * 2654435761U) & mask;
+    if (dispatch->ScopeTimes == NULL)
+    {   // only allocated for traces recorded with the ThreadTime keyword.
+        if (!insert || (dispatch->ScopeTimes = (etw_scope_time_t*) calloc(SCOPE_TIME_MAX_THREADS, sizeof(etw_scope_time_t))) == NULL)
+            return NULL;
+    }
+    for (uint32_t i = 0; i < SCOPE_TIME_MAX_THREADS; ++i, index = (index + 1) & mask)
+    {
+        etw_scope_time_t *slot = &dispatch->ScopeTimes[index];
+        if (slot->Key == key)
+            return slot;
+        if (slot->Key == 0)
+        {
+            if (!insert)
+                return NULL;
+            slot->Key = key;
+            return slot;
+        }
+    }
+    return NULL;
+}
+
+/// @summary Attach the on-CPU time held from a ScopeTime event to the leave event written
+/// after it, or hold the time from a ScopeTime event. The provider always writes the plain
+/// leave event, so a trace recorded without the ThreadTime keyword has the same scopes.
+/// @param dispatch The dispatch state.
+/// @param ev The decoded ScopeTime or leave event, updated in place.
+static void scope_time_merge(etw_dispatch_t *dispatch, etw_event_t *ev)
+{
+    etw_scope_time_t *slot = scope_time_slot(dispatch, ev, ev->Kind == ETW_EVENT_SCOPE_TIME);
+    if (slot == NULL)
+        return;
+    if (ev->Kind == ETW_EVENT_SCOPE_TIME)
+    {
+        slot->Depth = ev->Depth;
+        slot->OnCpu = ev->OnCpu;
+        return;
+    }
+    if (slot->OnCpu >= 0.0f && slot->Depth == ev->Depth)
+        ev->OnCpu = slot->OnCpu;
+    slot->OnCpu = -1.0f;
+}
+
+/// @summary Load the symbols for a module described by a Module event, or set the text of
+/// a function scope event to the name of the function.
+/// @param dispatch The dispatch state.
+/// @param ev The decoded event, updated in place.
+static void resolve_function(etw_dispatch_t *dispatch, etw_event_t *ev)
+{
+    if (dispatch->Symbols == NULL && (dispatch->Symbols = etw_symbols_create()) == NULL)
+        return;
+    if (ev->Kind == ETW_EVENT_MODULE)
+        etw_symbols_module(dispatch->Symbols, ev->ProcessId, ev->Id, (uint32_t) ev->Value[0], ev->Text);
+    else
+        ev->Text = etw_symbols_name(dispatch->Symbols, ev->ProcessId, ev->Id);
+}
+
+/// @summary Receives each event record from ProcessTrace(), decodes events from the
+/// custom providers and forwards them to the callback. Other events are ignored.
+/// @param record The event record.
+static void WINAPI event_record_callback(PEVENT_RECORD record)
+{
+    etw_dispatch_t *dispatch = (etw_dispatch_t*) record->UserContext;
+    GUID const     &provider = record->EventHeader.ProviderId;
+    USHORT const    id       = record->EventHeader.EventDescriptor.Id;
+    etw_payload_t   payload  = { 0 };
+    etw_event_t     ev;
+    bool            decoded  = false;
+
+    if (record->EventHeader.TimeStamp.QuadPart < dispatch->StartTime ||
+        record->EventHeader.TimeStamp.QuadPart > dispatch->EndTime)
+    {   // ProcessTrace() only filters at buffer granularity.
+        return;
+    }
+    memset(&ev, 0, sizeof(ev));
+    ev.Timestamp      = record->EventHeader.TimeStamp.QuadPart;
+    ev.ProcessId      = record->EventHeader.ProcessId;
+    ev.ThreadId       = record->EventHeader.ThreadId;
+    ev.Processor      = record->BufferContext.ProcessorNumber;
+    ev.Text           = "";
+    ev.OnCpu          = -1.0f;
+    payload.Cursor    = (uint8_t const*) record->UserData;
+    payload.End       = (uint8_t const*) record->UserData + record->UserDataLength;
+
+    if (IsEqualGUID(provider, ETW_MAIN_THREAD_GUID))
+    {
+        ev.Source     = ETW_SOURCE_MAIN;
+        decoded       = decode_thread_event(id, payload, &ev);
+    }
+    else if (IsEqualGUID(provider, ETW_TASK_THREAD_GUID))
+    {
+        ev.Source     = ETW_SOURCE_TASK;
+        decoded       = decode_thread_event(id, payload, &ev);
+    }
+    else if (IsEqualGUID(provider, ETW_USER_INPUT_GUID))
+    {
+        ev.Source     = ETW_SOURCE_INPUT;
+        decoded       = decode_input_event (id, payload, &ev);
+    }
+    else if (IsEqualGUID(provider, ETW_SYNC_GUID))
+    {
+        ev.Source     = ETW_SOURCE_SYNC;
+        decoded       = decode_sync_event  (id, payload, &ev);
+    }
+    else if (IsEqualGUID(provider, ETW_FILE_IO_GUID))
+    {
+        ev.Source     = ETW_SOURCE_FILEIO;
+        decoded       = decode_fileio_event(id, payload, &ev);
+    }
+    if (decoded && ev.Source == ETW_SOURCE_MAIN && (id == EVENT_ID_FUNCTION_ENTER || id == EVENT_ID_FUNCTION_LEAVE || id == EVENT_ID_MODULE))
+    {   // functions are reported by address; name them like any other scope.
+        resolve_function(dispatch, &ev);
+    }
+    if (decoded && (ev.Kind == ETW_EVENT_SCOPE_TIME || (ev.Kind == ETW_EVENT_LEAVE_SCOPE && id == EVENT_ID_LEAVE_SCOPE)))
+    {   // the on-CPU time of a scope is written just before its leave event.
+        scope_time_merge(dispatch, &ev);
+        if (ev.Kind == ETW_EVENT_SCOPE_TIME)
+            return;
+    }
+    if (decoded)
+    {   // track nesting on every thread, since the thread filter may change the depth seen.
+        compensate_overhead(dispatch, &ev);
+    }
+    if (decoded && (dispatch->ThreadId == 0 || ev.ThreadId == dispatch->ThreadId))
+    {   // samples are logged by the sampler thread, so filter on the decoded thread.
+        if (ev.Kind == ETW_EVENT_EVENTS_LOST && (uint32_t) ev.Value[0] < ETW_SOURCE_COUNT)
+        {   // the provider index matches etw_source_e.
+            dispatch->Lost[ev.Value[0]] += (uint32_t) ev.Value[1];
+        }
+        dispatch->Callback(&ev, dispatch->Context);
+    }
+}
+
+/// @summary Print a warning if any events were dropped by the providers or lost by the 
+/// sessions that recorded the processed traces, since every result derived from the 
+/// trace may then be missing scopes, or contain scopes with no matching leave event.
+/// @param dispatch The dispatch state after all events were processed.
+static void report_lost_events(etw_dispatch_t const *dispatch)
+{
+    static char const *SOURCE_NAME[ETW_SOURCE_COUNT] = { "MAIN", "TASK", "INPUT", "SYNC", "FILEIO" };
+    uint64_t           dropped = 0;
+
+    for (size_t i = 0; i < ETW_SOURCE_COUNT; ++i)
+    {
+        dropped += dispatch->Lost[i];
+    }
+    if (dropped == 0 && dispatch->SessionLost == 0 && dispatch->BuffersLost == 0)
+        return;
+
+    fprintf(stderr, "WARNING: The trace is incomplete; results may be skewed.\n");
+    if (dispatch->SessionLost > 0 || dispatch->BuffersLost > 0)
+    {
+        fprintf(stderr, "WARNING:   %I64u events and %I64u buffers lost by the session.\n", dispatch->SessionLost, dispatch->BuffersLost);
+    }
+    for (size_t i = 0; i < ETW_SOURCE_COUNT; ++i)
+    {
+        if (dispatch->Lost[i] > 0)
+            fprintf(stderr, "WARNING:   %I64u events dropped by the %s provider.\n", dispatch->Lost[i], SOURCE_NAME[i]);
+    }
+}
+
+/// @summary Determine whether a path names a chunk index rather than a trace file.
+/// @param path The path to check.
+/// @return true if the path ends with the index file extension.
+static bool is_index_path(char const *path)
+{
+    size_t len = strlen(path);
+    size_t ext = sizeof(INDEX_EXTENSION) - 1;
+    return len > ext && _stricmp(path + len - ext, INDEX_EXTENSION) == 0;
+}
+
+/// @summary Run ProcessTrace() on a set of opened traces and close them.
+/// @param handles The trace handles returned by OpenTrace().
+/// @param count The number of trace handles.
+/// @param start_time The time of the first buffer to process, or NULL.
+/// @param end_time The time of the last buffer to process, or NULL.
+/// @return true if ProcessTrace() completed successfully.
+static bool process_and_close(TRACEHANDLE *handles, ULONG count, FILETIME *start_time = NULL, FILETIME *end_time = NULL)
+{
+    ULONG result = ProcessTrace(handles, count, start_time, end_time);
+    for (ULONG i = 0; i < count; ++i)
+    {
+        CloseTrace(handles[i]);
+    }
+    if (result != ERROR_SUCCESS && result != ERROR_CANCELLED)
+    {
+        fprintf(stderr, "ERROR: ProcessTrace failed: 0x%08X.\n", result);
+        return false;
+    }
+    return true;
+}
+
+/*///////////////////////
+//  Public Functions   //
+///////////////////////*/
+bool etw_process_files(char const **paths, size_t count, etw_event_fn callback, void *context)
+{
+    return etw_process_range(paths, count, NULL, callback, context);
+}
+
+bool etw_process_range(char const **paths, size_t count, etw_time_range_t const *range, etw_event_fn callback, void *context)
+{
+    TRACEHANDLE    handles[MAX_TRACE_HANDLES];
+    char           chunks [MAX_TRACE_HANDLES][MAX_PATH];
+    char const    *files  [MAX_TRACE_HANDLES];
+    etw_dispatch_t dispatch  = { callback, context, 0, INT64_MAX, 0 };
+    int64_t        base_time = INT64_MAX;
+    size_t         nfiles    = 0;
+    ULONG          nopen     = 0;
+
+    for (size_t i = 0; i < count; ++i)
+    {   // replace each index with the chunks that overlap the requested range.
+        if (is_index_path(paths[i]))
+        {
+            size_t  nchunk = 0;
+            int64_t base   = 0;
+            if (!etw_index_select(paths[i], range, &chunks[nfiles], MAX_TRACE_HANDLES - nfiles, &nchunk, &base))
+            {
+                return false;
+            }
+            for (size_t j = 0; j < nchunk; ++j)
+            {
+                files[nfiles] = chunks[nfiles];
+                nfiles++;
+            }
+            if (base < base_time) base_time = base;
+        }
+        else if (nfiles < MAX_TRACE_HANDLES)
+        {
+            files[nfiles++] = paths[i];
+        }
+        else
+        {
+            nfiles = MAX_TRACE_HANDLES + 1;
+            break;
+        }
+    }
+    if (nfiles == 0 || nfiles > MAX_TRACE_HANDLES)
+    {
+        fprintf(stderr, "ERROR: Between 1 and %d trace files may be processed at once.\n", MAX_TRACE_HANDLES);
+        return false;
+    }
+    for (size_t i = 0; i < nfiles; ++i)
+    {
+        EVENT_TRACE_LOGFILEA logfile;
+        memset(&logfile, 0, sizeof(logfile));
+        logfile.LogFileName         = (LPSTR) files[i];
+        logfile.ProcessTraceMode    = PROCESS_TRACE_MODE_EVENT_RECORD;
+        logfile.EventRecordCallback = event_record_callback;
+        logfile.Context             = &dispatch;
+        if ((handles[nopen] = OpenTraceA(&logfile)) == (TRACEHANDLE) INVALID_HANDLE_VALUE)
+        {
+            fprintf(stderr, "ERROR: Unable to open trace file \'%s\': 0x%08X.\n", files[i], GetLastError());
+            for (ULONG j = 0; j < nopen; ++j) CloseTrace(handles[j]);
+            return false;
+        }
+        if (logfile.LogfileHeader.StartTime.QuadPart < base_time)
+        {   // OpenTrace() fills in the header; times are relative to the earliest session start.
+            base_time = logfile.LogfileHeader.StartTime.QuadPart;
+        }
+        dispatch.SessionLost += logfile.LogfileHeader.EventsLost;
+        dispatch.BuffersLost += logfile.LogfileHeader.BuffersLost;
+        nopen++;
+    }
+    bool result = false;
+    if (range != NULL)
+    {   // convert the range to absolute times and let ProcessTrace() skip whole buffers.
+        FILETIME start_ft, end_ft;
+        dispatch.StartTime = base_time + int64_t(range->FromMs * TICKS_PER_MS);
+        dispatch.EndTime   = range->ToMs >= 0.0 ? base_time + int64_t(range->ToMs * TICKS_PER_MS) : INT64_MAX;
+        dispatch.ThreadId  = range->ThreadId;
+        dispatch.Raw       = range->Raw;
+        start_ft.dwLowDateTime  = DWORD(dispatch.StartTime);
+        start_ft.dwHighDateTime = DWORD(dispatch.StartTime >> 32);
+        end_ft.dwLowDateTime    = DWORD(dispatch.EndTime);
+        end_ft.dwHighDateTime   = DWORD(dispatch.EndTime >> 32);
+        result = process_and_close(handles, nopen, &start_ft, range->ToMs >= 0.0 ? &end_ft : NULL);
+    }
+    else result = process_and_close(handles, nopen);
+    report_lost_events(&dispatch);
+    etw_symbols_delete(dispatch.Symbols);
+    free(dispatch.Overhead);
+    free(dispatch.ScopeTimes);
+    return result;
+}
+
+bool etw_range_option(int argc, char **argv, int *i, etw_time_range_t *range)
+{
+    if (strcmp(argv[*i], "-raw") == 0)
+    {
+        range->Raw = true;
+        return true;
+    }
+    if (*i + 1 >= argc)
+        return false;
+    if (strcmp(argv[*i], "-from") == 0)
+        range->FromMs   = atof(argv[++(*i)]);
+    else if (strcmp(argv[*i], "-to") == 0)
+        range->ToMs     = atof(argv[++(*i)]);
+    else if (strcmp(argv[*i], "-thread") == 0)
+        range->ThreadId = strtoul(argv[++(*i)], NULL, 0);
+    else
+        return false;
+    return true;
+}
+
+void etw_range_usage(FILE *fp)
+{
+    fprintf(fp, "  -from:   Ignore events before this many milliseconds into the trace.\n");
+    fprintf(fp, "  -to:     Ignore events after this many milliseconds into the trace.\n");
+    fprintf(fp, "  -thread: Only process events logged by this thread ID.\n");
+    fprintf(fp, "  -raw:    Report scope durations as measured, without subtracting the\n");
+    fprintf(fp, "           instrumentation overhead measured by the provider.\n");
+    fprintf(fp, "  INFILE may be an .etwidx written by 'record -split' or 'index', in which case\n");
+    fprintf(fp, "  only the chunks overlapping -from/-to and -thread are decoded.\n");
+}
+
+bool etw_trace_start_time(char const *path, int64_t *start_time)
+{
+    EVENT_TRACE_LOGFILEA logfile;
+    TRACEHANDLE          handle;
+
+    memset(&logfile, 0, sizeof(logfile));
+    logfile.LogFileName         = (LPSTR) path;
+    logfile.ProcessTraceMode    = PROCESS_TRACE_MODE_EVENT_RECORD;
+    logfile.EventRecordCallback = event_record_callback;
+    if ((handle = OpenTraceA(&logfile)) == (TRACEHANDLE) INVALID_HANDLE_VALUE)
+    {
+        fprintf(stderr, "ERROR: Unable to open trace file \'%s\': 0x%08X.\n", path, GetLastError());
+        return false;
+    }
+    *start_time = logfile.LogfileHeader.StartTime.QuadPart;
+    CloseTrace(handle);
+    return true;
+}
+
+bool etw_process_realtime(char const *session_name, etw_event_fn callback, void *context)
+{
+    EVENT_TRACE_LOGFILEA logfile;
+    TRACEHANDLE          handle;
+    etw_dispatch_t       dispatch = { callback, context, 0, INT64_MAX, 0 };
+
+    memset(&logfile, 0, sizeof(logfile));
+    logfile.LoggerName          = (LPSTR) session_name;
+    logfile.ProcessTraceMode    = PROCESS_TRACE_MODE_EVENT_RECORD | PROCESS_TRACE_MODE_REAL_TIME;
+    logfile.EventRecordCallback = event_record_callback;
+    logfile.Context             = &dispatch;
+    if ((handle = OpenTraceA(&logfile)) == (TRACEHANDLE) INVALID_HANDLE_VALUE)
+    {
+        fprintf(stderr, "ERROR: Unable to open real-time session \'%s\': 0x%08X.\n", session_name, GetLastError());
+        return false;
+    }
+    bool result = process_and_close(&handle, 1);
+    etw_symbols_delete(dispatch.Symbols);
+    free(dispatch.Overhead);
+    free(dispatch.ScopeTimes);
+    return result;
+}
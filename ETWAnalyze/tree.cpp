@@ -0,0 +1,157 @@
+/*/////////////////////////////////////////////////////////////////////////////
+/// @summary Implements the 'tree' and 'folded' commands, which reconstruct the
+/// scope hierarchy recorded in one or more .etl files and print it as a call
+/// tree or as folded stacks suitable for generating a flame graph.
+/// @author Russell Klenk (contact@russellklenk.com)
+///////////////////////////////////////////////////////////////////////////80*/
+
+/*////////////////
+//   Includes   //
+////////////////*/
+#include "ETWAnalyze.h"
+
+/*/////////////////
+//   Constants   //
+/////////////////*/
+/// @summary Define the maximum number of input files accepted on the command line.
+#define TREE_MAX_INPUTS      64
+
+/*///////////////////////
+//   Local Functions   //
+///////////////////////*/
+/// @summary Print usage information for the tree command.
+static void print_tree_usage(void)
+{
+    fprintf(stdout, "USAGE: etwanalyze.exe tree [-min PERCENT] [-from MS] [-to MS] [-thread TID] INFILE [INFILE...]\n");
+    fprintf(stdout, "  Print the per-thread call tree with inclusive and exclusive scope times.\n");
+    fprintf(stdout, "  -min: Omit scopes below this percentage of the thread's time (default 0).\n");
+    etw_range_usage(stdout);
+    fprintf(stdout, "\n");
+}
+
+/// @summary Print usage information for the folded command.
+static void print_folded_usage(void)
+{
+    fprintf(stdout, "USAGE: etwanalyze.exe folded [-o OUTFILE] [-from MS] [-to MS] [-thread TID] INFILE [INFILE...]\n");
+    fprintf(stdout, "  Write folded stacks weighted by exclusive time in microseconds.\n");
+    fprintf(stdout, "  The output can be passed directly to flamegraph.pl.\n");
+    fprintf(stdout, "  -o: The path of the output file (default stdout).\n");
+    etw_range_usage(stdout);
+    fprintf(stdout, "\n");
+}
+
+/// @summary Receives each decoded event and adds it to the call tree.
+/// @param ev The decoded event.
+/// @param context Pointer to the etw_tree_t.
+static void tree_event(etw_event_t const *ev, void *context)
+{
+    etw_tree_event((etw_tree_t*) context, ev);
+}
+
+/// @summary Build a call tree from a set of trace files.
+/// @param paths The paths of the .etl files to read.
+/// @param count The number of paths.
+/// @param range The time range and thread to include.
+/// @return The call tree, or NULL if the files could not be processed.
+static etw_tree_t* build_tree(char const **paths, size_t count, etw_time_range_t const *range)
+{
+    etw_tree_t *tree = etw_tree_create();
+    if (tree == NULL)
+    {
+        fprintf(stderr, "ERROR: Unable to allocate call tree.\n");
+        return NULL;
+    }
+    if (!etw_process_range(paths, count, range, tree_event, tree))
+    {
+        etw_tree_delete(tree);
+        return NULL;
+    }
+    return tree;
+}
+
+/*///////////////////////
+//  Public Functions   //
+///////////////////////*/
+int cmd_tree(int argc, char **argv)
+{
+    char const *inputs[TREE_MAX_INPUTS];
+    size_t      ninput      = 0;
+    double      min_percent = 0.0;
+    etw_time_range_t range  = { 0.0, -1.0, 0 };
+
+    for (int i = 0; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "-min") == 0 && i + 1 < argc)
+            min_percent = atof(argv[++i]);
+        else if (etw_range_option(argc, argv, &i, &range))
+            continue;
+        else if (argv[i][0] != '-' && ninput < TREE_MAX_INPUTS)
+            inputs[ninput++] = argv[i];
+        else
+        {
+            print_tree_usage();
+            return EXIT_FAILURE;
+        }
+    }
+    if (ninput == 0)
+    {
+        fprintf(stderr, "ERROR: Missing argument INFILE.\n\n");
+        print_tree_usage();
+        return EXIT_FAILURE;
+    }
+
+    etw_tree_t *tree = build_tree(inputs, ninput, &range);
+    if (tree == NULL)
+    {
+        return EXIT_FAILURE;
+    }
+    etw_tree_print(tree, stdout, min_percent);
+    etw_tree_delete(tree);
+    return EXIT_SUCCESS;
+}
+
+int cmd_folded(int argc, char **argv)
+{
+    char const *inputs[TREE_MAX_INPUTS];
+    size_t      ninput  = 0;
+    char const *outfile = NULL;
+    FILE       *fp      = stdout;
+    etw_time_range_t range = { 0.0, -1.0, 0 };
+
+    for (int i = 0; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+            outfile = argv[++i];
+        else if (etw_range_option(argc, argv, &i, &range))
+            continue;
+        else if (argv[i][0] != '-' && ninput < TREE_MAX_INPUTS)
+            inputs[ninput++] = argv[i];
+        else
+        {
+            print_folded_usage();
+            return EXIT_FAILURE;
+        }
+    }
+    if (ninput == 0)
+    {
+        fprintf(stderr, "ERROR: Missing argument INFILE.\n\n");
+        print_folded_usage();
+        return EXIT_FAILURE;
+    }
+
+    etw_tree_t *tree = build_tree(inputs, ninput, &range);
+    if (tree == NULL)
+    {
+        return EXIT_FAILURE;
+    }
+    if (outfile != NULL && (fp = fopen(outfile, "w")) == NULL)
+    {
+        fprintf(stderr, "ERROR: Unable to open output file \'%s\': %s\n", outfile, strerror(errno));
+        etw_tree_delete(tree);
+        return EXIT_FAILURE;
+    }
+    etw_tree_folded(tree, fp);
+    if (fp != stdout) fclose(fp);
+    etw_tree_delete(tree);
+    return EXIT_SUCCESS;
+}
@@ -67,6 +67,33 @@ typedef LONGLONG (__cdecl *ETWEnterScopeMainFn)(char const*);
 typedef LONGLONG (__cdecl *ETWLeaveScopeMainFn)(char const*, LONGLONG);
 typedef LONGLONG (__cdecl *ETWEnterScopeTaskFn)(char const*);
 typedef LONGLONG (__cdecl *ETWLeaveScopeTaskFn)(char const*, LONGLONG);
+typedef LONGLONG (__cdecl *ETWWaitBeginFn)(char const*, void const*);
+typedef void     (__cdecl *ETWWaitEndFn)(char const*, void const*, LONGLONG, DWORD);
+typedef void     (__cdecl *ETWFlowMainFn)(char const*, ULONGLONG, DWORD);
+typedef void     (__cdecl *ETWFlowTaskFn)(char const*, ULONGLONG, DWORD);
+typedef void     (__cdecl *ETWSetOverflowPolicyFn)(DWORD, DWORD);
+typedef ULONGLONG(__cdecl *ETWLostEventsFn)(DWORD);
+typedef ETWTASK  (__cdecl *ETWTaskCreateFn)(char const*);
+typedef void     (__cdecl *ETWTaskResumeFn)(ETWTASK);
+typedef void     (__cdecl *ETWTaskSuspendFn)(ETWTASK);
+typedef void     (__cdecl *ETWTaskDeleteFn)(ETWTASK);
+typedef void     (__cdecl *ETWFileOpenFn)(char const*, HANDLE, DWORD, DWORD, float);
+typedef void     (__cdecl *ETWFileReadFn)(HANDLE, ULONGLONG, DWORD, DWORD, DWORD, float);
+typedef void     (__cdecl *ETWFileMappingFn)(HANDLE, HANDLE, ULONGLONG, float);
+typedef void     (__cdecl *ETWFileMapViewFn)(HANDLE, void const*, ULONGLONG, ULONGLONG, float);
+typedef void     (__cdecl *ETWFileUnmapViewFn)(void const*, float);
+typedef void     (__cdecl *ETWFilePrefetchFn)(void const*, ULONGLONG, DWORD, float);
+typedef DWORD    (__cdecl *ETWHookFileIOFn)(void);
+typedef void     (__cdecl *ETWFunctionEnterFn)(void const*, void const*);
+typedef void     (__cdecl *ETWFunctionLeaveFn)(void const*);
+typedef void     (__cdecl *ETWFunctionFilterFn)(char const*, char const*, DWORD);
+typedef BOOL     (__cdecl *ETWCounterRegionFn)(char const*, void const*, ULONGLONG);
+typedef void     (__cdecl *ETWCounterRegionRemoveFn)(void const*);
+typedef void     (__cdecl *ETWSetCounterIntervalFn)(DWORD);
+typedef void     (__cdecl *ETWSetOverheadBudgetFn)(float);
+typedef BOOL     (__cdecl *ETWScopeThresholdFn)(char const*, DWORD);
+typedef BOOL     (__cdecl *ETWScopeSamplingFn)(char const*, DWORD);
+typedef void     (__cdecl *ETWSetLiveStatsFn)(BOOL);
 
 // Global pointers to the functions we load from ETWProvider.dll. If the DLL
 // cannot be loaded, these will be set to no-op stubs after ETWInitialize() returns.
@@ -86,6 +113,33 @@ static ETWMouseUpFn                   ETWMouseUp_Func                   = NULL;
 static ETWMouseMoveFn                 ETWMouseMove_Func                 = NULL;
 static ETWMouseWheelFn                ETWMouseWheel_Func                = NULL;
 static ETWKeyDownFn                   ETWKeyDown_Func                   = NULL;
+static ETWWaitBeginFn                 ETWWaitBegin_Func                 = NULL;
+static ETWWaitEndFn                   ETWWaitEnd_Func                   = NULL;
+static ETWFlowMainFn                  ETWFlowMain_Func                  = NULL;
+static ETWFlowTaskFn                  ETWFlowTask_Func                  = NULL;
+static ETWSetOverflowPolicyFn         ETWSetOverflowPolicy_Func         = NULL;
+static ETWLostEventsFn                ETWLostEvents_Func                = NULL;
+static ETWTaskCreateFn                ETWTaskCreate_Func                = NULL;
+static ETWTaskResumeFn                ETWTaskResume_Func                = NULL;
+static ETWTaskSuspendFn               ETWTaskSuspend_Func               = NULL;
+static ETWTaskDeleteFn                ETWTaskDelete_Func                = NULL;
+static ETWFileOpenFn                  ETWFileOpen_Func                  = NULL;
+static ETWFileReadFn                  ETWFileRead_Func                  = NULL;
+static ETWFileMappingFn               ETWFileMapping_Func               = NULL;
+static ETWFileMapViewFn               ETWFileMapView_Func               = NULL;
+static ETWFileUnmapViewFn             ETWFileUnmapView_Func             = NULL;
+static ETWFilePrefetchFn              ETWFilePrefetch_Func              = NULL;
+static ETWHookFileIOFn                ETWHookFileIO_Func                = NULL;
+static ETWFunctionEnterFn             ETWFunctionEnter_Func             = NULL;
+static ETWFunctionLeaveFn             ETWFunctionLeave_Func             = NULL;
+static ETWFunctionFilterFn            ETWFunctionFilter_Func            = NULL;
+static ETWCounterRegionFn             ETWCounterRegion_Func             = NULL;
+static ETWCounterRegionRemoveFn       ETWCounterRegionRemove_Func       = NULL;
+static ETWSetCounterIntervalFn        ETWSetCounterInterval_Func        = NULL;
+static ETWSetOverheadBudgetFn         ETWSetOverheadBudget_Func         = NULL;
+static ETWScopeThresholdFn            ETWScopeThreshold_Func            = NULL;
+static ETWScopeSamplingFn             ETWScopeSampling_Func             = NULL;
+static ETWSetLiveStatsFn              ETWSetLiveStats_Func              = NULL;
 static HMODULE                        ETWProviderDLL                    = NULL;
 
 /*///////////////////////
@@ -198,6 +252,183 @@ static LONGLONG __cdecl ETWLeaveScopeTask_Stub(char const *message, LONGLONG ent
     return 0;
 }
 
+static LONGLONG __cdecl ETWWaitBegin_Stub(char const *name, void const *object)
+{
+    UNUSED_ARG(name);
+    UNUSED_ARG(object);
+    return 0;
+}
+
+static void __cdecl ETWWaitEnd_Stub(char const *name, void const *object, LONGLONG begin_time, DWORD result)
+{
+    UNUSED_ARG(name);
+    UNUSED_ARG(object);
+    UNUSED_ARG(begin_time);
+    UNUSED_ARG(result);
+}
+
+static void __cdecl ETWFlowMain_Stub(char const *name, ULONGLONG flow_id, DWORD phase)
+{
+    UNUSED_ARG(name);
+    UNUSED_ARG(flow_id);
+    UNUSED_ARG(phase);
+}
+
+static void __cdecl ETWFlowTask_Stub(char const *name, ULONGLONG flow_id, DWORD phase)
+{
+    UNUSED_ARG(name);
+    UNUSED_ARG(flow_id);
+    UNUSED_ARG(phase);
+}
+
+static void __cdecl ETWSetOverflowPolicy_Stub(DWORD policy, DWORD spin_us)
+{
+    UNUSED_ARG(policy);
+    UNUSED_ARG(spin_us);
+}
+
+static ULONGLONG __cdecl ETWLostEvents_Stub(DWORD provider)
+{
+    UNUSED_ARG(provider);
+    return 0;
+}
+
+static ETWTASK __cdecl ETWTaskCreate_Stub(char const *name)
+{
+    UNUSED_ARG(name);
+    return NULL;
+}
+
+static void __cdecl ETWTaskResume_Stub(ETWTASK task)
+{
+    UNUSED_ARG(task);
+}
+
+static void __cdecl ETWTaskSuspend_Stub(ETWTASK task)
+{
+    UNUSED_ARG(task);
+}
+
+static void __cdecl ETWTaskDelete_Stub(ETWTASK task)
+{
+    UNUSED_ARG(task);
+}
+
+static void __cdecl ETWFileOpen_Stub(char const *path, HANDLE file, DWORD access, DWORD error, float latency_ms)
+{
+    UNUSED_ARG(path);
+    UNUSED_ARG(file);
+    UNUSED_ARG(access);
+    UNUSED_ARG(error);
+    UNUSED_ARG(latency_ms);
+}
+
+static void __cdecl ETWFileRead_Stub(HANDLE file, ULONGLONG offset, DWORD requested, DWORD transferred, DWORD error, float latency_ms)
+{
+    UNUSED_ARG(file);
+    UNUSED_ARG(offset);
+    UNUSED_ARG(requested);
+    UNUSED_ARG(transferred);
+    UNUSED_ARG(error);
+    UNUSED_ARG(latency_ms);
+}
+
+static void __cdecl ETWFileMapping_Stub(HANDLE file, HANDLE mapping, ULONGLONG size, float latency_ms)
+{
+    UNUSED_ARG(file);
+    UNUSED_ARG(mapping);
+    UNUSED_ARG(size);
+    UNUSED_ARG(latency_ms);
+}
+
+static void __cdecl ETWFileMapView_Stub(HANDLE mapping, void const *address, ULONGLONG offset, ULONGLONG size, float latency_ms)
+{
+    UNUSED_ARG(mapping);
+    UNUSED_ARG(address);
+    UNUSED_ARG(offset);
+    UNUSED_ARG(size);
+    UNUSED_ARG(latency_ms);
+}
+
+static void __cdecl ETWFileUnmapView_Stub(void const *address, float latency_ms)
+{
+    UNUSED_ARG(address);
+    UNUSED_ARG(latency_ms);
+}
+
+static void __cdecl ETWFilePrefetch_Stub(void const *address, ULONGLONG size, DWORD ranges, float latency_ms)
+{
+    UNUSED_ARG(address);
+    UNUSED_ARG(size);
+    UNUSED_ARG(ranges);
+    UNUSED_ARG(latency_ms);
+}
+
+static DWORD __cdecl ETWHookFileIO_Stub(void)
+{
+    return 0;
+}
+
+static void __cdecl ETWFunctionEnter_Stub(void const *address, void const *stack)
+{
+    UNUSED_ARG(address);
+    UNUSED_ARG(stack);
+}
+
+static void __cdecl ETWFunctionLeave_Stub(void const *stack)
+{
+    UNUSED_ARG(stack);
+}
+
+static void __cdecl ETWFunctionFilter_Stub(char const *include, char const *exclude, DWORD min_us)
+{
+    UNUSED_ARG(include);
+    UNUSED_ARG(exclude);
+    UNUSED_ARG(min_us);
+}
+
+static BOOL __cdecl ETWCounterRegion_Stub(char const *name, void const *address, ULONGLONG size)
+{
+    UNUSED_ARG(name);
+    UNUSED_ARG(address);
+    UNUSED_ARG(size);
+    return FALSE;
+}
+
+static void __cdecl ETWCounterRegionRemove_Stub(void const *address)
+{
+    UNUSED_ARG(address);
+}
+
+static void __cdecl ETWSetCounterInterval_Stub(DWORD interval_ms)
+{
+    UNUSED_ARG(interval_ms);
+}
+
+static void __cdecl ETWSetOverheadBudget_Stub(float percent)
+{
+    UNUSED_ARG(percent);
+}
+
+static BOOL __cdecl ETWScopeThreshold_Stub(char const *name, DWORD min_us)
+{
+    UNUSED_ARG(name);
+    UNUSED_ARG(min_us);
+    return FALSE;
+}
+
+static BOOL __cdecl ETWScopeSampling_Stub(char const *name, DWORD one_in)
+{
+    UNUSED_ARG(name);
+    UNUSED_ARG(one_in);
+    return FALSE;
+}
+
+static void __cdecl ETWSetLiveStats_Stub(BOOL enable)
+{
+    UNUSED_ARG(enable);
+}
+
 /*///////////////////////
 //  Public Functions   //
 ///////////////////////*/
@@ -261,6 +492,33 @@ void ETWInitialize(void)
     ETW_DLL_RESOLVE(dll_inst, ETWMouseMove);
     ETW_DLL_RESOLVE(dll_inst, ETWMouseWheel);
     ETW_DLL_RESOLVE(dll_inst, ETWKeyDown);
+    ETW_DLL_RESOLVE(dll_inst, ETWWaitBegin);
+    ETW_DLL_RESOLVE(dll_inst, ETWWaitEnd);
+    ETW_DLL_RESOLVE(dll_inst, ETWFlowMain);
+    ETW_DLL_RESOLVE(dll_inst, ETWFlowTask);
+    ETW_DLL_RESOLVE(dll_inst, ETWSetOverflowPolicy);
+    ETW_DLL_RESOLVE(dll_inst, ETWLostEvents);
+    ETW_DLL_RESOLVE(dll_inst, ETWTaskCreate);
+    ETW_DLL_RESOLVE(dll_inst, ETWTaskResume);
+    ETW_DLL_RESOLVE(dll_inst, ETWTaskSuspend);
+    ETW_DLL_RESOLVE(dll_inst, ETWTaskDelete);
+    ETW_DLL_RESOLVE(dll_inst, ETWFileOpen);
+    ETW_DLL_RESOLVE(dll_inst, ETWFileRead);
+    ETW_DLL_RESOLVE(dll_inst, ETWFileMapping);
+    ETW_DLL_RESOLVE(dll_inst, ETWFileMapView);
+    ETW_DLL_RESOLVE(dll_inst, ETWFileUnmapView);
+    ETW_DLL_RESOLVE(dll_inst, ETWFilePrefetch);
+    ETW_DLL_RESOLVE(dll_inst, ETWHookFileIO);
+    ETW_DLL_RESOLVE(dll_inst, ETWFunctionEnter);
+    ETW_DLL_RESOLVE(dll_inst, ETWFunctionLeave);
+    ETW_DLL_RESOLVE(dll_inst, ETWFunctionFilter);
+    ETW_DLL_RESOLVE(dll_inst, ETWCounterRegion);
+    ETW_DLL_RESOLVE(dll_inst, ETWCounterRegionRemove);
+    ETW_DLL_RESOLVE(dll_inst, ETWSetCounterInterval);
+    ETW_DLL_RESOLVE(dll_inst, ETWSetOverheadBudget);
+    ETW_DLL_RESOLVE(dll_inst, ETWScopeThreshold);
+    ETW_DLL_RESOLVE(dll_inst, ETWScopeSampling);
+    ETW_DLL_RESOLVE(dll_inst, ETWSetLiveStats);
 
     // register the custom providers as part of the initialization.
     ETWRegisterCustomProviders_Func();
@@ -292,6 +550,33 @@ use_stubs:
     ETWMouseMove_Func                 = ETWMouseMove_Stub;
     ETWMouseWheel_Func                = ETWMouseWheel_Stub;
     ETWKeyDown_Func                   = ETWKeyDown_Stub;
+    ETWWaitBegin_Func                 = ETWWaitBegin_Stub;
+    ETWWaitEnd_Func                   = ETWWaitEnd_Stub;
+    ETWFlowMain_Func                  = ETWFlowMain_Stub;
+    ETWFlowTask_Func                  = ETWFlowTask_Stub;
+    ETWSetOverflowPolicy_Func         = ETWSetOverflowPolicy_Stub;
+    ETWLostEvents_Func                = ETWLostEvents_Stub;
+    ETWTaskCreate_Func                = ETWTaskCreate_Stub;
+    ETWTaskResume_Func                = ETWTaskResume_Stub;
+    ETWTaskSuspend_Func               = ETWTaskSuspend_Stub;
+    ETWTaskDelete_Func                = ETWTaskDelete_Stub;
+    ETWFileOpen_Func                  = ETWFileOpen_Stub;
+    ETWFileRead_Func                  = ETWFileRead_Stub;
+    ETWFileMapping_Func               = ETWFileMapping_Stub;
+    ETWFileMapView_Func               = ETWFileMapView_Stub;
+    ETWFileUnmapView_Func             = ETWFileUnmapView_Stub;
+    ETWFilePrefetch_Func              = ETWFilePrefetch_Stub;
+    ETWHookFileIO_Func                = ETWHookFileIO_Stub;
+    ETWFunctionEnter_Func             = ETWFunctionEnter_Stub;
+    ETWFunctionLeave_Func             = ETWFunctionLeave_Stub;
+    ETWFunctionFilter_Func            = ETWFunctionFilter_Stub;
+    ETWCounterRegion_Func             = ETWCounterRegion_Stub;
+    ETWCounterRegionRemove_Func       = ETWCounterRegionRemove_Stub;
+    ETWSetCounterInterval_Func        = ETWSetCounterInterval_Stub;
+    ETWSetOverheadBudget_Func         = ETWSetOverheadBudget_Stub;
+    ETWScopeThreshold_Func            = ETWScopeThreshold_Stub;
+    ETWScopeSampling_Func             = ETWScopeSampling_Stub;
+    ETWSetLiveStats_Func              = ETWSetLiveStats_Stub;
 #else
     /* empty */
 #endif
@@ -320,6 +605,33 @@ void ETWShutdown(void)
     ETWMouseMove_Func                 = ETWMouseMove_Stub;
     ETWMouseWheel_Func                = ETWMouseWheel_Stub;
     ETWKeyDown_Func                   = ETWKeyDown_Stub;
+    ETWWaitBegin_Func                 = ETWWaitBegin_Stub;
+    ETWWaitEnd_Func                   = ETWWaitEnd_Stub;
+    ETWFlowMain_Func                  = ETWFlowMain_Stub;
+    ETWFlowTask_Func                  = ETWFlowTask_Stub;
+    ETWSetOverflowPolicy_Func         = ETWSetOverflowPolicy_Stub;
+    ETWLostEvents_Func                = ETWLostEvents_Stub;
+    ETWTaskCreate_Func                = ETWTaskCreate_Stub;
+    ETWTaskResume_Func                = ETWTaskResume_Stub;
+    ETWTaskSuspend_Func               = ETWTaskSuspend_Stub;
+    ETWTaskDelete_Func                = ETWTaskDelete_Stub;
+    ETWFileOpen_Func                  = ETWFileOpen_Stub;
+    ETWFileRead_Func                  = ETWFileRead_Stub;
+    ETWFileMapping_Func               = ETWFileMapping_Stub;
+    ETWFileMapView_Func               = ETWFileMapView_Stub;
+    ETWFileUnmapView_Func             = ETWFileUnmapView_Stub;
+    ETWFilePrefetch_Func              = ETWFilePrefetch_Stub;
+    ETWHookFileIO_Func                = ETWHookFileIO_Stub;
+    ETWFunctionEnter_Func             = ETWFunctionEnter_Stub;
+    ETWFunctionLeave_Func             = ETWFunctionLeave_Stub;
+    ETWFunctionFilter_Func            = ETWFunctionFilter_Stub;
+    ETWCounterRegion_Func             = ETWCounterRegion_Stub;
+    ETWCounterRegionRemove_Func       = ETWCounterRegionRemove_Stub;
+    ETWSetCounterInterval_Func        = ETWSetCounterInterval_Stub;
+    ETWSetOverheadBudget_Func         = ETWSetOverheadBudget_Stub;
+    ETWScopeThreshold_Func            = ETWScopeThreshold_Stub;
+    ETWScopeSampling_Func             = ETWScopeSampling_Stub;
+    ETWSetLiveStats_Func              = ETWSetLiveStats_Stub;
 
     // unload the DLL, which should only have one reference.
     if (ETWProviderDLL != NULL)
@@ -415,6 +727,19 @@ void ETWMarkerFormatMain(_Printf_format_string_ char const *format, ...)
 #endif
 }
 
+void ETWMarkerFormatMainV(_Printf_format_string_ char const *format, va_list args)
+{
+#ifndef ETW_STRIP_IMPLEMENTATION
+    assert(ETWMarkerFormatMainV_Func && "ETWInitialize must be called!");
+    char   buffer[ETW_PROVIDER_FORMAT_BUFFER_SIZE];
+    // NOTE: the second argument expects the buffer length in characters.
+    ETWMarkerFormatMainV_Func(buffer, ETW_PROVIDER_FORMAT_BUFFER_SIZE, format, args);
+#else
+    UNUSED_ARG(format);
+    UNUSED_ARG(args);
+#endif
+}
+
 void ETWMarkerTask(char const *message)
 {
 #ifndef ETW_STRIP_IMPLEMENTATION
@@ -440,6 +765,19 @@ void ETWMarkerFormatTask(_Printf_format_string_ char const *format, ...)
 #endif
 }
 
+void ETWMarkerFormatTaskV(_Printf_format_string_ char const *format, va_list args)
+{
+#ifndef ETW_STRIP_IMPLEMENTATION
+    assert(ETWMarkerFormatTaskV_Func && "ETWInitialize must be called!");
+    char   buffer[ETW_PROVIDER_FORMAT_BUFFER_SIZE];
+    // NOTE: the second argument expects the buffer length in characters.
+    ETWMarkerFormatTaskV_Func(buffer, ETW_PROVIDER_FORMAT_BUFFER_SIZE, format, args);
+#else
+    UNUSED_ARG(format);
+    UNUSED_ARG(args);
+#endif
+}
+
 void ETWMouseDown(int button, DWORD flags, int x, int y)
 {
 #ifndef ETW_STRIP_IMPLEMENTATION
@@ -503,3 +841,396 @@ void ETWKeyDown(DWORD character, char const* name, DWORD repeat_count, DWORD fla
     UNUSED_ARG(flags);
 #endif
 }
+
+LONGLONG ETWWaitBegin(char const *name, void const *object)
+{
+#ifndef ETW_STRIP_IMPLEMENTATION
+    assert(ETWWaitBegin_Func && "ETWInitialize must be called!");
+    return ETWWaitBegin_Func(name, object);
+#else
+    UNUSED_ARG(name);
+    UNUSED_ARG(object);
+    return 0;
+#endif
+}
+
+void ETWWaitEnd(char const *name, void const *object, LONGLONG begin_time, DWORD result)
+{
+#ifndef ETW_STRIP_IMPLEMENTATION
+    assert(ETWWaitEnd_Func && "ETWInitialize must be called!");
+    ETWWaitEnd_Func(name, object, begin_time, result);
+#else
+    UNUSED_ARG(name);
+    UNUSED_ARG(object);
+    UNUSED_ARG(begin_time);
+    UNUSED_ARG(result);
+#endif
+}
+
+DWORD ETWWaitForSingleObject(char const *name, HANDLE handle, DWORD timeout)
+{   // poll first; only a wait that would actually block is recorded.
+    DWORD result = WaitForSingleObject(handle, 0);
+    if (result == WAIT_TIMEOUT && timeout != 0)
+    {
+        LONGLONG begin_time = ETWWaitBegin(name, handle);
+        result = WaitForSingleObject(handle, timeout);
+        ETWWaitEnd(name, handle, begin_time, result);
+    }
+    return result;
+}
+
+DWORD ETWWaitForMultipleObjectsEx(char const *name, DWORD count, HANDLE const *handles, BOOL wait_all, DWORD timeout, BOOL alertable)
+{   // poll first; only a wait that would actually block is recorded.
+    DWORD result = WaitForMultipleObjectsEx(count, handles, wait_all, 0, alertable);
+    if (result == WAIT_TIMEOUT && timeout != 0)
+    {
+        LONGLONG begin_time = ETWWaitBegin(name, handles[0]);
+        result = WaitForMultipleObjectsEx(count, handles, wait_all, timeout, alertable);
+        ETWWaitEnd(name, handles[0], begin_time, result);
+    }
+    return result;
+}
+
+void ETWFlowMain(char const *name, ULONGLONG flow_id, DWORD phase)
+{
+#ifndef ETW_STRIP_IMPLEMENTATION
+    assert(ETWFlowMain_Func && "ETWInitialize must be called!");
+    ETWFlowMain_Func(name, flow_id, phase);
+#else
+    UNUSED_ARG(name);
+    UNUSED_ARG(flow_id);
+    UNUSED_ARG(phase);
+#endif
+}
+
+void ETWFlowTask(char const *name, ULONGLONG flow_id, DWORD phase)
+{
+#ifndef ETW_STRIP_IMPLEMENTATION
+    assert(ETWFlowTask_Func && "ETWInitialize must be called!");
+    ETWFlowTask_Func(name, flow_id, phase);
+#else
+    UNUSED_ARG(name);
+    UNUSED_ARG(flow_id);
+    UNUSED_ARG(phase);
+#endif
+}
+
+void ETWSetOverflowPolicy(DWORD policy, DWORD spin_us)
+{
+#ifndef ETW_STRIP_IMPLEMENTATION
+    assert(ETWSetOverflowPolicy_Func && "ETWInitialize must be called!");
+    ETWSetOverflowPolicy_Func(policy, spin_us);
+#else
+    UNUSED_ARG(policy);
+    UNUSED_ARG(spin_us);
+#endif
+}
+
+ULONGLONG ETWLostEvents(DWORD provider)
+{
+#ifndef ETW_STRIP_IMPLEMENTATION
+    assert(ETWLostEvents_Func && "ETWInitialize must be called!");
+    return ETWLostEvents_Func(provider);
+#else
+    UNUSED_ARG(provider);
+    return 0;
+#endif
+}
+
+ETWTASK ETWTaskCreate(char const *name)
+{
+#ifndef ETW_STRIP_IMPLEMENTATION
+    assert(ETWTaskCreate_Func && "ETWInitialize must be called!");
+    return ETWTaskCreate_Func(name);
+#else
+    UNUSED_ARG(name);
+    return NULL;
+#endif
+}
+
+void ETWTaskResume(ETWTASK task)
+{
+#ifndef ETW_STRIP_IMPLEMENTATION
+    assert(ETWTaskResume_Func && "ETWInitialize must be called!");
+    ETWTaskResume_Func(task);
+#else
+    UNUSED_ARG(task);
+#endif
+}
+
+void ETWTaskSuspend(ETWTASK task)
+{
+#ifndef ETW_STRIP_IMPLEMENTATION
+    assert(ETWTaskSuspend_Func && "ETWInitialize must be called!");
+    ETWTaskSuspend_Func(task);
+#else
+    UNUSED_ARG(task);
+#endif
+}
+
+void ETWTaskDelete(ETWTASK task)
+{
+#ifndef ETW_STRIP_IMPLEMENTATION
+    assert(ETWTaskDelete_Func && "ETWInitialize must be called!");
+    ETWTaskDelete_Func(task);
+#else
+    UNUSED_ARG(task);
+#endif
+}
+
+void ETWFileOpen(char const *path, HANDLE file, DWORD access, DWORD error, float latency_ms)
+{
+#ifndef ETW_STRIP_IMPLEMENTATION
+    assert(ETWFileOpen_Func && "ETWInitialize must be called!");
+    ETWFileOpen_Func(path, file, access, error, latency_ms);
+#else
+    UNUSED_ARG(path);
+    UNUSED_ARG(file);
+    UNUSED_ARG(access);
+    UNUSED_ARG(error);
+    UNUSED_ARG(latency_ms);
+#endif
+}
+
+void ETWFileRead(HANDLE file, ULONGLONG offset, DWORD requested, DWORD transferred, DWORD error, float latency_ms)
+{
+#ifndef ETW_STRIP_IMPLEMENTATION
+    assert(ETWFileRead_Func && "ETWInitialize must be called!");
+    ETWFileRead_Func(file, offset, requested, transferred, error, latency_ms);
+#else
+    UNUSED_ARG(file);
+    UNUSED_ARG(offset);
+    UNUSED_ARG(requested);
+    UNUSED_ARG(transferred);
+    UNUSED_ARG(error);
+    UNUSED_ARG(latency_ms);
+#endif
+}
+
+void ETWFileMapping(HANDLE file, HANDLE mapping, ULONGLONG size, float latency_ms)
+{
+#ifndef ETW_STRIP_IMPLEMENTATION
+    assert(ETWFileMapping_Func && "ETWInitialize must be called!");
+    ETWFileMapping_Func(file, mapping, size, latency_ms);
+#else
+    UNUSED_ARG(file);
+    UNUSED_ARG(mapping);
+    UNUSED_ARG(size);
+    UNUSED_ARG(latency_ms);
+#endif
+}
+
+void ETWFileMapView(HANDLE mapping, void const *address, ULONGLONG offset, ULONGLONG size, float latency_ms)
+{
+#ifndef ETW_STRIP_IMPLEMENTATION
+    assert(ETWFileMapView_Func && "ETWInitialize must be called!");
+    ETWFileMapView_Func(mapping, address, offset, size, latency_ms);
+#else
+    UNUSED_ARG(mapping);
+    UNUSED_ARG(address);
+    UNUSED_ARG(offset);
+    UNUSED_ARG(size);
+    UNUSED_ARG(latency_ms);
+#endif
+}
+
+void ETWFileUnmapView(void const *address, float latency_ms)
+{
+#ifndef ETW_STRIP_IMPLEMENTATION
+    assert(ETWFileUnmapView_Func && "ETWInitialize must be called!");
+    ETWFileUnmapView_Func(address, latency_ms);
+#else
+    UNUSED_ARG(address);
+    UNUSED_ARG(latency_ms);
+#endif
+}
+
+void ETWFilePrefetch(void const *address, ULONGLONG size, DWORD ranges, float latency_ms)
+{
+#ifndef ETW_STRIP_IMPLEMENTATION
+    assert(ETWFilePrefetch_Func && "ETWInitialize must be called!");
+    ETWFilePrefetch_Func(address, size, ranges, latency_ms);
+#else
+    UNUSED_ARG(address);
+    UNUSED_ARG(size);
+    UNUSED_ARG(ranges);
+    UNUSED_ARG(latency_ms);
+#endif
+}
+
+DWORD ETWHookFileIO(void)
+{
+#ifndef ETW_STRIP_IMPLEMENTATION
+    assert(ETWHookFileIO_Func && "ETWInitialize must be called!");
+    return ETWHookFileIO_Func();
+#else
+    return 0;
+#endif
+}
+
+// Called by the _penter hook. Instrumented code may run before ETWInitialize() or after
+// ETWShutdown(), so unlike the public functions this does not assert.
+extern "C" void __cdecl ETWPenterHook(void const *address, void const *stack)
+{
+#ifndef ETW_STRIP_IMPLEMENTATION
+    if (ETWFunctionEnter_Func != NULL)
+        ETWFunctionEnter_Func(address, stack);
+#else
+    UNUSED_ARG(address);
+    UNUSED_ARG(stack);
+#endif
+}
+
+// Called by the _pexit hook.
+extern "C" void __cdecl ETWPexitHook(void const *stack)
+{
+#ifndef ETW_STRIP_IMPLEMENTATION
+    if (ETWFunctionLeave_Func != NULL)
+        ETWFunctionLeave_Func(stack);
+#else
+    UNUSED_ARG(stack);
+#endif
+}
+
+#if defined(_M_X64)
+// The x64 hooks are implemented in ETWPenter.asm.
+#pragma comment(linker, "/EXPORT:_penter")
+#pragma comment(linker, "/EXPORT:_pexit")
+#elif defined(_M_IX86)
+// Called on entry to every function compiled with /Gh, before its prologue. The call to 
+// _penter is 5 bytes long and is the first instruction of the function, and the function's
+// return address is on top of its stack. Registers holding arguments are preserved.
+extern "C" ETWCLIENT_API __declspec(naked) void __cdecl _penter(void)
+{
+    __asm
+    {
+        push    eax
+        push    ecx
+        push    edx
+        lea     eax, [esp + 16]
+        push    eax
+        mov     eax, [esp + 16]
+        sub     eax, 5
+        push    eax
+        call    ETWPenterHook
+        add     esp, 8
+        pop     edx
+        pop     ecx
+        pop     eax
+        ret
+    }
+}
+
+// Called on exit from every function compiled with /GH, before its epilogue. A return 
+// value may be in eax:edx or on the x87 stack, so both are preserved.
+extern "C" ETWCLIENT_API __declspec(naked) void __cdecl _pexit(void)
+{
+    __asm
+    {
+        push    eax
+        push    ecx
+        push    edx
+        sub     esp, 108
+        fnsave  [esp]
+        lea     eax, [esp + 124]
+        push    eax
+        call    ETWPexitHook
+        add     esp, 4
+        frstor  [esp]
+        add     esp, 108
+        pop     edx
+        pop     ecx
+        pop     eax
+        ret
+    }
+}
+#endif
+
+void ETWFunctionFilter(char const *include, char const *exclude, DWORD min_us)
+{
+#ifndef ETW_STRIP_IMPLEMENTATION
+    assert(ETWFunctionFilter_Func && "ETWInitialize must be called!");
+    ETWFunctionFilter_Func(include, exclude, min_us);
+#else
+    UNUSED_ARG(include);
+    UNUSED_ARG(exclude);
+    UNUSED_ARG(min_us);
+#endif
+}
+
+BOOL ETWCounterRegion(char const *name, void const *address, ULONGLONG size)
+{
+#ifndef ETW_STRIP_IMPLEMENTATION
+    assert(ETWCounterRegion_Func && "ETWInitialize must be called!");
+    return ETWCounterRegion_Func(name, address, size);
+#else
+    UNUSED_ARG(name);
+    UNUSED_ARG(address);
+    UNUSED_ARG(size);
+    return FALSE;
+#endif
+}
+
+void ETWCounterRegionRemove(void const *address)
+{
+#ifndef ETW_STRIP_IMPLEMENTATION
+    assert(ETWCounterRegionRemove_Func && "ETWInitialize must be called!");
+    ETWCounterRegionRemove_Func(address);
+#else
+    UNUSED_ARG(address);
+#endif
+}
+
+void ETWSetCounterInterval(DWORD interval_ms)
+{
+#ifndef ETW_STRIP_IMPLEMENTATION
+    assert(ETWSetCounterInterval_Func && "ETWInitialize must be called!");
+    ETWSetCounterInterval_Func(interval_ms);
+#else
+    UNUSED_ARG(interval_ms);
+#endif
+}
+
+void ETWSetOverheadBudget(float percent)
+{
+#ifndef ETW_STRIP_IMPLEMENTATION
+    assert(ETWSetOverheadBudget_Func && "ETWInitialize must be called!");
+    ETWSetOverheadBudget_Func(percent);
+#else
+    UNUSED_ARG(percent);
+#endif
+}
+
+BOOL ETWScopeThreshold(char const *name, DWORD min_us)
+{
+#ifndef ETW_STRIP_IMPLEMENTATION
+    assert(ETWScopeThreshold_Func && "ETWInitialize must be called!");
+    return ETWScopeThreshold_Func(name, min_us);
+#else
+    UNUSED_ARG(name);
+    UNUSED_ARG(min_us);
+    return FALSE;
+#endif
+}
+
+BOOL ETWScopeSampling(char const *name, DWORD one_in)
+{
+#ifndef ETW_STRIP_IMPLEMENTATION
+    assert(ETWScopeSampling_Func && "ETWInitialize must be called!");
+    return ETWScopeSampling_Func(name, one_in);
+#else
+    UNUSED_ARG(name);
+    UNUSED_ARG(one_in);
+    return FALSE;
+#endif
+}
+
+void ETWSetLiveStats(BOOL enable)
+{
+#ifndef ETW_STRIP_IMPLEMENTATION
+    assert(ETWSetLiveStats_Func && "ETWInitialize must be called!");
+    ETWSetLiveStats_Func(enable);
+#else
+    UNUSED_ARG(enable);
+#endif
+}
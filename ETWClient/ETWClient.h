@@ -41,6 +41,77 @@ enum etw_input_flags_e
     ETW_FLAGS_FORCE_32BIT  = 0xFFFFFFFFU
 };
 
+/// @summary Identifies a step in the lifetime of a unit of work that is handed between 
+/// threads, such as a prefetch request issued by one thread and serviced by another.
+enum etw_flow_phase_e
+{
+    ETW_FLOW_ISSUE         = 0, /* the work was requested */
+    ETW_FLOW_START         = 1, /* a thread started performing the work */
+    ETW_FLOW_FINISH        = 2, /* the work completed */
+    ETW_FLOW_CANCEL        = 3, /* the work was abandoned before completion */
+    ETW_FLOW_CONSUME       = 4, /* the requester needs the result of the work */
+    ETW_FLOW_FORCE_32BIT   = 0x7FFFFFFFL
+};
+
+/// @summary Identifies the custom providers declared in ETWProvider.man.
+enum etw_provider_e
+{
+    ETW_PROVIDER_MAIN_THREAD = 0,
+    ETW_PROVIDER_TASK_THREAD = 1,
+    ETW_PROVIDER_USER_INPUT  = 2,
+    ETW_PROVIDER_SYNC        = 3,
+    ETW_PROVIDER_FILE_IO     = 4
+};
+
+/// @summary An opaque handle to a task context created by ETWTaskCreate.
+typedef struct ETWTASK__ *ETWTASK;
+
+/// @summary Identifies what a provider does when a session has no free buffer for an event.
+enum etw_overflow_policy_e
+{
+    ETW_OVERFLOW_DROP_NEWEST = 0, /* drop the event being written; the default */
+    ETW_OVERFLOW_SPIN        = 1, /* wait a bounded time for a free buffer, then drop */
+    ETW_OVERFLOW_FORCE_32BIT = 0x7FFFFFFFL
+};
+
+/// @summary The keyword masks used to classify call sites by how often they fire. 
+/// These must match the keywords declared in ETWProvider.man.
+#define ETW_KEYWORD_LOW_FREQUENCY       0x0000000000000001ULL
+#define ETW_KEYWORD_NORMAL_FREQUENCY    0x0000000000000002ULL
+#define ETW_KEYWORD_HIGH_FREQUENCY      0x0000000000000004ULL
+
+/// @summary The event levels, with the same values as the TRACE_LEVEL_xxx constants.
+#define ETW_LEVEL_CRITICAL              1
+#define ETW_LEVEL_ERROR                 2
+#define ETW_LEVEL_WARNING               3
+#define ETW_LEVEL_INFORMATION           4
+#define ETW_LEVEL_VERBOSE               5
+
+/// @summary The keyword mask and maximum level of the filtered call sites that are 
+/// compiled into the build; see ETWSite. Define these on the compiler command line to 
+/// strip call sites, for example /DETW_COMPILE_KEYWORDS=0x3 removes HighFrequency sites 
+/// while keeping LowFrequency and NormalFrequency ones. The per-provider values default 
+/// to the global ones. Unlike ETW_STRIP_IMPLEMENTATION, which turns every function in 
+/// ETWClient.dll into a no-op, stripped sites generate no code at all in the caller.
+#ifndef ETW_COMPILE_KEYWORDS
+#define ETW_COMPILE_KEYWORDS            0xFFFFFFFFFFFFFFFFULL
+#endif
+#ifndef ETW_COMPILE_LEVEL
+#define ETW_COMPILE_LEVEL               ETW_LEVEL_VERBOSE
+#endif
+#ifndef ETW_COMPILE_KEYWORDS_MAIN
+#define ETW_COMPILE_KEYWORDS_MAIN       ETW_COMPILE_KEYWORDS
+#endif
+#ifndef ETW_COMPILE_LEVEL_MAIN
+#define ETW_COMPILE_LEVEL_MAIN          ETW_COMPILE_LEVEL
+#endif
+#ifndef ETW_COMPILE_KEYWORDS_TASK
+#define ETW_COMPILE_KEYWORDS_TASK       ETW_COMPILE_KEYWORDS
+#endif
+#ifndef ETW_COMPILE_LEVEL_TASK
+#define ETW_COMPILE_LEVEL_TASK          ETW_COMPILE_LEVEL
+#endif
+
 /*///////////////////////
 //  Public Functions   //
 ///////////////////////*/
@@ -56,22 +127,28 @@ ETWCLIENT_API void     ETWInitialize(void);
 ETWCLIENT_API void     ETWShutdown(void);
 
 /// @summary Emits an event specifying the name associated with a given thread ID. Typically,
-/// this function would be called when a new thread is created.
+/// this function would be called when a new thread is created. Threads that are never named 
+/// explicitly emit a name automatically (from SetThreadDescription, if set) on their first event.
 /// @param thread_name A NULL-terminated string identifying the thread.
 /// @param thread_id The operating system identifier of the thread.
 ETWCLIENT_API void     ETWThreadID(char const *thread_name, DWORD thread_id);
 
 /// @summary Indicates that a named, timed scope is being entered. Typically, this function
 /// is not called directly; instead, it is easier and safer to use the ETWScope class.
+/// If a session enables the Sampling keyword, samples taken while the scope is open are 
+/// attributed to it, so its name must remain valid until the scope is exited.
 /// @param message A NULL-terminated string identifying the scope.
-/// @return The current timestamp, which must be passed to ETWLeaveScope.
+/// @return The current timestamp, which must be passed to ETWLeaveScope, or zero if the
+/// scope was not sampled (see ETWScopeSampling).
 ETWCLIENT_API LONGLONG ETWEnterScopeMain(char const *message);
 
 /// @summary Indicates that a named, timed scope is being exited. Typically, this function 
 /// is not called directly; instead, it is easier and safer to use the ETWScope class.
+/// If a session enables the ThreadTime keyword, a second event also reports how much of 
+/// the scope duration the thread spent running on a processor, and how much it spent blocked.
 /// @param message A NULL-terminated string identifying the scope.
 /// @param enter_time The timestamp value returned from ETWEnterScope().
-/// @return The current timestamp.
+/// @return The current timestamp, or zero if the scope was not sampled.
 ETWCLIENT_API LONGLONG ETWLeaveScopeMain(char const *message, LONGLONG enter_time);
 
 /// @summary Emits a string marker event to the tracing system.
@@ -83,6 +160,18 @@ ETWCLIENT_API void     ETWMarkerMain(char const *message);
 /// @param ... Substitution arguments for the format string.
 ETWCLIENT_API void     ETWMarkerFormatMain(_Printf_format_string_ char const *format, ...);
 
+/// @summary Emits a formatted string marker event to the tracing system.
+/// @param format A NULL-terminated string following printf format specifier rules.
+/// @param args Substitution arguments for the format string.
+ETWCLIENT_API void     ETWMarkerFormatMainV(_Printf_format_string_ char const *format, va_list args);
+
+/// @summary Emits a flow event, which links work performed on different threads. Events
+/// with the same name and flow ID, emitted from any thread, describe one unit of work.
+/// @param name A NULL-terminated string identifying the kind of work.
+/// @param flow_id The application-defined identifier of the unit of work.
+/// @param phase One of the values of etw_flow_phase_e.
+ETWCLIENT_API void     ETWFlowMain(char const *name, ULONGLONG flow_id, DWORD phase);
+
 /// @summary Indicates that a named, timed scope is being entered. Typically, this function
 /// is not called directly; instead, it is easier and safer to use the ETWScope class.
 /// @param message A NULL-terminated string identifying the scope.
@@ -91,6 +180,8 @@ ETWCLIENT_API LONGLONG ETWEnterScopeTask(char const *message);
 
 /// @summary Indicates that a named, timed scope is being exited. Typically, this function 
 /// is not called directly; instead, it is easier and safer to use the ETWScope class.
+/// If a session enables the ThreadTime keyword, a second event also reports how much of 
+/// the scope duration the thread spent running on a processor, and how much it spent blocked.
 /// @param message A NULL-terminated string identifying the scope.
 /// @param enter_time The timestamp value returned from ETWEnterScope().
 /// @return The current timestamp.
@@ -105,6 +196,162 @@ ETWCLIENT_API void     ETWMarkerTask(char const *message);
 /// @param ... Substitution arguments for the format string.
 ETWCLIENT_API void     ETWMarkerFormatTask(_Printf_format_string_ char const *format, ...);
 
+/// @summary Emits a formatted string marker event to the tracing system.
+/// @param format A NULL-terminated string following printf format specifier rules.
+/// @param args Substitution arguments for the format string.
+ETWCLIENT_API void     ETWMarkerFormatTaskV(_Printf_format_string_ char const *format, va_list args);
+
+/// @summary Emits a flow event, which links work performed on different threads. Events
+/// with the same name and flow ID, emitted from any thread, describe one unit of work.
+/// @param name A NULL-terminated string identifying the kind of work.
+/// @param flow_id The application-defined identifier of the unit of work.
+/// @param phase One of the values of etw_flow_phase_e.
+ETWCLIENT_API void     ETWFlowTask(char const *name, ULONGLONG flow_id, DWORD phase);
+
+/// @summary Creates a task context for a unit of work that may be suspended on one thread
+/// and resumed on another, such as a coroutine or a job that yields. While the task is 
+/// resumed on a thread, ETWEnterScopeTask and ETWLeaveScopeTask use the task's own scope
+/// stack, so scope depth and nesting follow the task rather than the thread.
+/// @param name A NULL-terminated string identifying the kind of task. The string must 
+/// remain valid until the task is deleted.
+/// @return The task context, or NULL if it could not be created. A NULL task may be 
+/// passed to the other ETWTaskXxx functions, which then do nothing.
+ETWCLIENT_API ETWTASK  ETWTaskCreate(char const *name);
+
+/// @summary Makes a task current on the calling thread, and emits a TaskResume event.
+/// Resume and suspend calls on a thread must nest; a task that runs another task inline 
+/// must suspend it before being suspended itself.
+/// @param task The task context returned by ETWTaskCreate.
+ETWCLIENT_API void     ETWTaskResume(ETWTASK task);
+
+/// @summary Restores the task that was current on the calling thread before the task was 
+/// resumed, and emits a TaskSuspend event. Scopes still open in the task stay open, and 
+/// may be left after the task is resumed on another thread.
+/// @param task The task context passed to ETWTaskResume.
+ETWCLIENT_API void     ETWTaskSuspend(ETWTASK task);
+
+/// @summary Emits a TaskComplete event, which reports the time from creation to completion,
+/// the time the task spent resumed and how often it moved between threads, and then frees
+/// the task context. The task must not be current on any thread.
+/// @param task The task context returned by ETWTaskCreate.
+ETWCLIENT_API void     ETWTaskDelete(ETWTASK task);
+
+/// @summary Emits an event describing an attempt to open a file. These events are normally
+/// emitted by the hooks installed with ETWHookFileIO, but may be emitted directly by code 
+/// that performs I/O through its own layer.
+/// @param path The path of the file, as UTF-8.
+/// @param file The handle returned by the open call, or INVALID_HANDLE_VALUE.
+/// @param access The access rights requested.
+/// @param error The error code if the open failed, or zero.
+/// @param latency_ms The time taken by the open call, in milliseconds.
+ETWCLIENT_API void     ETWFileOpen(char const *path, HANDLE file, DWORD access, DWORD error, float latency_ms);
+
+/// @summary Emits an event describing a read from a file. A thread that reads very often
+/// has its reads summed into a FileSummary event instead of writing one event per read.
+/// @param file The handle of the file.
+/// @param offset The file offset of the read, or ~0 if the read used the file pointer.
+/// @param requested The number of bytes requested.
+/// @param transferred The number of bytes read.
+/// @param error The error code if the read failed or is pending, or zero.
+/// @param latency_ms The time taken by the read call, in milliseconds.
+ETWCLIENT_API void     ETWFileRead(HANDLE file, ULONGLONG offset, DWORD requested, DWORD transferred, DWORD error, float latency_ms);
+
+/// @summary Emits an event describing the creation of a file mapping object.
+/// @param file The handle of the mapped file.
+/// @param mapping The handle of the file mapping object, or NULL on failure.
+/// @param size The maximum size of the mapping, or zero for the size of the file.
+/// @param latency_ms The time taken by the call, in milliseconds.
+ETWCLIENT_API void     ETWFileMapping(HANDLE file, HANDLE mapping, ULONGLONG size, float latency_ms);
+
+/// @summary Emits an event describing a view mapped from a file mapping object.
+/// @param mapping The handle of the file mapping object.
+/// @param address The base address of the view, or NULL on failure.
+/// @param offset The file offset of the view.
+/// @param size The number of bytes mapped.
+/// @param latency_ms The time taken by the call, in milliseconds.
+ETWCLIENT_API void     ETWFileMapView(HANDLE mapping, void const *address, ULONGLONG offset, ULONGLONG size, float latency_ms);
+
+/// @summary Emits an event describing a view being unmapped.
+/// @param address The base address of the view.
+/// @param latency_ms The time taken by the call, in milliseconds.
+ETWCLIENT_API void     ETWFileUnmapView(void const *address, float latency_ms);
+
+/// @summary Emits an event describing a request to prefetch pages of mapped files.
+/// @param address The address of the first range.
+/// @param size The total number of bytes in all ranges.
+/// @param ranges The number of address ranges.
+/// @param latency_ms The time taken by the call, in milliseconds.
+ETWCLIENT_API void     ETWFilePrefetch(void const *address, ULONGLONG size, DWORD ranges, float latency_ms);
+
+/// @summary Hooks CreateFile, ReadFile, CreateFileMapping, MapViewOfFile, UnmapViewOfFile
+/// and PrefetchVirtualMemory in every module loaded in the process, so each call emits 
+/// one of the ETWFileXxx events. Modules loaded later, and calls through addresses obtained
+/// with GetProcAddress, are not hooked. Call this once, after loading the application's DLLs.
+/// @return The number of imports patched.
+ETWCLIENT_API DWORD    ETWHookFileIO(void);
+
+/// @summary Restricts which calls to instrumented functions are reported. Code compiled 
+/// with /Gh /GH and linked against ETWClient.lib calls the _penter and _pexit hooks exported
+/// by ETWClient.dll, and while a session enables the Functions keyword, calls are reported 
+/// as FunctionEnter and FunctionLeave events identified by the function address, which the
+/// analyzer resolves to a name using the module's PDB. Calls shorter than the minimum 
+/// duration are not reported, unless they enclose a call or scope that is; each reported
+/// call counts the shorter calls it made.
+/// @param include A ';'-separated list of module name substrings, compared without regard 
+/// to case. If not NULL or empty, only functions in matching modules are reported.
+/// @param exclude A ';'-separated list of module name substrings. Functions in matching
+/// modules are not reported. May be NULL.
+/// @param min_us The minimum duration of a reported call, in microseconds, or zero to use
+/// a minimum derived from the measured cost of a scope.
+ETWCLIENT_API void     ETWFunctionFilter(char const *include, char const *exclude, DWORD min_us);
+
+/// @summary Sets the minimum duration of the main scopes that are reported. A scope's enter
+/// event is held until the scope has run that long; shorter scopes write no events, and are
+/// counted and timed by name in a ScopeSummary event written every 100ms instead. A scope 
+/// enclosing a reported scope, function call, marker or flow is always reported. Live stats
+/// for the 'top' command include every scope.
+/// @param name The scope name, or NULL to set the threshold of all scopes without their own.
+/// @param min_us The minimum duration, in microseconds, or zero to report every scope.
+/// @return TRUE if the threshold was set, or FALSE if too many names have thresholds.
+ETWCLIENT_API BOOL     ETWScopeThreshold(char const *name, DWORD min_us);
+
+/// @summary Samples the main scopes with a given name, for scopes entered millions of times
+/// per second. Each instance is sampled independently with probability 1/one_in; the rest 
+/// write no events and cost only a counter increment, and are counted by name in a 
+/// ScopeSampled event. The 'scopes' command scales the counts and times of sampled names to
+/// unbiased estimates. Scopes nested in an instance that is not sampled are reported as 
+/// children of its parent, and live stats for the 'top' command include sampled instances only.
+/// @param name The scope name.
+/// @param one_in The sampling rate, or zero or one to report every scope.
+/// @return TRUE if the rate was set, or FALSE if too many names have a threshold or rate.
+ETWCLIENT_API BOOL     ETWScopeSampling(char const *name, DWORD one_in);
+
+/// @summary Starts or stops publishing per-scope statistics to shared memory for the 'top'
+/// command. Publishing is off by default, since each scope exit then costs a table lookup 
+/// and a few interlocked adds. The segment is created on the first call that enables it, 
+/// and kept until ETWShutdown(); while stopped, 'top' shows no new scopes.
+/// @param enable TRUE to publish statistics, or FALSE to stop.
+ETWCLIENT_API void     ETWSetLiveStats(BOOL enable);
+
+/// @summary Registers an address range, such as a view of a mapped input file, whose 
+/// residency is sampled along with the process memory, fault, I/O and CPU counters while
+/// a session enables the Counters keyword on the file I/O provider. A page is counted as 
+/// resident when it is in the working set of the process.
+/// @param name A short name identifying the range in the trace. The string is copied.
+/// @param address The first byte of the range.
+/// @param size The size of the range, in bytes.
+/// @return TRUE if the range was registered, or FALSE if too many ranges are registered.
+ETWCLIENT_API BOOL     ETWCounterRegion(char const *name, void const *address, ULONGLONG size);
+
+/// @summary Stops sampling the residency of an address range. Call this before the range
+/// is unmapped or freed.
+/// @param address The address passed to ETWCounterRegion.
+ETWCLIENT_API void     ETWCounterRegionRemove(void const *address);
+
+/// @summary Sets the interval between counter samples. The default is 10 milliseconds.
+/// @param interval_ms The interval, in milliseconds, or zero for the default.
+ETWCLIENT_API void     ETWSetCounterInterval(DWORD interval_ms);
+
 /// @summary Emits a mouse button press event to the tracing system.
 /// @param button One of the values of etw_button_e.
 /// @param flags A combination of one or more values of etw_input_flags_e.
@@ -139,6 +386,68 @@ ETWCLIENT_API void     ETWMouseWheel(DWORD flags, int delta_z, int x, int y);
 /// @param flags A combination of one or more values of etw_input_flags_e.
 ETWCLIENT_API void     ETWKeyDown(DWORD character, char const* name, DWORD repeat_count, DWORD flags);
 
+/// @summary Indicates that the calling thread is about to block on a synchronization object.
+/// Call this only after a non-blocking attempt to acquire the object has failed, so that 
+/// uncontended acquisitions emit no events. Typically, this function is not called directly;
+/// instead, use ETWCriticalSection or one of the ETWWaitForXxx functions.
+/// @param name A NULL-terminated string identifying the lock or wait.
+/// @param object The address or handle of the synchronization object.
+/// @return The current timestamp, which must be passed to ETWWaitEnd.
+ETWCLIENT_API LONGLONG ETWWaitBegin(char const *name, void const *object);
+
+/// @summary Indicates that a blocking wait started with ETWWaitBegin has completed.
+/// @param name A NULL-terminated string identifying the lock or wait.
+/// @param object The address or handle of the synchronization object.
+/// @param begin_time The timestamp value returned from ETWWaitBegin().
+/// @param result The value returned by the wait function, or zero for a lock acquisition.
+ETWCLIENT_API void     ETWWaitEnd(char const *name, void const *object, LONGLONG begin_time, DWORD result);
+
+/// @summary A drop-in replacement for WaitForSingleObject that emits wait events if, and 
+/// only if, the object is not already signaled.
+/// @param name A NULL-terminated string identifying the wait.
+/// @param handle The handle of the object to wait on.
+/// @param timeout The maximum time to wait, in milliseconds, or INFINITE.
+/// @return The value returned by WaitForSingleObject.
+ETWCLIENT_API DWORD    ETWWaitForSingleObject(char const *name, HANDLE handle, DWORD timeout);
+
+/// @summary A drop-in replacement for WaitForMultipleObjectsEx that emits wait events if, 
+/// and only if, the wait cannot be satisfied immediately.
+/// @param name A NULL-terminated string identifying the wait.
+/// @param count The number of handles.
+/// @param handles The handles of the objects to wait on. The first handle identifies the wait.
+/// @param wait_all TRUE to wait until all of the objects are signaled.
+/// @param timeout The maximum time to wait, in milliseconds, or INFINITE.
+/// @param alertable TRUE to return when an APC or I/O completion routine is queued.
+/// @return The value returned by WaitForMultipleObjectsEx.
+ETWCLIENT_API DWORD    ETWWaitForMultipleObjectsEx(char const *name, DWORD count, HANDLE const *handles, BOOL wait_all, DWORD timeout, BOOL alertable);
+
+/// @summary Sets what happens when a session has no free buffer for an event. Dropped events 
+/// are counted per provider, and each thread reports its drops in the trace, with an 
+/// EventsLost event, on its next successful write. To keep the oldest events instead, 
+/// record to a circular log file (etwanalyze record -circular), which overwrites them.
+/// @param policy One of the values of etw_overflow_policy_e.
+/// @param spin_us For ETW_OVERFLOW_SPIN, the longest a write may wait for a free buffer,
+/// in microseconds. Spinning protects the trace at the cost of stalling the caller. When
+/// several sessions are enabled, a retried event may be written again to a session that 
+/// had room for it, so prefer the default policy when a flight recorder runs beside a capture.
+ETWCLIENT_API void     ETWSetOverflowPolicy(DWORD policy, DWORD spin_us);
+
+/// @summary Sets the share of the process CPU time that writing events may cost. Every 100ms
+/// the provider estimates its cost per provider; while it is over budget, HighFrequency events
+/// (mouse moves, file reads and views) are sampled 1 in 4, 16 or 64, and then not written at
+/// all, and each change is recorded in the trace with a marker. File operations that are not 
+/// written are still summed into the file summary events; mouse moves that are not written are
+/// only counted, in a marker written every 100ms. The governor is disabled until a budget is set.
+/// @param percent The budget, as a percentage of the process CPU time, or zero to disable the
+/// governor and write every event.
+ETWCLIENT_API void     ETWSetOverheadBudget(float percent);
+
+/// @summary Retrieves the number of events the process has dropped since ETWInitialize().
+/// @param provider One of the values of etw_provider_e, or any larger value to retrieve
+/// the total for all providers.
+/// @return The number of events that could not be written.
+ETWCLIENT_API ULONGLONG ETWLostEvents(DWORD provider);
+
 #ifdef __cplusplus
 /// @summary A helper class to manage entering and exiting a scope. This 
 /// class calls ETWEnterScopeMain for your when it is instantiated, and 
@@ -191,6 +500,298 @@ private:
     char const *Description;
     LONGLONG    EnterTime;
 };
+
+/// @summary A helper class that owns a task context. Embed one in a coroutine promise or 
+/// a job, call Resume when the work starts running on a thread and Suspend when it yields
+/// (for a coroutine, in await_resume and await_suspend of the awaiters it uses, and in 
+/// initial_suspend and final_suspend), or use ETWTaskActivation to do both for a scope.
+class ETWTaskContext
+{
+public:
+    inline ETWTaskContext(char const *name)
+    {
+        Task = ETWTaskCreate(name);
+    }
+
+    inline ~ETWTaskContext(void)
+    {
+        ETWTaskDelete(Task);
+    }
+
+    inline void Resume(void)
+    {
+        ETWTaskResume(Task);
+    }
+
+    inline void Suspend(void)
+    {
+        ETWTaskSuspend(Task);
+    }
+private:
+    ETWTaskContext(void);                               /* disallow default */
+    ETWTaskContext(ETWTaskContext const &);             /* disallow copying */
+    ETWTaskContext& operator =(ETWTaskContext const &); /* disallow copying */
+private:
+    ETWTASK     Task;
+};
+
+/// @summary A helper class to resume a task context for the lifetime of a scope, such as 
+/// the body of a job system callback that runs one slice of a task.
+class ETWTaskActivation
+{
+public:
+    inline ETWTaskActivation(ETWTaskContext &task)
+        :
+        Task(task)
+    {
+        Task.Resume();
+    }
+
+    inline ~ETWTaskActivation(void)
+    {
+        Task.Suspend();
+    }
+private:
+    ETWTaskActivation(void);                                  /* disallow default */
+    ETWTaskActivation(ETWTaskActivation const &);             /* disallow copying */
+    ETWTaskActivation& operator =(ETWTaskActivation const &); /* disallow copying */
+private:
+    ETWTaskContext &Task;
+};
+
+/// @summary The build-time filter applied to the call sites of a provider.
+template <int Provider> struct ETWCompileFilter;
+template <> struct ETWCompileFilter<ETW_PROVIDER_MAIN_THREAD>
+{
+    static ULONGLONG const Keywords = ETW_COMPILE_KEYWORDS_MAIN;
+    static int       const Level    = ETW_COMPILE_LEVEL_MAIN;
+};
+template <> struct ETWCompileFilter<ETW_PROVIDER_TASK_THREAD>
+{
+    static ULONGLONG const Keywords = ETW_COMPILE_KEYWORDS_TASK;
+    static int       const Level    = ETW_COMPILE_LEVEL_TASK;
+};
+
+/// @summary Evaluates, at compile time, whether a call site with the given provider, 
+/// keyword and level passes the build-time filter.
+template <int Provider, ULONGLONG Keyword, int Level>
+struct ETWSiteEnabled
+{
+    static bool const Value = ((Keyword & ETWCompileFilter<Provider>::Keywords) != 0) && 
+                              (Level   <= ETWCompileFilter<Provider>::Level);
+};
+
+/// @summary A call site tagged with a provider, keyword and level. Sites that pass the 
+/// build-time filter forward to the ETWxxxMain or ETWxxxTask functions; sites that do 
+/// not are empty inline functions, and the compiler removes both the call and any 
+/// argument expressions without side effects. Use the ETW_xxx macros below rather than 
+/// naming this class directly. The keyword and level only select sites at build time: 
+/// enabled sites write the same events as the untagged functions, with the keywords 
+/// declared for those events in ETWProvider.man (NormalFrequency for scopes and flows, 
+/// LowFrequency for markers), so a session cannot drop a HighFrequency site at runtime 
+/// through its keyword mask. Use ETW_COMPILE_KEYWORDS or ETWScopeSampling() instead.
+template <int Provider, ULONGLONG Keyword, int Level, bool Enabled = ETWSiteEnabled<Provider, Keyword, Level>::Value>
+struct ETWSite
+{   /* stripped: every operation is a no-op */
+    static inline LONGLONG EnterScope(char const *)                 { return 0; }
+    static inline void     LeaveScope(char const *, LONGLONG)       { /* empty */ }
+    static inline void     Marker(char const *)                     { /* empty */ }
+    static inline void     MarkerFormat(char const *, ...)          { /* empty */ }
+    static inline void     Flow(char const *, ULONGLONG, DWORD)     { /* empty */ }
+};
+
+template <ULONGLONG Keyword, int Level>
+struct ETWSite<ETW_PROVIDER_MAIN_THREAD, Keyword, Level, true>
+{
+    static inline LONGLONG EnterScope(char const *name)                 { return ETWEnterScopeMain(name); }
+    static inline void     LeaveScope(char const *name, LONGLONG enter) { ETWLeaveScopeMain(name, enter); }
+    static inline void     Marker(char const *message)                  { ETWMarkerMain(message); }
+    static inline void     Flow(char const *name, ULONGLONG id, DWORD phase) { ETWFlowMain(name, id, phase); }
+    static inline void     MarkerFormat(_Printf_format_string_ char const *format, ...)
+    {
+        va_list args;
+        va_start(args, format);
+        ETWMarkerFormatMainV(format, args);
+        va_end(args);
+    }
+};
+
+template <ULONGLONG Keyword, int Level>
+struct ETWSite<ETW_PROVIDER_TASK_THREAD, Keyword, Level, true>
+{
+    static inline LONGLONG EnterScope(char const *name)                 { return ETWEnterScopeTask(name); }
+    static inline void     LeaveScope(char const *name, LONGLONG enter) { ETWLeaveScopeTask(name, enter); }
+    static inline void     Marker(char const *message)                  { ETWMarkerTask(message); }
+    static inline void     Flow(char const *name, ULONGLONG id, DWORD phase) { ETWFlowTask(name, id, phase); }
+    static inline void     MarkerFormat(_Printf_format_string_ char const *format, ...)
+    {
+        va_list args;
+        va_start(args, format);
+        ETWMarkerFormatTaskV(format, args);
+        va_end(args);
+    }
+};
+
+/// @summary A scope helper like ETWMainScope and ETWTaskScope, tagged with a provider, 
+/// keyword and level. When the site is stripped the object is empty and its constructor 
+/// and destructor compile to nothing.
+template <int Provider, ULONGLONG Keyword, int Level, bool Enabled = ETWSiteEnabled<Provider, Keyword, Level>::Value>
+class ETWFilteredScope
+{
+public:
+    inline ETWFilteredScope(char const *name)
+        :
+        Description(name)
+    {
+        EnterTime = ETWSite<Provider, Keyword, Level>::EnterScope(name);
+    }
+
+    inline ~ETWFilteredScope(void)
+    {
+        ETWSite<Provider, Keyword, Level>::LeaveScope(Description, EnterTime);
+    }
+private:
+    ETWFilteredScope(void);                                 /* disallow default */
+    ETWFilteredScope(ETWFilteredScope const &);             /* disallow copying */
+    ETWFilteredScope& operator =(ETWFilteredScope const &); /* disallow copying */
+private:
+    char const *Description;
+    LONGLONG    EnterTime;
+};
+
+template <int Provider, ULONGLONG Keyword, int Level>
+class ETWFilteredScope<Provider, Keyword, Level, false>
+{
+public:
+    inline ETWFilteredScope(char const *) { /* empty */ }
+private:
+    ETWFilteredScope(void);                                 /* disallow default */
+    ETWFilteredScope(ETWFilteredScope const &);             /* disallow copying */
+    ETWFilteredScope& operator =(ETWFilteredScope const &); /* disallow copying */
+};
+
+/// @summary Call site macros that carry a keyword (ETW_KEYWORD_xxx) and level (ETW_LEVEL_xxx).
+/// For example, ETW_SCOPE_MAIN(s, ETW_KEYWORD_HIGH_FREQUENCY, ETW_LEVEL_VERBOSE, "INNER")
+/// declares a scope object s that disappears when built with /DETW_COMPILE_KEYWORDS=0x3.
+#define ETW_SCOPE_MAIN(var, keyword, level, name)           ETWFilteredScope<ETW_PROVIDER_MAIN_THREAD, (keyword), (level)> var(name)
+#define ETW_SCOPE_TASK(var, keyword, level, name)           ETWFilteredScope<ETW_PROVIDER_TASK_THREAD, (keyword), (level)> var(name)
+#define ETW_MARKER_MAIN(keyword, level, message)            ETWSite<ETW_PROVIDER_MAIN_THREAD, (keyword), (level)>::Marker(message)
+#define ETW_MARKER_TASK(keyword, level, message)            ETWSite<ETW_PROVIDER_TASK_THREAD, (keyword), (level)>::Marker(message)
+#define ETW_MARKER_FORMAT_MAIN(keyword, level, format, ...) ETWSite<ETW_PROVIDER_MAIN_THREAD, (keyword), (level)>::MarkerFormat(format, __VA_ARGS__)
+#define ETW_MARKER_FORMAT_TASK(keyword, level, format, ...) ETWSite<ETW_PROVIDER_TASK_THREAD, (keyword), (level)>::MarkerFormat(format, __VA_ARGS__)
+#define ETW_FLOW_MAIN(keyword, level, name, id, phase)      ETWSite<ETW_PROVIDER_MAIN_THREAD, (keyword), (level)>::Flow(name, id, phase)
+#define ETW_FLOW_TASK(keyword, level, name, id, phase)      ETWSite<ETW_PROVIDER_TASK_THREAD, (keyword), (level)>::Flow(name, id, phase)
+
+/// @summary A drop-in replacement for CRITICAL_SECTION that emits wait events when, and 
+/// only when, a thread has to block to acquire it. The uncontended path is a single 
+/// TryEnterCriticalSection call, so there is no overhead when the lock is free.
+class ETWCriticalSection
+{
+public:
+    inline ETWCriticalSection(char const *name, DWORD spin_count = 0)
+        :
+        Name(name)
+    {
+        InitializeCriticalSectionAndSpinCount(&Lock, spin_count);
+    }
+
+    inline ~ETWCriticalSection(void)
+    {
+        DeleteCriticalSection(&Lock);
+    }
+
+    inline void Enter(void)
+    {
+        if (!TryEnterCriticalSection(&Lock))
+        {   // contended; record how long it takes to acquire the lock.
+            LONGLONG begin_time = ETWWaitBegin(Name, this);
+            EnterCriticalSection(&Lock);
+            ETWWaitEnd(Name, this, begin_time, 0);
+        }
+    }
+
+    inline bool TryEnter(void)
+    {
+        return TryEnterCriticalSection(&Lock) ? true : false;
+    }
+
+    inline void Leave(void)
+    {
+        LeaveCriticalSection(&Lock);
+    }
+
+#if (_WIN32_WINNT >= 0x0600)
+    /// @summary Wait on a condition variable until a predicate holds, releasing the lock 
+    /// while blocked. The lock must be held. If the predicate already holds, the call returns
+    /// at once and emits no events; otherwise a single wait is recorded, from the first block
+    /// until the predicate holds, including the time spent re-acquiring the lock after each wake.
+    /// @param cv The condition variable signaled when the predicate may have changed.
+    /// @param ready A function object returning true once the thread can proceed.
+    /// @param timeout The longest time to wait, in milliseconds, or INFINITE.
+    /// @return TRUE if the predicate holds, or FALSE if the timeout expired or the wait failed.
+    template <typename Predicate>
+    inline BOOL Sleep(CONDITION_VARIABLE *cv, Predicate ready, DWORD timeout = INFINITE)
+    {
+        if (ready())
+        {   // not contended; nothing to wait for.
+            return TRUE;
+        }
+        LONGLONG begin_time = ETWWaitBegin(Name, cv);
+        DWORD    start      = GetTickCount();
+        DWORD    result     = WAIT_OBJECT_0;
+        do
+        {
+            DWORD elapsed = GetTickCount() - start;
+            DWORD wait    = timeout;
+            if (timeout != INFINITE)
+            {
+                if (elapsed >= timeout) { result = WAIT_TIMEOUT; break; }
+                wait = timeout - elapsed;
+            }
+            if (!SleepConditionVariableCS(cv, &Lock, wait))
+            {
+                result = GetLastError() == ERROR_TIMEOUT ? WAIT_TIMEOUT : WAIT_FAILED;
+                break;
+            }
+        } while (!ready());
+        if (result == WAIT_TIMEOUT && ready())
+            result = WAIT_OBJECT_0;
+        ETWWaitEnd(Name, cv, begin_time, result);
+        return (result == WAIT_OBJECT_0) ? TRUE : FALSE;
+    }
+#endif
+
+private:
+    ETWCriticalSection(void);                                   /* disallow default */
+    ETWCriticalSection(ETWCriticalSection const &);             /* disallow copying */
+    ETWCriticalSection& operator =(ETWCriticalSection const &); /* disallow copying */
+private:
+    char const       *Name;
+    CRITICAL_SECTION  Lock;
+};
+
+/// @summary A helper class to acquire an ETWCriticalSection for the lifetime of a scope.
+class ETWLockGuard
+{
+public:
+    inline ETWLockGuard(ETWCriticalSection &cs)
+        :
+        Lock(cs)
+    {
+        Lock.Enter();
+    }
+
+    inline ~ETWLockGuard(void)
+    {
+        Lock.Leave();
+    }
+private:
+    ETWLockGuard(void);                             /* disallow default */
+    ETWLockGuard(ETWLockGuard const &);             /* disallow copying */
+    ETWLockGuard& operator =(ETWLockGuard const &); /* disallow copying */
+private:
+    ETWCriticalSection &Lock;
+};
 #endif /*  defined(__cplusplus) */
 
 #endif /* !defined(ETW_CLIENT_H) */
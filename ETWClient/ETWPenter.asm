@@ -0,0 +1,78 @@
+;//////////////////////////////////////////////////////////////////////////////
+;/// @summary Implements the _penter and _pexit hooks called by functions 
+;/// compiled with /Gh and /GH, for x64. The x86 hooks are in ETWClient.cpp.
+;/// @author Russell Klenk (contact@russellklenk.com)
+;////////////////////////////////////////////////////////////////////////////80
+
+EXTERN ETWPenterHook:PROC
+EXTERN ETWPexitHook:PROC
+
+.CODE
+
+;/// @summary Save the registers that may hold arguments or return values of the
+;/// instrumented function, and align the stack for a call with shadow space. On 
+;/// return, [rbp+8] is the return address of the hook, and rbp+16 is the stack 
+;/// pointer of the instrumented function when it called the hook.
+HOOK_ENTER MACRO
+    push    rbp
+    mov     rbp, rsp
+    push    rax
+    push    rcx
+    push    rdx
+    push    r8
+    push    r9
+    push    r10
+    push    r11
+    sub     rsp, 0A0h
+    and     rsp, -16
+    movdqa  [rsp+020h], xmm0
+    movdqa  [rsp+030h], xmm1
+    movdqa  [rsp+040h], xmm2
+    movdqa  [rsp+050h], xmm3
+    movdqa  [rsp+060h], xmm4
+    movdqa  [rsp+070h], xmm5
+ENDM
+
+;/// @summary Restore the registers saved by HOOK_ENTER and return to the 
+;/// instrumented function.
+HOOK_LEAVE MACRO
+    movdqa  xmm0, [rsp+020h]
+    movdqa  xmm1, [rsp+030h]
+    movdqa  xmm2, [rsp+040h]
+    movdqa  xmm3, [rsp+050h]
+    movdqa  xmm4, [rsp+060h]
+    movdqa  xmm5, [rsp+070h]
+    lea     rsp, [rbp-038h]
+    pop     r11
+    pop     r10
+    pop     r9
+    pop     r8
+    pop     rdx
+    pop     rcx
+    pop     rax
+    pop     rbp
+    ret
+ENDM
+
+;/// @summary Called on entry to every function compiled with /Gh, before its 
+;/// prologue. The call to _penter is 5 bytes long and is the first instruction
+;/// of the function, and the function's return address is on top of its stack.
+_penter PROC
+    HOOK_ENTER
+    mov     rcx, [rbp+8]
+    sub     rcx, 5
+    lea     rdx, [rbp+16]
+    call    ETWPenterHook
+    HOOK_LEAVE
+_penter ENDP
+
+;/// @summary Called on exit from every function compiled with /GH, before its
+;/// epilogue, so the return value is still in rax or xmm0.
+_pexit PROC
+    HOOK_ENTER
+    lea     rcx, [rbp+16]
+    call    ETWPexitHook
+    HOOK_LEAVE
+_pexit ENDP
+
+END
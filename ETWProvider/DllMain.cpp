@@ -22,6 +22,8 @@
 /*///////////////
 //   Globals   //
 ///////////////*/
+/// @summary Implemented in ETWPublic.cpp. Frees the provider state for the calling thread.
+extern "C" void ETWThreadDetach(void);
 
 /*///////////////////////
 //   Local Functions   //
@@ -52,6 +54,7 @@ BOOL WINAPI DllMain(HINSTANCE /*instance*/, DWORD reason, LPVOID /*reserved*/)
             break;
 
         case DLL_THREAD_DETACH:
+            ETWThreadDetach();
             break;
 
         default:
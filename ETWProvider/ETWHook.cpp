@@ -0,0 +1,371 @@
+/*/////////////////////////////////////////////////////////////////////////////
+/// @summary Implements hooks for the Win32 file I/O functions, which report
+/// each call to the ETW.FILE_IO provider with its latency and size. The hooks
+/// are installed by rewriting the import address tables of the modules loaded
+/// in the process, so an unmodified application can be traced by injecting
+/// the provider DLL and calling ETWInjectMain (see 'etwanalyze launch').
+/// Modules loaded after the hooks are installed, code that resolves the
+/// functions with GetProcAddress, and the system modules that implement the
+/// functions themselves are not hooked.
+/// @author Russell Klenk (contact@russellklenk.com)
+///////////////////////////////////////////////////////////////////////////80*/
+
+/*////////////////
+//   Includes   //
+////////////////*/
+#include <Windows.h>
+#include <TlHelp32.h>
+
+/*/////////////////
+//   Constants   //
+/////////////////*/
+/// @summary The file offset reported for reads that use the file pointer.
+#define ETW_HOOK_OFFSET_UNKNOWN             (~0ULL)
+
+/*//////////////////
+//   Data Types   //
+//////////////////*/
+typedef HANDLE (WINAPI *CreateFileWFn)(LPCWSTR, DWORD, DWORD, LPSECURITY_ATTRIBUTES, DWORD, DWORD, HANDLE);
+typedef HANDLE (WINAPI *CreateFileAFn)(LPCSTR , DWORD, DWORD, LPSECURITY_ATTRIBUTES, DWORD, DWORD, HANDLE);
+typedef BOOL   (WINAPI *ReadFileFn)(HANDLE, LPVOID, DWORD, LPDWORD, LPOVERLAPPED);
+typedef HANDLE (WINAPI *CreateFileMappingWFn)(HANDLE, LPSECURITY_ATTRIBUTES, DWORD, DWORD, DWORD, LPCWSTR);
+typedef HANDLE (WINAPI *CreateFileMappingAFn)(HANDLE, LPSECURITY_ATTRIBUTES, DWORD, DWORD, DWORD, LPCSTR);
+typedef LPVOID (WINAPI *MapViewOfFileFn)(HANDLE, DWORD, DWORD, DWORD, SIZE_T);
+typedef BOOL   (WINAPI *UnmapViewOfFileFn)(LPCVOID);
+typedef BOOL   (WINAPI *PrefetchVirtualMemoryFn)(HANDLE, ULONG_PTR, PWIN32_MEMORY_RANGE_ENTRY, ULONG);
+
+/// @summary Describes a single hooked function.
+struct etw_hook_t
+{
+    char const   *Name;       /// The name of the function, as imported from kernel32.dll.
+    void         *Hook;       /// The replacement function in this module.
+    void        **Original;   /// Receives the address of the original function.
+};
+
+/// @summary The modules whose imports are never patched. On Windows 8 and later the
+/// kernel32.dll exports are stubs that jump through kernel32's own import table into
+/// KernelBase.dll, so patching either would route the original functions back into 
+/// the hooks. ETWClient.dll only forwards to the provider.
+static WCHAR const *HOOK_SKIP_MODULES[] =
+{
+    L"kernel32.dll", L"kernelbase.dll", L"ntdll.dll", L"ETWClient.dll"
+};
+
+/*///////////////
+//   Globals   //
+///////////////*/
+/// @summary The original functions, resolved when the hooks are installed.
+static CreateFileWFn           ORIGINAL_CreateFileW           = NULL;
+static CreateFileAFn           ORIGINAL_CreateFileA           = NULL;
+static ReadFileFn              ORIGINAL_ReadFile              = NULL;
+static CreateFileMappingWFn    ORIGINAL_CreateFileMappingW    = NULL;
+static CreateFileMappingAFn    ORIGINAL_CreateFileMappingA    = NULL;
+static MapViewOfFileFn         ORIGINAL_MapViewOfFile         = NULL;
+static UnmapViewOfFileFn       ORIGINAL_UnmapViewOfFile       = NULL;
+static PrefetchVirtualMemoryFn ORIGINAL_PrefetchVirtualMemory = NULL;
+
+/// @summary The frequency of the high-resolution timer, in counts per-second.
+static LARGE_INTEGER           HOOK_QPC_FREQUENCY             = { 0 };
+
+/// @summary Non-zero once ETWHookFileIO has patched the loaded modules.
+static LONG volatile           HOOKS_INSTALLED                = 0;
+
+/// @summary Implemented in ETWPublic.cpp. Emit the events for each file I/O operation.
+extern "C" void ETWRegisterCustomProviders(void);
+extern "C" void ETWFileOpen(char const *path, HANDLE file, DWORD access, DWORD error, float latency_ms);
+extern "C" void ETWFileRead(HANDLE file, ULONGLONG offset, DWORD requested, DWORD transferred, DWORD error, float latency_ms);
+extern "C" void ETWFileMapping(HANDLE file, HANDLE mapping, ULONGLONG size, float latency_ms);
+extern "C" void ETWFileMapView(HANDLE mapping, void const *address, ULONGLONG offset, ULONGLONG size, float latency_ms);
+extern "C" void ETWFileUnmapView(void const *address, float latency_ms);
+extern "C" void ETWFilePrefetch(void const *address, ULONGLONG size, DWORD ranges, float latency_ms);
+
+/*///////////////////////
+//   Local Functions   //
+///////////////////////*/
+/// @summary Read the high-resolution timer.
+/// @return The current timestamp, in counts.
+static inline LONGLONG hook_timestamp(void)
+{
+    LARGE_INTEGER tsc;
+    QueryPerformanceCounter(&tsc);
+    return tsc.QuadPart;
+}
+
+/// @summary Compute the time elapsed since a timestamp returned by hook_timestamp.
+/// @param start The timestamp taken before the hooked call.
+/// @return The elapsed time, in milliseconds.
+static inline float hook_elapsed(LONGLONG start)
+{
+    return float(double(hook_timestamp() - start) * 1000.0 / double(HOOK_QPC_FREQUENCY.QuadPart));
+}
+
+/// @summary Combine a file offset or size split into two 32-bit parts, as passed to the
+/// file mapping functions.
+static inline ULONGLONG make_u64(DWORD high, DWORD low)
+{
+    return (ULONGLONG(high) << 32) | ULONGLONG(low);
+}
+
+static HANDLE WINAPI Hook_CreateFileW(LPCWSTR path, DWORD access, DWORD share, LPSECURITY_ATTRIBUTES sa, DWORD disposition, DWORD flags, HANDLE template_file)
+{
+    char     utf8[MAX_PATH * 3];
+    LONGLONG start  = hook_timestamp();
+    HANDLE   result = ORIGINAL_CreateFileW(path, access, share, sa, disposition, flags, template_file);
+    float    ms     = hook_elapsed(start);
+    DWORD    error  = GetLastError();
+    if (path == NULL || WideCharToMultiByte(CP_UTF8, 0, path, -1, utf8, sizeof(utf8), NULL, NULL) == 0)
+        utf8[0] = '\0';
+    ETWFileOpen(utf8, result, access, result != INVALID_HANDLE_VALUE ? 0 : error, ms);
+    SetLastError(error);
+    return result;
+}
+
+static HANDLE WINAPI Hook_CreateFileA(LPCSTR path, DWORD access, DWORD share, LPSECURITY_ATTRIBUTES sa, DWORD disposition, DWORD flags, HANDLE template_file)
+{
+    LONGLONG start  = hook_timestamp();
+    HANDLE   result = ORIGINAL_CreateFileA(path, access, share, sa, disposition, flags, template_file);
+    float    ms     = hook_elapsed(start);
+    DWORD    error  = GetLastError();
+    ETWFileOpen(path != NULL ? path : "", result, access, result != INVALID_HANDLE_VALUE ? 0 : error, ms);
+    SetLastError(error);
+    return result;
+}
+
+static BOOL WINAPI Hook_ReadFile(HANDLE file, LPVOID buffer, DWORD size, LPDWORD transferred, LPOVERLAPPED overlapped)
+{
+    LONGLONG  start  = hook_timestamp();
+    BOOL      result = ORIGINAL_ReadFile(file, buffer, size, transferred, overlapped);
+    float     ms     = hook_elapsed(start);
+    DWORD     error  = GetLastError();
+    DWORD     count  = (result && transferred != NULL) ? *transferred : 0;
+    ULONGLONG offset = ETW_HOOK_OFFSET_UNKNOWN;
+    if (overlapped != NULL)
+    {   // positioned read; the equivalent of pread.
+        offset = make_u64(overlapped->OffsetHigh, overlapped->Offset);
+    }
+    ETWFileRead(file, offset, size, count, result ? 0 : error, ms);
+    SetLastError(error);
+    return result;
+}
+
+static HANDLE WINAPI Hook_CreateFileMappingW(HANDLE file, LPSECURITY_ATTRIBUTES sa, DWORD protect, DWORD size_high, DWORD size_low, LPCWSTR name)
+{
+    LONGLONG start  = hook_timestamp();
+    HANDLE   result = ORIGINAL_CreateFileMappingW(file, sa, protect, size_high, size_low, name);
+    float    ms     = hook_elapsed(start);
+    DWORD    error  = GetLastError();
+    ETWFileMapping(file, result, make_u64(size_high, size_low), ms);
+    SetLastError(error);
+    return result;
+}
+
+static HANDLE WINAPI Hook_CreateFileMappingA(HANDLE file, LPSECURITY_ATTRIBUTES sa, DWORD protect, DWORD size_high, DWORD size_low, LPCSTR name)
+{
+    LONGLONG start  = hook_timestamp();
+    HANDLE   result = ORIGINAL_CreateFileMappingA(file, sa, protect, size_high, size_low, name);
+    float    ms     = hook_elapsed(start);
+    DWORD    error  = GetLastError();
+    ETWFileMapping(file, result, make_u64(size_high, size_low), ms);
+    SetLastError(error);
+    return result;
+}
+
+static LPVOID WINAPI Hook_MapViewOfFile(HANDLE mapping, DWORD access, DWORD offset_high, DWORD offset_low, SIZE_T size)
+{
+    LONGLONG start  = hook_timestamp();
+    LPVOID   result = ORIGINAL_MapViewOfFile(mapping, access, offset_high, offset_low, size);
+    float    ms     = hook_elapsed(start);
+    DWORD    error  = GetLastError();
+    ETWFileMapView(mapping, result, make_u64(offset_high, offset_low), size, ms);
+    SetLastError(error);
+    return result;
+}
+
+static BOOL WINAPI Hook_UnmapViewOfFile(LPCVOID address)
+{
+    LONGLONG start  = hook_timestamp();
+    BOOL     result = ORIGINAL_UnmapViewOfFile(address);
+    float    ms     = hook_elapsed(start);
+    DWORD    error  = GetLastError();
+    ETWFileUnmapView(address, ms);
+    SetLastError(error);
+    return result;
+}
+
+static BOOL WINAPI Hook_PrefetchVirtualMemory(HANDLE process, ULONG_PTR count, PWIN32_MEMORY_RANGE_ENTRY ranges, ULONG flags)
+{
+    LONGLONG  start  = hook_timestamp();
+    BOOL      result = ORIGINAL_PrefetchVirtualMemory(process, count, ranges, flags);
+    float     ms     = hook_elapsed(start);
+    DWORD     error  = GetLastError();
+    ULONGLONG total  = 0;
+    for (ULONG_PTR i = 0; i < count; ++i)
+    {
+        total += ranges[i].NumberOfBytes;
+    }
+    ETWFilePrefetch(count > 0 ? ranges[0].VirtualAddress : NULL, total, (DWORD) count, ms);
+    SetLastError(error);
+    return result;
+}
+
+/// @summary The table of hooked functions. PrefetchVirtualMemory is only present on
+/// Windows 8 and later; when it cannot be resolved it is not hooked.
+static etw_hook_t HOOKS[] =
+{
+    { "CreateFileW"          , (void*) Hook_CreateFileW          , (void**) &ORIGINAL_CreateFileW           },
+    { "CreateFileA"          , (void*) Hook_CreateFileA          , (void**) &ORIGINAL_CreateFileA           },
+    { "ReadFile"             , (void*) Hook_ReadFile             , (void**) &ORIGINAL_ReadFile              },
+    { "CreateFileMappingW"   , (void*) Hook_CreateFileMappingW   , (void**) &ORIGINAL_CreateFileMappingW    },
+    { "CreateFileMappingA"   , (void*) Hook_CreateFileMappingA   , (void**) &ORIGINAL_CreateFileMappingA    },
+    { "MapViewOfFile"        , (void*) Hook_MapViewOfFile        , (void**) &ORIGINAL_MapViewOfFile         },
+    { "UnmapViewOfFile"      , (void*) Hook_UnmapViewOfFile      , (void**) &ORIGINAL_UnmapViewOfFile       },
+    { "PrefetchVirtualMemory", (void*) Hook_PrefetchVirtualMemory, (void**) &ORIGINAL_PrefetchVirtualMemory }
+};
+static size_t const HOOK_COUNT = sizeof(HOOKS) / sizeof(HOOKS[0]);
+
+/// @summary Find the hook for an imported function name.
+/// @param name The name of the imported function.
+/// @return The hook, or NULL if the function is not hooked.
+static etw_hook_t* find_hook(char const *name)
+{
+    for (size_t i = 0; i < HOOK_COUNT; ++i)
+    {
+        if (HOOKS[i].Original[0] != NULL && strcmp(HOOKS[i].Name, name) == 0)
+            return &HOOKS[i];
+    }
+    return NULL;
+}
+
+/// @summary Overwrite one entry in an import address table.
+/// @param slot The import address table entry.
+/// @param address The new function address.
+static void patch_slot(void **slot, void *address)
+{
+    DWORD protect = 0;
+    if (VirtualProtect(slot, sizeof(void*), PAGE_READWRITE, &protect))
+    {
+        InterlockedExchangePointer(slot, address);
+        VirtualProtect(slot, sizeof(void*), protect, &protect);
+    }
+}
+
+/// @summary Determine whether a module's imports must be left unpatched.
+/// @param name The file name of the module, without a path.
+/// @return true if the module is in HOOK_SKIP_MODULES.
+static bool skip_module(WCHAR const *name)
+{
+    for (size_t i = 0; i < sizeof(HOOK_SKIP_MODULES) / sizeof(HOOK_SKIP_MODULES[0]); ++i)
+    {
+        if (lstrcmpiW(HOOK_SKIP_MODULES[i], name) == 0)
+            return true;
+    }
+    return false;
+}
+
+/// @summary Redirect a module's imports of the hooked functions to the hooks. Imports
+/// are matched by name, so forwarded imports (via api-ms-win-core-* sets) are patched too.
+/// @param module The base address of the module.
+/// @return The number of import address table entries patched.
+static size_t patch_module(HMODULE module)
+{
+    BYTE                     *base    = (BYTE*) module;
+    IMAGE_DOS_HEADER         *dos     = (IMAGE_DOS_HEADER*) base;
+    IMAGE_NT_HEADERS         *nt      = NULL;
+    IMAGE_DATA_DIRECTORY     *dir     = NULL;
+    IMAGE_IMPORT_DESCRIPTOR  *imports = NULL;
+    size_t                    patched = 0;
+
+    if (dos->e_magic != IMAGE_DOS_SIGNATURE)
+        return 0;
+    nt  = (IMAGE_NT_HEADERS*) (base + dos->e_lfanew);
+    if (nt->Signature != IMAGE_NT_SIGNATURE)
+        return 0;
+    dir = &nt->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_IMPORT];
+    if (dir->VirtualAddress == 0 || dir->Size == 0)
+        return 0;
+
+    for (imports = (IMAGE_IMPORT_DESCRIPTOR*) (base + dir->VirtualAddress); imports->Name != 0; ++imports)
+    {
+        IMAGE_THUNK_DATA *names = NULL;
+        IMAGE_THUNK_DATA *iat   = (IMAGE_THUNK_DATA*) (base + imports->FirstThunk);
+        if (imports->OriginalFirstThunk == 0)
+            continue;  // bound imports without a name table; nothing to match against.
+        names = (IMAGE_THUNK_DATA*) (base + imports->OriginalFirstThunk);
+        for ( ; names->u1.AddressOfData != 0; ++names, ++iat)
+        {
+            IMAGE_IMPORT_BY_NAME *import = NULL;
+            etw_hook_t           *hook   = NULL;
+            if (IMAGE_SNAP_BY_ORDINAL(names->u1.Ordinal))
+                continue;
+            import = (IMAGE_IMPORT_BY_NAME*) (base + names->u1.AddressOfData);
+            if ((hook = find_hook((char const*) import->Name)) != NULL)
+            {
+                patch_slot((void**) &iat->u1.Function, hook->Hook);
+                patched++;
+            }
+        }
+    }
+    return patched;
+}
+
+/*///////////////////////
+//  Public Functions   //
+///////////////////////*/
+extern "C" {
+
+/// @summary Installs the file I/O hooks into every module currently loaded in the process,
+/// except the provider DLL itself and the modules in HOOK_SKIP_MODULES. Calls made through
+/// the hooks are reported to the ETW.FILE_IO provider while a session has it enabled.
+/// Subsequent calls have no effect.
+/// @return The number of import address table entries patched.
+DWORD ETWHookFileIO(void)
+{
+    HMODULE        kernel32 = GetModuleHandleA("kernel32.dll");
+    HMODULE        kbase    = GetModuleHandleA("kernelbase.dll");
+    HMODULE        self     = NULL;
+    HANDLE         snapshot = INVALID_HANDLE_VALUE;
+    MODULEENTRY32W module;
+    size_t         patched  = 0;
+
+    if (InterlockedCompareExchange(&HOOKS_INSTALLED, 1, 0) != 0)
+        return 0;
+
+    QueryPerformanceFrequency(&HOOK_QPC_FREQUENCY);
+    for (size_t i = 0; i < HOOK_COUNT; ++i)
+    {   // prefer the implementations in KernelBase.dll (Windows 7 and later) over the 
+        // kernel32 stubs, which would re-enter a hook if kernel32 were ever patched.
+        if (kbase != NULL)
+            HOOKS[i].Original[0] = (void*) GetProcAddress(kbase, HOOKS[i].Name);
+        if (HOOKS[i].Original[0] == NULL)
+            HOOKS[i].Original[0] = (void*) GetProcAddress(kernel32, HOOKS[i].Name);
+    }
+    GetModuleHandleExA(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS | GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT, (LPCSTR) ETWHookFileIO, &self);
+
+    if ((snapshot = CreateToolhelp32Snapshot(TH32CS_SNAPMODULE, GetCurrentProcessId())) == INVALID_HANDLE_VALUE)
+        return 0;
+    module.dwSize = sizeof(MODULEENTRY32W);
+    if (Module32FirstW(snapshot, &module))
+    {
+        do
+        {
+            if (module.hModule != self && !skip_module(module.szModule))
+                patched += patch_module(module.hModule);
+        } while (Module32NextW(snapshot, &module));
+    }
+    CloseHandle(snapshot);
+    return (DWORD) patched;
+}
+
+/// @summary The entry point run on a remote thread after the provider DLL has been injected
+/// into a process, for example by 'etwanalyze launch'. Registers the custom providers and
+/// installs the file I/O hooks.
+/// @param argp Unused.
+/// @return The number of import address table entries patched.
+DWORD WINAPI ETWInjectMain(LPVOID argp)
+{
+    UNREFERENCED_PARAMETER(argp);
+    ETWRegisterCustomProviders();
+    return ETWHookFileIO();
+}
+
+}; /* extern "C" */
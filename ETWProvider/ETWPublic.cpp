@@ -32,113 +32,2263 @@
 #define ETW_PROVIDER_FORMAT_BUFFER_SIZE     1024
 #endif
 
+/// Define the maximum length of the thread name emitted automatically the first 
+/// time a thread writes an event, including the terminating NULL.
+#ifndef ETW_PROVIDER_THREAD_NAME_SIZE
+#define ETW_PROVIDER_THREAD_NAME_SIZE       64
+#endif
+
+/// Define the number of thread IDs remembered after being explicitly named with 
+/// ETWThreadID(), which suppresses the automatically-generated name for those threads.
+#ifndef ETW_PROVIDER_MAX_NAMED_THREADS
+#define ETW_PROVIDER_MAX_NAMED_THREADS      64
+#endif
+
+/// Define the maximum scope nesting depth for which on-CPU time is measured. Scopes
+/// nested deeper than this emit the plain LeaveScope event, with wall time only.
+#ifndef ETW_PROVIDER_MAX_SCOPE_DEPTH
+#define ETW_PROVIDER_MAX_SCOPE_DEPTH        32
+#endif
+
+/// Define the number of scope names that may be given their own minimum duration with 
+/// ETWScopeThreshold() or sampling rate with ETWScopeSampling(). The table is searched each
+/// time a main scope is entered while any name is in it, so it is kept small.
+#ifndef ETW_PROVIDER_MAX_SCOPE_POLICIES
+#define ETW_PROVIDER_MAX_SCOPE_POLICIES     32
+#endif
+
+/// Define the number of scope names each thread can sum while their scopes are too short to
+/// report, and the interval at which the sums are written as MainScopeSummary_Event, in 
+/// milliseconds. A thread that elides more names than this writes its sums early.
+#ifndef ETW_PROVIDER_SCOPE_SUMMARY_SLOTS
+#define ETW_PROVIDER_SCOPE_SUMMARY_SLOTS    16
+#endif
+#ifndef ETW_PROVIDER_SCOPE_SUMMARY_MS
+#define ETW_PROVIDER_SCOPE_SUMMARY_MS       100
+#endif
+
+/// The maximum length of a scope name stored in a policy or summary slot, including the
+/// NULL. Longer names are matched and reported on this many characters.
+#define ETW_PROVIDER_SCOPE_NAME_SIZE        64
+
+/// The keyword mask of the ThreadTime keyword declared in ETWProvider.man. When a session
+/// enables this keyword, scopes sample the thread cycle counter on enter and leave, and 
+/// each leave event is preceded by a ScopeTime event carrying the on-CPU time.
+#define ETW_PROVIDER_KEYWORD_THREAD_TIME    0x8ULL
+
+/// The keyword mask of the Sampling keyword declared in ETWProvider.man. When a session
+/// enables this keyword on the main thread provider, a sampler thread periodically suspends
+/// each thread that has emitted events and records its instruction pointer and open scopes.
+#define ETW_PROVIDER_KEYWORD_SAMPLING       0x20ULL
+
+/// The keyword mask of the Functions keyword declared in ETWProvider.man. When a session
+/// enables this keyword on the main thread provider, calls to functions compiled with /Gh 
+/// and /GH are reported through the _penter and _pexit hooks exported by ETWClient.dll.
+#define ETW_PROVIDER_KEYWORD_FUNCTIONS      0x40ULL
+
+/// The keyword mask of the Counters keyword declared in ETWProvider.man. When a session
+/// enables this keyword on the file I/O provider, a counter thread periodically reports the
+/// memory, page fault, I/O and CPU counters of the process, and how much of each address 
+/// range registered with ETWCounterRegion() is resident.
+#define ETW_PROVIDER_KEYWORD_COUNTERS       0x80ULL
+
+/// Define the default interval between counter samples, in milliseconds. The interval can
+/// be changed at runtime with ETWSetCounterInterval().
+#ifndef ETW_PROVIDER_COUNTER_INTERVAL_MS
+#define ETW_PROVIDER_COUNTER_INTERVAL_MS    10
+#endif
+
+/// Define the number of address ranges that can be registered with ETWCounterRegion(), and
+/// the number of pages of each range checked per sample. Larger ranges are checked at an 
+/// even stride, starting one page later each sample, and the resident size is estimated.
+#ifndef ETW_PROVIDER_MAX_COUNTER_REGIONS
+#define ETW_PROVIDER_MAX_COUNTER_REGIONS    16
+#endif
+#ifndef ETW_PROVIDER_COUNTER_REGION_PAGES
+#define ETW_PROVIDER_COUNTER_REGION_PAGES   1024
+#endif
+
+/// The size of the name stored for a range registered with ETWCounterRegion(), including
+/// the terminating NULL. Longer names are truncated.
+#define ETW_PROVIDER_COUNTER_NAME_SIZE      64
+
+/// Define the interval between samples, in milliseconds. The system timer resolution is
+/// raised to one millisecond while the sampler is running so that short intervals are honored.
+/// This may be defined as a compile option ie. /D ETW_PROVIDER_SAMPLE_INTERVAL_MS=####.
+#ifndef ETW_PROVIDER_SAMPLE_INTERVAL_MS
+#define ETW_PROVIDER_SAMPLE_INTERVAL_MS     1
+#endif
+
+/// Define the size of the buffer holding the ';'-separated scope names of a sample, 
+/// including the terminating NULL. Stacks that do not fit are truncated at the innermost end.
+#ifndef ETW_PROVIDER_SAMPLE_STACK_SIZE
+#define ETW_PROVIDER_SAMPLE_STACK_SIZE      512
+#endif
+
+/// Define to zero to compile out publishing per-scope statistics to shared memory for the 
+/// 'top' viewer. Publishing is off until ETWSetLiveStats() enables it, and then each scope
+/// exit costs a table lookup and a few interlocked adds.
+#ifndef ETW_PROVIDER_LIVE_STATS
+#define ETW_PROVIDER_LIVE_STATS             1
+#endif
+
+/// Define the number of scope enter/leave pairs timed each time the provider measures its
+/// own cost. The median pair is reported, so preemption during the measurement is ignored.
+#ifndef ETW_PROVIDER_CALIBRATE_PAIRS
+#define ETW_PROVIDER_CALIBRATE_PAIRS        64
+#endif
+
+/// Define the length of the window over which file I/O events are rate-limited on each 
+/// thread, in milliseconds, and the number of read, map, unmap and prefetch events a thread
+/// may write in full within one window. Further operations in the window are summed, and
+/// written as one FileSummary_Event per operation when the thread's next window begins.
+#ifndef ETW_PROVIDER_FILEIO_WINDOW_MS
+#define ETW_PROVIDER_FILEIO_WINDOW_MS       10
+#endif
+#ifndef ETW_PROVIDER_FILEIO_MAX_EVENTS
+#define ETW_PROVIDER_FILEIO_MAX_EVENTS      64
+#endif
+
+/// The file I/O operations reported in FileSummary_Event, which are the offsets of the
+/// corresponding event IDs from FileOpen_Event. Opens and mappings are never summarized.
+#define ETW_PROVIDER_FILEIO_READ            1
+#define ETW_PROVIDER_FILEIO_MAP_VIEW        3
+#define ETW_PROVIDER_FILEIO_UNMAP_VIEW      4
+#define ETW_PROVIDER_FILEIO_PREFETCH        5
+#define ETW_PROVIDER_FILEIO_OPS             6
+
+/// Define the number of nested calls to instrumented functions tracked on each thread. 
+/// Calls nested deeper than this are never reported.
+#ifndef ETW_PROVIDER_MAX_FUNCTION_DEPTH
+#define ETW_PROVIDER_MAX_FUNCTION_DEPTH     256
+#endif
+
+/// Define the number of modules containing instrumented functions that can be tracked.
+/// Functions in modules loaded after the table is full are never reported.
+#ifndef ETW_PROVIDER_MAX_FUNCTION_MODULES
+#define ETW_PROVIDER_MAX_FUNCTION_MODULES   64
+#endif
+
+/// Define the number of addresses outside any module, such as generated code, remembered 
+/// so that the loader is not queried again each time they are entered. Must be a power of two.
+#ifndef ETW_PROVIDER_FUNCTION_UNKNOWN_SIZE
+#define ETW_PROVIDER_FUNCTION_UNKNOWN_SIZE  256
+#endif
+
+/// Define the default minimum duration of a reported function call, in microseconds, and 
+/// the multiple of the measured cost of a scope below which calls are not reported unless
+/// ETWFunctionFilter() sets a minimum explicitly. A shorter call is only reported if it
+/// encloses a call or scope that is; otherwise it is counted in its caller's Elided value.
+#ifndef ETW_PROVIDER_FUNCTION_MIN_US
+#define ETW_PROVIDER_FUNCTION_MIN_US        5
+#endif
+#ifndef ETW_PROVIDER_FUNCTION_MIN_COST
+#define ETW_PROVIDER_FUNCTION_MIN_COST      20
+#endif
+
+/// The size of the include and exclude module lists set with ETWFunctionFilter(), 
+/// including the terminating NULL.
+#define ETW_PROVIDER_FUNCTION_FILTER_SIZE   256
+
+/// The number of custom providers declared in ETWProvider.man, and the number of values
+/// of etw_provider_e in ETWClient.h. Lost events are counted separately for each provider.
+#define ETW_PROVIDER_COUNT                  5
+
+/// The overflow policies accepted by ETWSetOverflowPolicy(). These must match the values
+/// of etw_overflow_policy_e in ETWClient.h.
+#define ETW_PROVIDER_OVERFLOW_DROP          0
+#define ETW_PROVIDER_OVERFLOW_SPIN          1
+
+/// Define the default time a write may spin waiting for a free buffer under the spin 
+/// overflow policy, in microseconds.
+#ifndef ETW_PROVIDER_OVERFLOW_SPIN_US
+#define ETW_PROVIDER_OVERFLOW_SPIN_US       50
+#endif
+
+/// The keyword mask of the HighFrequency keyword declared in ETWProvider.man. Events with 
+/// this keyword are thinned out by the overhead governor when tracing exceeds its budget.
+#define ETW_PROVIDER_KEYWORD_HIGH_FREQUENCY 0x4ULL
+
+/// Define the default share of the process CPU time the providers may spend writing events,
+/// in hundredths of a percent. The default of zero leaves the overhead governor disabled, so
+/// writes pay nothing for it until ETWSetOverheadBudget() sets a budget.
+#ifndef ETW_PROVIDER_GOVERNOR_BUDGET
+#define ETW_PROVIDER_GOVERNOR_BUDGET        0
+#endif
+
+/// Define the length of the window over which the governor estimates the cost of tracing,
+/// in milliseconds. The levels are re-evaluated at the end of each window.
+#ifndef ETW_PROVIDER_GOVERNOR_WINDOW_MS
+#define ETW_PROVIDER_GOVERNOR_WINDOW_MS     100
+#endif
+
+/// Define the number of events a thread counts before adding its counts to the process 
+/// totals and checking whether the governor window has ended.
+#ifndef ETW_PROVIDER_GOVERNOR_BATCH
+#define ETW_PROVIDER_GOVERNOR_BATCH         64
+#endif
+
+/// The number of governor levels. Level zero writes every HighFrequency event, levels one 
+/// to three write one in 4, 16 and 64, and the last level writes none; file I/O operations 
+/// that are not written are still summed into FileSummary_Event.
+#define ETW_PROVIDER_GOVERNOR_LEVELS        5
+
+/// The generated McGenControlCallbackV2 forwards all enable, disable and capture 
+/// state notifications to this function. It must be declared before the generated
+/// header is included.
+#define MCGEN_PRIVATE_ENABLE_CALLBACK_V2    ETWProviderControl
+
 /*////////////////
 //   Includes   //
 ////////////////*/
 #include <stdio.h>
 #include <stdarg.h>
+#include <intrin.h>
 #include <Windows.h>
+#include <Psapi.h>
 #include <sal.h>
+#include "ETWStats.h"
+
+static void ETWProviderControl(LPCGUID, ULONG, UCHAR, ULONGLONG, ULONGLONG, PEVENT_FILTER_DESCRIPTOR, PVOID);
+static ULONG event_write_failed(REGHANDLE, PCEVENT_DESCRIPTOR, ULONG, PEVENT_DATA_DESCRIPTOR, ULONG);
+static void  event_report_lost(void);
+static bool  governor_filter(REGHANDLE, PCEVENT_DESCRIPTOR);
+
+#include "ETWProviderGenerated.h"
+
+/*//////////////////
+//   Data Types   //
+//////////////////*/
+/// @summary A stack of open scopes. Each thread has one for its main scopes and one for 
+/// its task scopes; each task context has its own, which replaces the task scope stack of 
+/// the thread it is resumed on, so that task scopes nest by task rather than by thread.
+struct etw_scope_stack_t
+{
+    DWORD         Depth;      /// The current nesting depth.
+    BOOL          Untimed;    /// TRUE if CycleBias is unknown, so on-CPU time cannot be measured.
+    ULONG64       CycleBias;  /// Added to the thread cycle count to give the cycle count of the owner; zero for thread stacks.
+    ULONG64       Cycles[ETW_PROVIDER_MAX_SCOPE_DEPTH]; /// The owner cycle count at each open scope, or zero if not sampled.
+    char const   *Names [ETW_PROVIDER_MAX_SCOPE_DEPTH]; /// The name passed to each open EnterScope call, read by the sampler.
+};
+
+/// @summary File I/O operations of one kind summed while a thread is over its event budget.
+struct etw_fileio_summary_t
+{
+    DWORD         Count;      /// The number of operations.
+    ULONGLONG     Bytes;      /// The total number of bytes read, mapped or prefetched.
+    float         TotalMs;    /// The total latency of the operations, in milliseconds.
+    float         MaxMs;      /// The longest latency of any operation, in milliseconds.
+};
+
+/// @summary The main scopes of one name that were too short to report on a thread, summed 
+/// until the thread writes them as a MainScopeSummary_Event.
+struct etw_scope_summary_t
+{
+    DWORD         Count;      /// The number of scopes elided.
+    LONGLONG      Total;      /// The summed duration of the scopes, in QueryPerformanceCounter ticks.
+    LONGLONG      Max;        /// The longest duration of any of the scopes, in QueryPerformanceCounter ticks.
+    char          Name[ETW_PROVIDER_SCOPE_NAME_SIZE]; /// The name passed to ETWEnterScopeMain().
+};
+
+/// @summary How the main scopes with a given name are reported, set with ETWScopeThreshold()
+/// and ETWScopeSampling().
+struct etw_scope_policy_t
+{
+    LONG volatile MinUs;      /// The minimum duration of a reported scope, in microseconds, or -1 to use ETW_SCOPE_MIN_US.
+    LONG volatile OneIn;      /// The scopes are sampled one in this many; zero or one reports every scope.
+    char          Name[ETW_PROVIDER_SCOPE_NAME_SIZE]; /// The scope name.
+};
+
+/// @summary A module containing instrumented functions. Entries are appended the first time
+/// a function in the module is entered, and are never removed.
+struct etw_function_module_t
+{
+    ULONG_PTR     Base;       /// The address at which the module is loaded.
+    DWORD         Size;       /// The size of the module image, in bytes.
+    BOOL          Allowed;    /// TRUE if the module passes the filters set with ETWFunctionFilter().
+    LONG          Generation; /// The value of ETW_ENABLE_GENERATION when Module_Event was last written.
+    char          Path[MAX_PATH]; /// The path of the module file.
+};
+
+/// @summary A call to an instrumented function that has not yet returned.
+struct etw_function_frame_t
+{
+    ULONG_PTR     Address;    /// The address of the function.
+    ULONG_PTR     Stack;      /// The address of the caller's return address, used to detect frames unwound by an exception.
+    LONGLONG      EnterTime;  /// The timestamp at which the function was entered.
+    DWORD         Elided;     /// The number of calls made by the function that were too short to report.
+    BOOL          Allowed;    /// TRUE if the function's module passes the filters.
+    BOOL          Emitted;    /// TRUE once FunctionEnter_Event has been written for the call.
+    etw_function_module_t *Module; /// The module containing the function, or NULL if unknown.
+    char          Name[20];   /// The address as a hex string, pushed onto the main scope stack for the sampler.
+};
+
+/// @summary The calls to instrumented functions that are in progress on one thread, 
+/// allocated the first time the thread enters one. FunctionEnter_Event is written lazily:
+/// a call is reported once it has run longer than the minimum duration, or when a call or
+/// scope nested within it is reported, so that short leaf calls cost no events at all.
+struct etw_function_stack_t
+{
+    DWORD         Count;      /// The number of calls in progress, which may exceed ETW_PROVIDER_MAX_FUNCTION_DEPTH.
+    DWORD         Pending;    /// The number of allowed frames whose FunctionEnter_Event has not been written.
+    ULONG_PTR     OverflowStack; /// The Stack value of the outermost untracked call, while Count exceeds ETW_PROVIDER_MAX_FUNCTION_DEPTH.
+    etw_function_frame_t Frames[ETW_PROVIDER_MAX_FUNCTION_DEPTH]; /// The calls in progress, outermost first.
+};
+
+/// @summary An address range whose residency is reported by the counter thread.
+struct etw_counter_region_t
+{
+    ULONG_PTR     Address;    /// The first byte of the range, or zero for a free slot.
+    SIZE_T        Size;       /// The size of the range, in bytes.
+    DWORD         Phase;      /// The number of samples taken, which selects the first page checked.
+    char          Name[ETW_PROVIDER_COUNTER_NAME_SIZE]; /// The name passed to ETWCounterRegion().
+};
+
+/// @summary State maintained by the provider for each thread that emits events. An 
+/// instance is allocated the first time a thread writes an event and is freed when 
+/// the thread detaches from the DLL or the providers are unregistered. The processor
+/// number and thread ID of each event are stamped into the event header by ETW itself
+/// (the per-processor buffer knows its CPU) so they are not repeated in the payload.
+struct etw_thread_t
+{
+    etw_thread_t *Next;       /// The next thread in the global list of thread states.
+    etw_thread_t *Prev;       /// The previous thread in the global list of thread states.
+    DWORD         ThreadId;   /// The operating system identifier of the thread, cached at allocation.
+    LONG          NameGen;    /// The value of ETW_ENABLE_GENERATION when the thread name was last emitted.
+    BOOL          Explicit;   /// TRUE if the thread was named explicitly by a call to ETWThreadID().
+    etw_scope_stack_t  Main;  /// The scopes opened by ETWEnterScopeMain().
+    DWORD         Committed;  /// The number of open main scopes, outermost first, whose enter event has been written. The enter events of the rest are held.
+    LONGLONG      HeldEnter  [ETW_PROVIDER_MAX_SCOPE_DEPTH]; /// The timestamp at which each held main scope was entered.
+    LONGLONG      HeldMinTime[ETW_PROVIDER_MAX_SCOPE_DEPTH]; /// The duration a held main scope must reach to be reported, in QueryPerformanceCounter ticks.
+    LONGLONG      ScopeWindow; /// The timestamp at which the thread last wrote its scope summaries.
+    DWORD         ScopeSummaryCount; /// The number of used entries in ScopeSummary.
+    etw_scope_summary_t ScopeSummary[ETW_PROVIDER_SCOPE_SUMMARY_SLOTS]; /// The elided main scopes, by name.
+    ULONG         SkipCount[ETW_PROVIDER_MAX_SCOPE_POLICIES]; /// The main scopes not sampled since the last summary, by index in ETW_SCOPE_POLICIES.
+    BOOL          SkipPending; /// TRUE if any SkipCount value is non-zero.
+    DWORD         SampleSeed; /// The state of the xorshift generator that decides which main scopes are sampled, or zero if not yet seeded.
+    etw_scope_stack_t  Tasks; /// The scopes opened by ETWEnterScopeTask() while no task context is resumed.
+    etw_scope_stack_t *Task;  /// The stack of the task context resumed on the thread, or NULL to use Tasks.
+    HANDLE        Handle;     /// A handle to the thread used by the sampler to suspend it and read its context, or NULL. Opened by the sampler the first time it samples the thread.
+    BOOL          HandleTried; /// TRUE once the sampler has tried to open Handle, so a thread that cannot be opened is not retried.
+    LONG volatile Sampling;   /// Non-zero while the sampler references the thread state outside ETW_THREAD_LOCK; etw_thread_delete() waits for it to clear.
+    ULONG64       SampleCycles; /// The thread cycle count at the previous sample, used to skip threads that have not run.
+    ULONG         LostPending[ETW_PROVIDER_COUNT]; /// The number of events dropped by this thread that have not yet been reported, per provider.
+    ULONG64       LostTotal  [ETW_PROVIDER_COUNT]; /// The number of events dropped by this thread since it was created, per provider.
+    BOOL          LostQueued; /// TRUE if any LostPending value is non-zero; counted in ETW_LOST_PENDING.
+    BOOL          Reporting;  /// TRUE while the thread writes an EventsLost_Event, so failures are not counted recursively.
+    LONGLONG      IoWindow;   /// The timestamp at which the thread's current file I/O window began.
+    DWORD         IoEvents;   /// The number of file I/O events written in full in the current window.
+    DWORD         IoPending;  /// The number of operations summed in IoSummary in the current window.
+    etw_fileio_summary_t IoSummary[ETW_PROVIDER_FILEIO_OPS]; /// The operations summed in the current window, by type.
+    etw_function_stack_t *Functions; /// The calls to instrumented functions in progress, or NULL.
+    ULONG         GovOther  [ETW_PROVIDER_COUNT]; /// The events without the HighFrequency keyword written since the last batch, per provider.
+    ULONG         GovOffered[ETW_PROVIDER_COUNT]; /// The HighFrequency events offered since the last batch, whether or not they were written.
+    ULONG         GovRefused[ETW_PROVIDER_COUNT]; /// The HighFrequency events offered since the last batch that were not written.
+    DWORD         GovBatch;   /// The number of events counted in GovOther and GovOffered.
+    DWORD         GovSkip;    /// Counts the HighFrequency events offered at a sampling level, to admit one in N.
+};
+
+/// @summary State maintained for a unit of work, such as a coroutine or a job, that may be 
+/// suspended on one thread and resumed on another. Allocated by ETWTaskCreate() and owned 
+/// by the application, which returns it with ETWTaskDelete().
+struct etw_task_context_t
+{
+    etw_scope_stack_t  Stack; /// The scopes opened while the task was resumed.
+    etw_scope_stack_t *Prev;  /// The task scope stack the thread was using before the task was resumed.
+    ULONGLONG     TaskId;     /// The process-unique identifier of the task, reported in each task event.
+    char const   *Name;       /// The name passed to ETWTaskCreate(), which must remain valid until ETWTaskDelete().
+    DWORD         ThreadId;   /// The thread the task was last resumed on, or zero.
+    DWORD         Resumes;    /// The number of times the task has been resumed.
+    DWORD         Migrations; /// The number of times the task was resumed on a different thread than the time before.
+    LONGLONG      CreateTime; /// The timestamp at which the task was created.
+    LONGLONG      ResumeTime; /// The timestamp at which the task was last resumed.
+    LONGLONG      Running;    /// The total time the task has been resumed, in QueryPerformanceCounter ticks.
+    ULONG64       RunCycles;  /// The task cycle count when the task was last suspended. Starts at one, so that zero means not sampled.
+};
+
+/*///////////////
+//   Globals   //
+///////////////*/
+/// @summary Typedefs for use with GetProcAddress. We will load Advapi32.dll dynamically 
+/// and try to resolve these functions manually. These functions are not available
+/// on Windows XP, and on that platform they fall-back to no-ops.
+typedef ULONG (__stdcall *EventRegisterFn)(LPCGUID, PENABLECALLBACK, PVOID, PREGHANDLE);
+typedef ULONG (__stdcall *EventWriteFn)(REGHANDLE, PCEVENT_DESCRIPTOR, ULONG, PEVENT_DATA_DESCRIPTOR);
+typedef ULONG (__stdcall *EventUnregisterFn)(REGHANDLE);
+typedef HRESULT (WINAPI *GetThreadDescriptionFn)(HANDLE, PWSTR*);
+typedef BOOL    (WINAPI *QueryThreadCycleTimeFn)(HANDLE, PULONG64);
+typedef UINT    (WINAPI *TimePeriodFn)(UINT);
+typedef BOOL    (WINAPI *GetProcessMemoryInfoFn)(HANDLE, PPROCESS_MEMORY_COUNTERS, DWORD);
+typedef BOOL    (WINAPI *QueryWorkingSetExFn)(HANDLE, PVOID, DWORD);
+
+/// @summary Several of the API functions rely on QueryPerformanceCounter. Store the result
+/// of calling QueryPerformanceFrequency here.
+static LARGE_INTEGER      QPC_FREQUENCY        = { 0 };
+
+/// @summary The value returned by TlsAlloc() used to identify the per-thread slot storing
+/// the etw_thread_t for the calling thread. This value is initialized when 
+/// ETWRegisterCustomProviders() is called.
+static DWORD              ETW_THREAD_STATE     = TLS_OUT_OF_INDEXES;
+
+/// @summary The list of all live thread states, used to free state for threads that are
+/// still running when the providers are unregistered. Protected by ETW_THREAD_LOCK.
+static etw_thread_t      *ETW_THREAD_LIST      = NULL;
+static CRITICAL_SECTION   ETW_THREAD_LOCK;
+
+/// @summary Thread state handed out when no TLS slot is available (for example, when
+/// Advapi32.dll could not be loaded). Events are not emitted in this case, so sharing 
+/// a single instance between threads is harmless.
+static etw_thread_t       ETW_THREAD_FALLBACK  = { 0 };
+
+/// @summary Incremented each time a session enables a provider or requests a state capture.
+/// Threads compare this against etw_thread_t::NameGen and re-emit their ThreadID_Event 
+/// when they differ, so that sessions started after a thread was named still see it.
+static LONG volatile      ETW_ENABLE_GENERATION = 1;
+
+/// @summary A ring of thread IDs explicitly named by ETWThreadID(), possibly from another
+/// thread, so that the automatic name does not overwrite the name chosen by the application.
+/// Protected by ETW_THREAD_LOCK.
+static DWORD              ETW_NAMED_THREADS[ETW_PROVIDER_MAX_NAMED_THREADS] = { 0 };
+static DWORD              ETW_NAMED_COUNT      = 0;
+
+/// @summary Resolved from Kernel32.dll at runtime. Available on Windows 10 1607 and later.
+static GetThreadDescriptionFn GetThreadDescription_Func = NULL;
+
+/// @summary Resolved from Kernel32.dll at runtime. Available on Vista and later. The thread
+/// cycle counter only advances while the thread is scheduled on a processor.
+static QueryThreadCycleTimeFn QueryThreadCycleTime_Func = NULL;
+
+/// @summary The TSC and QPC values sampled when the providers were registered, and the
+/// TSC rate derived from them, used to convert thread cycle counts to milliseconds.
+/// The rate is refined each time a session enables a provider.
+static ULONG64            CALIBRATE_TSC        = 0;
+static LONGLONG           CALIBRATE_QPC        = 0;
+static double volatile    CYCLES_PER_MS        = 0.0;
+
+/// @summary The median cost of a scope enter/leave pair measured by calibrate_overhead(), 
+/// in QueryPerformanceCounter ticks, used to derive the minimum duration of a reported call.
+static LONGLONG volatile  ETW_OVERHEAD_PAIR    = 0;
+
+/// @summary The modules containing instrumented functions. Entries are appended under 
+/// ETW_THREAD_LOCK and never removed, so the first ETW_FUNCTION_MODULE_COUNT entries can 
+/// be searched without locking. A module unloaded and replaced by another at the same 
+/// address keeps its original entry.
+static etw_function_module_t ETW_FUNCTION_MODULES[ETW_PROVIDER_MAX_FUNCTION_MODULES];
+static LONG volatile      ETW_FUNCTION_MODULE_COUNT = 0;
+
+/// @summary Instrumented function addresses that the loader did not find in any module, 
+/// indexed by a hash of the address. Entries are overwritten on collision without locking.
+static ULONG_PTR volatile ETW_FUNCTION_UNKNOWN[ETW_PROVIDER_FUNCTION_UNKNOWN_SIZE];
+
+/// @summary The ';'-separated module name filters and the minimum call duration set with 
+/// ETWFunctionFilter(). The filters are protected by ETW_THREAD_LOCK. A minimum of zero 
+/// selects the automatic minimum derived from ETW_OVERHEAD_PAIR.
+static char               ETW_FUNCTION_INCLUDE[ETW_PROVIDER_FUNCTION_FILTER_SIZE] = { 0 };
+static char               ETW_FUNCTION_EXCLUDE[ETW_PROVIDER_FUNCTION_FILTER_SIZE] = { 0 };
+static LONG volatile      ETW_FUNCTION_MIN_US  = 0;
+
+/// @summary The reporting policy of main scopes set with ETWScopeThreshold() and ETWScopeSampling(),
+/// by name, and the minimum duration of all other main scopes, in microseconds. Entries are 
+/// appended under ETW_THREAD_LOCK and never removed, so the first ETW_SCOPE_POLICY_COUNT 
+/// entries can be searched without locking. While both are zero, main scope events are 
+/// written immediately.
+static etw_scope_policy_t ETW_SCOPE_POLICIES[ETW_PROVIDER_MAX_SCOPE_POLICIES];
+static LONG volatile      ETW_SCOPE_POLICY_COUNT = 0;
+static LONG volatile      ETW_SCOPE_MIN_US     = 0;
+
+/// @summary The identifier assigned to the most recently created task context.
+static LONGLONG volatile  ETW_TASK_ID          = 0;
+
+/// @summary The number of events dropped by all threads, indexed by etw_provider_e, and the
+/// number of threads with drops that have not yet been reported with an EventsLost_Event.
+/// Successful writes only look for something to report while ETW_LOST_PENDING is non-zero.
+static LONGLONG volatile  ETW_LOST_EVENTS[ETW_PROVIDER_COUNT] = { 0 };
+static LONG volatile      ETW_LOST_PENDING     = 0;
+
+/// @summary The overflow policy set with ETWSetOverflowPolicy(), and the time a write may 
+/// spin under ETW_PROVIDER_OVERFLOW_SPIN, in microseconds.
+static LONG volatile      ETW_OVERFLOW_POLICY  = ETW_PROVIDER_OVERFLOW_DROP;
+static LONG volatile      ETW_OVERFLOW_SPIN_US = ETW_PROVIDER_OVERFLOW_SPIN_US;
+
+/// @summary The share of the process CPU time the providers may spend writing events, in 
+/// hundredths of a percent, set with ETWSetOverheadBudget(). Zero disables the governor.
+static LONG volatile      ETW_GOVERNOR_BUDGET  = ETW_PROVIDER_GOVERNOR_BUDGET;
+
+/// @summary The governor level applied to the HighFrequency events of each provider, 
+/// indexed by etw_provider_e. Changed only by the thread that evaluates a window.
+static LONG volatile      ETW_GOVERNOR_LEVEL[ETW_PROVIDER_COUNT] = { 0 };
+
+/// @summary The events counted by all threads in the current governor window, indexed by 
+/// etw_provider_e: the events without the HighFrequency keyword that were written, and the
+/// HighFrequency events offered, which is what would be written at level zero, and the 
+/// HighFrequency events offered that were not written.
+static LONGLONG volatile  ETW_GOVERNOR_OTHER  [ETW_PROVIDER_COUNT] = { 0 };
+static LONGLONG volatile  ETW_GOVERNOR_OFFERED[ETW_PROVIDER_COUNT] = { 0 };
+static LONGLONG volatile  ETW_GOVERNOR_REFUSED[ETW_PROVIDER_COUNT] = { 0 };
+
+/// @summary The names of the providers used in governor markers, indexed by etw_provider_e.
+static char const        *GOVERNOR_NAMES[ETW_PROVIDER_COUNT] = { "MAIN_THREAD", "TASK_THREAD", "USER_INPUT", "SYNC", "FILE_IO" };
+
+/// @summary The timestamp at which the current governor window began, and the CPU time 
+/// used by the process at that point, in 100ns units.
+static LONGLONG volatile  ETW_GOVERNOR_TIME    = 0;
+static LONGLONG           ETW_GOVERNOR_CPU     = 0;
+
+/// @summary The sampler thread, and the manual-reset event signaled to make it exit. Both are
+/// NULL while sampling is disabled. Protected by ETW_SAMPLER_LOCK, which is never acquired
+/// while holding ETW_THREAD_LOCK, since the sampler thread acquires ETW_THREAD_LOCK itself.
+static HANDLE             ETW_SAMPLER_THREAD   = NULL;
+static HANDLE             ETW_SAMPLER_STOP     = NULL;
+static CRITICAL_SECTION   ETW_SAMPLER_LOCK;
+
+/// @summary The thread states referenced by the sampler during one pass, and the capacity 
+/// of the array. Used only by the sampler thread, which frees the array when it exits.
+static etw_thread_t     **ETW_SAMPLER_THREADS  = NULL;
+static DWORD              ETW_SAMPLER_CAPACITY = 0;
+
+/// @summary Resolved from Winmm.dll the first time the sampler is started, and used to raise
+/// the system timer resolution while it runs. NULL if Winmm.dll is not available.
+static TimePeriodFn       timeBeginPeriod_Func = NULL;
+static TimePeriodFn       timeEndPeriod_Func   = NULL;
+
+/// @summary Resolved from Kernel32.dll at runtime. Available on Windows 7 and later, where
+/// the PSAPI functions are exported from Kernel32.dll with a K32 prefix. The counters they
+/// provide are reported as zero when they are not available.
+static GetProcessMemoryInfoFn K32GetProcessMemoryInfo_Func = NULL;
+static QueryWorkingSetExFn    K32QueryWorkingSetEx_Func    = NULL;
+
+/// @summary The counter thread, and the manual-reset event signaled to make it exit. Both
+/// are NULL while the Counters keyword is disabled. Protected by ETW_SAMPLER_LOCK.
+static HANDLE             ETW_COUNTER_THREAD   = NULL;
+static HANDLE             ETW_COUNTER_STOP     = NULL;
+
+/// @summary The interval between counter samples set with ETWSetCounterInterval(), in 
+/// milliseconds. Read by the counter thread before each wait.
+static LONG volatile      ETW_COUNTER_INTERVAL_MS = ETW_PROVIDER_COUNTER_INTERVAL_MS;
+
+/// @summary The address ranges registered with ETWCounterRegion(). Protected by 
+/// ETW_COUNTER_LOCK, which the counter thread holds while it checks the ranges.
+static etw_counter_region_t ETW_COUNTER_REGIONS[ETW_PROVIDER_MAX_COUNTER_REGIONS];
+static CRITICAL_SECTION   ETW_COUNTER_LOCK;
+
+/// @summary The pages passed to QueryWorkingSetEx() by the counter thread, which is the
+/// only thread that uses this buffer.
+static PSAPI_WORKING_SET_EX_INFORMATION ETW_COUNTER_PAGES[ETW_PROVIDER_COUNTER_REGION_PAGES];
+
+/// @summary The file mapping and view of the shared-memory statistics segment defined in 
+/// ETWStats.h, created the first time ETWSetLiveStats() enables it. ETW_STATS is NULL if 
+/// live statistics were never enabled or the segment could not be created. Scope exits are
+/// recorded only while ETW_STATS_ENABLED is non-zero, and ETW_STATS_CREATING is set by the
+/// thread creating the segment.
+static HANDLE              ETW_STATS_MAPPING   = NULL;
+static etw_stats_header_t *ETW_STATS           = NULL;
+static LONG volatile       ETW_STATS_ENABLED   = 0;
+static LONG volatile       ETW_STATS_CREATING  = 0;
+
+/// @summary The following functions are resolved at runtime by dynamically loading 
+/// Advapi32.dll. If running on Windows XP, they will be NULL as custom event
+/// tracing is not available.
+static EventWriteFn       EventWrite_Func      = NULL;
+static EventRegisterFn    EventRegister_Func   = NULL;
+static EventUnregisterFn  EventUnregister_Func = NULL;
+
+/*///////////////////////
+//   Local Functions   //
+///////////////////////*/
+/// @summary Wrapper function to call the underlying EventWrite() from Advapi32.dll, 
+/// if that function is available at runtime. The function is available only
+/// on Vista and later systems. If the function is not available, just return 
+/// a success status and do nothing. All of the generated EventWriteXxx functions
+/// call this function, so it is where dropped events are counted and reported, and
+/// where the overhead governor counts events and throttles HighFrequency events.
+/// @param reghandle Registration handle of the provider. The handle comes from EventRegister.
+/// @param evdesc Metadata that identifies the event to write. For details, see EVENT_DESCRIPTOR.
+/// @param count Number of EVENT_DATA_DESCRIPTOR structures in UserData. The maximum number is 128.
+/// @param evdata The event data to write. Allocate a block of memory that contains one or more EVENT_DATA_DESCRIPTOR structures. Set this parameter to NULL if UserDataCount is zero. The data must be in the order specified in the manifest.
+/// @return ERROR_SUCCESS if the operation was successful.
+static ULONG EVNTAPI EventWrite(REGHANDLE reghandle, PCEVENT_DESCRIPTOR evdesc, ULONG count, PEVENT_DATA_DESCRIPTOR evdata)
+{
+    if (EventWrite_Func != NULL)
+    {   // This function exists in Advapi32.dll. Running on Vista+.
+        if (ETW_GOVERNOR_BUDGET != 0 && !governor_filter(reghandle, evdesc))
+            return ERROR_SUCCESS;
+        ULONG result = EventWrite_Func(reghandle, evdesc, count, evdata);
+        if (result != ERROR_SUCCESS)
+            result = event_write_failed(reghandle, evdesc, count, evdata, result);
+        else if (ETW_LOST_PENDING != 0)
+            event_report_lost();
+        return result;
+    }
+    else return ERROR_SUCCESS;
+}
+
+/// @summary Wrapper function to call the underlying EventRegister() from Advapi32.dll, 
+/// if that function is available at runtime. The function is available only
+/// on Vista and later systems. If the function is not available, just return 
+/// a success status and do nothing.
+/// @param provider The GUID that uniquely identifies the provider.
+/// @param enablecb Callback that ETW calls to notify you when a session enables or disables your provider. Can be NULL.
+/// @param ctx Provider-defined context data to pass to the callback when the provider is enabled or disabled. Can be NULL.
+/// @param reghandle Registration handle. The handle is used by most provider function calls. Before your provider exits, you must pass this handle to EventUnregister to free the handle.
+/// @return ERROR_SUCCESS if the operation was successful.
+static ULONG EVNTAPI EventRegister(LPCGUID provider, PENABLECALLBACK enablecb, PVOID ctx, PREGHANDLE reghandle)
+{
+    if (EventRegister_Func != NULL)
+    {   // This function exists in Advapi32.dll. Running on Vista+.
+        return EventRegister_Func(provider, enablecb, ctx, reghandle);
+    }
+    else return 0;
+}
+
+/// @summary Wrapper function to call the underlying EventUnregister() from Advapi32.dll, 
+/// if that function is available at runtime. The function is available only
+/// on Vista and later systems. If the function is not available, just return 
+/// a success status and do nothing.
+/// @param reghandle Registration handle returned by EventRegister().
+/// @return ERROR_SUCCESS if the operation was successful.
+static ULONG EVNTAPI EventUnregister(REGHANDLE reghandle)
+{
+    if (EventUnregister_Func != NULL)
+    {   // This function exists in Advapi32.dll. Running on Vista+.
+        return EventUnregister_Func(reghandle);
+    }
+    else return 0;
+}
+
+/// @summary Get a raw timestamp value from the system.
+/// @return a timestamp value in unspecified units.
+static inline LONGLONG timestamp(void)
+{
+    LARGE_INTEGER qpc = { 0 };
+    QueryPerformanceCounter(&qpc);
+    return qpc.QuadPart;
+}
+
+/// @summary Convert a timestamp value, or timestamp delta, to milliseconds.
+/// @param raw The raw timestamp value.
+/// @return the timestamp value or duration in milliseconds.
+static inline float milliseconds(LONGLONG raw)
+{
+    LONGLONG frequency = QPC_FREQUENCY.QuadPart;
+    return float(double(raw) / double(frequency)) * 1000.0f;
+}
+
+/// @summary Update the TSC rate using the time elapsed since the providers were registered.
+/// The rate is only computed once at least a millisecond has elapsed, which keeps the error
+/// well below the resolution of the emitted values.
+static void calibrate_cycles(void)
+{
+    LONGLONG qpc = timestamp();
+    ULONG64  tsc = __rdtsc();
+    double   ms  = double(qpc - CALIBRATE_QPC) * 1000.0 / double(QPC_FREQUENCY.QuadPart);
+    if (CALIBRATE_QPC != 0 && ms >= 1.0)
+    {
+        CYCLES_PER_MS = double(tsc - CALIBRATE_TSC) / ms;
+    }
+}
+
+/// @summary Map a provider registration handle to the corresponding etw_provider_e value.
+/// @param reghandle The registration handle passed to EventWrite().
+/// @return The index of the provider, in [0, ETW_PROVIDER_COUNT).
+static inline DWORD provider_index(REGHANDLE reghandle)
+{
+    if (reghandle == ETW_TASK_THREADHandle) return 1;
+    if (reghandle == ETW_USER_INPUTHandle ) return 2;
+    if (reghandle == ETW_SYNCHandle       ) return 3;
+    if (reghandle == ETW_FILE_IOHandle    ) return 4;
+    return 0;
+}
+
+/// @summary Retry a write that failed because the session had no free buffers, until the
+/// write succeeds or the spin budget set with ETWSetOverflowPolicy() is exhausted.
+/// @param reghandle Registration handle of the provider.
+/// @param evdesc Metadata that identifies the event to write.
+/// @param count Number of EVENT_DATA_DESCRIPTOR structures in evdata.
+/// @param evdata The event data to write.
+/// @return The result of the last attempt.
+static ULONG overflow_spin(REGHANDLE reghandle, PCEVENT_DESCRIPTOR evdesc, ULONG count, PEVENT_DATA_DESCRIPTOR evdata)
+{
+    LONGLONG const budget = (QPC_FREQUENCY.QuadPart * ETW_OVERFLOW_SPIN_US) / 1000000;
+    LONGLONG const start  = timestamp();
+    ULONG          result = ERROR_NOT_ENOUGH_MEMORY;
+    for (DWORD i = 0; result == ERROR_NOT_ENOUGH_MEMORY && timestamp() - start < budget; ++i)
+    {   // spin briefly, then yield so the logger can flush a buffer.
+        if (i < 16) YieldProcessor();
+        else SwitchToThread();
+        result = EventWrite_Func(reghandle, evdesc, count, evdata);
+    }
+    return result;
+}
+
+/// @summary Apply the overflow policy to a failed write, and count the event as lost if it
+/// still could not be written. The drop is recorded against the calling thread so that it
+/// can be reported by the thread's next successful write.
+/// @param reghandle Registration handle of the provider.
+/// @param evdesc Metadata that identifies the event to write.
+/// @param count Number of EVENT_DATA_DESCRIPTOR structures in evdata.
+/// @param evdata The event data to write.
+/// @param result The error returned by the first attempt.
+/// @return ERROR_SUCCESS if a retry succeeded, or the error returned by the last attempt.
+static ULONG event_write_failed(REGHANDLE reghandle, PCEVENT_DESCRIPTOR evdesc, ULONG count, PEVENT_DATA_DESCRIPTOR evdata, ULONG result)
+{
+    etw_thread_t *thread   = NULL;
+    DWORD const   provider = provider_index(reghandle);
+
+    if (result == ERROR_NOT_ENOUGH_MEMORY && ETW_OVERFLOW_POLICY == ETW_PROVIDER_OVERFLOW_SPIN)
+    {
+        if ((result = overflow_spin(reghandle, evdesc, count, evdata)) == ERROR_SUCCESS)
+            return result;
+    }
+    if (ETW_THREAD_STATE != TLS_OUT_OF_INDEXES)
+    {   // threads without state, like the sampler, only update the global count.
+        thread = (etw_thread_t*) TlsGetValue(ETW_THREAD_STATE);
+    }
+    if (thread != NULL && thread->Reporting)
+    {   // the EventsLost_Event itself was dropped; it stays pending.
+        return result;
+    }
+    InterlockedIncrement64(&ETW_LOST_EVENTS[provider]);
+    if (thread != NULL)
+    {
+        thread->LostPending[provider]++;
+        thread->LostTotal  [provider]++;
+        if (!thread->LostQueued)
+        {
+            thread->LostQueued = TRUE;
+            InterlockedIncrement(&ETW_LOST_PENDING);
+        }
+    }
+    return result;
+}
+
+/// @summary Emit an EventsLost_Event for each provider on which the calling thread has 
+/// dropped events since its last report. Called after a successful write, when there is
+/// likely to be room in the session buffers again.
+static void event_report_lost(void)
+{
+    etw_thread_t *thread  = NULL;
+    DWORD         pending = 0;
+
+    if (ETW_THREAD_STATE == TLS_OUT_OF_INDEXES || (thread = (etw_thread_t*) TlsGetValue(ETW_THREAD_STATE)) == NULL)
+        return;
+    if (!thread->LostQueued || thread->Reporting)
+        return;
+
+    thread->Reporting = TRUE;
+    for (DWORD i = 0; i < ETW_PROVIDER_COUNT; ++i)
+    {
+        if (thread->LostPending[i] == 0)
+            continue;
+        if (EventWriteEventsLost_Event(i, thread->ThreadId, thread->LostPending[i], thread->LostTotal[i]) == ERROR_SUCCESS)
+            thread->LostPending[i] = 0;
+        else
+            pending++;
+    }
+    thread->Reporting = FALSE;
+    if (pending == 0)
+    {
+        thread->LostQueued = FALSE;
+        InterlockedDecrement(&ETW_LOST_PENDING);
+    }
+}
+
+/// @summary Retrieve the number of HighFrequency events offered for each one written at a
+/// governor level below ETW_PROVIDER_GOVERNOR_LEVELS - 1.
+/// @param level The governor level.
+/// @return One for level zero, then 4, 16 and 64.
+static inline DWORD governor_rate(LONG level)
+{
+    return 1UL << (2 * level);
+}
+
+/// @summary Estimate the time spent writing the HighFrequency events of a provider at a level.
+/// @param offered The number of HighFrequency events offered.
+/// @param level The governor level.
+/// @param per_event The estimated cost of writing one event, in milliseconds.
+/// @return The estimated cost, in milliseconds.
+static inline double governor_cost(LONGLONG offered, LONG level, double per_event)
+{
+    if (level >= ETW_PROVIDER_GOVERNOR_LEVELS - 1)
+        return 0.0;
+    return (double(offered) * per_event) / governor_rate(level);
+}
+
+/// @summary Add the events counted by a thread to the totals for the current window.
+/// @param thread The thread state.
+static void governor_flush(etw_thread_t *thread)
+{
+    for (DWORD i = 0; i < ETW_PROVIDER_COUNT; ++i)
+    {
+        if (thread->GovOther[i] != 0)
+        {
+            InterlockedExchangeAdd64(&ETW_GOVERNOR_OTHER[i], thread->GovOther[i]);
+            thread->GovOther[i] = 0;
+        }
+        if (thread->GovOffered[i] != 0)
+        {
+            InterlockedExchangeAdd64(&ETW_GOVERNOR_OFFERED[i], thread->GovOffered[i]);
+            thread->GovOffered[i] = 0;
+        }
+        if (thread->GovRefused[i] != 0)
+        {
+            InterlockedExchangeAdd64(&ETW_GOVERNOR_REFUSED[i], thread->GovRefused[i]);
+            thread->GovRefused[i] = 0;
+        }
+    }
+    thread->GovBatch = 0;
+}
+
+/// @summary Retrieve the CPU time used by the process so far.
+/// @return The sum of the kernel and user time, in 100ns units, or zero if unavailable.
+static LONGLONG governor_cpu_time(void)
+{
+    FILETIME created, exited, kernel, user;
+    if (!GetProcessTimes(GetCurrentProcess(), &created, &exited, &kernel, &user))
+        return 0;
+    ULONGLONG k = ((ULONGLONG) kernel.dwHighDateTime << 32) | kernel.dwLowDateTime;
+    ULONGLONG u = ((ULONGLONG) user.dwHighDateTime   << 32) | user.dwLowDateTime;
+    return (LONGLONG) (k + u);
+}
+
+/// @summary Restart the governor when a session enables the providers. The levels return
+/// to zero, so each session starts with full detail.
+static void governor_reset(void)
+{
+    for (DWORD i = 0; i < ETW_PROVIDER_COUNT; ++i)
+    {
+        InterlockedExchange  (&ETW_GOVERNOR_LEVEL  [i], 0);
+        InterlockedExchange64(&ETW_GOVERNOR_OTHER  [i], 0);
+        InterlockedExchange64(&ETW_GOVERNOR_OFFERED[i], 0);
+        InterlockedExchange64(&ETW_GOVERNOR_REFUSED[i], 0);
+    }
+    ETW_GOVERNOR_CPU  = governor_cpu_time();
+    ETW_GOVERNOR_TIME = timestamp();
+}
+
+/// @summary Write a marker on the main thread provider recording a change of governor level,
+/// so that gaps in the HighFrequency events of a provider can be explained in the trace.
+/// @param provider The index of the provider, in [0, ETW_PROVIDER_COUNT).
+/// @param level The new governor level.
+/// @param share The estimated share of the process CPU time spent tracing in the window that
+/// triggered the change, in percent.
+static void governor_report(DWORD provider, LONG level, double share)
+{
+    char               mode[32];
+    char               text[160];
+    if (level == 0)
+        sprintf_s(mode, "written in full");
+    else if (level < ETW_PROVIDER_GOVERNOR_LEVELS - 1)
+        sprintf_s(mode, "sampled 1 in %u", governor_rate(level));
+    else if (provider == provider_index(ETW_FILE_IOHandle))
+        sprintf_s(mode, "aggregated only");
+    else
+        sprintf_s(mode, "counted only");
+    sprintf_s(text, "ETW governor: %s HighFrequency events %s (tracing %.2f%% of CPU, budget %.2f%%)", 
+              GOVERNOR_NAMES[provider], mode, share, ETW_GOVERNOR_BUDGET / 100.0);
+    EventWriteMainMarker_Event(text);
+}
+
+/// @summary Write a marker on the main thread provider recording how many HighFrequency 
+/// events of a provider were not written in a window. File I/O operations that are not 
+/// written are summed into FileSummary_Event instead, so they are not reported here.
+/// @param provider The index of the provider, in [0, ETW_PROVIDER_COUNT).
+/// @param refused The number of HighFrequency events not written in the window.
+static void governor_report_refused(DWORD provider, LONGLONG refused)
+{
+    char text[160];
+    if (refused == 0 || provider == provider_index(ETW_FILE_IOHandle))
+        return;
+    sprintf_s(text, "ETW governor: %I64d %s HighFrequency events not written", refused, GOVERNOR_NAMES[provider]);
+    EventWriteMainMarker_Event(text);
+}
+
+/// @summary Choose the governor level of each provider for the next window, from the events
+/// counted in the window that just ended. The cost of an event is estimated as half the cost
+/// of a scope enter/leave pair measured by calibrate_overhead(). Events without the 
+/// HighFrequency keyword are always written, and the rest of the budget is shared between
+/// the providers, smallest HighFrequency traffic first, so that a provider producing few 
+/// events keeps full detail while the one responsible for the load is thinned out. A level
+/// is lowered only once the cost at the lower level fits in half the provider's share, so
+/// the governor does not oscillate around the budget. When the other events alone exceed
+/// the budget every share is zero; a provider with no HighFrequency traffic has nothing to
+/// throttle and returns to full detail.
+/// @param cpu_time The CPU time used by the process at the end of the window, in 100ns units.
+static void governor_evaluate(LONGLONG cpu_time)
+{
+    LONGLONG   offered[ETW_PROVIDER_COUNT];
+    LONGLONG   refused[ETW_PROVIDER_COUNT];
+    DWORD      order  [ETW_PROVIDER_COUNT];
+    LONG       levels [ETW_PROVIDER_COUNT];
+    LONGLONG   other     = 0;
+    double     cpu_ms    = double(cpu_time - ETW_GOVERNOR_CPU) / 10000.0;
+    double     per_event = milliseconds(ETW_OVERHEAD_PAIR) * 0.5;
+    double     remaining = 0.0;
+    double     current   = 0.0;
+    LONG const budget    = ETW_GOVERNOR_BUDGET;
+
+    for (DWORD i = 0; i < ETW_PROVIDER_COUNT; ++i)
+    {
+        other     += InterlockedExchange64(&ETW_GOVERNOR_OTHER[i], 0);
+        offered[i] = InterlockedExchange64(&ETW_GOVERNOR_OFFERED[i], 0);
+        refused[i] = InterlockedExchange64(&ETW_GOVERNOR_REFUSED[i], 0);
+        levels [i] = ETW_GOVERNOR_LEVEL[i];
+        order  [i] = i;
+        governor_report_refused(i, refused[i]);
+    }
+    ETW_GOVERNOR_CPU = cpu_time;
+    if (budget == 0 || ETW_OVERHEAD_PAIR == 0 || cpu_time == 0 || cpu_ms < 1.0)
+    {   // the cost of an event is not known yet, or the process was idle.
+        return;
+    }
+    for (DWORD i = 1; i < ETW_PROVIDER_COUNT; ++i)
+    {   // insertion sort by ascending HighFrequency traffic.
+        DWORD const key = order[i];
+        DWORD       j   = i;
+        for ( ; j > 0 && offered[order[j-1]] > offered[key]; --j)
+            order[j] = order[j-1];
+        order[j] = key;
+    }
+
+    current   = double(other) * per_event;
+    remaining = (cpu_ms * budget) / 10000.0 - current;
+    for (DWORD i = 0; i < ETW_PROVIDER_COUNT; ++i)
+        current += governor_cost(offered[i], levels[i], per_event);
+
+    for (DWORD i = 0; i < ETW_PROVIDER_COUNT; ++i)
+    {
+        DWORD  const provider = order[i];
+        double const share    = remaining > 0.0 ? remaining / (ETW_PROVIDER_COUNT - i) : 0.0;
+        LONG         level    = levels[provider];
+        if (offered[provider] == 0)
+        {   // no HighFrequency traffic in the window; it costs nothing at any level.
+            level = 0;
+        }
+        else
+        {
+            while (level < ETW_PROVIDER_GOVERNOR_LEVELS - 1 && governor_cost(offered[provider], level, per_event) > share)
+                level++;
+            while (level > 0 && governor_cost(offered[provider], level - 1, per_event) <= share * 0.5)
+                level--;
+            remaining -= governor_cost(offered[provider], level, per_event);
+        }
+        if (level != levels[provider])
+        {
+            InterlockedExchange(&ETW_GOVERNOR_LEVEL[provider], level);
+            governor_report(provider, level, (100.0 * current) / cpu_ms);
+        }
+    }
+}
+
+/// @summary Count an event against the governor totals, and decide whether a HighFrequency 
+/// event is written at its provider's current level. Every ETW_PROVIDER_GOVERNOR_BATCH events
+/// the thread adds its counts to the totals, and the first thread to do so after the window
+/// has ended evaluates it.
+/// @param thread The state associated with the calling thread.
+/// @param provider The index of the provider, in [0, ETW_PROVIDER_COUNT).
+/// @param high true if the event has the HighFrequency keyword.
+/// @return true if the event should be written.
+static bool governor_admit(etw_thread_t *thread, DWORD provider, bool high)
+{
+    bool admit = true;
+    if (high)
+    {
+        LONG const level = ETW_GOVERNOR_LEVEL[provider];
+        thread->GovOffered[provider]++;
+        if (level >= ETW_PROVIDER_GOVERNOR_LEVELS - 1)
+            admit = false;
+        else if (level > 0)
+            admit = (thread->GovSkip++ % governor_rate(level)) == 0;
+        if (!admit) thread->GovRefused[provider]++;
+    }
+    else thread->GovOther[provider]++;
+
+    if (++thread->GovBatch >= ETW_PROVIDER_GOVERNOR_BATCH)
+    {
+        LONGLONG const nowtime = timestamp();
+        LONGLONG const last    = ETW_GOVERNOR_TIME;
+        LONGLONG const wait    = (QPC_FREQUENCY.QuadPart * ETW_PROVIDER_GOVERNOR_WINDOW_MS) / 1000;
+        governor_flush(thread);
+        if (nowtime - last >= wait && InterlockedCompareExchange64(&ETW_GOVERNOR_TIME, nowtime, last) == last)
+            governor_evaluate(governor_cpu_time());
+    }
+    return admit;
+}
+
+/// @summary Apply the overhead governor to an event about to be written. Events written by 
+/// threads without state, such as the sampler and counter threads, are not counted. File I/O
+/// operations are counted and admitted by fileio_admit(), which sums the ones not written.
+/// @param reghandle Registration handle of the provider.
+/// @param evdesc Metadata that identifies the event to write.
+/// @return true if the event should be written.
+static bool governor_filter(REGHANDLE reghandle, PCEVENT_DESCRIPTOR evdesc)
+{
+    etw_thread_t *thread = NULL;
+    bool const    high   = (evdesc->Keyword & ETW_PROVIDER_KEYWORD_HIGH_FREQUENCY) != 0;
+    if (ETW_THREAD_STATE == TLS_OUT_OF_INDEXES || (thread = (etw_thread_t*) TlsGetValue(ETW_THREAD_STATE)) == NULL)
+        return true;
+    if (high && reghandle == ETW_FILE_IOHandle)
+        return true;
+    return governor_admit(thread, provider_index(reghandle), high);
+}
+
+/// @summary Determine whether a session has enabled the ThreadTime keyword on a provider,
+/// using the same keyword matching rules as the generated EventEnabled checks.
+/// @param ctx The generated provider context (ETW_MAIN_THREAD_Context, etc.)
+/// @return true if scopes should sample the thread cycle counter.
+static inline bool thread_time_enabled(MCGEN_TRACE_CONTEXT const *ctx)
+{
+    ULONGLONG const keyword = ETW_PROVIDER_KEYWORD_THREAD_TIME;
+    if (!ctx->IsEnabled || QueryThreadCycleTime_Func == NULL)
+        return false;
+    if (ctx->MatchAnyKeyword != 0 && (ctx->MatchAnyKeyword & keyword) == 0)
+        return false;
+    return (ctx->MatchAllKeyword & keyword) == ctx->MatchAllKeyword;
+}
+
+/// @summary Record the cycle count of the stack owner when a scope is entered, if enabled.
+/// For a task stack, this is the number of cycles the task has run on any thread.
+/// @param stack The scope stack.
+/// @param depth The depth of the scope being entered, starting from one.
+/// @param ctx The generated provider context.
+static inline void scope_cycles_enter(etw_scope_stack_t *stack, DWORD depth, MCGEN_TRACE_CONTEXT const *ctx)
+{
+    if (depth > 0 && depth <= ETW_PROVIDER_MAX_SCOPE_DEPTH)
+    {
+        ULONG64 now = 0;
+        if (!stack->Untimed && thread_time_enabled(ctx))
+        {
+            QueryThreadCycleTime_Func(GetCurrentThread(), &now);
+            now += stack->CycleBias;
+        }
+        stack->Cycles[depth-1] = now;
+    }
+}
+
+/// @summary Compute the on-CPU time of a scope being left.
+/// @param stack The scope stack.
+/// @param depth The depth after leaving the scope, which is the index of its slot.
+/// @param oncpu On return, stores the time the owner was running within the scope, in milliseconds.
+/// @return true if the cycle count was sampled when the scope was entered.
+static inline bool scope_cycles_leave(etw_scope_stack_t *stack, DWORD depth, float *oncpu)
+{
+    ULONG64 enter = 0;
+    ULONG64 now   = 0;
+    if (depth >= ETW_PROVIDER_MAX_SCOPE_DEPTH || (enter = stack->Cycles[depth]) == 0)
+    {   // too deep, or the keyword was not enabled when the scope was entered.
+        return false;
+    }
+    stack->Cycles[depth] = 0;
+    if (stack->Untimed)
+    {   // a task resumed before the keyword was enabled.
+        return false;
+    }
+    if (CYCLES_PER_MS == 0.0)
+    {
+        calibrate_cycles();
+        if (CYCLES_PER_MS == 0.0) return false;
+    }
+    QueryThreadCycleTime_Func(GetCurrentThread(), &now);
+    *oncpu = float(double(now + stack->CycleBias - enter) / CYCLES_PER_MS);
+    return true;
+}
+
+/// @summary Push a scope name onto a scope stack of the calling thread. The name is stored
+/// before the depth is updated so that the sampler, which suspends the thread at an 
+/// arbitrary point, never sees a slot that has not been written.
+/// @param stack The scope stack.
+/// @param message The name of the scope being entered.
+/// @return The depth of the scope being entered, starting from one.
+static inline DWORD scope_names_push(etw_scope_stack_t *stack, char const *message)
+{
+    DWORD new_depth = stack->Depth + 1;
+    if (new_depth - 1 < ETW_PROVIDER_MAX_SCOPE_DEPTH)
+    {
+        stack->Names[new_depth-1] = message;
+    }
+    _ReadWriteBarrier();
+    stack->Depth = new_depth;
+    return new_depth;
+}
+
+/// @summary Sort a small array of timestamp deltas in ascending order.
+/// @param values The values to sort.
+/// @param count The number of values.
+static void sort_deltas(LONGLONG *values, DWORD count)
+{
+    for (DWORD i = 1; i < count; ++i)
+    {
+        LONGLONG value = values[i];
+        DWORD    j     = i;
+        for ( ; j > 0 && values[j-1] > value; --j)
+        {
+            values[j] = values[j-1];
+        }
+        values[j] = value;
+    }
+}
+
+/// @summary Measure the cost of instrumenting a scope, and emit an Overhead_Event so that
+/// the analyzer can subtract it. Each iteration repeats the work ETWEnterScopeMain() and
+/// ETWLeaveScopeMain() do around an empty scope, on a private stack the sampler cannot see,
+/// writing CalibrateProbe_Event in place of the scope events. Two costs are reported: the
+/// whole enter/leave pair, which is added to the duration of every enclosing scope, and the
+/// part between the two timestamps, which is added to the duration of the scope itself.
+/// Publishing live statistics is not included, since it would create a slot for the probe.
+/// The probes have the Calibration keyword, so only sessions that ask for them receive them;
+/// when no session enables it, the probes are filtered before they are logged and the cost 
+/// measured leaves out the cost of logging an event.
+static void calibrate_overhead(void)
+{
+    etw_scope_stack_t probe;
+    LONGLONG          pair[ETW_PROVIDER_CALIBRATE_PAIRS];
+    LONGLONG          bias[ETW_PROVIDER_CALIBRATE_PAIRS];
+    DWORD const       count = ETW_PROVIDER_CALIBRATE_PAIRS;
+    char const       *name  = "ETW Calibration";
+
+    if (!ETW_MAIN_THREAD_Context.IsEnabled || ETW_THREAD_STATE == TLS_OUT_OF_INDEXES)
+    {   // nothing would record the result.
+        return;
+    }
+    ZeroMemory(&probe, sizeof(probe));
+    for (DWORD i = 0; i < count; ++i)
+    {
+        LONGLONG enter = timestamp();
+        float    oncpu = 0.0f;
+        TlsGetValue(ETW_THREAD_STATE);
+        DWORD    depth = scope_names_push(&probe, name);
+        scope_cycles_enter(&probe, depth, &ETW_MAIN_THREAD_Context);
+        EventWriteCalibrateProbe_Event(name, depth);
+        LONGLONG leave = timestamp();
+        TlsGetValue(ETW_THREAD_STATE);
+        depth = --probe.Depth;
+        scope_cycles_leave(&probe, depth, &oncpu);
+        EventWriteCalibrateProbe_Event(name, depth);
+        pair[i] = timestamp() - enter;
+        bias[i] = leave - enter;
+    }
+    sort_deltas(pair, count);
+    sort_deltas(bias, count);
+    ETW_OVERHEAD_PAIR = pair[count / 2];
+    EventWriteOverhead_Event(milliseconds(pair[count / 2]) * 1000000.0f, milliseconds(bias[count / 2]) * 1000000.0f, count);
+}
+
+/// @summary Retrieve the stack that receives the task scopes of a thread.
+/// @param thread The thread state.
+/// @return The stack of the task context resumed on the thread, or the thread's own stack.
+static inline etw_scope_stack_t* task_stack(etw_thread_t *thread)
+{
+    etw_scope_stack_t *stack = thread->Task;
+    return stack != NULL ? stack : &thread->Tasks;
+}
+
+/// @summary Append the names of a scope stack to the stack string of a sample. This function
+/// runs while the owning thread is suspended, so it must not call anything that may acquire a 
+/// lock (including the CRT string functions, which may take the locale lock.)
+/// @param dst The stack string buffer, of ETW_PROVIDER_SAMPLE_STACK_SIZE bytes.
+/// @param len The current length of the stack string, updated on return.
+/// @param stack The scope stack.
+/// @return The number of names appended.
+static DWORD sample_append_names(char *dst, size_t *len, etw_scope_stack_t const *stack)
+{
+    char const * const *names = stack->Names;
+    size_t const max   = ETW_PROVIDER_SAMPLE_STACK_SIZE - 1;
+    size_t       n     = *len;
+    DWORD        count = stack->Depth < ETW_PROVIDER_MAX_SCOPE_DEPTH ? stack->Depth : ETW_PROVIDER_MAX_SCOPE_DEPTH;
+    DWORD        i     = 0;
+    for (i = 0; i < count && n < max; ++i)
+    {
+        char const *name = names[i] != NULL ? names[i] : "?";
+        if (n > 0)    dst[n++] = ';';
+        while (*name != '\0' && n < max)
+        {   // ';' separates frames in the stack string.
+            char c = *name++;
+            dst[n++] = c == ';' ? ':' : c;
+        }
+    }
+    dst[n] = '\0';
+    *len   = n;
+    return i;
+}
+
+/// @summary Suspend a thread, capture its instruction pointer and open scopes, resume it and
+/// emit a Sample_Event. Threads that have not consumed any cycles since their previous sample
+/// are skipped, so that idle and blocked threads do not contribute samples. The caller must 
+/// hold a reference in etw_thread_t::Sampling, which keeps the thread state alive while it
+/// is being sampled. The thread is opened the first time it is sampled.
+/// @param thread The state of the thread to sample.
+static void sample_thread(etw_thread_t *thread)
+{
+    char     stack[ETW_PROVIDER_SAMPLE_STACK_SIZE];
+    CONTEXT  context;
+    ULONG64  cycles = 0;
+    ULONG64  ip     = 0;
+    size_t   length = 0;
+    DWORD    depth  = 0;
+
+    if (thread->Handle == NULL && !thread->HandleTried)
+    {   // only the sampler uses the handle, so threads are opened once sampling is enabled.
+        thread->Handle      = OpenThread(THREAD_SUSPEND_RESUME | THREAD_GET_CONTEXT | THREAD_QUERY_INFORMATION, FALSE, thread->ThreadId);
+        thread->HandleTried = TRUE;
+    }
+    if (thread->Handle == NULL)
+    {   // the thread could not be opened with the required access rights.
+        return;
+    }
+    if (QueryThreadCycleTime_Func != NULL && QueryThreadCycleTime_Func(thread->Handle, &cycles))
+    {
+        if (cycles == thread->SampleCycles)
+            return;
+        thread->SampleCycles = cycles;
+    }
+    if (SuspendThread(thread->Handle) == (DWORD) -1)
+    {   // the thread is exiting.
+        return;
+    }
+    // GetThreadContext() waits for the suspension to complete, so the scope 
+    // stacks cannot change until ResumeThread() is called.
+    ZeroMemory(&context, sizeof(context));
+    context.ContextFlags = CONTEXT_CONTROL;
+    if (GetThreadContext(thread->Handle, &context))
+    {
+#if   defined(_M_X64)
+        ip = context.Rip;
+#elif defined(_M_IX86)
+        ip = context.Eip;
+#endif
+    }
+    stack[0] = '\0';
+    depth   += sample_append_names(stack, &length, &thread->Main);
+    depth   += sample_append_names(stack, &length, task_stack(thread));
+    ResumeThread(thread->Handle);
+    EventWriteSample_Event(thread->ThreadId, ip, depth, stack);
+}
+
+/// @summary Determine whether a session has enabled the Sampling keyword on the main thread
+/// provider, using the same keyword matching rules as the generated EventEnabled checks.
+/// @return true if the sampler thread should be running.
+static inline bool sampling_enabled(void)
+{
+    MCGEN_TRACE_CONTEXT const *ctx     = &ETW_MAIN_THREAD_Context;
+    ULONGLONG const            keyword = ETW_PROVIDER_KEYWORD_SAMPLING;
+    if (!ctx->IsEnabled)
+        return false;
+    if (ctx->MatchAnyKeyword != 0 && (ctx->MatchAnyKeyword & keyword) == 0)
+        return false;
+    return (ctx->MatchAllKeyword & keyword) == ctx->MatchAllKeyword;
+}
+
+/// @summary The entry point of the sampler thread. Each tick, every thread that has emitted
+/// an event is sampled once. The thread list is only copied under ETW_THREAD_LOCK, taking a
+/// reference on each state, and the threads are suspended and sampled after the lock is 
+/// released, so threads starting, exiting or naming themselves are not stalled by a pass.
+/// The sampler never emits scope events itself, so it does not appear in the thread list.
+/// @param argp Unused.
+/// @return Zero.
+static DWORD WINAPI sampler_main(LPVOID argp)
+{
+    UNREFERENCED_PARAMETER(argp);
+    while (WaitForSingleObject(ETW_SAMPLER_STOP, ETW_PROVIDER_SAMPLE_INTERVAL_MS) == WAIT_TIMEOUT)
+    {
+        DWORD count = 0;
+        EnterCriticalSection(&ETW_THREAD_LOCK);
+        for (etw_thread_t *thread = ETW_THREAD_LIST; thread != NULL; thread = thread->Next)
+        {
+            if (count == ETW_SAMPLER_CAPACITY)
+            {   // grow the array; threads that do not fit are sampled on the next pass.
+                DWORD const    capacity = ETW_SAMPLER_CAPACITY != 0 ? ETW_SAMPLER_CAPACITY * 2 : 64;
+                etw_thread_t **threads  = (etw_thread_t**) (ETW_SAMPLER_THREADS != NULL ?
+                    HeapReAlloc(GetProcessHeap(), 0, ETW_SAMPLER_THREADS, capacity * sizeof(etw_thread_t*)) :
+                    HeapAlloc  (GetProcessHeap(), 0, capacity * sizeof(etw_thread_t*)));
+                if (threads == NULL)
+                    break;
+                ETW_SAMPLER_THREADS  = threads;
+                ETW_SAMPLER_CAPACITY = capacity;
+            }
+            InterlockedIncrement(&thread->Sampling);
+            ETW_SAMPLER_THREADS[count++] = thread;
+        }
+        LeaveCriticalSection(&ETW_THREAD_LOCK);
+        for (DWORD i = 0; i < count; ++i)
+        {
+            sample_thread(ETW_SAMPLER_THREADS[i]);
+            InterlockedDecrement(&ETW_SAMPLER_THREADS[i]->Sampling);
+        }
+    }
+    if (ETW_SAMPLER_THREADS != NULL)
+        HeapFree(GetProcessHeap(), 0, ETW_SAMPLER_THREADS);
+    ETW_SAMPLER_THREADS  = NULL;
+    ETW_SAMPLER_CAPACITY = 0;
+    return 0;
+}
+
+/// @summary Resolve the functions used to raise the system timer resolution, the first time
+/// the sampler or the counter thread is started. Winmm.dll stays loaded once it has been used.
+/// The caller must hold ETW_SAMPLER_LOCK.
+static void timer_period_load(void)
+{
+    if (timeBeginPeriod_Func == NULL)
+    {
+        HMODULE winmm = LoadLibraryW(L"Winmm.dll");
+        if (winmm != NULL)
+        {
+            timeEndPeriod_Func   = (TimePeriodFn) GetProcAddress(winmm, "timeEndPeriod");
+            timeBeginPeriod_Func = (TimePeriodFn) GetProcAddress(winmm, "timeBeginPeriod");
+        }
+    }
+}
+
+/// @summary Start the sampler thread, if it is not already running.
+static void sampler_start(void)
+{
+    EnterCriticalSection(&ETW_SAMPLER_LOCK);
+    if (ETW_SAMPLER_THREAD == NULL)
+    {
+        timer_period_load();
+        if ((ETW_SAMPLER_STOP = CreateEventW(NULL, TRUE, FALSE, NULL)) == NULL)
+            goto error_cleanup;
+        if ((ETW_SAMPLER_THREAD = CreateThread(NULL, 0, sampler_main, NULL, CREATE_SUSPENDED, NULL)) == NULL)
+            goto error_cleanup;
+        if (timeBeginPeriod_Func != NULL && timeEndPeriod_Func != NULL)
+            timeBeginPeriod_Func(1);
+        // samples should land on schedule even when the application saturates every core.
+        SetThreadPriority(ETW_SAMPLER_THREAD, THREAD_PRIORITY_TIME_CRITICAL);
+        ResumeThread(ETW_SAMPLER_THREAD);
+    }
+    LeaveCriticalSection(&ETW_SAMPLER_LOCK);
+    return;
+
+error_cleanup:
+    if (ETW_SAMPLER_STOP != NULL) CloseHandle(ETW_SAMPLER_STOP);
+    ETW_SAMPLER_STOP = NULL;
+    LeaveCriticalSection(&ETW_SAMPLER_LOCK);
+}
+
+/// @summary Stop the sampler thread and wait for it to exit, if it is running.
+static void sampler_stop(void)
+{
+    EnterCriticalSection(&ETW_SAMPLER_LOCK);
+    if (ETW_SAMPLER_THREAD != NULL)
+    {
+        SetEvent(ETW_SAMPLER_STOP);
+        WaitForSingleObject(ETW_SAMPLER_THREAD, INFINITE);
+        CloseHandle(ETW_SAMPLER_THREAD);
+        CloseHandle(ETW_SAMPLER_STOP);
+        ETW_SAMPLER_THREAD = NULL;
+        ETW_SAMPLER_STOP   = NULL;
+        if (timeBeginPeriod_Func != NULL && timeEndPeriod_Func != NULL)
+            timeEndPeriod_Func(1);
+    }
+    LeaveCriticalSection(&ETW_SAMPLER_LOCK);
+}
+
+/// @summary Determine whether a session has enabled the Counters keyword on the file I/O
+/// provider, using the same keyword matching rules as the generated EventEnabled checks.
+/// @return true if the counter thread should be running.
+static inline bool counters_enabled(void)
+{
+    MCGEN_TRACE_CONTEXT const *ctx     = &ETW_FILE_IO_Context;
+    ULONGLONG const            keyword = ETW_PROVIDER_KEYWORD_COUNTERS;
+    if (!ctx->IsEnabled)
+        return false;
+    if (ctx->MatchAnyKeyword != 0 && (ctx->MatchAnyKeyword & keyword) == 0)
+        return false;
+    return (ctx->MatchAllKeyword & keyword) == ctx->MatchAllKeyword;
+}
+
+/// @summary Write a RegionResidency_Event for each range registered with ETWCounterRegion().
+/// QueryWorkingSetEx() reports whether each page is in the working set of the process, 
+/// without faulting it in. Only ETW_PROVIDER_COUNTER_REGION_PAGES pages are checked per
+/// range, so the cost of a sample is bounded regardless of the size of the ranges.
+/// @param process The pseudo-handle of the current process.
+/// @param page_size The size of a page, in bytes.
+static void counters_sample_regions(HANDLE process, SIZE_T page_size)
+{
+    EnterCriticalSection(&ETW_COUNTER_LOCK);
+    for (DWORD i = 0; i < ETW_PROVIDER_MAX_COUNTER_REGIONS; ++i)
+    {
+        etw_counter_region_t *region = &ETW_COUNTER_REGIONS[i];
+        ULONGLONG             bytes  = 0;
+        DWORD                 count  = 0;
+        DWORD                 valid  = 0;
+        if (region->Address == 0)
+            continue;
+
+        ULONG_PTR const base   = region->Address - (region->Address % page_size);
+        SIZE_T    const pages  = (region->Address + region->Size - base + page_size - 1) / page_size;
+        SIZE_T    const stride = (pages + ETW_PROVIDER_COUNTER_REGION_PAGES - 1) / ETW_PROVIDER_COUNTER_REGION_PAGES;
+        for (SIZE_T p = region->Phase % stride; p < pages && count < ETW_PROVIDER_COUNTER_REGION_PAGES; p += stride)
+        {
+            ETW_COUNTER_PAGES[count++].VirtualAddress = (PVOID)(base + p * page_size);
+        }
+        region->Phase++;
+        if (count > 0 && K32QueryWorkingSetEx_Func(process, ETW_COUNTER_PAGES, count * sizeof(PSAPI_WORKING_SET_EX_INFORMATION)))
+        {
+            for (DWORD j = 0; j < count; ++j)
+            {
+                if (ETW_COUNTER_PAGES[j].VirtualAttributes.Valid)
+                    valid++;
+            }
+            bytes = ULONGLONG(double(valid) * double(pages) / double(count) * double(page_size));
+            if (bytes > region->Size) bytes = region->Size;
+        }
+        EventWriteRegionResidency_Event(region->Name, (ULONGLONG) region->Address, (ULONGLONG) region->Size, bytes, count);
+    }
+    LeaveCriticalSection(&ETW_COUNTER_LOCK);
+}
+
+/// @summary Write a ProcessCounters_Event with the current process counters, preceded by the
+/// residency of each registered range. Counters are cumulative since the process started, 
+/// so the analyzer derives rates from consecutive samples and no sample depends on another 
+/// having been delivered. The event also reports the time taken to collect the sample.
+/// @param process The pseudo-handle of the current process.
+/// @param page_size The size of a page, in bytes.
+static void counters_sample(HANDLE process, SIZE_T page_size)
+{
+    LONGLONG const             start  = timestamp();
+    PROCESS_MEMORY_COUNTERS_EX memory;
+    IO_COUNTERS                io;
+    FILETIME                   created, exited, kernel, user;
+    float                      cpu_ms = 0.0f;
+
+    ZeroMemory(&memory, sizeof(memory));
+    ZeroMemory(&io    , sizeof(io));
+    if (K32GetProcessMemoryInfo_Func != NULL)
+        K32GetProcessMemoryInfo_Func(process, (PPROCESS_MEMORY_COUNTERS) &memory, sizeof(memory));
+    if (K32QueryWorkingSetEx_Func != NULL)
+        counters_sample_regions(process, page_size);
+    GetProcessIoCounters(process, &io);
+    if (GetProcessTimes(process, &created, &exited, &kernel, &user))
+    {   // the times are in 100ns units.
+        ULONGLONG k = ((ULONGLONG) kernel.dwHighDateTime << 32) | kernel.dwLowDateTime;
+        ULONGLONG u = ((ULONGLONG) user.dwHighDateTime   << 32) | user.dwLowDateTime;
+        cpu_ms = float(double(k + u) / 10000.0);
+    }
+    EventWriteProcessCounters_Event((ULONGLONG) memory.WorkingSetSize, (ULONGLONG) memory.PrivateUsage, memory.PageFaultCount, 
+        io.ReadTransferCount, io.WriteTransferCount, io.ReadOperationCount, io.WriteOperationCount, cpu_ms, milliseconds(timestamp() - start));
+}
+
+/// @summary The entry point of the counter thread. A sample is taken as soon as the thread
+/// starts, so that each session begins with a baseline, and then once per interval.
+/// @param argp Unused.
+/// @return Zero.
+static DWORD WINAPI counters_main(LPVOID argp)
+{
+    HANDLE const process = GetCurrentProcess();
+    SYSTEM_INFO  sysinfo;
+    UNREFERENCED_PARAMETER(argp);
+    GetSystemInfo(&sysinfo);
+    do
+    {
+        counters_sample(process, sysinfo.dwPageSize);
+    } while (WaitForSingleObject(ETW_COUNTER_STOP, (DWORD) ETW_COUNTER_INTERVAL_MS) == WAIT_TIMEOUT);
+    return 0;
+}
+
+/// @summary Start the counter thread, if it is not already running. The system timer 
+/// resolution is raised while it runs, as for the sampler.
+static void counters_start(void)
+{
+    EnterCriticalSection(&ETW_SAMPLER_LOCK);
+    if (ETW_COUNTER_THREAD == NULL)
+    {
+        timer_period_load();
+        if ((ETW_COUNTER_STOP = CreateEventW(NULL, TRUE, FALSE, NULL)) == NULL)
+            goto error_cleanup;
+        if ((ETW_COUNTER_THREAD = CreateThread(NULL, 0, counters_main, NULL, CREATE_SUSPENDED, NULL)) == NULL)
+            goto error_cleanup;
+        if (timeBeginPeriod_Func != NULL && timeEndPeriod_Func != NULL)
+            timeBeginPeriod_Func(1);
+        SetThreadPriority(ETW_COUNTER_THREAD, THREAD_PRIORITY_ABOVE_NORMAL);
+        ResumeThread(ETW_COUNTER_THREAD);
+    }
+    LeaveCriticalSection(&ETW_SAMPLER_LOCK);
+    return;
+
+error_cleanup:
+    if (ETW_COUNTER_STOP != NULL) CloseHandle(ETW_COUNTER_STOP);
+    ETW_COUNTER_STOP = NULL;
+    LeaveCriticalSection(&ETW_SAMPLER_LOCK);
+}
+
+/// @summary Stop the counter thread and wait for it to exit, if it is running.
+static void counters_stop(void)
+{
+    EnterCriticalSection(&ETW_SAMPLER_LOCK);
+    if (ETW_COUNTER_THREAD != NULL)
+    {
+        SetEvent(ETW_COUNTER_STOP);
+        WaitForSingleObject(ETW_COUNTER_THREAD, INFINITE);
+        CloseHandle(ETW_COUNTER_THREAD);
+        CloseHandle(ETW_COUNTER_STOP);
+        ETW_COUNTER_THREAD = NULL;
+        ETW_COUNTER_STOP   = NULL;
+        if (timeBeginPeriod_Func != NULL && timeEndPeriod_Func != NULL)
+            timeEndPeriod_Func(1);
+    }
+    LeaveCriticalSection(&ETW_SAMPLER_LOCK);
+}
+
+/// @summary Compute the FNV-1a hash of a scope name, as stored in the statistics segment, 
+/// and its source. The result is never zero, which marks a free slot.
+/// @param name The scope name. Only the first ETW_STATS_MAX_NAME-1 characters are hashed.
+/// @param source Zero for the main thread provider, one for the task thread provider.
+/// @return The hash value.
+static LONG stats_hash(char const *name, LONG source)
+{
+    ULONG h = 2166136261UL ^ (ULONG) source;
+    for (size_t i = 0; i < ETW_STATS_MAX_NAME - 1 && name[i] != '\0'; ++i)
+    {
+        h ^= (UCHAR) name[i];
+        h *= 16777619UL;
+    }
+    return h != 0 ? (LONG) h : 1;
+}
+
+/// @summary Find or claim the slot for a scope in the statistics segment. Slots are claimed
+/// with a compare-exchange on the hash, so no lock is taken.
+/// @param header The statistics segment.
+/// @param name The scope name.
+/// @param source Zero for the main thread provider, one for the task thread provider.
+/// @return The slot, or NULL if the table is full or the slot is still being initialized.
+static etw_stats_scope_t* stats_find(etw_stats_header_t *header, char const *name, LONG source)
+{
+    etw_stats_scope_t *scopes = (etw_stats_scope_t*) (header + 1);
+    LONG const         hash   = stats_hash(name, source);
+    DWORD const        mask   = ETW_STATS_MAX_SCOPES - 1;
+    DWORD              index  = DWORD(hash) & mask;
+    for (DWORD i = 0; i < ETW_STATS_MAX_SCOPES; ++i, index = (index + 1) & mask)
+    {
+        etw_stats_scope_t *scope = &scopes[index];
+        LONG               slot  = scope->Hash;
+        if (slot == 0 && (slot = InterlockedCompareExchange(&scope->Hash, hash, 0)) == 0)
+        {   // this thread claimed the slot; publish the name before marking it ready.
+            strncpy_s(scope->Name, ETW_STATS_MAX_NAME, name, _TRUNCATE);
+            scope->Source = source;
+            InterlockedExchange(&scope->Ready, 1);
+            InterlockedIncrement(&header->ScopeCount);
+            return scope;
+        }
+        if (slot == hash)
+        {
+            if (!scope->Ready)
+                return NULL;   // another thread is initializing the slot.
+            if (scope->Source == source && strncmp(scope->Name, name, ETW_STATS_MAX_NAME - 1) == 0)
+                return scope;
+        }
+    }
+    return NULL;
+}
+
+/// @summary Add a completed scope instance to the current window of its statistics slot.
+/// Instances that race with a writer recycling the window are dropped rather than waiting.
+/// @param message The scope name.
+/// @param source Zero for the main thread provider, one for the task thread provider.
+/// @param nowtime The timestamp at which the scope was exited.
+/// @param elapsed The scope duration, in timestamp units.
+static void stats_record(char const *message, LONG source, LONGLONG nowtime, LONGLONG elapsed)
+{
+    etw_stats_header_t *header = ETW_STATS;
+    etw_stats_scope_t  *scope  = NULL;
+    etw_stats_window_t *window = NULL;
+    LONGLONG            us     = 0;
+    LONG                epoch  = 0;
+    LONG                seen   = 0;
+
+    if (!ETW_STATS_ENABLED || header == NULL || message == NULL)
+    {   // live statistics are not enabled or not available.
+        return;
+    }
+    if ((scope = stats_find(header, message, source)) == NULL)
+    {
+        InterlockedIncrement(&header->Overflow);
+        return;
+    }
+    epoch  = etw_stats_epoch(header, nowtime);
+    window = &scope->Windows[epoch % ETW_STATS_WINDOW_COUNT];
+    if ((seen = window->Epoch) != epoch)
+    {   // the first instance in a new window clears the counts left from an old one.
+        if (seen == ETW_STATS_EPOCH_RESET || seen > epoch || InterlockedCompareExchange(&window->Epoch, ETW_STATS_EPOCH_RESET, seen) != seen)
+            return;
+        window->Count   = 0;
+        window->TotalUs = 0;
+        ZeroMemory((void*) window->Histogram, sizeof(window->Histogram));
+        InterlockedExchange(&window->Epoch, epoch);
+    }
+    us = (elapsed * 1000000) / QPC_FREQUENCY.QuadPart;
+    InterlockedIncrement(&window->Count);
+    InterlockedExchangeAdd64(&window->TotalUs, us);
+    InterlockedIncrement(&window->Histogram[etw_stats_bucket(us)]);
+    InterlockedIncrement64(&scope->TotalCount);
+}
+
+/// @summary Create the shared-memory statistics segment for the calling process. Readers
+/// identify the segment by process ID; see ETW_STATS_MAPPING_FORMATW.
+static void stats_create(void)
+{
+    etw_stats_header_t *header = NULL;
+    DWORD const         size   = DWORD(sizeof(etw_stats_header_t) + ETW_STATS_MAX_SCOPES * sizeof(etw_stats_scope_t));
+    WCHAR               name[64];
+    char                path[MAX_PATH];
+    char const         *base   = path;
+
+    _snwprintf_s(name, 64, _TRUNCATE, ETW_STATS_MAPPING_FORMATW, GetCurrentProcessId());
+    if ((ETW_STATS_MAPPING = CreateFileMappingW(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, size, name)) == NULL)
+        return;
+    if (GetLastError() == ERROR_ALREADY_EXISTS)
+        goto error_cleanup;   // another copy of the provider owns the segment.
+    if ((header = (etw_stats_header_t*) MapViewOfFile(ETW_STATS_MAPPING, FILE_MAP_WRITE, 0, 0, size)) == NULL)
+        goto error_cleanup;
+
+    // the pages of a new mapping are zero-filled, so all slots start out free.
+    path[0] = '\0';
+    GetModuleFileNameA(NULL, path, MAX_PATH);
+    path[MAX_PATH-1] = '\0';
+    for (char const *s = path; *s != '\0'; ++s)
+    {
+        if (*s == '\\' || *s == '/') base = s + 1;
+    }
+    strncpy_s(header->ProcessName, ETW_STATS_MAX_PROCESS, base, _TRUNCATE);
+    header->Version       = ETW_STATS_VERSION;
+    header->ProcessId     = GetCurrentProcessId();
+    header->ScopeCapacity = ETW_STATS_MAX_SCOPES;
+    header->WindowCount   = ETW_STATS_WINDOW_COUNT;
+    header->WindowMs      = ETW_STATS_WINDOW_MS;
+    header->BucketCount   = ETW_STATS_BUCKET_COUNT;
+    header->StartQpc      = timestamp();
+    header->QpcFrequency  = QPC_FREQUENCY.QuadPart;
+    // readers check the magic value, so write it last.
+    MemoryBarrier();
+    header->Magic         = ETW_STATS_MAGIC;
+    ETW_STATS             = header;
+    return;
+
+error_cleanup:
+    CloseHandle(ETW_STATS_MAPPING);
+    ETW_STATS_MAPPING = NULL;
+}
+
+/// @summary Unmap and close the shared-memory statistics segment, if it was created.
+static void stats_delete(void)
+{
+    etw_stats_header_t *header = ETW_STATS;
+    ETW_STATS = NULL;
+    if (header != NULL)
+    {
+        UnmapViewOfFile(header);
+    }
+    if (ETW_STATS_MAPPING != NULL)
+    {
+        CloseHandle(ETW_STATS_MAPPING);
+        ETW_STATS_MAPPING = NULL;
+    }
+}
+
+/// @summary Write a FileSummary_Event for each type of file I/O operation the calling thread
+/// summed during its last window, and reset the sums.
+/// @param thread The state associated with the calling thread.
+static void fileio_flush(etw_thread_t *thread)
+{
+    for (DWORD i = 0; i < ETW_PROVIDER_FILEIO_OPS; ++i)
+    {
+        etw_fileio_summary_t *sum = &thread->IoSummary[i];
+        if (sum->Count > 0)
+        {
+            EventWriteFileSummary_Event(i, sum->Count, sum->Bytes, sum->TotalMs, sum->MaxMs);
+            ZeroMemory(sum, sizeof(etw_fileio_summary_t));
+        }
+    }
+    thread->IoPending = 0;
+}
+
+/// @summary Determine whether a file I/O operation should be written as its own event, or
+/// summed because the calling thread has already written its budget for the current window.
+/// Starting a new window writes the sums from the previous one. Operations refused by the 
+/// overhead governor are summed in the same way.
+/// @param thread The state associated with the calling thread.
+/// @param op One of ETW_PROVIDER_FILEIO_READ, _MAP_VIEW, _UNMAP_VIEW or _PREFETCH.
+/// @param bytes The number of bytes read, mapped or prefetched.
+/// @param elapsed The latency of the operation, in milliseconds.
+/// @return true if the caller should write the event.
+static bool fileio_admit(etw_thread_t *thread, DWORD op, ULONGLONG bytes, float elapsed)
+{
+    LONGLONG const nowtime = timestamp();
+    LONGLONG const window  = (QPC_FREQUENCY.QuadPart * ETW_PROVIDER_FILEIO_WINDOW_MS) / 1000;
+    bool           admit   = true;
+    if (nowtime - thread->IoWindow >= window)
+    {
+        if (thread->IoPending > 0)
+            fileio_flush(thread);
+        thread->IoWindow = nowtime;
+        thread->IoEvents = 0;
+    }
+    if (ETW_GOVERNOR_BUDGET != 0 && !governor_admit(thread, provider_index(ETW_FILE_IOHandle), true))
+    {   // the overhead governor is thinning out file I/O events; sum the operation instead.
+        admit = false;
+    }
+    if (admit && thread->IoEvents < ETW_PROVIDER_FILEIO_MAX_EVENTS)
+    {
+        thread->IoEvents++;
+        return true;
+    }
+    etw_fileio_summary_t *sum = &thread->IoSummary[op];
+    sum->Count++;
+    sum->Bytes   += bytes;
+    sum->TotalMs += elapsed;
+    if (elapsed > sum->MaxMs) sum->MaxMs = elapsed;
+    thread->IoPending++;
+    return false;
+}
+
+/// @summary Find the policy set for a main scope name with ETWScopeThreshold() or ETWScopeSampling().
+/// @param message The name passed to ETWEnterScopeMain().
+/// @return The index of the entry in ETW_SCOPE_POLICIES, or -1 if the name has none.
+static inline LONG scope_policy_find(char const *message)
+{
+    LONG const count = ETW_SCOPE_POLICY_COUNT;
+    if (count == 0 || message == NULL)
+        return -1;
+    _ReadWriteBarrier();
+    for (LONG i = 0; i < count; ++i)
+    {
+        if (strncmp(ETW_SCOPE_POLICIES[i].Name, message, ETW_PROVIDER_SCOPE_NAME_SIZE - 1) == 0)
+            return i;
+    }
+    return -1;
+}
+
+/// @summary Compute the minimum duration of a main scope: the threshold set for its name with
+/// ETWScopeThreshold() if any, or else the threshold set for all scopes.
+/// @param policy The index returned by scope_policy_find().
+/// @return The minimum duration, in QueryPerformanceCounter ticks, or zero to report the 
+/// scope whatever its duration.
+static inline LONGLONG scope_min_time(LONG policy)
+{
+    LONG us = ETW_SCOPE_MIN_US;
+    if (policy >= 0 && ETW_SCOPE_POLICIES[policy].MinUs >= 0)
+        us = ETW_SCOPE_POLICIES[policy].MinUs;
+    return us != 0 ? (QPC_FREQUENCY.QuadPart * us) / 1000000 : 0;
+}
+
+/// @summary Decide whether a main scope instance is sampled, with probability one in the rate
+/// set for its name with ETWScopeSampling(). The decision is drawn from a per-thread xorshift
+/// generator, so it is independent of the scope's duration and of the other instances, and 
+/// an instance that is not sampled costs only a counter increment.
+/// @param thread The state associated with the calling thread.
+/// @param policy The index returned by scope_policy_find().
+/// @return true if the instance should be reported, or false if it was counted in SkipCount.
+static inline bool scope_sampled(etw_thread_t *thread, LONG policy)
+{
+    DWORD const one_in = (DWORD) ETW_SCOPE_POLICIES[policy].OneIn;
+    DWORD       x      = thread->SampleSeed;
+    if (one_in <= 1)
+        return true;
+    if (x == 0)
+        x = (thread->ThreadId ^ (DWORD) timestamp()) | 1;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    thread->SampleSeed = x;
+    if ((((ULONGLONG) x * one_in) >> 32) == 0)
+        return true;
+    thread->SkipCount[policy]++;
+    thread->SkipPending = TRUE;
+    return false;
+}
+
+/// @summary Update the policy for a main scope name, appending an entry if it has none.
+/// @param name The scope name. Names are compared on their first 63 characters.
+/// @param min_us The minimum duration, in microseconds, or -1 to leave it unchanged.
+/// @param one_in The sampling rate, or -1 to leave it unchanged.
+/// @return TRUE if the policy was set, or FALSE if the table is full.
+static BOOL scope_policy_set(char const *name, LONG min_us, LONG one_in)
+{
+    etw_scope_policy_t *entry = NULL;
+    if (ETW_THREAD_STATE == TLS_OUT_OF_INDEXES)
+        return FALSE;
+    EnterCriticalSection(&ETW_THREAD_LOCK);
+    for (LONG i = 0; i < ETW_SCOPE_POLICY_COUNT && entry == NULL; ++i)
+    {
+        if (strncmp(ETW_SCOPE_POLICIES[i].Name, name, ETW_PROVIDER_SCOPE_NAME_SIZE - 1) == 0)
+            entry = &ETW_SCOPE_POLICIES[i];
+    }
+    if (entry != NULL)
+    {
+        if (min_us >= 0) InterlockedExchange(&entry->MinUs, min_us);
+        if (one_in >= 0) InterlockedExchange(&entry->OneIn, one_in);
+    }
+    else if (ETW_SCOPE_POLICY_COUNT < ETW_PROVIDER_MAX_SCOPE_POLICIES)
+    {
+        entry = &ETW_SCOPE_POLICIES[ETW_SCOPE_POLICY_COUNT];
+        lstrcpynA(entry->Name, name, ETW_PROVIDER_SCOPE_NAME_SIZE);
+        entry->MinUs = min_us;
+        entry->OneIn = one_in > 0 ? one_in : 0;
+        _ReadWriteBarrier();
+        ETW_SCOPE_POLICY_COUNT++;
+    }
+    LeaveCriticalSection(&ETW_THREAD_LOCK);
+    return entry != NULL ? TRUE : FALSE;
+}
+
+/// @summary Write the held enter events of the calling thread's open main scopes, outermost
+/// first, so that an event reported from within them nests correctly. Each event carries the
+/// time since the scope was entered, which the analyzer subtracts from the event timestamp.
+/// @param thread The state associated with the calling thread.
+/// @param count The number of open main scopes, from the outermost, that must be written.
+/// @param nowtime The current timestamp.
+static void scope_commit(etw_thread_t *thread, DWORD count, LONGLONG nowtime)
+{
+    for (DWORD i = thread->Committed; i < count && i < ETW_PROVIDER_MAX_SCOPE_DEPTH; ++i)
+    {   // scopes deeper than ETW_PROVIDER_MAX_SCOPE_DEPTH are never held.
+        EventWriteMainEnterScopeLate_Event(thread->Main.Names[i], i + 1, milliseconds(nowtime - thread->HeldEnter[i]));
+    }
+    if (count > thread->Committed)
+        thread->Committed = count;
+}
+
+/// @summary Write the held enter events of all of the calling thread's open main scopes, 
+/// before a marker or flow event is reported from within them.
+/// @param thread The state associated with the calling thread.
+static inline void scope_commit_open(etw_thread_t *thread)
+{
+    if (thread->Committed < thread->Main.Depth)
+        scope_commit(thread, thread->Main.Depth, timestamp());
+}
+
+/// @summary Write a MainScopeSummary_Event for each name the calling thread has elided scopes
+/// of since its last summary, and a MainScopeSampled_Event for each name it has skipped 
+/// scopes of, and reset the sums.
+/// @param thread The state associated with the calling thread.
+/// @param nowtime The current timestamp.
+static void scope_summary_flush(etw_thread_t *thread, LONGLONG nowtime)
+{
+    for (DWORD i = 0; i < thread->ScopeSummaryCount; ++i)
+    {
+        etw_scope_summary_t *sum = &thread->ScopeSummary[i];
+        EventWriteMainScopeSummary_Event(sum->Name, sum->Count, milliseconds(sum->Total), milliseconds(sum->Max));
+    }
+    if (thread->SkipPending)
+    {
+        LONG const count = ETW_SCOPE_POLICY_COUNT;
+        for (LONG i = 0; i < count; ++i)
+        {
+            if (thread->SkipCount[i] > 0)
+            {
+                EventWriteMainScopeSampled_Event(ETW_SCOPE_POLICIES[i].Name, thread->SkipCount[i], (ULONG) ETW_SCOPE_POLICIES[i].OneIn);
+                thread->SkipCount[i] = 0;
+            }
+        }
+        thread->SkipPending = FALSE;
+    }
+    thread->ScopeSummaryCount = 0;
+    thread->ScopeWindow = nowtime;
+}
+
+/// @summary Determine whether ETW_PROVIDER_SCOPE_SUMMARY_MS has elapsed since the calling 
+/// thread last wrote its scope summaries.
+/// @param thread The state associated with the calling thread.
+/// @param nowtime The current timestamp.
+/// @return true if the summaries should be written.
+static inline bool scope_summary_due(etw_thread_t *thread, LONGLONG nowtime)
+{
+    return (nowtime - thread->ScopeWindow) >= (QPC_FREQUENCY.QuadPart * ETW_PROVIDER_SCOPE_SUMMARY_MS) / 1000;
+}
+
+/// @summary Sum a main scope that was too short to report into the summary for its name. 
+/// The summaries are written once ETW_PROVIDER_SCOPE_SUMMARY_MS has elapsed since the last
+/// ones, or early if the thread runs out of slots.
+/// @param thread The state associated with the calling thread.
+/// @param message The name passed to ETWEnterScopeMain().
+/// @param nowtime The current timestamp.
+/// @param elapsed The duration of the scope, in QueryPerformanceCounter ticks.
+static void scope_elide(etw_thread_t *thread, char const *message, LONGLONG nowtime, LONGLONG elapsed)
+{
+    etw_scope_summary_t *sum = NULL;
+    for (DWORD i = 0; i < thread->ScopeSummaryCount; ++i)
+    {
+        if (strncmp(thread->ScopeSummary[i].Name, message, ETW_PROVIDER_SCOPE_NAME_SIZE - 1) == 0)
+        {
+            sum = &thread->ScopeSummary[i];
+            break;
+        }
+    }
+    if (sum == NULL)
+    {
+        if (thread->ScopeSummaryCount == ETW_PROVIDER_SCOPE_SUMMARY_SLOTS)
+            scope_summary_flush(thread, nowtime);
+        sum = &thread->ScopeSummary[thread->ScopeSummaryCount++];
+        lstrcpynA(sum->Name, message, ETW_PROVIDER_SCOPE_NAME_SIZE);
+        sum->Count = 0;
+        sum->Total = 0;
+        sum->Max   = 0;
+    }
+    sum->Count++;
+    sum->Total += elapsed;
+    if (elapsed > sum->Max) sum->Max = elapsed;
+    if (scope_summary_due(thread, nowtime))
+        scope_summary_flush(thread, nowtime);
+}
+
+/// @summary Determine whether a session has enabled the Functions keyword on the main thread
+/// provider, using the same keyword matching rules as the generated EventEnabled checks.
+/// @return true if calls to instrumented functions should be reported.
+static inline bool functions_enabled(void)
+{
+    MCGEN_TRACE_CONTEXT const *ctx     = &ETW_MAIN_THREAD_Context;
+    ULONGLONG const            keyword = ETW_PROVIDER_KEYWORD_FUNCTIONS;
+    if (!ctx->IsEnabled)
+        return false;
+    if (ctx->MatchAnyKeyword != 0 && (ctx->MatchAnyKeyword & keyword) == 0)
+        return false;
+    return (ctx->MatchAllKeyword & keyword) == ctx->MatchAllKeyword;
+}
+
+/// @summary Determine whether a module file name contains any of the entries in a filter.
+/// @param name The file name of the module, without the directory.
+/// @param list A ';'-separated list of substrings, compared without regard to case.
+/// @return true if any entry is found in the name.
+static bool function_filter_match(char const *name, char const *list)
+{
+    while (*list != '\0')
+    {
+        char const *end = list;
+        while (*end != '\0' && *end != ';') ++end;
+        for (char const *s = name; end > list && *s != '\0'; ++s)
+        {
+            char const *a = s;
+            char const *b = list;
+            while (b < end && *a != '\0' && (*a | 0x20) == (*b | 0x20))
+            {   // ASCII case folding is enough for module names.
+                ++a; ++b;
+            }
+            if (b == end)
+                return true;
+        }
+        list = *end == ';' ? end + 1 : end;
+    }
+    return false;
+}
 
-#include "ETWProviderGenerated.h"
+/// @summary Apply the filters set with ETWFunctionFilter() to a module. A module is allowed
+/// if the include list is empty or matches its file name, and the exclude list does not.
+/// The caller must hold ETW_THREAD_LOCK.
+/// @param path The path of the module file.
+/// @return TRUE if calls to functions in the module may be reported.
+static BOOL function_module_allowed(char const *path)
+{
+    char const *name = path;
+    for (char const *s = path; *s != '\0'; ++s)
+    {
+        if (*s == '\\' || *s == '/') name = s + 1;
+    }
+    if (ETW_FUNCTION_INCLUDE[0] != '\0' && !function_filter_match(name, ETW_FUNCTION_INCLUDE))
+        return FALSE;
+    if (ETW_FUNCTION_EXCLUDE[0] != '\0' &&  function_filter_match(name, ETW_FUNCTION_EXCLUDE))
+        return FALSE;
+    return TRUE;
+}
 
-/*///////////////
-//   Globals   //
-///////////////*/
-/// @summary Typedefs for use with GetProcAddress. We will load Advapi32.dll dynamically 
-/// and try to resolve these functions manually. These functions are not available
-/// on Windows XP, and on that platform they fall-back to no-ops.
-typedef ULONG (__stdcall *EventRegisterFn)(LPCGUID, PENABLECALLBACK, PVOID, PREGHANDLE);
-typedef ULONG (__stdcall *EventWriteFn)(REGHANDLE, PCEVENT_DESCRIPTOR, ULONG, PEVENT_DATA_DESCRIPTOR);
-typedef ULONG (__stdcall *EventUnregisterFn)(REGHANDLE);
+/// @summary Find the module containing an instrumented function, adding it to the module
+/// table the first time one of its functions is entered. The loader is queried before 
+/// ETW_THREAD_LOCK is acquired, since a thread holding the loader lock may be waiting for
+/// ETW_THREAD_LOCK in ETWThreadDetach(). Addresses the loader cannot find are remembered in
+/// ETW_FUNCTION_UNKNOWN and not queried again.
+/// @param address The address of the function.
+/// @return The module entry, or NULL if the address is not in a module or the table is full.
+static etw_function_module_t* function_module(ULONG_PTR address)
+{
+    etw_function_module_t *entry  = NULL;
+    HMODULE                module = NULL;
+    IMAGE_DOS_HEADER const *dos   = NULL;
+    IMAGE_NT_HEADERS const *nt    = NULL;
+    char                   path[MAX_PATH];
+    LONG                   count  = ETW_FUNCTION_MODULE_COUNT;
+    DWORD const            slot   = (DWORD) (address >> 4) & (ETW_PROVIDER_FUNCTION_UNKNOWN_SIZE - 1);
+    _ReadWriteBarrier();
+    for (LONG i = 0; i < count; ++i)
+    {
+        entry = &ETW_FUNCTION_MODULES[i];
+        if (address - entry->Base < entry->Size)
+            return entry;
+    }
+    if (count >= ETW_PROVIDER_MAX_FUNCTION_MODULES || ETW_FUNCTION_UNKNOWN[slot] == address)
+        return NULL;
+    if (!GetModuleHandleExA(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS | GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT, (LPCSTR) address, &module))
+    {   // the address is not in a module, so it will never be reported.
+        ETW_FUNCTION_UNKNOWN[slot] = address;
+        return NULL;
+    }
+    if (GetModuleFileNameA(module, path, MAX_PATH) == 0)
+        path[0] = '\0';
+    path[MAX_PATH-1] = '\0';
+    dos = (IMAGE_DOS_HEADER const*) module;
+    nt  = (IMAGE_NT_HEADERS const*)((BYTE const*) module + dos->e_lfanew);
 
-/// @summary Several of the API functions rely on QueryPerformanceCounter. Store the result
-/// of calling QueryPerformanceFrequency here.
-static LARGE_INTEGER      QPC_FREQUENCY        = { 0 };
+    EnterCriticalSection(&ETW_THREAD_LOCK);
+    entry = NULL;
+    for (LONG i = 0; i < ETW_FUNCTION_MODULE_COUNT; ++i)
+    {   // another thread may have added the module while the lock was not held.
+        if (ETW_FUNCTION_MODULES[i].Base == (ULONG_PTR) module)
+            entry = &ETW_FUNCTION_MODULES[i];
+    }
+    if (entry == NULL && ETW_FUNCTION_MODULE_COUNT < ETW_PROVIDER_MAX_FUNCTION_MODULES)
+    {
+        entry = &ETW_FUNCTION_MODULES[ETW_FUNCTION_MODULE_COUNT];
+        entry->Base       = (ULONG_PTR) module;
+        entry->Size       = nt->OptionalHeader.SizeOfImage;
+        entry->Allowed    = function_module_allowed(path);
+        entry->Generation = 0;
+        CopyMemory(entry->Path, path, sizeof(path));
+        _ReadWriteBarrier();
+        ETW_FUNCTION_MODULE_COUNT++;
+    }
+    LeaveCriticalSection(&ETW_THREAD_LOCK);
+    return entry;
+}
 
-/// @summary The value returned by TlsAlloc() used to identify the per-thread slot for tracking
-/// the depth of ETWScopeEnterX() and ETWScopeExitX() pairs. This value is initialized 
-/// when ETWRegisterCustomProviders() is called.
-static DWORD              ETW_SCOPE_DEPTH_MAIN = TLS_OUT_OF_INDEXES;
-static DWORD              ETW_SCOPE_DEPTH_TASK = TLS_OUT_OF_INDEXES;
+/// @summary Compute the minimum duration of a reported call: the value set with 
+/// ETWFunctionFilter() if any, or else the larger of ETW_PROVIDER_FUNCTION_MIN_US and
+/// ETW_PROVIDER_FUNCTION_MIN_COST times the measured cost of a scope.
+/// @return The minimum duration, in QueryPerformanceCounter ticks.
+static inline LONGLONG function_min_time(void)
+{
+    LONG const     us   = ETW_FUNCTION_MIN_US;
+    LONGLONG const cost = ETW_OVERHEAD_PAIR * ETW_PROVIDER_FUNCTION_MIN_COST;
+    LONGLONG const time = (QPC_FREQUENCY.QuadPart * (us > 0 ? us : ETW_PROVIDER_FUNCTION_MIN_US)) / 1000000;
+    return (us > 0 || time >= cost) ? time : cost;
+}
 
-/// @summary The following functions are resolved at runtime by dynamically loading 
-/// Advapi32.dll. If running on Windows XP, they will be NULL as custom event
-/// tracing is not available.
-static EventWriteFn       EventWrite_Func      = NULL;
-static EventRegisterFn    EventRegister_Func   = NULL;
-static EventUnregisterFn  EventUnregister_Func = NULL;
+/// @summary Write FunctionEnter_Event for every allowed call in progress on the calling thread
+/// that has not been reported yet, outermost first, and push each onto the main scope stack.
+/// Called before anything is reported from within those calls, so that the trace nests 
+/// correctly; held main scopes enclosing the calls are written first for the same reason.
+/// Each event carries the time since the call was entered, which the analyzer subtracts
+/// from the event timestamp. Module_Event is written for the containing module once per
+/// session.
+/// @param thread The state associated with the calling thread.
+/// @param nowtime The current timestamp.
+static void function_flush(etw_thread_t *thread, LONGLONG nowtime)
+{
+    etw_function_stack_t *stack = thread->Functions;
+    DWORD const           count = stack->Count < ETW_PROVIDER_MAX_FUNCTION_DEPTH ? stack->Count : ETW_PROVIDER_MAX_FUNCTION_DEPTH;
+    for (DWORD i = 0; i < count && stack->Pending > 0; ++i)
+    {
+        etw_function_frame_t  *frame  = &stack->Frames[i];
+        etw_function_module_t *module = frame->Module;
+        ULONGLONG              addr   = (ULONGLONG) frame->Address;
+        if (!frame->Allowed || frame->Emitted)
+            continue;
+        if (module->Generation != ETW_ENABLE_GENERATION)
+        {   // a session has been started since the module was last described.
+            module->Generation  = ETW_ENABLE_GENERATION;
+            EventWriteModule_Event((ULONGLONG) module->Base, module->Size, module->Path);
+        }
+        frame->Name[0] = '0';
+        frame->Name[1] = 'x';
+        for (int j = 0; j < 16; ++j)
+        {   // the sampler may not call the CRT, so the name is formatted here.
+            frame->Name[2+j] = "0123456789ABCDEF"[(addr >> (60 - 4 * j)) & 0xF];
+        }
+        frame->Name[18] = '\0';
+        frame->Emitted  = TRUE;
+        stack->Pending--;
+        scope_commit(thread, thread->Main.Depth, nowtime);
+        DWORD depth = scope_names_push(&thread->Main, frame->Name);
+        thread->Committed = depth;
+        EventWriteFunctionEnter_Event(addr, depth, milliseconds(nowtime - frame->EnterTime));
+    }
+}
 
-/*///////////////////////
-//   Local Functions   //
-///////////////////////*/
-/// @summary Wrapper function to call the underlying EventWrite() from Advapi32.dll, 
-/// if that function is available at runtime. The function is available only
-/// on Vista and later systems. If the function is not available, just return 
-/// a success status and do nothing.
-/// @param reghandle Registration handle of the provider. The handle comes from EventRegister.
-/// @param evdesc Metadata that identifies the event to write. For details, see EVENT_DESCRIPTOR.
-/// @param count Number of EVENT_DATA_DESCRIPTOR structures in UserData. The maximum number is 128.
-/// @param evdata The event data to write. Allocate a block of memory that contains one or more EVENT_DATA_DESCRIPTOR structures. Set this parameter to NULL if UserDataCount is zero. The data must be in the order specified in the manifest.
-/// @return ERROR_SUCCESS if the operation was successful.
-static ULONG EVNTAPI EventWrite(REGHANDLE reghandle, PCEVENT_DESCRIPTOR evdesc, ULONG count, PEVENT_DATA_DESCRIPTOR evdata)
+/// @summary Remove the innermost call in progress on the calling thread. A call that was 
+/// reported writes FunctionLeave_Event; an allowed call that ran longer than the minimum
+/// duration is reported first, along with its callers. Any other call is counted in the 
+/// Elided value of its caller.
+/// @param thread The state associated with the calling thread.
+/// @param nowtime The current timestamp, or zero if it has not been read yet. The timestamp 
+/// is only read when the call may be reported, and is stored here for the next call popped.
+static void function_pop(etw_thread_t *thread, LONGLONG *nowtime)
 {
-    if (EventWrite_Func != NULL)
-    {   // This function exists in Advapi32.dll. Running on Vista+.
-        return EventWrite_Func(reghandle, evdesc, count, evdata);
+    etw_function_stack_t *stack = thread->Functions;
+    etw_function_frame_t *frame = NULL;
+    if (stack->Count > ETW_PROVIDER_MAX_FUNCTION_DEPTH)
+    {   // the call was never tracked.
+        stack->Count--;
+        return;
     }
-    else return ERROR_SUCCESS;
+    frame = &stack->Frames[stack->Count-1];
+    if (*nowtime == 0 && (frame->Emitted || (frame->Allowed && functions_enabled())))
+    {   // calls entered while the Functions keyword was disabled never need the time.
+        *nowtime = timestamp();
+    }
+    if (frame->Allowed && !frame->Emitted && functions_enabled() && *nowtime - frame->EnterTime >= function_min_time())
+    {
+        function_flush(thread, *nowtime);
+    }
+    if (frame->Emitted)
+    {
+        DWORD depth = --thread->Main.Depth;
+        thread->Committed = depth;
+        EventWriteFunctionLeave_Event((ULONGLONG) frame->Address, milliseconds(*nowtime - frame->EnterTime), depth, frame->Elided);
+    }
+    else
+    {
+        if (frame->Allowed)
+            stack->Pending--;
+        if (stack->Count > 1)
+            stack->Frames[stack->Count-2].Elided += (frame->Allowed ? 1 : 0) + frame->Elided;
+    }
+    stack->Count--;
 }
 
-/// @summary Wrapper function to call the underlying EventRegister() from Advapi32.dll, 
-/// if that function is available at runtime. The function is available only
-/// on Vista and later systems. If the function is not available, just return 
-/// a success status and do nothing.
-/// @param provider The GUID that uniquely identifies the provider.
-/// @param enablecb Callback that ETW calls to notify you when a session enables or disables your provider. Can be NULL.
-/// @param ctx Provider-defined context data to pass to the callback when the provider is enabled or disabled. Can be NULL.
-/// @param reghandle Registration handle. The handle is used by most provider function calls. Before your provider exits, you must pass this handle to EventUnregister to free the handle.
-/// @return ERROR_SUCCESS if the operation was successful.
-static ULONG EVNTAPI EventRegister(LPCGUID provider, PENABLECALLBACK enablecb, PVOID ctx, PREGHANDLE reghandle)
+/// @summary Determine whether a thread ID was passed to ETWThreadID() explicitly.
+/// The caller must hold ETW_THREAD_LOCK.
+/// @param thread_id The operating system identifier of the thread.
+/// @return true if the thread has been named by the application.
+static bool etw_thread_named_explicitly(DWORD thread_id)
 {
-    if (EventRegister_Func != NULL)
-    {   // This function exists in Advapi32.dll. Running on Vista+.
-        return EventRegister_Func(provider, enablecb, ctx, reghandle);
+    DWORD count = ETW_NAMED_COUNT < ETW_PROVIDER_MAX_NAMED_THREADS ? ETW_NAMED_COUNT : ETW_PROVIDER_MAX_NAMED_THREADS;
+    for (DWORD i = 0; i < count; ++i)
+    {
+        if (ETW_NAMED_THREADS[i] == thread_id)
+            return true;
     }
-    else return 0;
+    return false;
 }
 
-/// @summary Wrapper function to call the underlying EventUnregister() from Advapi32.dll, 
-/// if that function is available at runtime. The function is available only
-/// on Vista and later systems. If the function is not available, just return 
-/// a success status and do nothing.
-/// @param reghandle Registration handle returned by EventRegister().
-/// @return ERROR_SUCCESS if the operation was successful.
-static ULONG EVNTAPI EventUnregister(REGHANDLE reghandle)
+/// @summary Emit the ThreadID_Event for the calling thread, using the description set with
+/// SetThreadDescription() if one is available, or a name derived from the thread ID otherwise.
+/// Threads named explicitly with ETWThreadID() are not renamed.
+/// @param thread The state associated with the calling thread.
+static void etw_thread_emit_name(etw_thread_t *thread)
 {
-    if (EventUnregister_Func != NULL)
-    {   // This function exists in Advapi32.dll. Running on Vista+.
-        return EventUnregister_Func(reghandle);
+    char  name[ETW_PROVIDER_THREAD_NAME_SIZE];
+    PWSTR desc  = NULL;
+
+    thread->NameGen = ETW_ENABLE_GENERATION;
+    if (thread->Explicit)
+    {   // the application named this thread; ETWThreadID() owns the name.
+        return;
     }
-    else return 0;
+    name[0] = '\0';
+    if (GetThreadDescription_Func != NULL && SUCCEEDED(GetThreadDescription_Func(GetCurrentThread(), &desc)))
+    {   // convert the UTF-16 description; an empty description falls through.
+        if (desc[0] != L'\0')
+        {
+            WideCharToMultiByte(CP_ACP, 0, desc, -1, name, ETW_PROVIDER_THREAD_NAME_SIZE, NULL, NULL);
+            name[ETW_PROVIDER_THREAD_NAME_SIZE-1] = '\0';
+        }
+        LocalFree(desc);
+    }
+    if (name[0] == '\0')
+    {   // no description is available, so generate one.
+        _snprintf_s(name, ETW_PROVIDER_THREAD_NAME_SIZE, _TRUNCATE, "Thread %u", thread->ThreadId);
+    }
+    EventWriteThreadID_Event(name, thread->ThreadId);
 }
 
-/// @summary Get a raw timestamp value from the system.
-/// @return a timestamp value in unspecified units.
-static inline LONGLONG timestamp(void)
+/// @summary Allocate and initialize the state for the calling thread, and link it into 
+/// the global thread list. This happens once per thread, on the first event it emits.
+/// @return The thread state, or &ETW_THREAD_FALLBACK if the state cannot be allocated.
+static etw_thread_t* etw_thread_create(void)
 {
-    LARGE_INTEGER qpc = { 0 };
-    QueryPerformanceCounter(&qpc);
-    return qpc.QuadPart;
+    etw_thread_t *thread = NULL;
+    if (ETW_THREAD_STATE == TLS_OUT_OF_INDEXES)
+    {   // the providers have not been registered.
+        return &ETW_THREAD_FALLBACK;
+    }
+    if ((thread = (etw_thread_t*) HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(etw_thread_t))) == NULL)
+    {   // out of memory; events will still be emitted, but depth is shared.
+        return &ETW_THREAD_FALLBACK;
+    }
+    thread->ThreadId = GetCurrentThreadId();
+    thread->NameGen  = 0;
+    EnterCriticalSection(&ETW_THREAD_LOCK);
+    thread->Explicit = etw_thread_named_explicitly(thread->ThreadId) ? TRUE : FALSE;
+    thread->Next     = ETW_THREAD_LIST;
+    thread->Prev     = NULL;
+    if (ETW_THREAD_LIST != NULL) ETW_THREAD_LIST->Prev = thread;
+    ETW_THREAD_LIST  = thread;
+    LeaveCriticalSection(&ETW_THREAD_LOCK);
+    TlsSetValue(ETW_THREAD_STATE, thread);
+    return thread;
 }
 
-/// @summary Convert a timestamp value, or timestamp delta, to milliseconds.
-/// @param raw The raw timestamp value.
-/// @return the timestamp value or duration in milliseconds.
-static inline float milliseconds(LONGLONG raw)
+/// @summary Retrieve the state for the calling thread, allocating it if necessary, and emit
+/// the thread metadata if no enabled session has seen it yet.
+/// @return The state associated with the calling thread. This value is never NULL.
+static inline etw_thread_t* etw_thread_state(void)
 {
-    LONGLONG frequency = QPC_FREQUENCY.QuadPart;
-    return float(double(raw) / double(frequency)) * 1000.0f;
+    etw_thread_t *thread = (etw_thread_t*) TlsGetValue(ETW_THREAD_STATE);
+    if (thread == NULL)
+    {   // this is the first event emitted by the calling thread.
+        thread = etw_thread_create();
+    }
+    if (thread->NameGen != ETW_ENABLE_GENERATION && thread != &ETW_THREAD_FALLBACK)
+    {   // a session has been started since the thread name was last emitted.
+        etw_thread_emit_name(thread);
+    }
+    return thread;
+}
+
+/// @summary Unlink and free a thread state. 
+/// @param thread The thread state to free. 
+static void etw_thread_delete(etw_thread_t *thread)
+{
+    EnterCriticalSection(&ETW_THREAD_LOCK);
+    if (thread->Prev != NULL) thread->Prev->Next = thread->Next;
+    else ETW_THREAD_LIST = thread->Next;
+    if (thread->Next != NULL) thread->Next->Prev = thread->Prev;
+    LeaveCriticalSection(&ETW_THREAD_LOCK);
+    while (thread->Sampling != 0)
+    {   // the sampler copied the list before the state was unlinked; a sample is brief.
+        SwitchToThread();
+    }
+    if (thread->LostQueued) InterlockedDecrement(&ETW_LOST_PENDING);
+    if (thread->GovBatch != 0) governor_flush(thread);
+    if (thread->Handle != NULL) CloseHandle(thread->Handle);
+    if (thread->Functions != NULL) HeapFree(GetProcessHeap(), 0, thread->Functions);
+    HeapFree(GetProcessHeap(), 0, thread);
+}
+
+/// @summary Receives enable, disable and capture state notifications for all of the
+/// custom providers. Called by the generated McGenControlCallbackV2.
+/// @param source_id The GUID of the session controller.
+/// @param control_code One of EVENT_CONTROL_CODE_DISABLE_PROVIDER, EVENT_CONTROL_CODE_ENABLE_PROVIDER or EVENT_CONTROL_CODE_CAPTURE_STATE.
+/// @param level The level enabled by the session.
+/// @param match_any The keyword mask; events matching any bit are written.
+/// @param match_all The keyword mask; events must match all bits to be written.
+/// @param filter Optional session-supplied filter data.
+/// @param context The generated provider context (ETW_MAIN_THREAD_Context, etc.)
+static void ETWProviderControl(LPCGUID source_id, ULONG control_code, UCHAR level, ULONGLONG match_any, ULONGLONG match_all, PEVENT_FILTER_DESCRIPTOR filter, PVOID context)
+{
+    UNREFERENCED_PARAMETER(source_id);
+    UNREFERENCED_PARAMETER(level);
+    UNREFERENCED_PARAMETER(match_any);
+    UNREFERENCED_PARAMETER(match_all);
+    UNREFERENCED_PARAMETER(filter);
+    if (control_code == EVENT_CONTROL_CODE_ENABLE_PROVIDER || control_code == EVENT_CONTROL_CODE_CAPTURE_STATE)
+    {   // make each thread re-emit its name on the next event it writes.
+        InterlockedIncrement(&ETW_ENABLE_GENERATION);
+        calibrate_cycles();
+    }
+    if (control_code == EVENT_CONTROL_CODE_ENABLE_PROVIDER)
+    {   // start the new session with full detail.
+        governor_reset();
+    }
+    if (context == &ETW_MAIN_THREAD_Context && ETW_THREAD_STATE != TLS_OUT_OF_INDEXES)
+    {   // the generated callback has already updated the keyword masks.
+        if (sampling_enabled()) sampler_start();
+        else sampler_stop();
+        if (control_code == EVENT_CONTROL_CODE_ENABLE_PROVIDER || control_code == EVENT_CONTROL_CODE_CAPTURE_STATE)
+        {   // record the cost of a scope at the start of each session, on the thread ETW
+            // uses to deliver the notification rather than on an application thread.
+            calibrate_overhead();
+        }
+    }
+    if (context == &ETW_FILE_IO_Context && ETW_THREAD_STATE != TLS_OUT_OF_INDEXES)
+    {
+        if (counters_enabled()) counters_start();
+        else counters_stop();
+    }
 }
 
 /*///////////////////////
@@ -154,7 +2304,8 @@ void ETWRegisterCustomProviders(void)
 {   // Call QueryPerformanceFrequency() once when the providers are registered.
     // All high-resolution timer queries rely on this frequency information.
     QueryPerformanceFrequency(&QPC_FREQUENCY);
-
+    CALIBRATE_QPC = timestamp();
+    CALIBRATE_TSC = __rdtsc();
     HMODULE advapi32 = NULL;
     // Load Advapi32.dll. This DLL is always available on XP and later, but the 
     // functions for custom ETW events are only available on Vista and later.
@@ -167,50 +2318,106 @@ void ETWRegisterCustomProviders(void)
         // Allocate any thread-local data slots. Don't use __declspec(thread)
         // as that can cause problems if the DLL is loaded on Windows XP.
         // The values stored at all slot indexes are automatically initialized to zero.
-        ETW_SCOPE_DEPTH_MAIN = TlsAlloc();
-        ETW_SCOPE_DEPTH_TASK = TlsAlloc();
+        InitializeCriticalSection(&ETW_THREAD_LOCK);
+        InitializeCriticalSection(&ETW_SAMPLER_LOCK);
+        InitializeCriticalSection(&ETW_COUNTER_LOCK);
+        ETW_THREAD_STATE = TlsAlloc();
+
+        // GetThreadDescription is optional, and is used to name threads automatically.
+        GetThreadDescription_Func = (GetThreadDescriptionFn) GetProcAddress(GetModuleHandleW(L"Kernel32.dll"), "GetThreadDescription");
+        QueryThreadCycleTime_Func = (QueryThreadCycleTimeFn) GetProcAddress(GetModuleHandleW(L"Kernel32.dll"), "QueryThreadCycleTime");
+        K32GetProcessMemoryInfo_Func = (GetProcessMemoryInfoFn) GetProcAddress(GetModuleHandleW(L"Kernel32.dll"), "K32GetProcessMemoryInfo");
+        K32QueryWorkingSetEx_Func    = (QueryWorkingSetExFn   ) GetProcAddress(GetModuleHandleW(L"Kernel32.dll"), "K32QueryWorkingSetEx");
 
         // Call the registration functions, which are defined in the 
         // ETWProviderGenerated.h file, generated by processing ETWProvider.man.
         EventRegisterETW_MAIN_THREAD();
         EventRegisterETW_TASK_THREAD();
         EventRegisterETW_USER_INPUT();
+        EventRegisterETW_SYNC();
+        EventRegisterETW_FILE_IO();
     }
 }
 
 /// @summary Public API function to be called to unregister the custom ETW providers and events.
 /// This function must not be called from DllMain, or a deadlock may result.
 void ETWUnregisterCustomProviders(void)
-{   // Call the unregistration functions, which are defined in the 
+{   // The sampler walks the thread list and writes events, so stop it first.
+    if (ETW_THREAD_STATE != TLS_OUT_OF_INDEXES)
+    {
+        sampler_stop();
+        counters_stop();
+    }
+    // Call the unregistration functions, which are defined in the 
     // ETWProviderGenerated.h file, generated by processing ETWProvider.man.
+    EventUnregisterETW_FILE_IO();
+    EventUnregisterETW_SYNC();
     EventUnregisterETW_USER_INPUT();
     EventUnregisterETW_TASK_THREAD();
     EventUnregisterETW_MAIN_THREAD();
 
-    // Free any thread-local data slots.
-    if (ETW_SCOPE_DEPTH_MAIN != TLS_OUT_OF_INDEXES)
+    // Free the state of any threads that are still running, and the TLS slot.
+    if (ETW_THREAD_STATE != TLS_OUT_OF_INDEXES)
     {
-        TlsFree(ETW_SCOPE_DEPTH_TASK);
-        ETW_SCOPE_DEPTH_TASK  = TLS_OUT_OF_INDEXES;
+        while (ETW_THREAD_LIST != NULL)
+        {
+            etw_thread_delete(ETW_THREAD_LIST);
+        }
+        TlsFree(ETW_THREAD_STATE);
+        ETW_THREAD_STATE = TLS_OUT_OF_INDEXES;
+        DeleteCriticalSection(&ETW_COUNTER_LOCK);
+        DeleteCriticalSection(&ETW_SAMPLER_LOCK);
+        DeleteCriticalSection(&ETW_THREAD_LOCK);
     }
-    if (ETW_SCOPE_DEPTH_MAIN != TLS_OUT_OF_INDEXES)
+    stats_delete();
+}
+
+/// @summary Free the state associated with the calling thread. Called from DllMain when a
+/// thread detaches, so this function must not call anything that could acquire the loader lock.
+void ETWThreadDetach(void)
+{
+    if (ETW_THREAD_STATE != TLS_OUT_OF_INDEXES)
     {
-        TlsFree(ETW_SCOPE_DEPTH_MAIN);
-        ETW_SCOPE_DEPTH_MAIN  = TLS_OUT_OF_INDEXES;
+        etw_thread_t *thread = (etw_thread_t*) TlsGetValue(ETW_THREAD_STATE);
+        if (thread != NULL)
+        {
+            if (thread->IoPending > 0)
+                fileio_flush(thread);
+            if (thread->ScopeSummaryCount > 0 || thread->SkipPending)
+                scope_summary_flush(thread, timestamp());
+            TlsSetValue(ETW_THREAD_STATE, NULL);
+            etw_thread_delete(thread);
+        }
     }
 }
 
 /// @summary 
 /// @param message 
-/// @return 
+/// @return The value to pass to ETWLeaveScopeMain(), which is zero if the instance was not
+/// sampled (see ETWScopeSampling).
 LONGLONG ETWEnterScopeMain(char const *message)
 {
-    LONGLONG nowtime = timestamp();
-    LPVOID raw_depth = TlsGetValue(ETW_SCOPE_DEPTH_MAIN);
-    DWORD      depth = reinterpret_cast<DWORD>(raw_depth)+1;
+    etw_thread_t *thread = etw_thread_state();
+    LONG          policy = scope_policy_find(message);
+    if (policy >= 0 && !scope_sampled(thread, policy))
+    {   // not sampled; the instance is only counted, and nested scopes report to the parent.
+        return 0;
+    }
+    LONGLONG     nowtime = timestamp();
+    if (thread->Functions != NULL && thread->Functions->Pending > 0 && functions_enabled())
+        function_flush(thread, nowtime);
+    DWORD         depth  = scope_names_push(&thread->Main, message);
+    LONGLONG      mintime = depth - 1 < ETW_PROVIDER_MAX_SCOPE_DEPTH ? scope_min_time(policy) : 0;
+    scope_cycles_enter(&thread->Main, depth, &ETW_MAIN_THREAD_Context);
+    if (mintime > 0)
+    {   // hold the enter event until the scope has run for the minimum duration.
+        thread->HeldEnter  [depth-1] = nowtime;
+        thread->HeldMinTime[depth-1] = mintime;
+        return nowtime;
+    }
+    scope_commit(thread, depth - 1, nowtime);
+    thread->Committed = depth;
     EventWriteMainEnterScope_Event(message, depth);
-    raw_depth = reinterpret_cast<LPVOID>(depth);
-    TlsSetValue(ETW_SCOPE_DEPTH_MAIN, raw_depth);
     return nowtime;
 }
 
@@ -220,13 +2427,38 @@ LONGLONG ETWEnterScopeMain(char const *message)
 /// @return 
 LONGLONG ETWLeaveScopeMain(char const *message, LONGLONG enter_time)
 {
-    LONGLONG nowtime = timestamp();
-    float    elapsed = milliseconds(nowtime - enter_time);
-    LPVOID raw_depth = TlsGetValue(ETW_SCOPE_DEPTH_MAIN);
-    DWORD      depth = reinterpret_cast<DWORD>(raw_depth)-1;
+    if (enter_time == 0)
+    {   // the instance was not sampled; ETWEnterScopeMain() has already counted it.
+        return 0;
+    }
+    LONGLONG     nowtime = timestamp();
+    float        elapsed = milliseconds(nowtime - enter_time);
+    etw_thread_t *thread = etw_thread_state();
+    if (thread->Main.Depth == 0)
+    {   // no scope is open, e.g. the thread state was recreated since the matching enter.
+        return nowtime;
+    }
+    DWORD         depth  = --thread->Main.Depth;
+    float         oncpu  = 0.0f;
+    stats_record(message, 0, nowtime, nowtime - enter_time);
+    if (depth >= thread->Committed && depth < ETW_PROVIDER_MAX_SCOPE_DEPTH)
+    {   // the enter event was held; the scope is reported only if it ran long enough.
+        if (nowtime - enter_time < thread->HeldMinTime[depth])
+        {
+            thread->Main.Cycles[depth] = 0;
+            scope_elide(thread, message, nowtime, nowtime - enter_time);
+            return nowtime;
+        }
+        scope_commit(thread, depth + 1, nowtime);
+    }
+    thread->Committed = depth;
+    if (scope_cycles_leave(&thread->Main, depth, &oncpu))
+    {   // written first, so a reader can attach it to the leave event that follows.
+        EventWriteMainScopeTime_Event(message, oncpu, elapsed > oncpu ? elapsed - oncpu : 0.0f, depth);
+    }
     EventWriteMainLeaveScope_Event(message, elapsed, depth);
-    raw_depth = reinterpret_cast<LPVOID>(depth);
-    TlsSetValue(ETW_SCOPE_DEPTH_MAIN, raw_depth);
+    if (thread->SkipPending && scope_summary_due(thread, nowtime))
+        scope_summary_flush(thread, nowtime);
     return nowtime;
 }
 
@@ -235,12 +2467,12 @@ LONGLONG ETWLeaveScopeMain(char const *message, LONGLONG enter_time)
 /// @return 
 LONGLONG ETWEnterScopeTask(char const *message)
 {
-    LONGLONG nowtime = timestamp();
-    LPVOID raw_depth = TlsGetValue(ETW_SCOPE_DEPTH_TASK);
-    DWORD      depth = reinterpret_cast<DWORD>(raw_depth)+1;
+    LONGLONG     nowtime = timestamp();
+    etw_thread_t *thread = etw_thread_state();
+    etw_scope_stack_t *stack = task_stack(thread);
+    DWORD         depth  = scope_names_push(stack, message);
+    scope_cycles_enter(stack, depth, &ETW_TASK_THREAD_Context);
     EventWriteTaskEnterScope_Event(message, depth);
-    raw_depth = reinterpret_cast<LPVOID>(depth);
-    TlsSetValue(ETW_SCOPE_DEPTH_TASK, raw_depth);
     return nowtime;
 }
 
@@ -250,13 +2482,22 @@ LONGLONG ETWEnterScopeTask(char const *message)
 /// @return
 LONGLONG ETWLeaveScopeTask(char const *message, LONGLONG enter_time)
 {
-    LONGLONG nowtime = timestamp();
-    float    elapsed = milliseconds(nowtime - enter_time);
-    LPVOID raw_depth = TlsGetValue(ETW_SCOPE_DEPTH_TASK);
-    DWORD      depth = reinterpret_cast<DWORD>(raw_depth)-1;
+    LONGLONG     nowtime = timestamp();
+    float        elapsed = milliseconds(nowtime - enter_time);
+    etw_thread_t *thread = etw_thread_state();
+    etw_scope_stack_t *stack = task_stack(thread);
+    if (stack->Depth == 0)
+    {   // no scope is open, e.g. the scope was entered on a stack the task has since left.
+        return nowtime;
+    }
+    DWORD         depth  = --stack->Depth;
+    float         oncpu  = 0.0f;
+    stats_record(message, 1, nowtime, nowtime - enter_time);
+    if (scope_cycles_leave(stack, depth, &oncpu))
+    {   // written first, so a reader can attach it to the leave event that follows.
+        EventWriteTaskScopeTime_Event(message, oncpu, elapsed > oncpu ? elapsed - oncpu : 0.0f, depth);
+    }
     EventWriteTaskLeaveScope_Event(message, elapsed, depth);
-    raw_depth = reinterpret_cast<LPVOID>(depth);
-    TlsSetValue(ETW_SCOPE_DEPTH_TASK, raw_depth);
     return nowtime;
 }
 
@@ -265,6 +2506,22 @@ LONGLONG ETWLeaveScopeTask(char const *message, LONGLONG enter_time)
 /// @param thread_id
 void ETWThreadID(char const *thread_name, DWORD thread_id)
 {
+    if (ETW_THREAD_STATE != TLS_OUT_OF_INDEXES)
+    {   // remember the name was chosen by the application, so that the thread
+        // doesn't emit an automatically-generated name on its first event. the
+        // caller is often the creator of a worker whose state already exists.
+        EnterCriticalSection(&ETW_THREAD_LOCK);
+        for (etw_thread_t *thread = ETW_THREAD_LIST; thread != NULL; thread = thread->Next)
+        {
+            if (thread->ThreadId == thread_id)
+            {
+                thread->Explicit = TRUE;
+                break;
+            }
+        }
+        ETW_NAMED_THREADS[ETW_NAMED_COUNT++ % ETW_PROVIDER_MAX_NAMED_THREADS] = thread_id;
+        LeaveCriticalSection(&ETW_THREAD_LOCK);
+    }
     EventWriteThreadID_Event(thread_name, thread_id);
 }
 
@@ -272,6 +2529,7 @@ void ETWThreadID(char const *thread_name, DWORD thread_id)
 /// @param message 
 void ETWMarkerMain(char const *message)
 {
+    scope_commit_open(etw_thread_state());
     EventWriteMainMarker_Event(message);
 }
 
@@ -285,6 +2543,7 @@ void ETWMarkerFormatMain(_Printf_format_string_ char const *format, ...)
     va_start(arglist , format);
     vsprintf_s(buffer, format, arglist);
     va_end(arglist);
+    scope_commit_open(etw_thread_state());
     EventWriteMainMarker_Event(buffer);
 }
 
@@ -298,6 +2557,7 @@ void ETWMarkerFormatMainV(char *buffer, size_t count, char const *format, va_lis
     _vsnprintf(buffer, count , format, args);
     if (count > 0)             buffer[count-1] = '\0';
     else if (buffer != NULL)   buffer[0] = '\0';
+    scope_commit_open(etw_thread_state());
     EventWriteMainMarker_Event(buffer);
 }
 
@@ -305,6 +2565,7 @@ void ETWMarkerFormatMainV(char *buffer, size_t count, char const *format, va_lis
 /// @param message 
 void ETWMarkerTask(char const *message)
 {
+    etw_thread_state();
     EventWriteTaskMarker_Event(message);
 }
 
@@ -318,6 +2579,7 @@ void ETWMarkerFormatTask(_Printf_format_string_ char const *format, ...)
     va_start(arglist , format);
     vsprintf_s(buffer, format, arglist);
     va_end(arglist);
+    etw_thread_state();
     EventWriteTaskMarker_Event(buffer);
 }
 
@@ -331,6 +2593,7 @@ void ETWMarkerFormatTaskV(char *buffer, size_t count, char const *format, va_lis
     _vsnprintf(buffer, count , format, args);
     if (count > 0)             buffer[count-1] = '\0';
     else if (buffer != NULL)   buffer[0] = '\0';
+    etw_thread_state();
     EventWriteTaskMarker_Event(buffer);
 }
 
@@ -341,6 +2604,7 @@ void ETWMarkerFormatTaskV(char *buffer, size_t count, char const *format, va_lis
 /// @param y 
 void ETWMouseDown(int button, DWORD flags, int x, int y)
 {
+	etw_thread_state();
 	EventWriteMouse_down(button, flags, x, y);
 }
 
@@ -351,6 +2615,7 @@ void ETWMouseDown(int button, DWORD flags, int x, int y)
 /// @param y 
 void ETWMouseUp(int button, DWORD flags, int x, int y)
 {
+	etw_thread_state();
 	EventWriteMouse_up(button, flags, x, y);
 }
 
@@ -360,6 +2625,7 @@ void ETWMouseUp(int button, DWORD flags, int x, int y)
 /// @param y
 void ETWMouseMove(DWORD flags, int x, int y)
 {
+	etw_thread_state();
 	EventWriteMouse_move(flags, x, y);
 }
 
@@ -370,6 +2636,7 @@ void ETWMouseMove(DWORD flags, int x, int y)
 /// @param y 
 void ETWMouseWheel(DWORD flags, int delta_z, int x, int y)
 {
+	etw_thread_state();
 	EventWriteMouse_wheel(flags, delta_z, x, y);
 }
 
@@ -380,9 +2647,515 @@ void ETWMouseWheel(DWORD flags, int delta_z, int x, int y)
 /// @param flags 
 void ETWKeyDown(DWORD character, char const* name, DWORD repeat_count, DWORD flags)
 {
+	etw_thread_state();
 	EventWriteKey_down(character, name, repeat_count, flags);
 }
 
+/// @summary Emits a flow event from the main thread provider, linking work done on 
+/// different threads that shares the same flow ID.
+/// @param name A NULL-terminated string identifying the kind of work.
+/// @param flow_id The application-defined identifier of the unit of work.
+/// @param phase One of the values of etw_flow_phase_e.
+void ETWFlowMain(char const *name, ULONGLONG flow_id, DWORD phase)
+{
+    scope_commit_open(etw_thread_state());
+    EventWriteMainFlow_Event(name, flow_id, phase);
+}
+
+/// @summary Emits a flow event from the task thread provider, linking work done on 
+/// different threads that shares the same flow ID.
+/// @param name A NULL-terminated string identifying the kind of work.
+/// @param flow_id The application-defined identifier of the unit of work.
+/// @param phase One of the values of etw_flow_phase_e.
+void ETWFlowTask(char const *name, ULONGLONG flow_id, DWORD phase)
+{
+    etw_thread_state();
+    EventWriteTaskFlow_Event(name, flow_id, phase);
+}
+
+/// @summary Emits an event indicating that the calling thread is about to block on a 
+/// synchronization object. Called only after a non-blocking acquire attempt has failed.
+/// @param name A NULL-terminated string identifying the lock or wait.
+/// @param object The address or handle of the synchronization object.
+/// @return The current timestamp, which must be passed to ETWWaitEnd.
+LONGLONG ETWWaitBegin(char const *name, void const *object)
+{
+    LONGLONG nowtime = timestamp();
+    etw_thread_state();
+    EventWriteWaitBegin_Event(name, (ULONGLONG) object);
+    return nowtime;
+}
+
+/// @summary Emits an event indicating that a blocking wait started with ETWWaitBegin 
+/// has completed, and how long the calling thread was blocked.
+/// @param name A NULL-terminated string identifying the lock or wait.
+/// @param object The address or handle of the synchronization object.
+/// @param begin_time The timestamp value returned from ETWWaitBegin().
+/// @param result The value returned by the wait function, or zero for a lock acquisition.
+void ETWWaitEnd(char const *name, void const *object, LONGLONG begin_time, DWORD result)
+{
+    LONGLONG nowtime = timestamp();
+    float    elapsed = milliseconds(nowtime - begin_time);
+    etw_thread_state();
+    EventWriteWaitEnd_Event(name, (ULONGLONG) object, elapsed, result);
+}
+
+/// @summary Creates a task context, which carries its own stack of task scopes for a unit
+/// of work that may be suspended and resumed on different threads, such as a coroutine.
+/// @param name A NULL-terminated string identifying the kind of task. The string must 
+/// remain valid until the task is deleted.
+/// @return The task context, or NULL if memory is exhausted.
+void* ETWTaskCreate(char const *name)
+{
+    etw_task_context_t *task = NULL;
+    if ((task = (etw_task_context_t*) HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(etw_task_context_t))) == NULL)
+    {
+        return NULL;
+    }
+    task->TaskId     = (ULONGLONG) InterlockedIncrement64(&ETW_TASK_ID);
+    task->Name       = name != NULL ? name : "";
+    task->CreateTime = timestamp();
+    task->RunCycles  = 1;
+    return task;
+}
+
+/// @summary Makes a task context current on the calling thread. Until the task is suspended,
+/// ETWEnterScopeTask() and ETWLeaveScopeTask() use the task's scope stack, and on-CPU time
+/// measured for its scopes includes only the time the task was running. Resume and suspend
+/// calls on a thread must be nested, so a task that resumes another suspends it first.
+/// @param context The task context returned by ETWTaskCreate().
+void ETWTaskResume(void *context)
+{
+    etw_task_context_t *task    = (etw_task_context_t*) context;
+    etw_thread_t       *thread  = NULL;
+    ULONG64             cycles  = 0;
+    LONGLONG            nowtime = timestamp();
+
+    if (task == NULL)
+        return;
+
+    thread = etw_thread_state();
+    if (task->ThreadId != 0 && task->ThreadId != thread->ThreadId)
+        task->Migrations++;
+    task->ThreadId   = thread->ThreadId;
+    task->ResumeTime = nowtime;
+    task->Resumes++;
+    if (thread_time_enabled(&ETW_TASK_THREAD_Context) && QueryThreadCycleTime_Func(GetCurrentThread(), &cycles))
+    {   // continue counting from where the task stopped, whichever thread that was on.
+        task->Stack.CycleBias = task->RunCycles - cycles;
+        task->Stack.Untimed   = FALSE;
+    }
+    else task->Stack.Untimed  = TRUE;
+    task->Prev   = thread->Task;
+    thread->Task = &task->Stack;
+    EventWriteTaskResume_Event(task->TaskId, task->Name, task->Stack.Depth);
+}
+
+/// @summary Restores the task scope stack that the calling thread was using before a task 
+/// context was resumed. Scopes that are still open remain open on the task, and are left
+/// on whichever thread resumes it next.
+/// @param context The task context passed to ETWTaskResume().
+void ETWTaskSuspend(void *context)
+{
+    etw_task_context_t *task    = (etw_task_context_t*) context;
+    etw_thread_t       *thread  = NULL;
+    ULONG64             cycles  = 0;
+    LONGLONG            nowtime = timestamp();
+
+    if (task == NULL)
+        return;
+
+    thread = etw_thread_state();
+    if (thread->Task != &task->Stack)
+    {   // the task is not the one current on this thread.
+        return;
+    }
+    if (!task->Stack.Untimed && QueryThreadCycleTime_Func(GetCurrentThread(), &cycles))
+    {
+        task->RunCycles = cycles + task->Stack.CycleBias;
+    }
+    task->Running += nowtime - task->ResumeTime;
+    thread->Task   = task->Prev;
+    task->Prev     = NULL;
+    EventWriteTaskSuspend_Event(task->TaskId, task->Name, task->Stack.Depth);
+}
+
+/// @summary Emits the summary of a task, including the time from creation to completion, 
+/// and frees the task context. The task must not be current on any thread.
+/// @param context The task context returned by ETWTaskCreate().
+void ETWTaskDelete(void *context)
+{
+    etw_task_context_t *task    = (etw_task_context_t*) context;
+    LONGLONG            nowtime = timestamp();
+
+    if (task == NULL)
+        return;
+
+    etw_thread_state();
+    EventWriteTaskComplete_Event(task->TaskId, task->Name, milliseconds(nowtime - task->CreateTime), milliseconds(task->Running), task->Resumes, task->Migrations);
+    HeapFree(GetProcessHeap(), 0, task);
+}
+
+/// @summary Emits an event describing an attempt to open a file. The hooks installed by 
+/// ETWHookFileIO() call this for every CreateFile call; applications may call it directly.
+/// @param path The path of the file, as UTF-8.
+/// @param file The handle returned by the open call, or INVALID_HANDLE_VALUE.
+/// @param access The access rights requested.
+/// @param error The error code if the open failed, or zero.
+/// @param latency_ms The time taken by the open call, in milliseconds.
+void ETWFileOpen(char const *path, HANDLE file, DWORD access, DWORD error, float latency_ms)
+{
+    if (!ETW_FILE_IO_Context.IsEnabled)
+        return;
+    etw_thread_state();
+    EventWriteFileOpen_Event(path, (ULONGLONG) file, access, error, latency_ms);
+}
+
+/// @summary Emits an event describing a read from a file. When the calling thread reads
+/// faster than ETW_PROVIDER_FILEIO_MAX_EVENTS per window, reads are summed instead.
+/// @param file The handle of the file.
+/// @param offset The file offset of the read, or ~0 if the read used the file pointer.
+/// @param requested The number of bytes requested.
+/// @param transferred The number of bytes read, or zero if the read completes asynchronously.
+/// @param error The error code if the read failed or is pending, or zero.
+/// @param latency_ms The time taken by the read call, in milliseconds.
+void ETWFileRead(HANDLE file, ULONGLONG offset, DWORD requested, DWORD transferred, DWORD error, float latency_ms)
+{
+    etw_thread_t *thread = NULL;
+    if (!ETW_FILE_IO_Context.IsEnabled)
+        return;
+    thread = etw_thread_state();
+    if (fileio_admit(thread, ETW_PROVIDER_FILEIO_READ, transferred, latency_ms))
+        EventWriteFileRead_Event((ULONGLONG) file, offset, requested, transferred, error, latency_ms);
+}
+
+/// @summary Emits an event describing the creation of a file mapping object, which links
+/// the views mapped from it to the file.
+/// @param file The handle of the mapped file, or INVALID_HANDLE_VALUE for pagefile-backed sections.
+/// @param mapping The handle of the file mapping object, or NULL if it could not be created.
+/// @param size The maximum size of the mapping, or zero for the size of the file.
+/// @param latency_ms The time taken by the call, in milliseconds.
+void ETWFileMapping(HANDLE file, HANDLE mapping, ULONGLONG size, float latency_ms)
+{
+    if (!ETW_FILE_IO_Context.IsEnabled)
+        return;
+    etw_thread_state();
+    EventWriteFileMapping_Event((ULONGLONG) file, (ULONGLONG) mapping, size, latency_ms);
+}
+
+/// @summary Emits an event describing a view mapped from a file mapping object. Views are
+/// rate-limited like reads.
+/// @param mapping The handle of the file mapping object.
+/// @param address The base address of the view, or NULL if it could not be mapped.
+/// @param offset The file offset of the view.
+/// @param size The number of bytes mapped, or zero for the rest of the mapping.
+/// @param latency_ms The time taken by the call, in milliseconds.
+void ETWFileMapView(HANDLE mapping, void const *address, ULONGLONG offset, ULONGLONG size, float latency_ms)
+{
+    etw_thread_t *thread = NULL;
+    if (!ETW_FILE_IO_Context.IsEnabled)
+        return;
+    thread = etw_thread_state();
+    if (fileio_admit(thread, ETW_PROVIDER_FILEIO_MAP_VIEW, size, latency_ms))
+        EventWriteFileMapView_Event((ULONGLONG) mapping, (ULONGLONG) address, offset, size, latency_ms);
+}
+
+/// @summary Emits an event describing a view being unmapped. Unmaps are rate-limited like reads.
+/// @param address The base address of the view.
+/// @param latency_ms The time taken by the call, in milliseconds.
+void ETWFileUnmapView(void const *address, float latency_ms)
+{
+    etw_thread_t *thread = NULL;
+    if (!ETW_FILE_IO_Context.IsEnabled)
+        return;
+    thread = etw_thread_state();
+    if (fileio_admit(thread, ETW_PROVIDER_FILEIO_UNMAP_VIEW, 0, latency_ms))
+        EventWriteFileUnmapView_Event((ULONGLONG) address, latency_ms);
+}
+
+/// @summary Emits an event describing a request to prefetch mapped pages, such as a call 
+/// to PrefetchVirtualMemory. Prefetches are rate-limited like reads.
+/// @param address The address of the first range.
+/// @param size The total number of bytes in all ranges.
+/// @param ranges The number of address ranges.
+/// @param latency_ms The time taken by the call, in milliseconds.
+void ETWFilePrefetch(void const *address, ULONGLONG size, DWORD ranges, float latency_ms)
+{
+    etw_thread_t *thread = NULL;
+    if (!ETW_FILE_IO_Context.IsEnabled)
+        return;
+    thread = etw_thread_state();
+    if (fileio_admit(thread, ETW_PROVIDER_FILEIO_PREFETCH, size, latency_ms))
+        EventWriteFilePrefetch_Event((ULONGLONG) address, size, ranges, latency_ms);
+}
+
+/// @summary Records entry to a function compiled with /Gh. Called by the _penter hook in 
+/// ETWClient.dll on every call, so nothing is written here: the call is pushed onto the
+/// calling thread's function stack, and reported later if it runs long enough or encloses
+/// something that is reported. Calls are tracked even while no session has enabled the 
+/// Functions keyword, so that enters and leaves stay matched, but only their stack position
+/// is recorded: such calls are never reported, even if a session starts before they return.
+/// @param address The address of the function being entered.
+/// @param stack The address of the function's return address on the stack.
+void ETWFunctionEnter(void const *address, void const *stack)
+{
+    etw_thread_t  *thread  = NULL;
+    etw_function_stack_t *calls = NULL;
+    if (ETW_THREAD_STATE == TLS_OUT_OF_INDEXES)
+        return;
+    if ((thread = etw_thread_state()) == &ETW_THREAD_FALLBACK)
+        return;
+    if ((calls  = thread->Functions) == NULL)
+    {
+        if ((calls = (etw_function_stack_t*) HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(etw_function_stack_t))) == NULL)
+            return;
+        thread->Functions = calls;
+    }
+    if (calls->Count < ETW_PROVIDER_MAX_FUNCTION_DEPTH && !functions_enabled())
+    {   // only the depth is maintained; the time and module are not needed.
+        etw_function_frame_t  *frame  = &calls->Frames[calls->Count];
+        frame->Address   = (ULONG_PTR) address;
+        frame->Stack     = (ULONG_PTR) stack;
+        frame->EnterTime = 0;
+        frame->Elided    = 0;
+        frame->Module    = NULL;
+        frame->Allowed   = FALSE;
+        frame->Emitted   = FALSE;
+    }
+    else if (calls->Count < ETW_PROVIDER_MAX_FUNCTION_DEPTH)
+    {
+        etw_function_frame_t  *frame  = &calls->Frames[calls->Count];
+        etw_function_module_t *module = function_module((ULONG_PTR) address);
+        frame->Address   = (ULONG_PTR) address;
+        frame->Stack     = (ULONG_PTR) stack;
+        frame->EnterTime = timestamp();
+        frame->Elided    = 0;
+        frame->Module    = module;
+        frame->Allowed   = module != NULL ? module->Allowed : FALSE;
+        frame->Emitted   = FALSE;
+        if (frame->Allowed) calls->Pending++;
+    }
+    else if (calls->Count == ETW_PROVIDER_MAX_FUNCTION_DEPTH)
+    {   // deeper calls are only counted; remember where they start on the stack.
+        calls->OverflowStack = (ULONG_PTR) stack;
+    }
+    calls->Count++;
+}
+
+/// @summary Records exit from a function compiled with /GH. Called by the _pexit hook in 
+/// ETWClient.dll. Calls entered after the returning one that were unwound by an exception
+/// or longjmp, and so never returned through _pexit, are removed first.
+/// @param stack The stack pointer of the returning function when it called _pexit. This is
+/// at or below the address passed to ETWFunctionEnter() for the same call, and above the 
+/// address passed for any call it made.
+void ETWFunctionLeave(void const *stack)
+{
+    LONGLONG       nowtime = 0;
+    etw_thread_t  *thread  = NULL;
+    etw_function_stack_t *calls = NULL;
+    if (ETW_THREAD_STATE == TLS_OUT_OF_INDEXES)
+        return;
+    if ((thread = (etw_thread_t*) TlsGetValue(ETW_THREAD_STATE)) == NULL || (calls = thread->Functions) == NULL)
+        return;
+    if (calls->Count > ETW_PROVIDER_MAX_FUNCTION_DEPTH && calls->OverflowStack < (ULONG_PTR) stack)
+    {   // the returning call is tracked, so every untracked call was unwound.
+        calls->Count = ETW_PROVIDER_MAX_FUNCTION_DEPTH;
+    }
+    while (calls->Count > 0 && calls->Count <= ETW_PROVIDER_MAX_FUNCTION_DEPTH && calls->Frames[calls->Count-1].Stack < (ULONG_PTR) stack)
+    {   // the stack grows down, so these frames belong to callees that were unwound.
+        function_pop(thread, &nowtime);
+    }
+    if (calls->Count > 0)
+    {
+        function_pop(thread, &nowtime);
+    }
+}
+
+/// @summary Restricts the reporting of calls to functions compiled with /Gh and /GH.
+/// @param include A ';'-separated list of module name substrings, compared without regard
+/// to case. If not NULL or empty, only functions in matching modules are reported.
+/// @param exclude A ';'-separated list of module name substrings. Functions in matching 
+/// modules are not reported. May be NULL.
+/// @param min_us The minimum duration of a reported call, in microseconds, or zero to use
+/// a minimum derived from the measured cost of a scope. Shorter calls are reported only
+/// if they enclose a call or scope that is reported.
+void ETWFunctionFilter(char const *include, char const *exclude, DWORD min_us)
+{
+    if (ETW_THREAD_STATE == TLS_OUT_OF_INDEXES)
+        return;
+    EnterCriticalSection(&ETW_THREAD_LOCK);
+    lstrcpynA(ETW_FUNCTION_INCLUDE, include != NULL ? include : "", ETW_PROVIDER_FUNCTION_FILTER_SIZE);
+    lstrcpynA(ETW_FUNCTION_EXCLUDE, exclude != NULL ? exclude : "", ETW_PROVIDER_FUNCTION_FILTER_SIZE);
+    for (LONG i = 0; i < ETW_FUNCTION_MODULE_COUNT; ++i)
+    {   // calls already in progress keep the decision made when they were entered.
+        ETW_FUNCTION_MODULES[i].Allowed = function_module_allowed(ETW_FUNCTION_MODULES[i].Path);
+    }
+    LeaveCriticalSection(&ETW_THREAD_LOCK);
+    InterlockedExchange(&ETW_FUNCTION_MIN_US, (LONG) min_us);
+}
+
+/// @summary Registers an address range, such as a view of a mapped file, whose residency 
+/// is reported by the counter thread while a session enables the Counters keyword on the 
+/// file I/O provider. Registering an address again replaces its name and size.
+/// @param name A short name identifying the range in the trace. The string is copied.
+/// @param address The first byte of the range.
+/// @param size The size of the range, in bytes.
+/// @return TRUE if the range was registered, or FALSE if ETW_PROVIDER_MAX_COUNTER_REGIONS 
+/// ranges are already registered.
+BOOL ETWCounterRegion(char const *name, void const *address, ULONGLONG size)
+{
+    etw_counter_region_t *slot = NULL;
+    if (ETW_THREAD_STATE == TLS_OUT_OF_INDEXES || address == NULL)
+        return FALSE;
+    EnterCriticalSection(&ETW_COUNTER_LOCK);
+    for (DWORD i = 0; i < ETW_PROVIDER_MAX_COUNTER_REGIONS; ++i)
+    {
+        if (ETW_COUNTER_REGIONS[i].Address == (ULONG_PTR) address)
+        {
+            slot = &ETW_COUNTER_REGIONS[i];
+            break;
+        }
+        if (ETW_COUNTER_REGIONS[i].Address == 0 && slot == NULL)
+            slot = &ETW_COUNTER_REGIONS[i];
+    }
+    if (slot != NULL)
+    {
+        slot->Address = (ULONG_PTR) address;
+        slot->Size    = (SIZE_T) size;
+        slot->Phase   = 0;
+        lstrcpynA(slot->Name, name != NULL ? name : "", ETW_PROVIDER_COUNTER_NAME_SIZE);
+    }
+    LeaveCriticalSection(&ETW_COUNTER_LOCK);
+    return slot != NULL ? TRUE : FALSE;
+}
+
+/// @summary Stops reporting the residency of an address range. This must be called before
+/// the range is unmapped or freed.
+/// @param address The address passed to ETWCounterRegion().
+void ETWCounterRegionRemove(void const *address)
+{
+    if (ETW_THREAD_STATE == TLS_OUT_OF_INDEXES || address == NULL)
+        return;
+    EnterCriticalSection(&ETW_COUNTER_LOCK);
+    for (DWORD i = 0; i < ETW_PROVIDER_MAX_COUNTER_REGIONS; ++i)
+    {
+        if (ETW_COUNTER_REGIONS[i].Address == (ULONG_PTR) address)
+            ETW_COUNTER_REGIONS[i].Address = 0;
+    }
+    LeaveCriticalSection(&ETW_COUNTER_LOCK);
+}
+
+/// @summary Sets the minimum duration of the main scopes that are reported. The enter event
+/// of a scope is held by the thread until the scope has run for the minimum duration; shorter
+/// scopes write no events, and are summed by name into MainScopeSummary_Event instead. A 
+/// scope that encloses a reported scope, function call, marker or flow is always reported.
+/// @param name The scope name the threshold applies to, or NULL to set the threshold of all
+/// scopes without one of their own. Names are compared on their first 63 characters.
+/// @param min_us The minimum duration, in microseconds, or zero to report every scope.
+/// @return TRUE if the threshold was set, or FALSE if too many names have thresholds.
+BOOL ETWScopeThreshold(char const *name, DWORD min_us)
+{
+    if (name == NULL)
+    {
+        InterlockedExchange(&ETW_SCOPE_MIN_US, (LONG) min_us);
+        return TRUE;
+    }
+    return scope_policy_set(name, (LONG) min_us, -1);
+}
+
+/// @summary Samples the main scopes with a given name, for scopes entered so often that even
+/// summing them costs too much. Each instance is sampled independently with probability 
+/// 1/one_in; an instance that is not sampled writes no events, and is only counted, by name, 
+/// into MainScopeSampled_Event, from which the analyzer scales the reported counts and 
+/// durations to unbiased estimates. Scopes nested in an instance that is not sampled are 
+/// reported as children of its parent. Sampled instances are still subject to ETWScopeThreshold().
+/// @param name The scope name. Names are compared on their first 63 characters.
+/// @param one_in The sampling rate, or zero or one to report every scope.
+/// @return TRUE if the rate was set, or FALSE if too many names have a policy.
+BOOL ETWScopeSampling(char const *name, DWORD one_in)
+{
+    if (name == NULL)
+        return FALSE;
+    return scope_policy_set(name, -1, (LONG) one_in);
+}
+
+/// @summary Sets the interval between counter samples. The new interval takes effect after
+/// the current wait of the counter thread.
+/// @param interval_ms The interval, in milliseconds. Zero restores ETW_PROVIDER_COUNTER_INTERVAL_MS.
+void ETWSetCounterInterval(DWORD interval_ms)
+{
+    InterlockedExchange(&ETW_COUNTER_INTERVAL_MS, interval_ms != 0 ? (LONG) interval_ms : ETW_PROVIDER_COUNTER_INTERVAL_MS);
+}
+
+/// @summary Sets the share of the process CPU time the providers may spend writing events.
+/// While the estimated cost of tracing exceeds the budget, HighFrequency events are sampled
+/// and then no longer written, and a marker is written each time a provider changes level.
+/// File I/O operations that are not written are summed into FileSummary_Event; for the other
+/// providers, a marker records how many events were not written in each window.
+/// @param percent The budget, as a percentage of the CPU time used by the process. Zero
+/// disables the governor and writes every event.
+void ETWSetOverheadBudget(float percent)
+{
+    LONG const budget = percent > 0.0f ? (LONG) (percent * 100.0f + 0.5f) : 0;
+    LONG const prev   = InterlockedExchange(&ETW_GOVERNOR_BUDGET, budget);
+    if (budget == 0)
+    {   // levels are only re-evaluated while the governor is enabled.
+        for (DWORD i = 0; i < ETW_PROVIDER_COUNT; ++i)
+            InterlockedExchange(&ETW_GOVERNOR_LEVEL[i], 0);
+    }
+    else if (prev == 0)
+    {   // nothing was counted while disabled; start the first window now.
+        governor_reset();
+    }
+}
+
+/// @summary Starts or stops publishing per-scope statistics to shared memory. The segment
+/// is created by the first call that enables publishing, and unmapped when the providers 
+/// are unregistered, so a scope exit racing with a call to stop never touches freed memory.
+/// @param enable TRUE to publish statistics, or FALSE to stop.
+void ETWSetLiveStats(BOOL enable)
+{
+#if ETW_PROVIDER_LIVE_STATS
+    if (enable && ETW_STATS == NULL && InterlockedCompareExchange(&ETW_STATS_CREATING, 1, 0) == 0)
+    {   // a second caller may return before the segment exists; its scopes are not recorded.
+        if (ETW_STATS == NULL)
+            stats_create();
+        InterlockedExchange(&ETW_STATS_CREATING, 0);
+    }
+    InterlockedExchange(&ETW_STATS_ENABLED, enable ? 1 : 0);
+#else
+    UNREFERENCED_PARAMETER(enable);
+#endif
+}
+
+/// @summary Sets how a write is handled when the session has no free buffer. By default, 
+/// the event is dropped. Dropped events are always counted, and reported in the stream
+/// with an EventsLost_Event from the main thread provider.
+/// @param policy One of the values of etw_overflow_policy_e.
+/// @param spin_us For ETW_OVERFLOW_SPIN, the longest a write may wait for a free buffer,
+/// in microseconds, before the event is dropped.
+void ETWSetOverflowPolicy(DWORD policy, DWORD spin_us)
+{
+    InterlockedExchange(&ETW_OVERFLOW_SPIN_US, (LONG) spin_us);
+    InterlockedExchange(&ETW_OVERFLOW_POLICY , (LONG) policy);
+}
+
+/// @summary Retrieves the number of events dropped by the process since the providers were
+/// registered, because a session had no free buffers or the event could not be written.
+/// @param provider One of the values of etw_provider_e, or ETW_PROVIDER_COUNT or greater 
+/// to retrieve the total for all providers.
+/// @return The number of events dropped.
+ULONGLONG ETWLostEvents(DWORD provider)
+{
+    ULONGLONG total = 0;
+    for (DWORD i = 0; i < ETW_PROVIDER_COUNT; ++i)
+    {
+        if (provider == i || provider >= ETW_PROVIDER_COUNT)
+            total += (ULONGLONG) ETW_LOST_EVENTS[i];
+    }
+    return total;
+}
+
 #ifdef __cplusplus
 }; /* extern "C" */
 #endif
\ No newline at end of file
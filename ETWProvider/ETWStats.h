@@ -0,0 +1,120 @@
+/*/////////////////////////////////////////////////////////////////////////////
+/// @summary Defines the layout of the shared-memory segment to which the
+/// provider DLL publishes per-scope statistics, so that a viewer can attach
+/// to a running process without starting a trace session. The segment is
+/// written with interlocked operations only, and readers map it read-only,
+/// so attaching a viewer never blocks or slows the instrumented threads.
+/// @author Russell Klenk (contact@russellklenk.com)
+///////////////////////////////////////////////////////////////////////////80*/
+
+#ifndef ETW_STATS_H
+#define ETW_STATS_H
+
+/*////////////////
+//   Includes   //
+////////////////*/
+#include <Windows.h>
+
+/*/////////////////
+//   Constants   //
+/////////////////*/
+/// @summary The value of etw_stats_header_t::Magic, 'ETWS'.
+#define ETW_STATS_MAGIC           0x53575445UL
+
+/// @summary The value of etw_stats_header_t::Version. Incremented when the layout changes.
+#define ETW_STATS_VERSION         1
+
+/// @summary The format of the name of the file mapping, given the process ID.
+#define ETW_STATS_MAPPING_FORMATA "Local\\ETWProviderStats.%u"
+#define ETW_STATS_MAPPING_FORMATW L"Local\\ETWProviderStats.%u"
+
+/// @summary The number of scope slots in the segment. This value must be a power of two.
+#define ETW_STATS_MAX_SCOPES      512
+
+/// @summary The maximum length of a scope name stored in the segment, including the NULL.
+#define ETW_STATS_MAX_NAME        48
+
+/// @summary The maximum length of the process name stored in the segment, including the NULL.
+#define ETW_STATS_MAX_PROCESS     64
+
+/// @summary The number of windows kept for each scope, and the length of each window. Readers
+/// aggregate all but the oldest window, which may be in the process of being recycled.
+#define ETW_STATS_WINDOW_COUNT    8
+#define ETW_STATS_WINDOW_MS       1000
+
+/// @summary The number of histogram buckets. Bucket i counts durations of [2^i, 2^(i+1))
+/// microseconds; the first and last buckets are open-ended.
+#define ETW_STATS_BUCKET_COUNT    24
+
+/// @summary The value of etw_stats_window_t::Epoch while a writer is clearing the window.
+#define ETW_STATS_EPOCH_RESET     (-1L)
+
+/*//////////////////
+//   Data Types   //
+//////////////////*/
+/// @summary The durations of the instances of a scope that completed within one window.
+struct etw_stats_window_t
+{
+    LONG volatile     Epoch;      /// The window number the counts belong to, or zero if unused.
+    LONG volatile     Count;      /// The number of scope instances that completed in the window.
+    LONGLONG volatile TotalUs;    /// The sum of the scope durations, in microseconds.
+    LONG volatile     Histogram[ETW_STATS_BUCKET_COUNT]; /// The number of durations in each log2 bucket.
+};
+
+/// @summary The statistics published for a single scope name.
+struct etw_stats_scope_t
+{
+    LONG volatile     Hash;       /// The hash of the name and source, or zero if the slot is free.
+    LONG volatile     Ready;      /// Non-zero once Name and Source have been written.
+    LONG              Source;     /// Zero for scopes from the main thread provider, one for the task thread provider.
+    char              Name[ETW_STATS_MAX_NAME]; /// The scope name, truncated to fit.
+    LONGLONG volatile TotalCount; /// The number of instances that completed since the segment was created.
+    etw_stats_window_t Windows[ETW_STATS_WINDOW_COUNT]; /// Ring of windows indexed by Epoch % ETW_STATS_WINDOW_COUNT.
+};
+
+/// @summary The header at the start of the segment, followed by ScopeCapacity etw_stats_scope_t.
+struct etw_stats_header_t
+{
+    DWORD             Magic;      /// ETW_STATS_MAGIC.
+    DWORD             Version;    /// ETW_STATS_VERSION.
+    DWORD             ProcessId;  /// The identifier of the process that owns the segment.
+    DWORD             ScopeCapacity; /// The number of scope slots following the header.
+    DWORD             WindowCount; /// ETW_STATS_WINDOW_COUNT.
+    DWORD             WindowMs;   /// ETW_STATS_WINDOW_MS.
+    DWORD             BucketCount; /// ETW_STATS_BUCKET_COUNT.
+    LONG volatile     ScopeCount; /// The number of scope slots in use.
+    LONG volatile     Overflow;   /// The number of scope instances dropped because no slot was available.
+    DWORD             Reserved;   /// Padding; set to zero.
+    LONGLONG          StartQpc;   /// The QueryPerformanceCounter value at which window one began.
+    LONGLONG          QpcFrequency; /// The QueryPerformanceFrequency value, in ticks per second.
+    char              ProcessName[ETW_STATS_MAX_PROCESS]; /// The file name of the process executable.
+};
+
+/*///////////////////////
+//  Public Functions   //
+///////////////////////*/
+/// @summary Compute the window number for a QueryPerformanceCounter value.
+/// @param header The segment header.
+/// @param qpc The QueryPerformanceCounter value.
+/// @return The window number, starting from one.
+static inline LONG etw_stats_epoch(etw_stats_header_t const *header, LONGLONG qpc)
+{
+    LONGLONG ticks = (header->QpcFrequency * header->WindowMs) / 1000;
+    return (LONG) ((qpc - header->StartQpc) / ticks) + 1;
+}
+
+/// @summary Compute the histogram bucket for a duration.
+/// @param us The duration, in microseconds.
+/// @return The bucket index, in [0, ETW_STATS_BUCKET_COUNT).
+static inline DWORD etw_stats_bucket(LONGLONG us)
+{
+    DWORD bucket = 0;
+    while (us > 1 && bucket < ETW_STATS_BUCKET_COUNT - 1)
+    {
+        us >>= 1;
+        bucket++;
+    }
+    return bucket;
+}
+
+#endif /* !defined(ETW_STATS_H) */
@@ -506,12 +506,16 @@ int main(int argc, char **argv)
     hash_init(0, file_state.Hash);
     bool eof = false;
     do
-    {   // emit a marker event for viewing in WPA.
+    {   // emit a marker event for viewing in WPA. the scopes use the same
+        // names as MMIOPrefetch so the two runs can be compared with diff.
+        ETWMainScope window("MAIN-WINDOW");
         ETWMarkerMain("Tick");
-        // perform some computation on each byte in the mapped range.
-        for (size_t i = 0; i < 100; ++i)
-        {
-            hash_update(file_state.BufferBeg, file_state.MapSize, file_state.Hash);
+        {   // perform some computation on each byte in the mapped range.
+            ETWMainScope phase("MAIN-PROCESS");
+            for (size_t i = 0; i < 100; ++i)
+            {
+                hash_update(file_state.BufferBeg, file_state.MapSize, file_state.Hash);
+            }
         }
         // update the view to point to the next contiguous range in the file.
         // eof will be set to true if we've hit end-of-file.
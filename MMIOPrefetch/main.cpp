@@ -353,7 +353,7 @@ static DWORD WINAPI prefetch_thread(void *arg)
     {
         ETWMarkerTask("PREFETCH-SLEEP");
         bool   work_queued = false;
-        DWORD  wake_reason = WaitForMultipleObjectsEx(2, wait_handle, FALSE, INFINITE, TRUE);
+        DWORD  wake_reason = ETWWaitForMultipleObjectsEx("PREFETCH-IDLE", 2, wait_handle, FALSE, INFINITE, TRUE);
         ETWMarkerTask("PREFETCH-WAKE");
         switch(wake_reason)
         {
@@ -386,7 +386,9 @@ static DWORD WINAPI prefetch_thread(void *arg)
                 int64_t  const amount = req.Amount;
                 HANDLE         fd     = req.Fildes;
                 intptr_t const id     = req.Id;
+                bool           cancel = false;
                 ETWMarkerFormatTask("PREFETCH-START %p", req.Id);
+                ETWFlowTask("WINDOW", (ULONGLONG) id, ETW_FLOW_START);
                 while (rpos  < amount)
                 {   // process any pending cancellations.
                     if (update_cancel_list(S, cancel_list, cancel_count))
@@ -396,6 +398,8 @@ static DWORD WINAPI prefetch_thread(void *arg)
                             // the cancellation from the list, and stop 
                             // prefetching the current range of data.
                             ETWMarkerFormatTask("PREFETCH-CANCEL %p", id);
+                            ETWFlowTask("WINDOW", (ULONGLONG) id, ETW_FLOW_CANCEL);
+                            cancel = true;
                             break;
                         }
                     }
@@ -408,7 +412,8 @@ static DWORD WINAPI prefetch_thread(void *arg)
                     ReadFile(fd, &io_buffer, io_size, &nread, NULL);
                     rpos += io_size;
                 }
-                ETWMarkerFormatTask("PREFETCH-FINISH %p");
+                ETWMarkerFormatTask("PREFETCH-FINISH %p", id);
+                if (!cancel) ETWFlowTask("WINDOW", (ULONGLONG) id, ETW_FLOW_FINISH);
             }
             cancel_count = 0;
         }
@@ -892,26 +897,35 @@ int main(int argc, char **argv)
     intptr_t id  = 0;
     bool    eof  = false;
     do
-    {   // emit a marker event for viewing in WPA.
+    {   // emit a marker event for viewing in WPA. the scopes let the
+        // analyzer attribute the window time to the individual phases.
+        ETWMainScope window("MAIN-WINDOW");
         ETWMarkerFormatMain("MAIN-BEGIN %p", id);
+        // this thread needs the range now, whether or not the prefetch finished.
+        ETWFlowMain("WINDOW", (ULONGLONG) id, ETW_FLOW_CONSUME);
         // cancel prefetching of the previously mapped range, because 
         // this thread will prefault the entire range.
         prefetch_cancel(&prefetch_state, id);
         ETWMarkerFormatMain("MAIN-PREFAULT %p", id);
-        // pre-fault the entire range, so no faults are experienced while doing work.
-        prefault_range(file_state.BufferBeg, file_state.MapSize, 4096, 1);
+        {   // pre-fault the entire range, so no faults are experienced while doing work.
+            ETWMainScope phase("MAIN-PREFAULT");
+            prefault_range(file_state.BufferBeg, file_state.MapSize, 4096, 1);
+        }
         ETWMarkerFormatMain("MAIN-PREFETCH %p", id+1);
         // have the background thread start pre-faulting the next mapped range while 
         // this thread spends time doing work on the currently mapped range.
         HANDLE   fd     = file_state.Fildes;
         int64_t  offset = file_state.FileOffset + file_state.MapSize;
         size_t   amount = file_state.MapSize;
+        ETWFlowMain("WINDOW", (ULONGLONG) (id + 1), ETW_FLOW_ISSUE);
         prefetch_range(&prefetch_state, fd, offset, amount, ++id);
         ETWMarkerFormatMain("MAIN-PROCESS %p", id-1);
-        // perform some computation on each byte in the mapped range.
-        for (size_t i = 0; i < 100; ++i)
-        {
-            hash_update(file_state.BufferBeg, file_state.MapSize, file_state.Hash);
+        {   // perform some computation on each byte in the mapped range.
+            ETWMainScope phase("MAIN-PROCESS");
+            for (size_t i = 0; i < 100; ++i)
+            {
+                hash_update(file_state.BufferBeg, file_state.MapSize, file_state.Hash);
+            }
         }
         // update the view to point to the next contiguous range in the file.
         // eof will be set to true if we've hit end-of-file.
@@ -925,7 +939,7 @@ int main(int argc, char **argv)
     fprintf(stdout, "STATUS: Finished run in %f seconds (%0.3f bytes/sec).\n", elapsed_s, file_size / elapsed_s);
 
     SetEvent(prefetch_state.ExitSignal);
-    WaitForSingleObject(prefetch, INFINITE);
+    ETWWaitForSingleObject("PREFETCH-JOIN", prefetch, INFINITE);
     prefetch_free(&prefetch_state);
     close_file(&file_state);
     exit(EXIT_SUCCESS);